@@ -5,4 +5,4 @@ CFLAGS=${CFLAGS:--Wall -O3}
 
 mkdir -p out
 echo 'Compiling out/qoirconv'
-$CC $CFLAGS cmd/qoirconv.c -o out/qoirconv
+$CC $CFLAGS cmd/qoirconv.c -lpthread -o out/qoirconv
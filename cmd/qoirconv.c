@@ -13,20 +13,29 @@
 // limitations under the License.
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #define QOIR_IMPLEMENTATION
 #include "../src/qoir.h"
 
-#define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
-#define STBI_ONLY_PNG
-#define STBI_NO_LINEAR
-#include "../third_party/stb/stb_image.h"
 #include "../third_party/stb/stb_image_write.h"
 
+#define WUFFS_IMPLEMENTATION
+#define WUFFS_CONFIG__STATIC_FUNCTIONS
+#define WUFFS_CONFIG__MODULES
+#define WUFFS_CONFIG__MODULE__ADLER32
+#define WUFFS_CONFIG__MODULE__BASE
+#define WUFFS_CONFIG__MODULE__CRC32
+#define WUFFS_CONFIG__MODULE__DEFLATE
+#define WUFFS_CONFIG__MODULE__PNG
+#define WUFFS_CONFIG__MODULE__ZLIB
+#include "../third_party/wuffs/wuffs-v0.3.c"
+
 // Utilities should be #include'd after qoir.h
 #include "../util/load_file.c"
+#include "../util/walk_directory.c"
 
 // ----
 
@@ -137,6 +146,10 @@ static const size_t xmp_magic_len = 22;
 // ----
 
 typedef struct extract_png_metadata_result_struct {
+  // opaque_rgb is whether the image is RGB or palette-based (as opposed to
+  // gray) and has no alpha channel and no tRNS chunk.
+  bool opaque_rgb;
+
   const uint8_t* cicp_ptr;
   size_t cicp_len;
 
@@ -161,6 +174,7 @@ extract_png_metadata(               //
   }
   src_ptr += 8;
   src_len -= 8;
+  bool has_trns = false;
   while (src_len >= 8) {
     uint32_t chunk_len = peek_u32be(src_ptr + 0);
     uint32_t chunk_tag = peek_u32be(src_ptr + 4);
@@ -170,6 +184,15 @@ extract_png_metadata(               //
       return result;
     }
     switch (chunk_tag) {
+      case 0x49484452: {  // 'IHDR'be
+        result.opaque_rgb =
+            (chunk_len >= 13) && ((src_ptr[9] == 2) || (src_ptr[9] == 3));
+        break;
+      }
+      case 0x74524E53: {  // 'tRNS'be
+        has_trns = true;
+        break;
+      }
       case 0x63494350: {  // 'cICP'be
         result.cicp_ptr = src_ptr;
         result.cicp_len = chunk_len;
@@ -197,11 +220,101 @@ extract_png_metadata(               //
     src_ptr += chunk_len;
     src_len -= chunk_len;
     if (src_len < 4) {
-      return result;
+      break;
     }
     src_ptr += 4;
     src_len -= 4;
   }
+  result.opaque_rgb = result.opaque_rgb && !has_trns;
+  return result;
+}
+
+// decode_png decodes a PNG image to a malloc'ed buffer of BGR (if
+// num_channels is 3) or BGRA_NONPREMUL (otherwise) pixels.
+static qoir_decode_result    //
+decode_png(                  //
+    const uint8_t* src_ptr,  //
+    size_t src_len,          //
+    uint32_t num_channels) {
+  qoir_decode_result result = {0};
+  uint8_t* pixbuf_ptr = NULL;
+  uint8_t* workbuf_ptr = NULL;
+  wuffs_png__decoder* dec = wuffs_png__decoder__alloc();
+  if (!dec) {
+    result.status_message = "#main: out of memory";
+    return result;
+  }
+
+  do {
+    // Like stb_image, ignore the zlib and PNG chunks' checksums.
+    wuffs_png__decoder__set_quirk_enabled(
+        dec, WUFFS_BASE__QUIRK_IGNORE_CHECKSUM, true);
+    wuffs_base__io_buffer src =
+        wuffs_base__ptr_u8__reader((uint8_t*)src_ptr, src_len, true);
+
+    wuffs_base__image_config imgcfg;
+    result.status_message =
+        wuffs_png__decoder__decode_image_config(dec, &imgcfg, &src).repr;
+    if (result.status_message) {
+      break;
+    }
+    uint32_t w = wuffs_base__pixel_config__width(&imgcfg.pixcfg);
+    uint32_t h = wuffs_base__pixel_config__height(&imgcfg.pixcfg);
+    if ((w > 0xFFFFFF) || (h > 0xFFFFFF)) {
+      result.status_message = "#main: image is too large";
+      break;
+    }
+    uint64_t pixbuf_len = (uint64_t)w * (uint64_t)h * num_channels;
+    uint64_t workbuf_len = wuffs_png__decoder__workbuf_len(dec).max_incl;
+    if ((pixbuf_len > SIZE_MAX) || (workbuf_len > SIZE_MAX)) {
+      result.status_message = "#main: image is too large";
+      break;
+    }
+    pixbuf_ptr = malloc(pixbuf_len ? pixbuf_len : 1);
+    workbuf_ptr = malloc(workbuf_len ? workbuf_len : 1);
+    if (!pixbuf_ptr || !workbuf_ptr) {
+      result.status_message = "#main: out of memory";
+      break;
+    }
+
+    wuffs_base__pixel_config pixcfg;
+    wuffs_base__pixel_config__set(
+        &pixcfg,
+        (num_channels == 3) ? WUFFS_BASE__PIXEL_FORMAT__BGR
+                            : WUFFS_BASE__PIXEL_FORMAT__BGRA_NONPREMUL,
+        WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, w, h);
+    wuffs_base__pixel_buffer pixbuf;
+    result.status_message =
+        wuffs_base__pixel_buffer__set_from_slice(
+            &pixbuf, &pixcfg,
+            wuffs_base__make_slice_u8(pixbuf_ptr, pixbuf_len))
+            .repr;
+    if (result.status_message) {
+      break;
+    }
+    result.status_message =
+        wuffs_png__decoder__decode_frame(
+            dec, &pixbuf, &src, WUFFS_BASE__PIXEL_BLEND__SRC,
+            wuffs_base__make_slice_u8(workbuf_ptr, workbuf_len), NULL)
+            .repr;
+    if (result.status_message) {
+      break;
+    }
+
+    result.owned_memory = pixbuf_ptr;
+    result.dst_pixbuf.pixcfg.pixfmt = (num_channels == 3)
+                                          ? QOIR_PIXEL_FORMAT__BGR
+                                          : QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+    result.dst_pixbuf.pixcfg.width_in_pixels = w;
+    result.dst_pixbuf.pixcfg.height_in_pixels = h;
+    result.dst_pixbuf.data = pixbuf_ptr;
+    result.dst_pixbuf.stride_in_bytes = (size_t)w * num_channels;
+    pixbuf_ptr = NULL;
+  } while (false);
+
+  free(workbuf_ptr);
+  free(pixbuf_ptr);
+  free(dec);
   return result;
 }
 
@@ -212,24 +325,14 @@ convert_from_png_to_qoir(    //
     const qoir_encode_options* enc_opts) {
   load_file_result result = {0};
 
-  int width = 0;
-  int height = 0;
-  int channels = 0;
-  if (!stbi_info_from_memory(src_ptr, src_len, &width, &height, &channels)) {
-    result.status_message = "#main: stbi_info_from_memory failed";
-    return result;
-  } else if (channels != 3) {
-    channels = 4;
-  }
-  int ignored = 0;
-  unsigned char* pixbuf_data = stbi_load_from_memory(
-      src_ptr, src_len, &ignored, &ignored, &ignored, channels);
-  if (!pixbuf_data) {
-    result.status_message = "#main: stbi_load_from_memory failed";
-    return result;
-  } else if ((width > 0xFFFFFF) || (height > 0xFFFFFF)) {
-    stbi_image_free(pixbuf_data);
-    result.status_message = "#main: image is too large";
+  // Decode to 3 channels if and only if the image is opaque RGB, so that the
+  // QOIR pixel format is BGRX instead of BGRA_NONPREMUL.
+  extract_png_metadata_result png_metadata =
+      extract_png_metadata(src_ptr, src_len);
+  qoir_decode_result png =
+      decode_png(src_ptr, src_len, png_metadata.opaque_rgb ? 3 : 4);
+  if (png.status_message) {
+    result.status_message = png.status_message;
     return result;
   }
 
@@ -237,8 +340,6 @@ convert_from_png_to_qoir(    //
   if (enc_opts) {
     memcpy(&local_enc_opts, enc_opts, sizeof(qoir_encode_options));
   }
-  extract_png_metadata_result png_metadata =
-      extract_png_metadata(src_ptr, src_len);
   if (local_enc_opts.metadata_cicp_len == 0) {
     local_enc_opts.metadata_cicp_ptr = png_metadata.cicp_ptr;
     local_enc_opts.metadata_cicp_len = png_metadata.cicp_len;
@@ -256,15 +357,8 @@ convert_from_png_to_qoir(    //
     local_enc_opts.metadata_xmp_len = png_metadata.xmp_len;
   }
 
-  qoir_pixel_buffer pixbuf;
-  pixbuf.pixcfg.pixfmt = (channels == 3) ? QOIR_PIXEL_FORMAT__RGB
-                                         : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
-  pixbuf.pixcfg.width_in_pixels = width;
-  pixbuf.pixcfg.height_in_pixels = height;
-  pixbuf.data = (uint8_t*)pixbuf_data;
-  pixbuf.stride_in_bytes = (size_t)channels * (size_t)width;
-  qoir_encode_result enc = qoir_encode(&pixbuf, &local_enc_opts);
-  stbi_image_free(pixbuf_data);
+  qoir_encode_result enc = qoir_encode(&png.dst_pixbuf, &local_enc_opts);
+  free(png.owned_memory);
   if (enc.status_message) {
     free(enc.owned_memory);
     result.status_message = enc.status_message;
@@ -411,7 +505,8 @@ my_stbi_write_func(  //
 load_file_result             //
 convert_from_qoir_to_png(    //
     const uint8_t* src_ptr,  //
-    size_t src_len) {
+    size_t src_len,          //
+    qoir_decode_buffer* decbuf) {
   load_file_result result = {0};
 
   qoir_decode_pixel_configuration_result cfg =
@@ -425,6 +520,7 @@ convert_from_qoir_to_png(    //
   decopts.pixfmt = (cfg.dst_pixcfg.pixfmt == QOIR_PIXEL_FORMAT__BGRX)
                        ? QOIR_PIXEL_FORMAT__RGB
                        : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  decopts.decbuf = decbuf;
   qoir_decode_result dec = qoir_decode(src_ptr, src_len, &decopts);
   if (dec.status_message) {
     free(dec.owned_memory);
@@ -449,15 +545,338 @@ convert_from_qoir_to_png(    //
   return result;
 }
 
+// convert converts from PNG to QOIR or from QOIR to PNG, depending on the
+// source's first byte. The enc_opts and decbuf may be NULL.
+load_file_result                          //
+convert(                                  //
+    const uint8_t* src_ptr,               //
+    size_t src_len,                       //
+    const qoir_encode_options* enc_opts,  //
+    qoir_decode_buffer* decbuf) {
+  if (src_len > 0) {
+    switch (src_ptr[0]) {
+      case 0x51:
+        return convert_from_qoir_to_png(src_ptr, src_len, decbuf);
+      case 0x89:
+        return convert_from_png_to_qoir(src_ptr, src_len, enc_opts);
+    }
+  }
+  load_file_result result = {0};
+  result.status_message = "#main: unsupported file format";
+  return result;
+}
+
+// ----
+
+// Batch mode converts every ".png" or ".qoir" file under a source directory
+// to a ".qoir" or ".png" file under a destination directory (with the same
+// relative path). Walking the source directory changes the current working
+// directory, so the walk first collects every relative path. A pool of
+// threads then converts the files, each thread reading, converting and
+// writing one file at a time (so that some threads' I/O overlaps with other
+// threads' conversions) and re-using its own encode and decode buffers.
+
+#define BATCH_MAX_NUM_THREADS 256
+
+typedef struct batch_string_list_struct {
+  char** ptr;
+  size_t len;
+  size_t cap;
+} batch_string_list;
+
+typedef struct batch_context_struct {
+  const char* src_dirname;
+  const char* dst_dirname;
+  const qoir_encode_options* enc_opts;
+
+  // dirs and files hold paths relative to src_dirname (or to dst_dirname),
+  // each starting with a '/'. Parent directories precede their children.
+  batch_string_list dirs;
+  batch_string_list files;
+
+  pthread_mutex_t mutex;
+  size_t next_file;
+  size_t num_failures;
+} batch_context;
+
+// batch_concat returns a malloc'ed copy of a, b and c concatenated, excluding
+// a trailing suffix_len bytes of b, or NULL if out of memory.
+static char*            //
+batch_concat(           //
+    const char* a,      //
+    const char* b,      //
+    size_t suffix_len,  //
+    const char* c) {
+  size_t a_len = strlen(a);
+  size_t b_len = strlen(b) - suffix_len;
+  size_t c_len = strlen(c);
+  char* ret = malloc(a_len + b_len + c_len + 1);
+  if (ret) {
+    memcpy(ret, a, a_len);
+    memcpy(ret + a_len, b, b_len);
+    memcpy(ret + a_len + b_len, c, c_len + 1);
+  }
+  return ret;
+}
+
+static const char*            //
+batch_string_list__append(    //
+    batch_string_list* list,  //
+    char* s) {
+  if (!s) {
+    return "#main: out of memory";
+  } else if (list->len >= list->cap) {
+    size_t new_cap = list->cap ? (2 * list->cap) : 256;
+    char** new_ptr = realloc(list->ptr, new_cap * sizeof(char*));
+    if (!new_ptr) {
+      free(s);
+      return "#main: out of memory";
+    }
+    list->ptr = new_ptr;
+    list->cap = new_cap;
+  }
+  list->ptr[list->len++] = s;
+  return NULL;
+}
+
+static void               //
+batch_string_list__free(  //
+    batch_string_list* list) {
+  for (size_t i = 0; i < list->len; i++) {
+    free(list->ptr[i]);
+  }
+  free(list->ptr);
+}
+
+static bool         //
+batch_has_suffix(   //
+    const char* s,  //
+    const char* suffix) {
+  size_t s_len = strlen(s);
+  size_t suffix_len = strlen(suffix);
+  return (s_len > suffix_len) && !strcmp(s + s_len - suffix_len, suffix);
+}
+
+static const char*     //
+batch_enter_callback(  //
+    void* context,     //
+    uint32_t depth,    //
+    const char* dirname) {
+  batch_context* z = (batch_context*)context;
+  if (depth == 0) {
+    return NULL;
+  } else if (!strcmp(dirname, "/.../")) {
+    return "#main: path is too long";
+  }
+  return batch_string_list__append(&z->dirs, batch_concat("", dirname, 0, ""));
+}
+
+static const char*    //
+batch_exit_callback(  //
+    void* context,    //
+    uint32_t depth,   //
+    const char* dirname) {
+  return NULL;
+}
+
+static const char*        //
+batch_file_callback(      //
+    void* context,        //
+    uint32_t depth,       //
+    const char* dirname,  //
+    const char* filename) {
+  batch_context* z = (batch_context*)context;
+  if (!batch_has_suffix(filename, ".png") &&
+      !batch_has_suffix(filename, ".qoir")) {
+    return NULL;
+  } else if (!strcmp(dirname, "/.../")) {
+    return "#main: path is too long";
+  }
+  return batch_string_list__append(&z->files,
+                                   batch_concat(dirname, filename, 0, ""));
+}
+
+// batch_convert_one converts the file at the relative path rel_path.
+static const char*                        //
+batch_convert_one(                        //
+    batch_context* z,                     //
+    const char* rel_path,                 //
+    const qoir_encode_options* enc_opts,  //
+    qoir_decode_buffer* decbuf) {
+  bool to_qoir = batch_has_suffix(rel_path, ".png");
+  char* src_path = batch_concat(z->src_dirname, rel_path, 0, "");
+  char* dst_path = batch_concat(z->dst_dirname, rel_path, to_qoir ? 4 : 5,
+                                to_qoir ? ".qoir" : ".png");
+  const char* status_message = NULL;
+  load_file_result r0 = {0};
+  load_file_result r1 = {0};
+  do {
+    if (!src_path || !dst_path) {
+      status_message = "#main: out of memory";
+      break;
+    }
+    FILE* fin = fopen(src_path, "rb");
+    if (!fin) {
+      status_message = strerror(errno);
+      break;
+    }
+    r0 = map_file(fin, UINT64_MAX);
+    fclose(fin);
+    if (r0.status_message) {
+      status_message = r0.status_message;
+      break;
+    }
+    r1 = convert(r0.dst_ptr, r0.dst_len, enc_opts, decbuf);
+    if (r1.status_message) {
+      status_message = r1.status_message;
+      break;
+    }
+    FILE* fout = fopen(dst_path, "wb");
+    if (!fout) {
+      status_message = strerror(errno);
+      break;
+    }
+    size_t n = fwrite(r1.dst_ptr, 1, r1.dst_len, fout);
+    if (fclose(fout) || (n != r1.dst_len)) {
+      status_message = "#main: could not write file";
+    }
+  } while (false);
+  unload_file(&r1);
+  unload_file(&r0);
+  free(dst_path);
+  free(src_path);
+  return status_message;
+}
+
+static void*                 //
+batch_thread_start_routine(  //
+    void* context) {
+  batch_context* z = (batch_context*)context;
+
+  // The buffers are optional. If malloc fails, qoir_encode and qoir_decode
+  // will allocate (and free) their own, per call.
+  qoir_encode_buffer* encbuf = malloc(sizeof(qoir_encode_buffer));
+  qoir_decode_buffer* decbuf = malloc(sizeof(qoir_decode_buffer));
+  qoir_encode_options enc_opts = {0};
+  if (z->enc_opts) {
+    memcpy(&enc_opts, z->enc_opts, sizeof(qoir_encode_options));
+  }
+  enc_opts.encbuf = encbuf;
+
+  while (true) {
+    pthread_mutex_lock(&z->mutex);
+    size_t i = z->next_file++;
+    pthread_mutex_unlock(&z->mutex);
+    if (i >= z->files.len) {
+      break;
+    }
+    const char* status_message =
+        batch_convert_one(z, z->files.ptr[i], &enc_opts, decbuf);
+    if (status_message) {
+      pthread_mutex_lock(&z->mutex);
+      fprintf(stderr, "qoirconv: could not convert %s%s: %s\n",
+              z->src_dirname, z->files.ptr[i], status_message);
+      z->num_failures++;
+      pthread_mutex_unlock(&z->mutex);
+    }
+  }
+
+  free(decbuf);
+  free(encbuf);
+  return NULL;
+}
+
+int                                       //
+batch(                                    //
+    const char* src_dirname,              //
+    const char* dst_dirname,              //
+    const qoir_encode_options* enc_opts,  //
+    uint32_t num_threads) {
+  batch_context z = {0};
+  z.src_dirname = src_dirname;
+  z.dst_dirname = dst_dirname;
+  z.enc_opts = enc_opts;
+
+  DIR* d = opendir(src_dirname);
+  if (!d) {
+    fprintf(stderr, "qoirconv: could not open %s: %s\n", src_dirname,
+            strerror(errno));
+    return 1;
+  }
+  const char* status_message =
+      walk_directory(d, &z, &batch_enter_callback, &batch_exit_callback,
+                     &batch_file_callback);
+  closedir(d);
+  for (size_t i = 0; !status_message && (i <= z.dirs.len); i++) {
+    char* path = batch_concat(dst_dirname, (i > 0) ? z.dirs.ptr[i - 1] : "",
+                              0, "");
+    if (!path) {
+      status_message = "#main: out of memory";
+    } else if (mkdir(path, 0777) && (errno != EEXIST)) {
+      status_message = strerror(errno);
+    }
+    free(path);
+  }
+  if (status_message) {
+    fprintf(stderr, "qoirconv: could not walk %s: %s\n", src_dirname,
+            status_message);
+    batch_string_list__free(&z.files);
+    batch_string_list__free(&z.dirs);
+    return 1;
+  }
+
+  if (num_threads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = (n < 1)                       ? 1
+                  : (n > BATCH_MAX_NUM_THREADS) ? BATCH_MAX_NUM_THREADS
+                                                : (uint32_t)n;
+  }
+  if (num_threads > z.files.len) {
+    num_threads = (z.files.len > 0) ? (uint32_t)z.files.len : 1;
+  }
+  pthread_mutex_init(&z.mutex, NULL);
+  pthread_t threads[BATCH_MAX_NUM_THREADS];
+  uint32_t num_started = 0;
+  for (; num_started < num_threads; num_started++) {
+    if (pthread_create(&threads[num_started], NULL,
+                       &batch_thread_start_routine, &z)) {
+      break;
+    }
+  }
+  if (num_started == 0) {
+    batch_thread_start_routine(&z);
+  }
+  for (uint32_t i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&z.mutex);
+
+  size_t num_failures = z.num_failures;
+  batch_string_list__free(&z.files);
+  batch_string_list__free(&z.dirs);
+  return num_failures ? 1 : 0;
+}
+
 // ----
 
 int  //
 usage() {
   fprintf(stderr,
-          "Usage:\n"                                              //
-          "  qoirconv --lossiness=L --dither foo.png foo.qoir\n"  //
-          "  qoirconv foo.qoir foo.png\n"                         //
-          "  L ranges in 0 ..= 7; the default (0) means lossless\n");
+          "Usage:\n"                                                  //
+          "  qoirconv --lossiness=L --dither foo.png foo.qoir\n"      //
+          "  qoirconv foo.qoir foo.png\n"                             //
+          "  qoirconv --batch --threads=T src_dir dst_dir\n"          //
+          "  L ranges in 0 ..= 7; the default (0) means lossless\n"   //
+          "  --gamma-dither dithers in linear light, not sRGB\n"      //
+          "  --tile-index adds a TIDX chunk, for faster clipping\n"   //
+          "  --mipmaps=N adds a MIPS chunk with N mipmap levels\n"    //
+          "  --dedupe-tiles back-references repeated tiles\n"         //
+          "  --constant-tiles uses 4 bytes for uniform tiles\n"       //
+          "  --effort=E (0 ..= 9) trades encode time for size\n"      //
+          "  --lz4-min-savings=P only uses LZ4 if it saves P%%\n"     //
+          "  --huffman also tries the Huffman-Ops tile format\n"      //
+          "  --batch converts every .png and .qoir file in a tree\n"  //
+          "  --threads=T (0 ..= 256) for --batch; 0 means #CPUs\n");
   return 1;
 }
 
@@ -467,6 +886,8 @@ main(          //
     char** argv) {
   const char* arg_src = NULL;
   const char* arg_dst = NULL;
+  bool arg_batch = false;
+  uint32_t arg_threads = 0;
   qoir_encode_options encopts = {0};
 
   for (int i = 1; i < argc; i++) {
@@ -482,9 +903,52 @@ main(          //
       return usage();
     }
     arg++;
-    if (!strncmp(arg, "-dither", 7)) {
+    if (!strncmp(arg, "-gamma-dither", 13)) {
       encopts.dither = 1;
+      encopts.gamma_aware_dither = 1;
+      continue;
+    } else if (!strncmp(arg, "-dither", 7)) {
+      encopts.dither = 1;
+      continue;
+    } else if (!strncmp(arg, "-tile-index", 11)) {
+      encopts.write_tile_index = 1;
+      continue;
+    } else if (!strncmp(arg, "-batch", 6)) {
+      arg_batch = true;
       continue;
+    } else if (!strncmp(arg, "-threads=", 9)) {
+      long int x = strtol(arg + 9, NULL, 10);
+      if ((0 <= x) && (x <= BATCH_MAX_NUM_THREADS)) {
+        arg_threads = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-huffman", 8)) {
+      encopts.use_huffman_tile_format = 1;
+      continue;
+    } else if (!strncmp(arg, "-dedupe-tiles", 13)) {
+      encopts.reference_duplicate_tiles = 1;
+      continue;
+    } else if (!strncmp(arg, "-constant-tiles", 15)) {
+      encopts.use_constant_tile_format = 1;
+      continue;
+    } else if (!strncmp(arg, "-mipmaps=", 9)) {
+      long int x = strtol(arg + 9, NULL, 10);
+      if ((0 <= x) && (x <= 24)) {
+        encopts.num_mipmap_levels = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-effort=", 8)) {
+      long int x = strtol(arg + 8, NULL, 10);
+      if ((0 <= x) && (x <= 9)) {
+        encopts.effort = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-lz4-min-savings=", 17)) {
+      long int x = strtol(arg + 17, NULL, 10);
+      if ((0 <= x) && (x <= 100)) {
+        encopts.lz4_min_savings_percent = x;
+        continue;
+      }
     } else if (!strncmp(arg, "-lossiness=", 11)) {
       long int x = strtol(arg + 11, NULL, 10);
       if ((0 <= x) && (x < 8)) {
@@ -495,6 +959,13 @@ main(          //
     return usage();
   }
 
+  if (arg_batch) {
+    if (!arg_src || !arg_dst) {
+      return usage();
+    }
+    return batch(arg_src, arg_dst, &encopts, arg_threads);
+  }
+
   FILE* fin = stdin;
   if (arg_src) {
     fin = fopen(arg_src, "rb");
@@ -505,29 +976,18 @@ main(          //
     }
   }
 
-  load_file_result r0 = load_file(fin, UINT64_MAX);
+  load_file_result r0 = map_file(fin, UINT64_MAX);
   if (r0.status_message) {
     fprintf(stderr, "qoirconv: could not load %s: %s\n",
             arg_src ? arg_src : "<stdin>", r0.status_message);
     return 1;
   }
 
-  // We would normally have to call free(r0.owned_memory) at some point, but
-  // we're in the main function, so just exit the process (and 'leak' the
-  // memory) when this function returns. Ditto for r1.owned_memory below.
+  // We would normally have to call unload_file(&r0) at some point, but we're
+  // in the main function, so just exit the process (and 'leak' the memory or
+  // mapping) when this function returns. Ditto for r1.owned_memory below.
 
-  load_file_result r1 = {0};
-  r1.status_message = "#main: unsupported file format";
-  if (r0.dst_len > 0) {
-    switch (r0.dst_ptr[0]) {
-      case 0x51:
-        r1 = convert_from_qoir_to_png(r0.dst_ptr, r0.dst_len);
-        break;
-      case 0x89:
-        r1 = convert_from_png_to_qoir(r0.dst_ptr, r0.dst_len, &encopts);
-        break;
-    }
-  }
+  load_file_result r1 = convert(r0.dst_ptr, r0.dst_len, &encopts, NULL);
   if (r1.status_message) {
     fprintf(stderr, "qoirconv: could not convert %s: %s\n",
             arg_src ? arg_src : "<stdin>", r1.status_message);
@@ -20,196 +20,117 @@
 #define QOIR_IMPLEMENTATION
 #include "../src/qoir.h"
 
+#include "../util/load_file.c"
+
 // ----
 
 bool g_multithreaded = false;
 bool g_print_decode_time = false;
+bool g_tiled = false;
+uint32_t g_cache_mib = 256;
 
 // ----
 
-typedef struct worker_data_struct {
-  // Request.
-  const uint8_t* src_ptr;
-  size_t src_len;
-  qoir_decode_options* options;
-  int32_t y0;
-  int32_t y1;
+#define MAX_NUM_JOBS 16
 
-  // Response.
-  const char* status_message;
-} worker_data;
+typedef struct job_data_struct {
+  qoir_job_func job_func;
+  void* job_context;
+  uint32_t job_index;
+} job_data;
 
-int    //
-work(  //
+int   //
+job(  //
     void* data) {
-  worker_data* wd = (worker_data*)data;
-  qoir_decode_options opts = {0};
-  memcpy(&opts, wd->options, sizeof(*wd->options));
-  if (!opts.pixbuf.data) {
-    wd->status_message =
-        "main: inconsistent qoir_decode_options.pixbuf.data field\n";
-    return 0;
-  }
-  if (opts.src_clip_rectangle.y0 < wd->y0) {
-    opts.src_clip_rectangle.y0 = wd->y0;
-  }
-  if (opts.src_clip_rectangle.y1 > wd->y1) {
-    opts.src_clip_rectangle.y1 = wd->y1;
-  }
-
-  qoir_decode_result res = qoir_decode(wd->src_ptr, wd->src_len, &opts);
-  if (res.owned_memory) {
-    free(res.owned_memory);
-    wd->status_message =
-        "main: inconsistent qoir_decode_result.owned_memory field\n";
-  } else {
-    wd->status_message = res.status_message;
-  }
+  job_data* jd = (job_data*)data;
+  (*jd->job_func)(jd->job_context, jd->job_index);
   return 0;
 }
 
-qoir_decode_result           //
-multithreaded_decode(        //
-    const uint8_t* src_ptr,  //
-    const size_t src_len,    //
-    const qoir_decode_options* options) {
-  qoir_decode_pixel_configuration_result config =
-      qoir_decode_pixel_configuration(src_ptr, src_len);
-  if (config.status_message) {
-    qoir_decode_result res = {0};
-    res.status_message = config.status_message;
-    return res;
-  }
-
-  uint32_t height_in_tiles =
-      qoir_calculate_number_of_tiles_1d(config.dst_pixcfg.height_in_pixels);
-  if (height_in_tiles <= 1) {
-    return qoir_decode(src_ptr, src_len, options);
-  }
-
-  uint64_t pixbuf_len = 4 * (uint64_t)config.dst_pixcfg.width_in_pixels *
-                        (uint64_t)config.dst_pixcfg.height_in_pixels;
-  if (pixbuf_len > SIZE_MAX) {
-    qoir_decode_result res = {0};
-    res.status_message =
-        qoir_status_message__error_unsupported_pixbuf_dimensions;
-    return res;
-  }
-
-  qoir_decode_options opts = {0};
-  if (options) {
-    memcpy(&opts, options, sizeof(*options));
-  }
-
-  opts.pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRA_PREMUL;
-  opts.pixbuf.pixcfg.width_in_pixels = config.dst_pixcfg.width_in_pixels;
-  opts.pixbuf.pixcfg.height_in_pixels = config.dst_pixcfg.height_in_pixels;
-  opts.pixbuf.data = malloc(pixbuf_len);
-  opts.pixbuf.stride_in_bytes = 4 * opts.pixbuf.pixcfg.width_in_pixels;
-  if (!opts.pixbuf.data) {
-    qoir_decode_result res = {0};
-    res.status_message = qoir_status_message__error_out_of_memory;
-    return res;
-  }
-
-  if (!opts.use_src_clip_rectangle) {
-    opts.use_src_clip_rectangle = true;
-    opts.src_clip_rectangle =
-        qoir_make_rectangle(0, 0, (int32_t)config.dst_pixcfg.width_in_pixels,
-                            (int32_t)config.dst_pixcfg.height_in_pixels);
-  }
-
-  const char* status_message = NULL;
-  uint32_t num_threads = height_in_tiles;
-  if (num_threads > 16) {
-    num_threads = 16;
-  }
-  worker_data data[16] = {0};
-  SDL_Thread* threads[16] = {0};
-
-  for (uint32_t i = 0; i < num_threads; i++) {
-    data[i].src_ptr = src_ptr;
-    data[i].src_len = src_len;
-    data[i].options = &opts;
-    data[i].y0 = (((i + 0) * height_in_tiles) / num_threads) * QOIR_TILE_SIZE;
-    data[i].y1 = (((i + 1) * height_in_tiles) / num_threads) * QOIR_TILE_SIZE;
-    threads[i] = SDL_CreateThread(&work, "worker", &data[i]);
-    if (!threads[i]) {
-      status_message = "main: could not create thread";
+// run_jobs is a qoir_run_jobs_func that runs each job on its own SDL_Thread,
+// in batches of up to MAX_NUM_JOBS threads. If a thread cannot be created
+// then that job runs on the calling thread.
+void                         //
+run_jobs(                    //
+    void* context,           //
+    qoir_job_func job_func,  //
+    void* job_context,       //
+    uint32_t num_jobs) {
+  job_data data[MAX_NUM_JOBS] = {0};
+  SDL_Thread* threads[MAX_NUM_JOBS] = {0};
+
+  for (uint32_t begin = 0; begin < num_jobs; begin += MAX_NUM_JOBS) {
+    uint32_t n = ((num_jobs - begin) < MAX_NUM_JOBS) ? (num_jobs - begin)
+                                                     : MAX_NUM_JOBS;
+    for (uint32_t i = 0; i < n; i++) {
+      data[i].job_func = job_func;
+      data[i].job_context = job_context;
+      data[i].job_index = begin + i;
+      threads[i] = SDL_CreateThread(&job, "job", &data[i]);
+      if (!threads[i]) {
+        job(&data[i]);
+      }
     }
-  }
 
-  for (uint32_t i = 0; i < num_threads; i++) {
-    if (threads[i]) {
-      SDL_WaitThread(threads[i], NULL);
-      if (!status_message) {
-        status_message = data[i].status_message;
+    for (uint32_t i = 0; i < n; i++) {
+      if (threads[i]) {
+        SDL_WaitThread(threads[i], NULL);
       }
     }
   }
-  if (status_message) {
-    free(opts.pixbuf.data);
-    qoir_decode_result res = {0};
-    res.status_message = status_message;
-    return res;
-  }
-  qoir_decode_result res = {0};
-  res.owned_memory = opts.pixbuf.data;
-  memcpy(&res.dst_pixbuf, &opts.pixbuf, sizeof(opts.pixbuf));
-  return res;
 }
 
 // ----
 
+SDL_Surface*          //
+create_surface(       //
+    uint8_t* data,    //
+    uint32_t width,   //
+    uint32_t height,  //
+    size_t stride) {
+  return SDL_CreateRGBSurfaceFrom(data, width, height, 32, stride,
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+                                  0x0000FF00, 0x00FF0000, 0xFF000000,
+                                  0x000000FF);
+#else
+                                  0x00FF0000, 0x0000FF00, 0x000000FF,
+                                  0xFF000000);
+#endif
+}
+
 SDL_Surface*               //
 load(                      //
     const char* filename,  //
     void** owned_memory) {
-  SDL_RWops* rw = SDL_RWFromFile(filename, "rb");
-  if (!rw) {
-    fprintf(stderr, "main: load: SDL_RWFromFile: %s\n", SDL_GetError());
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
+    fprintf(stderr, "main: load: could not open file\n");
     return NULL;
   }
-
-  int64_t len = rw->size(rw);
-  if (len < 0) {
-    rw->close(rw);
-    fprintf(stderr, "main: load: could not get file size\n");
+  load_file_result file = map_file(f, UINT64_MAX);
+  fclose(f);
+  if (file.status_message) {
+    fprintf(stderr, "main: load: could not read file: %s\n",
+            file.status_message);
     return NULL;
-  } else if (len == 0) {
-    rw->close(rw);
+  } else if (file.dst_len == 0) {
+    unload_file(&file);
     fprintf(stderr, "main: load: empty file\n");
     return NULL;
-  } else if (len > 0x7FFFFFFF) {
-    rw->close(rw);
-    fprintf(stderr, "main: load: file is too large\n");
-    return NULL;
-  }
-
-  void* ptr = malloc(len);
-  if (!ptr) {
-    rw->close(rw);
-    fprintf(stderr, "main: load: out of memory\n");
-    return NULL;
-  }
-  size_t n = rw->read(rw, ptr, 1, len);
-  rw->close(rw);
-  rw = NULL;
-  if (n < len) {
-    free(ptr);
-    fprintf(stderr, "main: load: could not read file\n");
-    return NULL;
   }
 
   uint64_t now = SDL_GetPerformanceCounter();
   qoir_decode_options opts = {0};
   opts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_PREMUL;
-  qoir_decode_result decode = g_multithreaded
-                                  ? multithreaded_decode(ptr, len, &opts)
-                                  : qoir_decode(ptr, len, &opts);
-  free(ptr);
-  ptr = NULL;
-  len = 0;
+  if (g_multithreaded) {
+    int num_cpus = SDL_GetCPUCount();
+    opts.contextual_run_jobs_func = &run_jobs;
+    opts.max_num_jobs = (num_cpus < 1)              ? 1
+                        : (num_cpus > MAX_NUM_JOBS) ? MAX_NUM_JOBS
+                                                    : (uint32_t)num_cpus;
+  }
+  qoir_decode_result decode = qoir_decode(file.dst_ptr, file.dst_len, &opts);
+  unload_file(&file);
   if (decode.status_message) {
     free(decode.owned_memory);
     fprintf(stderr, "main: load: could not decode file: %s\n",
@@ -223,15 +144,10 @@ load(                      //
   }
 
   *owned_memory = decode.owned_memory;
-  return SDL_CreateRGBSurfaceFrom(
-      decode.dst_pixbuf.data, decode.dst_pixbuf.pixcfg.width_in_pixels,
-      decode.dst_pixbuf.pixcfg.height_in_pixels, 32,
-      decode.dst_pixbuf.stride_in_bytes,
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-      0x0000FF00, 0x00FF0000, 0xFF000000, 0x000000FF);
-#else
-      0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-#endif
+  return create_surface(decode.dst_pixbuf.data,
+                        decode.dst_pixbuf.pixcfg.width_in_pixels,
+                        decode.dst_pixbuf.pixcfg.height_in_pixels,
+                        decode.dst_pixbuf.stride_in_bytes);
 }
 
 bool                     //
@@ -265,6 +181,424 @@ draw(                    //
   return true;
 }
 
+// ----
+
+// Tiled (viewport-driven) mode decodes only the parts of the image that are
+// visible in the window, in VIEW_TILE_SIZE x VIEW_TILE_SIZE pieces (each
+// covering multiple QOIR tiles, all of whose prefixes are walked per piece
+// unless the file has a TIDX chunk). Decoded pieces are kept in a least
+// recently used cache, bounded by g_cache_mib, and background threads
+// prefetch the pieces just outside the window, so that panning is smooth.
+
+#define VIEW_TILE_SIZE 256
+#define MAX_NUM_PREFETCH_THREADS 4
+#define MAX_NUM_PREFETCH_REQUESTS 256
+
+#define CACHE_ENTRY_STATE__EMPTY 0
+#define CACHE_ENTRY_STATE__DECODING 1
+#define CACHE_ENTRY_STATE__READY 2
+
+typedef struct cache_entry_struct {
+  int32_t tx;
+  int32_t ty;
+  uint32_t state;
+  uint64_t last_use;
+  uint8_t* pixels;
+} cache_entry;
+
+typedef struct viewer_struct {
+  // These fields are set once, before any prefetch threads start.
+  load_file_result file;
+  uint32_t width;
+  uint32_t height;
+  uint32_t redraw_event_type;
+  cache_entry* entries;
+  uint32_t num_entries;
+
+  // These fields are guarded by the mutex.
+  SDL_mutex* mutex;
+  SDL_cond* cond;
+  bool quitting;
+  uint64_t use_counter;
+  int32_t requests[MAX_NUM_PREFETCH_REQUESTS][2];
+  uint32_t num_requests;
+
+  // These fields are only used by the main thread.
+  SDL_Thread* threads[MAX_NUM_PREFETCH_THREADS];
+  uint32_t num_threads;
+  int32_t view_x;
+  int32_t view_y;
+} viewer;
+
+// viewer__find returns the cache entry for the (tx, ty) piece, or NULL. The
+// mutex must be held.
+cache_entry*     //
+viewer__find(    //
+    viewer* v,   //
+    int32_t tx,  //
+    int32_t ty) {
+  for (uint32_t i = 0; i < v->num_entries; i++) {
+    cache_entry* e = &v->entries[i];
+    if ((e->state != CACHE_ENTRY_STATE__EMPTY) && (e->tx == tx) &&
+        (e->ty == ty)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// viewer__claim returns an empty (or else the least recently used ready)
+// cache entry, re-assigned to the (tx, ty) piece and marked as decoding, or
+// NULL if there is none. The mutex must be held.
+cache_entry*     //
+viewer__claim(   //
+    viewer* v,   //
+    int32_t tx,  //
+    int32_t ty) {
+  cache_entry* ret = NULL;
+  for (uint32_t i = 0; i < v->num_entries; i++) {
+    cache_entry* e = &v->entries[i];
+    if (e->state == CACHE_ENTRY_STATE__EMPTY) {
+      ret = e;
+      break;
+    } else if ((e->state == CACHE_ENTRY_STATE__READY) &&
+               (!ret || (ret->last_use > e->last_use))) {
+      ret = e;
+    }
+  }
+  if (ret && !ret->pixels) {
+    ret->pixels = malloc(4 * VIEW_TILE_SIZE * VIEW_TILE_SIZE);
+    if (!ret->pixels) {
+      return NULL;
+    }
+  }
+  if (ret) {
+    ret->tx = tx;
+    ret->ty = ty;
+    ret->state = CACHE_ENTRY_STATE__DECODING;
+    ret->last_use = ++v->use_counter;
+  }
+  return ret;
+}
+
+// viewer__decode decodes a claimed entry's piece. The mutex must not be held,
+// as decoding takes a while, but then must be held to mark the entry ready
+// (or empty, on failure).
+bool                 //
+viewer__decode(      //
+    viewer* v,       //
+    cache_entry* e,  //
+    qoir_decode_buffer* decbuf) {
+  int32_t x0 = e->tx * VIEW_TILE_SIZE;
+  int32_t y0 = e->ty * VIEW_TILE_SIZE;
+  qoir_decode_options opts = {0};
+  opts.decbuf = decbuf;
+  opts.pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRA_PREMUL;
+  opts.pixbuf.pixcfg.width_in_pixels =
+      ((v->width - x0) < VIEW_TILE_SIZE) ? (v->width - x0) : VIEW_TILE_SIZE;
+  opts.pixbuf.pixcfg.height_in_pixels =
+      ((v->height - y0) < VIEW_TILE_SIZE) ? (v->height - y0) : VIEW_TILE_SIZE;
+  opts.pixbuf.data = e->pixels;
+  opts.pixbuf.stride_in_bytes = 4 * VIEW_TILE_SIZE;
+  opts.offset_x = -x0;
+  opts.offset_y = -y0;
+  qoir_decode_result decode =
+      qoir_decode(v->file.dst_ptr, v->file.dst_len, &opts);
+  free(decode.owned_memory);
+  if (decode.status_message) {
+    fprintf(stderr, "main: viewer__decode: %s\n", decode.status_message);
+  }
+  return !decode.status_message;
+}
+
+int               //
+prefetch_thread(  //
+    void* data) {
+  viewer* v = (viewer*)data;
+  qoir_decode_buffer* decbuf = malloc(sizeof(qoir_decode_buffer));
+  SDL_LockMutex(v->mutex);
+  while (true) {
+    if (v->quitting) {
+      break;
+    } else if (v->num_requests == 0) {
+      SDL_CondWait(v->cond, v->mutex);
+      continue;
+    }
+    v->num_requests--;
+    int32_t tx = v->requests[v->num_requests][0];
+    int32_t ty = v->requests[v->num_requests][1];
+    cache_entry* e = viewer__find(v, tx, ty) ? NULL : viewer__claim(v, tx, ty);
+    if (!e) {
+      continue;
+    }
+    SDL_UnlockMutex(v->mutex);
+    bool ok = viewer__decode(v, e, decbuf);
+    SDL_LockMutex(v->mutex);
+    e->state = ok ? CACHE_ENTRY_STATE__READY : CACHE_ENTRY_STATE__EMPTY;
+
+    // Ask the main thread to redraw, in case this piece is now visible.
+    SDL_Event event = {0};
+    event.type = v->redraw_event_type;
+    SDL_PushEvent(&event);
+  }
+  SDL_UnlockMutex(v->mutex);
+  free(decbuf);
+  return 0;
+}
+
+bool                 //
+viewer__initialize(  //
+    viewer* v,       //
+    const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
+    fprintf(stderr, "main: load: could not open file\n");
+    return false;
+  }
+  v->file = map_file(f, UINT64_MAX);
+  fclose(f);
+  if (v->file.status_message) {
+    fprintf(stderr, "main: load: could not read file: %s\n",
+            v->file.status_message);
+    return false;
+  }
+  qoir_decode_pixel_configuration_result config =
+      qoir_decode_pixel_configuration(v->file.dst_ptr, v->file.dst_len);
+  if (config.status_message) {
+    fprintf(stderr, "main: load: could not decode file: %s\n",
+            config.status_message);
+    return false;
+  }
+  v->width = config.dst_pixcfg.width_in_pixels;
+  v->height = config.dst_pixcfg.height_in_pixels;
+
+  // Cache at least enough pieces for a large window and its surroundings.
+  uint64_t num_entries = ((uint64_t)g_cache_mib << 20) /
+                         (4 * VIEW_TILE_SIZE * VIEW_TILE_SIZE);
+  v->num_entries = (num_entries < 64)      ? 64
+                   : (num_entries > 65536) ? 65536
+                                           : (uint32_t)num_entries;
+  v->entries = calloc(v->num_entries, sizeof(cache_entry));
+  v->redraw_event_type = SDL_RegisterEvents(1);
+  v->mutex = SDL_CreateMutex();
+  v->cond = SDL_CreateCond();
+  if (!v->entries || (v->redraw_event_type == (uint32_t)-1) || !v->mutex ||
+      !v->cond) {
+    fprintf(stderr, "main: load: could not create the tile cache\n");
+    return false;
+  }
+
+  int num_cpus = SDL_GetCPUCount();
+  uint32_t num_threads = (num_cpus <= 1) ? 1
+                         : (num_cpus > (MAX_NUM_PREFETCH_THREADS + 1))
+                             ? MAX_NUM_PREFETCH_THREADS
+                             : (uint32_t)(num_cpus - 1);
+  for (; v->num_threads < num_threads; v->num_threads++) {
+    v->threads[v->num_threads] =
+        SDL_CreateThread(&prefetch_thread, "prefetch", v);
+    if (!v->threads[v->num_threads]) {
+      break;
+    }
+  }
+  return true;
+}
+
+void              //
+viewer__destroy(  //
+    viewer* v) {
+  if (v->mutex) {
+    SDL_LockMutex(v->mutex);
+    v->quitting = true;
+    SDL_CondBroadcast(v->cond);
+    SDL_UnlockMutex(v->mutex);
+  }
+  for (uint32_t i = 0; i < v->num_threads; i++) {
+    SDL_WaitThread(v->threads[i], NULL);
+  }
+  if (v->entries) {
+    for (uint32_t i = 0; i < v->num_entries; i++) {
+      free(v->entries[i].pixels);
+    }
+    free(v->entries);
+  }
+  if (v->cond) {
+    SDL_DestroyCond(v->cond);
+  }
+  if (v->mutex) {
+    SDL_DestroyMutex(v->mutex);
+  }
+  unload_file(&v->file);
+}
+
+// viewer__pan moves the view by (dx, dy), clamped to the image bounds.
+void                     //
+viewer__pan(             //
+    viewer* v,           //
+    SDL_Window* window,  //
+    int32_t dx,          //
+    int32_t dy) {
+  int ww = 0;
+  int wh = 0;
+  SDL_GetWindowSize(window, &ww, &wh);
+  int64_t max_x = (int64_t)v->width - ww;
+  int64_t max_y = (int64_t)v->height - wh;
+  int64_t x = (int64_t)v->view_x + dx;
+  int64_t y = (int64_t)v->view_y + dy;
+  x = (x < max_x) ? x : max_x;
+  y = (y < max_y) ? y : max_y;
+  v->view_x = (x > 0) ? (int32_t)x : 0;
+  v->view_y = (y > 0) ? (int32_t)y : 0;
+}
+
+bool            //
+viewer__draw(   //
+    viewer* v,  //
+    SDL_Window* window) {
+  SDL_Surface* ws = SDL_GetWindowSurface(window);
+  if (!ws) {
+    fprintf(stderr, "main: draw: SDL_GetWindowSurface: %s\n", SDL_GetError());
+    return false;
+  }
+  SDL_FillRect(ws, NULL, SDL_MapRGB(ws->format, 0x00, 0x00, 0x00));
+
+  // The visible pieces are [tx0, tx1) x [ty0, ty1).
+  int32_t max_tx = (int32_t)((v->width + VIEW_TILE_SIZE - 1) / VIEW_TILE_SIZE);
+  int32_t max_ty = (int32_t)((v->height + VIEW_TILE_SIZE - 1) / VIEW_TILE_SIZE);
+  int32_t tx0 = v->view_x / VIEW_TILE_SIZE;
+  int32_t ty0 = v->view_y / VIEW_TILE_SIZE;
+  int32_t tx1 = (v->view_x + ws->w + VIEW_TILE_SIZE - 1) / VIEW_TILE_SIZE;
+  int32_t ty1 = (v->view_y + ws->h + VIEW_TILE_SIZE - 1) / VIEW_TILE_SIZE;
+  tx1 = (tx1 < max_tx) ? tx1 : max_tx;
+  ty1 = (ty1 < max_ty) ? ty1 : max_ty;
+
+  // Decode any missing visible pieces on this thread, unless a prefetch
+  // thread is already decoding them (which will trigger another redraw).
+  SDL_LockMutex(v->mutex);
+  for (int32_t ty = ty0; ty < ty1; ty++) {
+    for (int32_t tx = tx0; tx < tx1; tx++) {
+      cache_entry* e = viewer__find(v, tx, ty);
+      if (!e) {
+        e = viewer__claim(v, tx, ty);
+        if (!e) {
+          continue;
+        }
+        SDL_UnlockMutex(v->mutex);
+        bool ok = viewer__decode(v, e, NULL);
+        SDL_LockMutex(v->mutex);
+        e->state = ok ? CACHE_ENTRY_STATE__READY : CACHE_ENTRY_STATE__EMPTY;
+      }
+      if (e->state != CACHE_ENTRY_STATE__READY) {
+        continue;
+      }
+      e->last_use = ++v->use_counter;
+      int32_t x0 = tx * VIEW_TILE_SIZE;
+      int32_t y0 = ty * VIEW_TILE_SIZE;
+      SDL_Surface* s = create_surface(
+          e->pixels,
+          ((v->width - x0) < VIEW_TILE_SIZE) ? (v->width - x0)
+                                             : VIEW_TILE_SIZE,
+          ((v->height - y0) < VIEW_TILE_SIZE) ? (v->height - y0)
+                                              : VIEW_TILE_SIZE,
+          4 * VIEW_TILE_SIZE);
+      if (s) {
+        SDL_Rect dst_rect = {x0 - v->view_x, y0 - v->view_y, 0, 0};
+        SDL_BlitSurface(s, NULL, ws, &dst_rect);
+        SDL_FreeSurface(s);
+      }
+    }
+  }
+
+  // Replace any previous prefetch requests with the ring of pieces around
+  // the visible ones. The prefetch threads take the last request first.
+  v->num_requests = 0;
+  for (int32_t ty = ty0 - 1; ty <= ty1; ty++) {
+    for (int32_t tx = tx0 - 1; tx <= tx1; tx++) {
+      if ((v->num_requests < MAX_NUM_PREFETCH_REQUESTS) &&
+          ((tx < tx0) || (tx >= tx1) || (ty < ty0) || (ty >= ty1)) &&
+          (0 <= tx) && (tx < max_tx) && (0 <= ty) && (ty < max_ty) &&
+          !viewer__find(v, tx, ty)) {
+        v->requests[v->num_requests][0] = tx;
+        v->requests[v->num_requests][1] = ty;
+        v->num_requests++;
+      }
+    }
+  }
+  SDL_CondBroadcast(v->cond);
+  SDL_UnlockMutex(v->mutex);
+
+  SDL_UpdateWindowSurface(window);
+  return true;
+}
+
+int                      //
+main_tiled(              //
+    SDL_Window* window,  //
+    const char* filename) {
+  viewer v = {0};
+  if (!viewer__initialize(&v, filename)) {
+    viewer__destroy(&v);
+    return 1;
+  }
+
+  int ret = 0;
+  bool dragging = false;
+  while (true) {
+    SDL_Event event;
+    if (!SDL_WaitEvent(&event)) {
+      fprintf(stderr, "main: SDL_WaitEvent: %s\n", SDL_GetError());
+      ret = 1;
+      break;
+    }
+
+    bool redraw = false;
+    if (event.type == v.redraw_event_type) {
+      redraw = true;
+    } else if (event.type == SDL_QUIT) {
+      break;
+    } else if (event.type == SDL_WINDOWEVENT) {
+      redraw = (event.window.event == SDL_WINDOWEVENT_EXPOSED);
+    } else if (event.type == SDL_KEYDOWN) {
+      int32_t dx = 0;
+      int32_t dy = 0;
+      switch (event.key.keysym.sym) {
+        case SDLK_ESCAPE:
+          goto cleanup;
+        case SDLK_LEFT:
+          dx = -VIEW_TILE_SIZE / 4;
+          break;
+        case SDLK_RIGHT:
+          dx = +VIEW_TILE_SIZE / 4;
+          break;
+        case SDLK_UP:
+          dy = -VIEW_TILE_SIZE / 4;
+          break;
+        case SDLK_DOWN:
+          dy = +VIEW_TILE_SIZE / 4;
+          break;
+      }
+      viewer__pan(&v, window, dx, dy);
+      redraw = (dx != 0) || (dy != 0);
+    } else if (event.type == SDL_MOUSEBUTTONDOWN) {
+      dragging = true;
+    } else if (event.type == SDL_MOUSEBUTTONUP) {
+      dragging = false;
+    } else if ((event.type == SDL_MOUSEMOTION) && dragging) {
+      viewer__pan(&v, window, -event.motion.xrel, -event.motion.yrel);
+      redraw = true;
+    }
+    if (redraw && !viewer__draw(&v, window)) {
+      ret = 1;
+      break;
+    }
+  }
+
+cleanup:
+  viewer__destroy(&v);
+  SDL_DestroyWindow(window);
+  SDL_Quit();
+  return ret;
+}
+
 int            //
 main(          //
     int argc,  //
@@ -282,6 +616,12 @@ main(          //
     } else if (strcmp(arg, "-print-decode-time") == 0) {
       g_print_decode_time = true;
       continue;
+    } else if (strcmp(arg, "-tiled") == 0) {
+      g_tiled = true;
+      continue;
+    } else if (strncmp(arg, "-cache-mib=", 11) == 0) {
+      g_cache_mib = (uint32_t)strtoul(arg + 11, NULL, 10);
+      continue;
     } else if (filename == NULL) {
       filename = argv[i];
       continue;
@@ -290,7 +630,9 @@ main(          //
   }
 
   if (too_many_args || (filename == NULL)) {
-    fprintf(stderr, "usage: %s -print-decode-time -multithreaded filename\n",
+    fprintf(stderr,
+            "usage: %s -print-decode-time -multithreaded "
+            "-tiled -cache-mib=N filename\n",
             argv[0]);
     return 1;
   }
@@ -305,6 +647,9 @@ main(          //
     fprintf(stderr, "main: SDL_CreateWindow: %s\n", SDL_GetError());
     return 1;
   }
+  if (g_tiled) {
+    return main_tiled(window, filename);
+  }
   void* surface_owned_memory = NULL;
   SDL_Surface* surface = load(filename, &surface_owned_memory);
   if (!surface) {
@@ -6,7 +6,14 @@ LDFLAGS=${LDFLAGS:-}
 
 mkdir -p out
 echo 'Compiling out/benchmarks'
-$CC $CFLAGS test/benchmarks.c $LDFLAGS -o out/benchmarks
+$CC $CFLAGS test/benchmarks.c $LDFLAGS -lpthread -o out/benchmarks
 echo 'Running   out/benchmarks'
-# The "| awk etc" sorts by the final column.
-out/benchmarks ${@:--v test/data} | awk '{print $NF,$0}' | sort | cut -f2- -d' '
+# The "| awk etc" sorts by the final column. CSV and JSON output is left
+# unsorted, so that any CSV header line stays first.
+case " $* " in
+  *" -csv "* | *" -json "*)
+    out/benchmarks "$@" ;;
+  *)
+    out/benchmarks ${@:--v test/data} \
+        | awk '{print $NF,$0}' | sort | cut -f2- -d' ' ;;
+esac
@@ -0,0 +1,39 @@
+// Copyright 2022 Nigel Tao.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//go:build ignore
+
+package main
+
+// This program prints the qoir_private_table_linearize values: each 8-bit
+// (gamma encoded) value converted to 16-bit linear light, with a gamma of 2.2
+// (the default in extra/lib/gammaawaredither).
+
+import (
+	"fmt"
+	"math"
+)
+
+func main() {
+	for k := 0; k < 256; k++ {
+		v := math.Round(65535 * math.Pow(float64(k)/255.0, 2.2))
+		if (k & 7) == 0 {
+			fmt.Printf("  0x%04X,", int(v))
+		} else if (k & 7) == 7 {
+			fmt.Printf("0x%04X,\n", int(v))
+		} else {
+			fmt.Printf("0x%04X,", int(v))
+		}
+	}
+}
@@ -95,9 +95,15 @@ $CC -DCONFIG_FULL_BENCHMARKS=1 \
     out/webp_adapter.o \
     out/zpng_adapter.o \
     -L../libjxl/build \
-    $LDFLAGS -ljxl -llz4 -lpng -lstdc++ -lwebp -lzstd -o out/full_benchmarks
+    $LDFLAGS -ljxl -llz4 -lpng -lpthread -lstdc++ -lwebp -lzstd -o out/full_benchmarks
 
 echo 'Running   out/full_benchmarks'
-# The "| awk etc" sorts by the final column.
-LD_LIBRARY_PATH=../libjxl/build out/full_benchmarks ${@:--v test/data} \
-    | awk '{print $NF,$0}' | sort | cut -f2- -d' '
+# The "| awk etc" sorts by the final column. CSV and JSON output is left
+# unsorted, so that any CSV header line stays first.
+case " $* " in
+  *" -csv "* | *" -json "*)
+    LD_LIBRARY_PATH=../libjxl/build out/full_benchmarks "$@" ;;
+  *)
+    LD_LIBRARY_PATH=../libjxl/build out/full_benchmarks ${@:--v test/data} \
+        | awk '{print $NF,$0}' | sort | cut -f2- -d' ' ;;
+esac
@@ -47,6 +47,7 @@ extern "C" {
 // -------- Compile-time Configuration
 
 // The compile-time configuration macros are:
+//  - QOIR_CONFIG__DISABLE_CPU_DISPATCH
 //  - QOIR_CONFIG__DISABLE_LARGE_LOOK_UP_TABLES
 //  - QOIR_CONFIG__DISABLE_SIMD
 //  - QOIR_CONFIG__STATIC_FUNCTIONS
@@ -54,6 +55,14 @@ extern "C" {
 
 // ----
 
+// On x86_64, QOIR uses SSE2 (part of that architecture's baseline) and, if the
+// CPU supports them, SSSE3 and AVX2 code paths. The CPU is queried at run time
+// unless QOIR_CONFIG__DISABLE_CPU_DISPATCH is defined, in which case those
+// code paths are only used if the compiler already targets them (e.g. with
+// "CFLAGS=-march=native"). QOIR_CONFIG__DISABLE_SIMD disables all of them.
+
+// ----
+
 // If using e.g. "CFLAGS='-DQOIR_CONFIG__USE_OFFICIAL_LZ4_LIBRARY -O3'") then
 // you probably also want "LDFLAGS=-llz4", otherwise you'll get "undefined
 // reference to `LZ4_decompress_safe'".
@@ -95,6 +104,7 @@ extern const char qoir_lz4_status_message__error_dst_is_too_short[];
 extern const char qoir_lz4_status_message__error_invalid_data[];
 extern const char qoir_lz4_status_message__error_src_is_too_long[];
 
+extern const char qoir_status_message__error_dst_is_too_short[];
 extern const char qoir_status_message__error_invalid_argument[];
 extern const char qoir_status_message__error_invalid_data[];
 extern const char qoir_status_message__error_out_of_memory[];
@@ -253,6 +263,28 @@ qoir_calculate_number_of_tiles_2d(  //
   return w * h;
 }
 
+// -------- Jobs
+
+// QOIR_MAX_NUM_JOBS is the upper bound on the number of jobs in a batch. Any
+// larger max_num_jobs option is treated as QOIR_MAX_NUM_JOBS.
+#define QOIR_MAX_NUM_JOBS 1024
+
+// A qoir_job_func performs one of a batch of (num_jobs) independent jobs. The
+// job_index ranges from 0 (inclusive) to num_jobs (exclusive).
+typedef void (*qoir_job_func)(void* job_context, uint32_t job_index);
+
+// A qoir_run_jobs_func runs a batch of jobs, calling job_func(job_context, i)
+// exactly once for each i in the range 0 (inclusive) to num_jobs (exclusive).
+// Those calls may happen concurrently (e.g. on a thread pool) and in any
+// order, but the qoir_run_jobs_func must not return until all of them have.
+//
+// Calling them sequentially (e.g. in a simple for loop) is also valid, albeit
+// single-threaded.
+typedef void (*qoir_run_jobs_func)(void* run_jobs_func_context,
+                                   qoir_job_func job_func,
+                                   void* job_context,
+                                   uint32_t num_jobs);
+
 // -------- LZ4 Decode
 
 // QOIR_LZ4_BLOCK_DECODE_MAX_INCL_SRC_LEN is the maximum (inclusive) supported
@@ -311,6 +343,159 @@ qoir_lz4_block_encode(                     //
     const uint8_t* QOIR_RESTRICT src_ptr,  //
     size_t src_len);
 
+// -------- Statistics
+
+// QOIR_NUM_TILE_FORMATS is one more than the largest tile format that this
+// implementation supports: Literals (0), Ops (1), LZ4-Literals (2), LZ4-Ops
+// (3), Constant (4), Back-Reference (5) and Huffman-Ops (6).
+#define QOIR_NUM_TILE_FORMATS 7
+
+// The QOIR_OP_TYPE__ETC values index the num_ops_by_type arrays, one element
+// per QOIR_OP_ETC op of the ops VM (virtual machine). See the file format
+// specification.
+
+// clang-format off
+
+#define QOIR_OP_TYPE__INDEX   0
+#define QOIR_OP_TYPE__BGR2    1
+#define QOIR_OP_TYPE__LUMA    2
+#define QOIR_OP_TYPE__BGR7    3
+#define QOIR_OP_TYPE__RUNS    4
+#define QOIR_OP_TYPE__RUNL    5
+#define QOIR_OP_TYPE__BGRA2   6
+#define QOIR_OP_TYPE__BGRA4   7
+#define QOIR_OP_TYPE__BGRA8   8
+#define QOIR_OP_TYPE__BGR8    9
+#define QOIR_OP_TYPE__A8     10
+
+#define QOIR_NUM_OP_TYPES    11
+
+// clang-format on
+
+// qoir_tile_stats describes how one tile was encoded or decoded.
+typedef struct qoir_tile_stats_struct {
+  // The tile's position, measured in tiles (not pixels), and its size,
+  // measured in pixels.
+  uint32_t tile_x;
+  uint32_t tile_y;
+  uint32_t width_in_pixels;
+  uint32_t height_in_pixels;
+
+  // The tile format. When decoding a Back-Reference tile, this (and the
+  // lengths and op counts below) is that of the earlier tile that it refers
+  // to and is_back_reference is true.
+  uint32_t tile_format;
+  bool is_back_reference;
+
+  // compressed_len is the length of the tile's encoded bytes, excluding its 4
+  // byte prefix. uncompressed_len is the length of the literals or ops that
+  // those bytes hold before any LZ4 or Huffman compression. The two are equal
+  // for the Literals, Ops and Constant tile formats.
+  size_t compressed_len;
+  size_t uncompressed_len;
+
+  // How many of each type of op the tile's ops hold. These are all zero for
+  // the tile formats that don't hold ops (Literals, LZ4-Literals and
+  // Constant).
+  uint32_t num_ops_by_type[QOIR_NUM_OP_TYPES];
+
+  // How long it took to encode or decode the tile, per a monotonic clock
+  // (POSIX's clock_gettime with CLOCK_MONOTONIC). This is only measured when
+  // there is a contextual_tile_func to pass it to, and is always zero where
+  // <time.h> doesn't provide that clock (e.g. on Windows or when compiling in
+  // a strict ISO C mode such as -std=c99).
+  uint64_t duration_in_nanoseconds;
+} qoir_tile_stats;
+
+// A qoir_tile_func is called once per tile that qoir_encode encodes or
+// qoir_decode decodes. When multi-threaded, calls may happen concurrently, on
+// whichever thread runs the job that contains the tile.
+typedef void (*qoir_tile_func)(void* tile_func_context,
+                               const qoir_tile_stats* tile_stats);
+
+// qoir_stats summarizes how an image's tiles were encoded or decoded: the sum
+// of every tile's qoir_tile_stats. A zero-valued qoir_stats is valid.
+//
+// The per tile format arrays are indexed by the tile_format (which, as per
+// qoir_tile_stats, is never the Back-Reference tile format).
+typedef struct qoir_stats_struct {
+  uint64_t num_tiles_by_format[QOIR_NUM_TILE_FORMATS];
+  uint64_t compressed_len_by_format[QOIR_NUM_TILE_FORMATS];
+  uint64_t uncompressed_len_by_format[QOIR_NUM_TILE_FORMATS];
+  uint64_t num_ops_by_type[QOIR_NUM_OP_TYPES];
+
+  // How many tiles were Back-References (when decoding) or were replaced by
+  // Back-References (when encoding with the reference_duplicate_tiles
+  // option). The latter happens after the tiles are first encoded, so those
+  // tiles are still counted in the arrays above.
+  uint64_t num_back_reference_tiles;
+
+  // How many tiles were not decoded because they were entirely outside of
+  // the clipping rectangles.
+  uint64_t num_clipped_tiles;
+} qoir_stats;
+
+// -------- QOIR Context
+
+// QOIR_CONTEXT_POOL_LEN is the maximum number of recycled memory blocks (e.g.
+// pixel buffers) that a qoir_context holds for re-use.
+#define QOIR_CONTEXT_POOL_LEN 8
+
+// qoir_context holds memory (scratch space, per-job state for the
+// multi-threaded code paths and a pool of recycled pixel buffers and encoded
+// output buffers) that is re-used across qoir_decode and qoir_encode calls.
+// Passing the same context to every call (via the options' context field) lets
+// a program that repeatedly decodes or encodes similarly sized images do
+// no memory allocation in the steady state.
+//
+// A qoir_context is not thread-safe. Use one per thread (it can be thread-
+// local), even though a single call's jobs can run on other threads.
+//
+// A zero-valued qoir_context is valid and equivalent to one initialized with
+// NULL memory functions. Call qoir_context__destroy to release its memory.
+typedef struct qoir_context_struct {
+  struct {
+    void* (*contextual_malloc_func)(void* memory_func_context, size_t len);
+    void (*contextual_free_func)(void* memory_func_context, void* ptr);
+    void* memory_func_context;
+    struct qoir_decode_buffer_struct* decbuf;
+    struct qoir_encode_buffer_struct* encbuf;
+    uint8_t* scratch_ptrs[3];
+    size_t scratch_lens[3];
+    void* pool[QOIR_CONTEXT_POOL_LEN];
+  } private_impl;
+} qoir_context;
+
+// Prepares the context. NULL etc_func pointers means to use the standard
+// malloc and free functions. Non-NULL etc_func pointers will be passed the
+// memory_func_context. Any options' memory functions are ignored for memory
+// that comes from a context.
+QOIR_MAYBE_STATIC void                                          //
+qoir_context__initialize(                                       //
+    qoir_context* context,                                      //
+    void* (*contextual_malloc_func)(void* memory_func_context,  //
+                                    size_t len),                //
+    void (*contextual_free_func)(void* memory_func_context,     //
+                                 void* ptr),                    //
+    void* memory_func_context);
+
+// Returns the owned_memory of a qoir_decode_result or qoir_encode_result,
+// produced by a call whose options' context field was this context, to the
+// context's pool. Passing NULL is a no-op.
+//
+// Such owned_memory can instead be freed (with the context's free function)
+// as usual, but only recycled memory can be re-used.
+QOIR_MAYBE_STATIC void      //
+qoir_context__recycle(      //
+    qoir_context* context,  //
+    void* owned_memory);
+
+// Releases the context's memory, including its pool. It is valid to call this
+// more than once. The context can be used again afterwards.
+QOIR_MAYBE_STATIC void  //
+qoir_context__destroy(  //
+    qoir_context* context);
+
 // -------- QOIR Decode
 
 typedef struct qoir_decode_pixel_configuration_result_struct {
@@ -323,12 +508,62 @@ qoir_decode_pixel_configuration(                          //
     const uint8_t* src_ptr,                               //
     size_t src_len);
 
+typedef struct qoir_decode_metadata_result_struct {
+  const char* status_message;
+
+  // The image's dimensions and its stored (not decoded) pixel format: BGRX,
+  // BGRA_NONPREMUL or BGRA_PREMUL.
+  qoir_pixel_configuration src_pixcfg;
+  uint32_t lossiness;
+
+  // The TIDX (tile index) chunk's payload, if present: 8 bytes per tile.
+  const uint8_t* tile_index_ptr;
+  uint64_t number_of_tiles;
+
+  // The MIPS (mipmap) chunk's payload length, or zero if absent.
+  size_t mipmap_len;
+
+  // Optional metadata chunks, the same as qoir_decode would return.
+
+  const uint8_t* metadata_cicp_ptr;
+  size_t metadata_cicp_len;
+
+  const uint8_t* metadata_iccp_ptr;
+  size_t metadata_iccp_len;
+
+  const uint8_t* metadata_exif_ptr;
+  size_t metadata_exif_len;
+
+  const uint8_t* metadata_xmp_ptr;
+  size_t metadata_xmp_len;
+} qoir_decode_metadata_result;
+
+// Walks the chunks of a QOIR image, validating them as qoir_decode does, but
+// skips over (instead of decoding) the pixel data. It does not allocate
+// memory and its cost depends on the number of chunks but not on the number
+// of pixels. The returned pointers are sub-slices of src.
+//
+// An image that qoir_decode_metadata rejects will also be rejected by
+// qoir_decode but, as the tiles are not visited, the converse is not true.
+QOIR_MAYBE_STATIC qoir_decode_metadata_result  //
+qoir_decode_metadata(                          //
+    const uint8_t* src_ptr,                    //
+    size_t src_len);
+
 typedef struct qoir_decode_buffer_struct {
   struct {
     // ops has to be before literals, so that (worst case) we can read (and
     // ignore) 8 bytes past the end of the ops array. See §
     uint8_t ops[4 * QOIR_TS2];
     uint8_t literals[QOIR_LITERALS_PRE_PADDING + (4 * QOIR_TS2)];
+    // huffman_table is the Huffman-Ops tile format's decoding table, indexed
+    // by the next 12 (the maximum code length) bits. Each element's low and
+    // high bytes are the decoded symbol and its code length (zero if
+    // invalid).
+    uint16_t huffman_table[1 << 12];
+    // stats accumulates (when the qoir_decode_options ask for statistics)
+    // this scratch space's job's tiles' stats.
+    qoir_stats stats;
   } private_impl;
 } qoir_decode_buffer;
 
@@ -366,6 +601,16 @@ typedef struct qoir_decode_options_struct {
   // If NULL, the 'scratch space' will be dynamically allocated and freed.
   qoir_decode_buffer* decbuf;
 
+  // Optional qoir_context. If non-NULL, the 'scratch space' (if the decbuf
+  // field is NULL), the multi-threaded jobs' state and any dynamically
+  // allocated pixel buffer come from (and are kept by) the context.
+  //
+  // The qoir_decode_result owned_memory is then a block from the context's
+  // pool. Pass it to qoir_context__recycle (instead of free) once done with
+  // the pixels. It is not the same pointer as the dst_pixbuf's data, which
+  // starts a few bytes later.
+  qoir_context* context;
+
   // Pre-allocated pixel buffer to decode into.
   //
   // If zero, it will be dynamically allocated and memory ownership (i.e. the
@@ -384,6 +629,10 @@ typedef struct qoir_decode_options_struct {
   // Clipping rectangles, in the destination or source (or both) coordinate
   // spaces. The clips (the qoir_rectangle typed fields) have no effect unless
   // the corresponding boolean typed field is true.
+  //
+  // If the source image has a TIDX (tile index) chunk, decoding a clipped
+  // region only visits the tiles that intersect it. Otherwise, every tile's
+  // prefix is visited, even if its pixels are clipped out.
   qoir_rectangle dst_clip_rectangle;
   qoir_rectangle src_clip_rectangle;
   bool use_dst_clip_rectangle;
@@ -393,6 +642,55 @@ typedef struct qoir_decode_options_struct {
   // corner of the decoded source image. The Y axis grows down.
   int32_t offset_x;
   int32_t offset_y;
+
+  // Optional mipmap level selection. If both of these are non-zero and the
+  // image has a MIPS chunk (see the qoir_encode_options num_mipmap_levels
+  // field), qoir_decode decodes the smallest level (possibly level 0, the full
+  // size image) that is at least this wide and high. The source image is then
+  // that level, for the rest of these options. The incremental qoir_decoder
+  // ignores these fields, always decoding level 0.
+  uint32_t mipmap_min_width_in_pixels;
+  uint32_t mipmap_min_height_in_pixels;
+
+  // Optional downscaling (e.g. for thumbnails). If non-zero, the source image
+  // is decoded at 1/2, 1/4 or 1/8 of its width and height (rounded up), for a
+  // downscale_shift of 1, 2 or 3. Larger values are equivalent to 3. Each
+  // destination pixel is the average of a block of source pixels (2x2, 4x4 or
+  // 8x8, or fewer at the right and bottom edges). Non-premultiplied colors
+  // are weighted by their alpha.
+  //
+  // The source coordinate space (for the clipping rectangles and offsets) is
+  // then the downscaled image's, and so is the size of any dynamically
+  // allocated pixel buffer.
+  uint32_t downscale_shift;
+
+  // Optional multi-threading. If contextual_run_jobs_func is non-NULL and
+  // max_num_jobs is greater than 1 then qoir_decode splits the tiles (those
+  // that intersect the clipping rectangles) into up to max_num_jobs jobs, each
+  // decoding a contiguous range of tiles into the shared pixel buffer. Those
+  // jobs are passed (along with run_jobs_func_context) to
+  // contextual_run_jobs_func, which will typically run them on a thread pool.
+  //
+  // Each job needs its own 'scratch space'. The first job uses the decbuf
+  // field (if non-NULL) and the others' are dynamically allocated and freed.
+  // If the source image has no TIDX (tile index) chunk then an equivalent (8
+  // bytes per tile) is also temporarily allocated.
+  qoir_run_jobs_func contextual_run_jobs_func;
+  void* run_jobs_func_context;
+  uint32_t max_num_jobs;
+
+  // Optional statistics. If non-NULL, qoir_decode adds (without first
+  // zeroing, so that it can sum over many images) its decoded tiles' stats
+  // to the qoir_stats that this points to. That includes num_clipped_tiles.
+  qoir_stats* stats;
+
+  // Optional per-tile instrumentation. If non-NULL, contextual_tile_func is
+  // passed tile_func_context and each decoded tile's qoir_tile_stats,
+  // including how long decoding that tile took.
+  //
+  // The incremental qoir_decoder ignores these and the stats field.
+  qoir_tile_func contextual_tile_func;
+  void* tile_func_context;
 } qoir_decode_options;
 
 // Decodes a pixel buffer from the QOIR format.
@@ -405,6 +703,135 @@ qoir_decode(                          //
     const size_t src_len,             //
     const qoir_decode_options* options);
 
+// -------- QOIR Batch Decode
+
+// qoir_decode_batch_item is one of the images that qoir_decode_batch decodes.
+//
+// The dst_rectangle is where, in the destination coordinate space, to place
+// the decoded image: its top-left corner is the image's top-left corner and
+// any pixels outside of it are clipped. Different items' rectangles should
+// not overlap, as items can be decoded concurrently.
+typedef struct qoir_decode_batch_item_struct {
+  const uint8_t* src_ptr;
+  size_t src_len;
+  qoir_rectangle dst_rectangle;
+
+  // Set by qoir_decode_batch: NULL on success or the item's error message.
+  const char* status_message;
+} qoir_decode_batch_item;
+
+// Decodes many (typically small) images into one pre-allocated pixel buffer,
+// such as a sprite atlas or a grid of thumbnails. The options pixbuf field is
+// required (a zero pixbuf is an invalid_argument error) and the other options
+// apply to every item, as for qoir_decode, except that each item's
+// dst_rectangle overrides the offset_x and offset_y fields and is intersected
+// with any dst_clip_rectangle. Metadata chunks are ignored.
+//
+// The scratch space (decbuf and, for multi-threading, the others') is shared
+// by consecutive items instead of being allocated per item. If
+// contextual_run_jobs_func is non-NULL and max_num_jobs is greater than 1 then
+// the items (instead of each item's tiles) are split into up to max_num_jobs
+// jobs, each decoding a contiguous range of items.
+//
+// One item failing does not stop the others from being decoded. The result is
+// NULL if every item succeeded, otherwise the first failing item's (or an
+// argument or allocation failure's) status message.
+QOIR_MAYBE_STATIC const char*       //
+qoir_decode_batch(                  //
+    qoir_decode_batch_item* items,  //
+    size_t num_items,               //
+    const qoir_decode_options* options);
+
+// -------- QOIR Incremental Decode
+
+// qoir_decoder decodes an image incrementally, from bytes that arrive a piece
+// at a time (e.g. over a network), decoding every tile as soon as all of its
+// bytes are available. The decoded pixels are the same as what qoir_decode
+// would produce, given the same options, but metadata chunks are skipped.
+//
+// Call qoir_decoder__initialize, then qoir_decoder__decode (one or more times,
+// as more bytes arrive, until qoir_decoder__is_done) and then
+// qoir_decoder__finish. If any of those fail (or to abandon a decoding half
+// way), call qoir_decoder__destroy instead of qoir_decoder__finish.
+typedef struct qoir_decoder_struct {
+  struct {
+    qoir_decode_options options;
+    qoir_decode_result result;
+    qoir_decode_buffer* decbuf;
+    bool free_decbuf;
+    uint32_t phase;
+    uint32_t seen_chunks;
+    qoir_pixel_format src_pixfmt;
+    uint32_t src_width_in_pixels;
+    uint32_t src_height_in_pixels;
+    uint32_t lossiness;
+    uint32_t num_decoded_rows;
+    uint64_t num_decoded_tiles;
+    uint64_t skip_len;
+    uint64_t qpix_remaining;
+  } private_impl;
+} qoir_decoder;
+
+// Prepares the decoder.
+//
+// A NULL options is valid, as for qoir_decode. The options are copied (and
+// its multi-threading and statistics fields are ignored) but any decbuf or
+// pixbuf memory must remain valid until qoir_decoder__finish or
+// qoir_decoder__destroy returns.
+QOIR_MAYBE_STATIC const char*  //
+qoir_decoder__initialize(      //
+    qoir_decoder* decoder,     //
+    const qoir_decode_options* options);
+
+// Decodes what it can of the next src_len bytes of the encoded image. The
+// result value is the number of bytes consumed, which can be less than
+// src_len, as a tile is only consumed (and decoded) once all of its bytes
+// (and the 8 bytes after it) are available. The caller should pass the
+// unconsumed bytes again, followed by any newly arrived bytes, in the next
+// call. The caller should therefore be prepared to hold (4 + 0xFFFFFF + 8)
+// bytes, although tiles produced by qoir_encode are much shorter: at most (4 *
+// QOIR_TS2) bytes.
+//
+// After returning an error, subsequent calls return the same error.
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_decoder__decode(               //
+    qoir_decoder* decoder,          //
+    const uint8_t* src_ptr,         //
+    size_t src_len);
+
+// Returns the pixel buffer being decoded into, which is zero until the
+// decoder has consumed the first (QOIR) chunk.
+QOIR_MAYBE_STATIC const qoir_pixel_buffer*  //
+qoir_decoder__dst_pixbuf(                   //
+    const qoir_decoder* decoder);
+
+// Returns how many of the source image's rows, counting from the top, are
+// fully decoded (subject to the clipping rectangles). This grows a row of
+// tiles (QOIR_TILE_SIZE rows) at a time, except for the last row of tiles.
+// When downscaling, it counts the downscaled image's rows.
+QOIR_MAYBE_STATIC uint32_t       //
+qoir_decoder__num_decoded_rows(  //
+    const qoir_decoder* decoder);
+
+// Returns whether the decoder has consumed the final (QEND) chunk.
+QOIR_MAYBE_STATIC bool  //
+qoir_decoder__is_done(  //
+    const qoir_decoder* decoder);
+
+// Returns the decoded image (after checking that the decoder is done) and
+// releases the decoder's resources, other than the result's owned_memory. The
+// result's metadata fields are all NULL.
+QOIR_MAYBE_STATIC qoir_decode_result  //
+qoir_decoder__finish(                 //
+    qoir_decoder* decoder);
+
+// Releases the decoder's resources, including any dynamically allocated pixel
+// buffer. It is valid to call this after qoir_decoder__finish, or more than
+// once.
+QOIR_MAYBE_STATIC void  //
+qoir_decoder__destroy(  //
+    qoir_decoder* decoder);
+
 // -------- QOIR Encode
 
 typedef struct qoir_encode_buffer_struct {
@@ -416,6 +843,15 @@ typedef struct qoir_encode_buffer_struct {
     // typical cache line size.
     uint8_t ops[(5 * QOIR_TS2) + 64];
     uint8_t literals[QOIR_LITERALS_PRE_PADDING + (4 * QOIR_TS2)];
+    // lz4_chain and lz4_heads are the hash chains for LZ4 compressing (at 4
+    // bytes per pixel) a tile's ops or literals when the qoir_encode_options
+    // effort is positive. lz4_heads has (1 << QOIR_LZ4_HASH_TABLE_SHIFT)
+    // elements.
+    uint16_t lz4_chain[4 * QOIR_TS2];
+    uint16_t lz4_heads[1 << 12];
+    // stats accumulates (when the qoir_encode_options ask for statistics)
+    // this scratch space's job's tiles' stats.
+    qoir_stats stats;
   } private_impl;
 } qoir_encode_buffer;
 
@@ -440,6 +876,48 @@ typedef struct qoir_encode_options_struct {
   // If NULL, the 'scratch space' will be dynamically allocated and freed.
   qoir_encode_buffer* encbuf;
 
+  // Optional qoir_context. If non-NULL, the 'scratch space' (if the encbuf
+  // field is NULL), the multi-threaded jobs' state and any dynamically
+  // allocated buffer to encode into come from (and are kept by) the context.
+  //
+  // The qoir_encode_result owned_memory is then a block from the context's
+  // pool. Pass it to qoir_context__recycle (instead of free) once done with
+  // the encoded bytes. It is not the same pointer as the dst_ptr, which
+  // starts a few bytes later.
+  qoir_context* context;
+
+  // Pre-allocated buffer to encode into. Its dst_len must be at least the
+  // qoir_encode_worst_case_dst_len (given the same src_pixbuf and options),
+  // even though the encoded output is typically much shorter.
+  //
+  // If NULL, it will be dynamically allocated and memory ownership (i.e. the
+  // responsibility to call free or equivalent) will be returned as the
+  // qoir_encode_result owned_memory field.
+  uint8_t* dst_ptr;
+  size_t dst_len;
+
+  // Optional output sink. If non-NULL, qoir_encode passes the encoded bytes to
+  // contextual_write_func instead of writing to dst_ptr (which must be NULL).
+  // The qoir_encode_result dst_ptr and owned_memory fields will be NULL and
+  // its dst_len field will be the total number of bytes written.
+  //
+  // Each call writes src_len bytes at the given position. The positions are
+  // contiguous and increasing, except for some 8 byte writes (of the QPIX
+  // chunk's length and, with mipmaps, of the MIPS chunk's and its levels'
+  // lengths, which aren't known until their tiles are encoded) that overwrite
+  // earlier bytes. The sink must therefore be seekable, e.g. a file
+  // (via pwrite) or a buffer, but the tiles are written as they are produced
+  // and the whole encoded image is never held in memory.
+  //
+  // A non-NULL return value is an error status message, which qoir_encode
+  // will return (as the qoir_encode_result status_message field) without
+  // making any further calls.
+  const char* (*contextual_write_func)(void* write_func_context,
+                                       uint64_t position,
+                                       const uint8_t* src_ptr,
+                                       size_t src_len);
+  void* write_func_context;
+
   // Optional metadata chunks.
 
   const uint8_t* metadata_cicp_ptr;
@@ -460,15 +938,117 @@ typedef struct qoir_encode_options_struct {
   // Whether to dither the lossy encoding. This option has no effect if
   // lossiness is zero.
   //
-  // The dithering algorithm is relatively simple. Fancier algorithms like
-  // https://nigeltao.github.io/blog/2022/gamma-aware-ordered-dithering.html
-  // can produce higher quality results, especially for lossiness levels at 6
-  // or 7 re overall brightness, but they are out of scope of this library. To
-  // use alternative dithering algorithms, apply them to src_pixbuf before
-  // passing to qoir_encode.
+  // The dithering algorithm is relatively simple: ordered dithering with a
+  // blue noise texture. To use other dithering algorithms, apply them to
+  // src_pixbuf before passing to qoir_encode.
   bool dither;
+
+  // Whether dithering (if the dither field is true) is gamma-aware, as per
+  // https://nigeltao.github.io/blog/2022/gamma-aware-ordered-dithering.html
+  // and extra/lib/gammaawaredither, which preserves the image's perceived
+  // brightness, especially for lossiness levels at 6 or 7. The color
+  // channels are compared in linear light, assuming a gamma of 2.2. The
+  // alpha channel is already linear.
+  bool gamma_aware_dither;
+
+  // How hard to try (how long to spend) to make the LZ4-Literals and LZ4-Ops
+  // tile formats smaller, ranging from 0 (the default) to 9. Larger values
+  // are clamped to 9. At zero, the LZ4 match finder is greedy and checks only
+  // one earlier position per hash. Above zero, it checks up to (4 << effort)
+  // earlier positions, prefers a longer match that starts one byte later and
+  // tries LZ4 compressing a tile's literals even when its ops are shorter.
+  // Either way, the tiles are plain LZ4 and decode just as fast.
+  uint32_t effort;
+
+  // The minimum percentage of a tile's Literals or Ops tile format bytes that
+  // LZ4 compression must save for the encoder to pick the LZ4-Literals or
+  // LZ4-Ops tile format instead. Decoding an LZ4 tile does roughly twice the
+  // work, so larger values favor decode speed over file size. Zero (the
+  // default) means any saving. 100 or more means to never use LZ4. Tiles that
+  // are too short for LZ4 to save that much are not even tried.
+  uint32_t lz4_min_savings_percent;
+
+  // Whether to use the 4 byte Constant tile format for tiles whose pixels
+  // (after any lossy quantization) are all the same, as is common for flat
+  // backgrounds. Such tiles are then much smaller and faster to decode, but
+  // decoders that predate that tile format reject them. This option has no
+  // effect if the lossy encoding is dithered, as dithered tiles are rarely
+  // uniform.
+  bool use_constant_tile_format;
+
+  // Whether to also try the Huffman-Ops tile format, which entropy codes a
+  // tile's ops (with 4 interleaved streams, for decoder instruction-level
+  // parallelism), and use it whenever it is the shortest. This usually makes
+  // files noticeably smaller but costs encoding time and some decoding time.
+  bool use_huffman_tile_format;
+
+  // Whether to also write a TIDX (tile index) chunk, holding the byte offset
+  // of every tile in the QPIX chunk. This makes the file slightly larger (8
+  // bytes per tile) but lets qoir_decode skip straight to the tiles that
+  // intersect its clipping rectangles, instead of walking every tile.
+  bool write_tile_index;
+
+  // How many reduced resolution (mipmap) levels to also write, in a MIPS
+  // chunk. Level k is the image downscaled by (1 << k), rounding up, and each
+  // level's pixels are the average of 2x2 blocks of the previous level's.
+  // Like level 0 (the QPIX chunk), each level is tiled and uses the same
+  // pixel format and lossiness. Zero means no MIPS chunk. Values beyond the
+  // level at which the image is 1x1 are equivalent to that level.
+  //
+  // The mipmap_min_etc fields of qoir_decode_options select a level.
+  uint32_t num_mipmap_levels;
+
+  // Whether to replace every tile whose encoding is byte-for-byte identical
+  // to an earlier tile's (as is common in texture atlases and tiled
+  // backgrounds) with a 12 byte Back-Reference to that earlier tile, instead
+  // of repeating it. This only applies when qoir_encode writes to memory (not
+  // to a contextual_write_func) and is ignored by the incremental qoir_encoder.
+  //
+  // qoir_decode handles such images but the incremental qoir_decoder, which
+  // does not keep earlier tiles' bytes, rejects them as an unsupported tile
+  // format.
+  bool reference_duplicate_tiles;
+
+  // Optional multi-threading. If contextual_run_jobs_func is non-NULL and
+  // max_num_jobs is greater than 1 then qoir_encode splits the tiles into up
+  // to max_num_jobs jobs, each encoding a contiguous range of tiles into its
+  // own region of the output buffer. Those jobs are passed (along with
+  // run_jobs_func_context) to contextual_run_jobs_func and, once they have all
+  // finished, their output is compacted into a single QPIX chunk. The encoded
+  // bytes are the same regardless of the number of jobs.
+  //
+  // The first job uses the encbuf field (if non-NULL) as its 'scratch space'
+  // and the others' are dynamically allocated and freed.
+  qoir_run_jobs_func contextual_run_jobs_func;
+  void* run_jobs_func_context;
+  uint32_t max_num_jobs;
+
+  // Optional statistics. If non-NULL, qoir_encode adds (without first
+  // zeroing, so that it can sum over many images) its encoded tiles' stats,
+  // including any mipmap levels' tiles, to the qoir_stats that this points
+  // to. Tiles that qoir_encode_dirty_rectangles copies (instead of encoding)
+  // are not counted.
+  qoir_stats* stats;
+
+  // Optional per-tile instrumentation. If non-NULL, contextual_tile_func is
+  // passed tile_func_context and each encoded tile's qoir_tile_stats,
+  // including how long encoding that tile took.
+  qoir_tile_func contextual_tile_func;
+  void* tile_func_context;
 } qoir_encode_options;
 
+// Returns the size of the buffer that qoir_encode needs, either dynamically
+// allocated or as the options' pre-allocated dst_ptr and dst_len. This depends
+// on the src_pixbuf's dimensions (but not its pixel format or pixel data) and
+// on the options (other than those options' dst_ptr and dst_len fields).
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_size_result        //
+qoir_encode_worst_case_dst_len(           //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options);
+
 // Encodes a pixel buffer to the QOIR format.
 //
 // A NULL options is valid and is equivalent to a non-NULL pointer to a
@@ -478,6 +1058,156 @@ qoir_encode(                              //
     const qoir_pixel_buffer* src_pixbuf,  //
     const qoir_encode_options* options);
 
+// Re-encodes a pixel buffer to the QOIR format, given prev (a previous
+// encoding of an image with the same dimensions, encoded pixel format and
+// lossiness) and the dirty rectangles (in pixel coordinates) outside of which
+// the pixels are unchanged since prev was encoded. Tiles that don't intersect
+// any dirty rectangle have their encoded bytes copied from prev instead of
+// being re-encoded, so that (e.g. when streaming screenshots) the encoding
+// cost is proportional to the changed area instead of the whole image.
+//
+// The output is a valid encoding of src_pixbuf only if the caller's dirty
+// rectangles are accurate. The copied tiles are not compared with src_pixbuf.
+// Any MIPS chunk is still computed from every pixel.
+//
+// The options are as for qoir_encode (and must specify the same lossiness as
+// prev's, otherwise it is an invalid_argument error). A NULL options is valid.
+QOIR_MAYBE_STATIC qoir_encode_result         //
+qoir_encode_dirty_rectangles(                //
+    const qoir_pixel_buffer* src_pixbuf,     //
+    const uint8_t* prev_ptr,                 //
+    size_t prev_len,                         //
+    const qoir_rectangle* dirty_rectangles,  //
+    size_t num_dirty_rectangles,             //
+    const qoir_encode_options* options);
+
+// -------- QOIR Incremental Encode
+
+// qoir_encoder encodes an image incrementally, a band of rows at a time, so
+// that the entire source image never needs to be in memory (only one row of
+// tiles is buffered). The encoded bytes are passed to the options'
+// contextual_write_func and are the same as what qoir_encode would produce.
+//
+// Call qoir_encoder__initialize, then qoir_encoder__push_rows (one or more
+// times, until all of the rows have been pushed) and then qoir_encoder__finish.
+// If any of those fail (or to abandon an encoding half way), call
+// qoir_encoder__destroy instead of qoir_encoder__finish.
+typedef struct qoir_encoder_struct {
+  struct {
+    qoir_encode_options options;
+    qoir_pixel_configuration pixcfg;
+    uint32_t lossiness;
+    uint32_t max_num_jobs;
+    uint32_t num_pushed_rows;
+    uint32_t num_band_rows;
+    uint64_t position;
+    uint64_t qpix_pos;
+    uint64_t qpix_len;
+    uint8_t* alloc_ptr;
+    uint8_t* band_ptr;
+    uint8_t* row_ptr;
+    uint8_t* tidx_ptr;
+    qoir_pixel_buffer mipmap_pixbuf;
+    uint32_t num_mipmap_levels;
+    qoir_encode_buffer* encbuf;
+    qoir_encode_buffer* other_encbufs;
+    qoir_size_result* results;
+    bool free_encbuf;
+  } private_impl;
+} qoir_encoder;
+
+// Prepares the encoder and writes the chunks that precede the pixel data.
+//
+// Unlike qoir_encode, the options must be non-NULL and its
+// contextual_write_func field must be non-NULL (and its dst_ptr field must be
+// NULL). The options are copied but any metadata_etc_ptr pointers must remain
+// valid until qoir_encoder__finish returns.
+QOIR_MAYBE_STATIC const char*                    //
+qoir_encoder__initialize(                        //
+    qoir_encoder* encoder,                       //
+    const qoir_pixel_configuration* src_pixcfg,  //
+    const qoir_encode_options* options);
+
+// Pushes the next src_pixbuf->pixcfg.height_in_pixels rows, which can be any
+// positive number (up to the number of rows remaining). Pushing a multiple of
+// QOIR_TILE_SIZE rows avoids copying them to an internal buffer.
+//
+// The src_pixbuf's pixfmt and width_in_pixels must match the src_pixcfg
+// passed to qoir_encoder__initialize.
+QOIR_MAYBE_STATIC const char*  //
+qoir_encoder__push_rows(       //
+    qoir_encoder* encoder,     //
+    const qoir_pixel_buffer* src_pixbuf);
+
+// Writes the chunks that follow the pixel data (after checking that all of
+// the rows have been pushed) and releases the encoder's resources. The result
+// value is the total number of bytes written.
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_encoder__finish(               //
+    qoir_encoder* encoder);
+
+// Releases the encoder's resources. It is valid to call this after
+// qoir_encoder__finish, or more than once.
+QOIR_MAYBE_STATIC void  //
+qoir_encoder__destroy(  //
+    qoir_encoder* encoder);
+
+// -------- QOIC Container
+
+// A QOIC container file holds a sequence of QOIR files (frames), such as a
+// texture array's layers or an animation's frames, plus a directory so that
+// any one frame can be found without parsing the others. The container
+// functions only deal in bytes: decode a frame by passing its bytes to
+// qoir_decode (or any other QOIR decode function) and encode the frames with
+// qoir_encode before passing them to qoir_container_encode.
+//
+// For example, a memory-mapped container can be opened once and then frames
+// decoded on demand, in any order.
+
+typedef struct qoir_container_frame_result_struct {
+  const char* status_message;
+  // The frame's QOIR bytes: a sub-slice of the container's bytes.
+  const uint8_t* dst_ptr;
+  size_t dst_len;
+} qoir_container_frame_result;
+
+// qoir_container_encode_dst_len returns the length of a container holding
+// num_frames frames, whose lengths are frame_lens[0 .. num_frames].
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_container_encode_dst_len(      //
+    const size_t* frame_lens,       //
+    size_t num_frames);
+
+// qoir_container_encode writes to dst a container holding num_frames frames
+// (each being the frame_lens[i] bytes at frame_ptrs[i]), returning the number
+// of bytes written. It does not check that the frames are valid QOIR files.
+//
+// It fails with qoir_status_message__error_dst_is_too_short if dst_len is
+// less than qoir_container_encode_dst_len(frame_lens, num_frames).
+QOIR_MAYBE_STATIC qoir_size_result     //
+qoir_container_encode(                 //
+    uint8_t* dst_ptr,                  //
+    size_t dst_len,                    //
+    const uint8_t* const* frame_ptrs,  //
+    const size_t* frame_lens,          //
+    size_t num_frames);
+
+// qoir_container_decode_number_of_frames returns the number of frames in the
+// container, after checking that its directory is in bounds.
+QOIR_MAYBE_STATIC qoir_size_result       //
+qoir_container_decode_number_of_frames(  //
+    const uint8_t* src_ptr,              //
+    size_t src_len);
+
+// qoir_container_decode_frame returns the frame_index'th frame's bytes. Its
+// cost does not depend on the number (or size) of the other frames, which are
+// not visited. An out of range frame_index is an invalid_argument error.
+QOIR_MAYBE_STATIC qoir_container_frame_result  //
+qoir_container_decode_frame(                   //
+    const uint8_t* src_ptr,                    //
+    size_t src_len,                            //
+    size_t frame_index);
+
 // ================================ -Public Interface
 
 #ifdef QOIR_IMPLEMENTATION
@@ -633,6 +1363,42 @@ static uint8_t qoir_private_table_unlossify[7][256] = {{
   0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,
 }};
 
+// The table was generated by script/gen_table_linearize.go
+static uint16_t qoir_private_table_linearize[256] = {
+  0x0000,0x0000,0x0002,0x0004,0x0007,0x000B,0x0011,0x0018,
+  0x0020,0x002A,0x0035,0x0041,0x004F,0x005E,0x006F,0x0081,
+  0x0094,0x00A9,0x00C0,0x00D8,0x00F2,0x010E,0x012B,0x014A,
+  0x016A,0x018C,0x01B0,0x01D5,0x01FC,0x0225,0x024F,0x027B,
+  0x02A9,0x02D9,0x030B,0x033E,0x0373,0x03AA,0x03E3,0x041D,
+  0x0459,0x0497,0x04D7,0x0519,0x055D,0x05A3,0x05EA,0x0633,
+  0x067F,0x06CC,0x071B,0x076C,0x07BF,0x0814,0x086B,0x08C3,
+  0x091E,0x097B,0x09D9,0x0A3A,0x0A9D,0x0B01,0x0B68,0x0BD0,
+  0x0C3B,0x0CA8,0x0D16,0x0D87,0x0DFA,0x0E6E,0x0EE5,0x0F5E,
+  0x0FD9,0x1056,0x10D5,0x1156,0x11DA,0x125F,0x12E6,0x1370,
+  0x13FB,0x1489,0x1519,0x15AB,0x163F,0x16D5,0x176E,0x1808,
+  0x18A5,0x1944,0x19E5,0x1A88,0x1B2D,0x1BD4,0x1C7E,0x1D2A,
+  0x1DD8,0x1E88,0x1F3A,0x1FEF,0x20A6,0x215F,0x221A,0x22D7,
+  0x2397,0x2459,0x251D,0x25E3,0x26AC,0x2776,0x2843,0x2913,
+  0x29E4,0x2AB8,0x2B8E,0x2C66,0x2D41,0x2E1E,0x2EFD,0x2FDE,
+  0x30C2,0x31A8,0x3290,0x337B,0x3468,0x3557,0x3648,0x373C,
+  0x3832,0x392B,0x3A25,0x3B22,0x3C22,0x3D24,0x3E28,0x3F2E,
+  0x4037,0x4142,0x424F,0x435F,0x4471,0x4586,0x469D,0x47B6,
+  0x48D2,0x49F0,0x4B10,0x4C33,0x4D58,0x4E7F,0x4FA9,0x50D6,
+  0x5204,0x5335,0x5469,0x559F,0x56D7,0x5812,0x594F,0x5A8E,
+  0x5BD0,0x5D15,0x5E5C,0x5FA5,0x60F1,0x623F,0x638F,0x64E2,
+  0x6638,0x6790,0x68EA,0x6A47,0x6BA6,0x6D08,0x6E6C,0x6FD3,
+  0x713C,0x72A7,0x7415,0x7586,0x76F9,0x786E,0x79E6,0x7B61,
+  0x7CDE,0x7E5D,0x7FDF,0x8164,0x82EA,0x8474,0x8600,0x878E,
+  0x891F,0x8AB3,0x8C49,0x8DE1,0x8F7C,0x911A,0x92BA,0x945D,
+  0x9602,0x97A9,0x9954,0x9B00,0x9CB0,0x9E62,0xA016,0xA1CD,
+  0xA386,0xA542,0xA701,0xA8C2,0xAA86,0xAC4C,0xAE15,0xAFE1,
+  0xB1AF,0xB37F,0xB552,0xB728,0xB900,0xBADB,0xBCB9,0xBE99,
+  0xC07B,0xC261,0xC449,0xC633,0xC820,0xCA10,0xCC02,0xCDF7,
+  0xCFEE,0xD1E8,0xD3E5,0xD5E4,0xD7E6,0xD9EB,0xDBF2,0xDDFC,
+  0xE008,0xE217,0xE429,0xE63D,0xE854,0xEA6E,0xEC8A,0xEEA9,
+  0xF0CA,0xF2EE,0xF515,0xF73F,0xF96B,0xFB9A,0xFDCB,0xFFFF,
+};
+
 #if !defined(QOIR_CONFIG__DISABLE_LARGE_LOOK_UP_TABLES)
 // The table was generated by script/gen_table_luma.go
 static uint8_t qoir_private_table_luma[65536] = {
@@ -4743,6 +5509,8 @@ static uint8_t qoir_private_table_luma[65536] = {
 #include <lz4.h>
 #endif
 
+#include <time.h>
+
 // This implementation assumes that:
 //  - converting a uint32_t to a size_t will never overflow.
 //  - converting a size_t to a uint64_t will never overflow.
@@ -4765,6 +5533,40 @@ static uint8_t qoir_private_table_luma[65536] = {
     (defined(_MSC_VER) && defined(_M_X64))
 #define QOIR_USE_SIMD_SSE2
 #include <emmintrin.h>
+// SSSE3 (for its PSHUFB byte shuffle) and AVX2 aren't part of the x86_64
+// baseline. Their code paths are compiled in if the compiler is told that they
+// are available (e.g. by gcc's -mssse3 or -march=native flags, or MSVC's
+// /arch:AVX2 flag). Otherwise, unless QOIR_CONFIG__DISABLE_CPU_DISPATCH is
+// defined, they are still compiled in (as functions with a target attribute,
+// for gcc and clang) but are only used if the CPU that the program is running
+// on supports them, as detected at run time.
+#if !defined(QOIR_CONFIG__DISABLE_CPU_DISPATCH) && \
+    (defined(__GNUC__) || defined(_MSC_VER))
+#define QOIR_USE_CPU_DISPATCH
+#endif
+#if defined(__SSSE3__) || defined(__AVX__) || defined(QOIR_USE_CPU_DISPATCH)
+#define QOIR_USE_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__) || defined(QOIR_USE_CPU_DISPATCH)
+#define QOIR_USE_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#if defined(QOIR_USE_CPU_DISPATCH) && defined(__GNUC__)
+#define QOIR_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define QOIR_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define QOIR_TARGET_SSSE3
+#define QOIR_TARGET_AVX2
+#endif
+#if defined(QOIR_USE_CPU_DISPATCH) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif (defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)) || \
+    (defined(_MSC_VER) && defined(_M_ARM64))
+// NEON is part of the aarch64 baseline.
+#define QOIR_USE_SIMD_NEON
+#include <arm_neon.h>
 #endif
 #endif
 
@@ -4784,6 +5586,18 @@ static uint8_t qoir_private_table_luma[65536] = {
 #define QOIR_USE_MEMCPY_LE_PEEK_POKE
 #endif
 
+static inline uint16_t    //
+qoir_private_peek_u16le(  //
+    const uint8_t* p) {
+#if defined(QOIR_USE_MEMCPY_LE_PEEK_POKE)
+  uint16_t x;
+  memcpy(&x, p, 2);
+  return x;
+#else
+  return (uint16_t)(((uint32_t)(p[0]) << 0) | ((uint32_t)(p[1]) << 8));
+#endif
+}
+
 static inline uint32_t    //
 qoir_private_peek_u32le(  //
     const uint8_t* p) {
@@ -4812,6 +5626,18 @@ qoir_private_peek_u64le(  //
 #endif
 }
 
+static inline void        //
+qoir_private_poke_u16le(  //
+    uint8_t* p,           //
+    uint16_t x) {
+#if defined(QOIR_USE_MEMCPY_LE_PEEK_POKE)
+  memcpy(p, &x, 2);
+#else
+  p[0] = (uint8_t)(x >> 0);
+  p[1] = (uint8_t)(x >> 8);
+#endif
+}
+
 static inline void        //
 qoir_private_poke_u32le(  //
     uint8_t* p,           //
@@ -4861,6 +5687,36 @@ qoir_private_tile_dimension(  //
                   : (((pixel_dimension - 1) & QOIR_TILE_MASK) + 1);
 }
 
+// qoir_private_downscaled_dimension returns pixel_dimension divided by (1 <<
+// downscale_shift), rounding up.
+static inline uint32_t              //
+qoir_private_downscaled_dimension(  //
+    uint32_t pixel_dimension,       //
+    uint32_t downscale_shift) {
+  return (uint32_t)(((uint64_t)pixel_dimension + (1u << downscale_shift) - 1) >>
+                    downscale_shift);
+}
+
+// qoir_private_num_mipmap_levels returns num_levels, clamped to the number of
+// levels (each half the width and height of the previous level, rounding up)
+// after which a width by height image is 1x1.
+static inline uint32_t           //
+qoir_private_num_mipmap_levels(  //
+    uint32_t width_in_pixels,    //
+    uint32_t height_in_pixels,   //
+    uint32_t num_levels) {
+  if ((width_in_pixels == 0) || (height_in_pixels == 0)) {
+    return 0;
+  }
+  uint32_t n = 0;
+  for (; (n < num_levels) && ((width_in_pixels > 1) || (height_in_pixels > 1));
+       n++) {
+    width_in_pixels = (width_in_pixels + 1) >> 1;
+    height_in_pixels = (height_in_pixels + 1) >> 1;
+  }
+  return n;
+}
+
 // QOIR_TILE_LZ4_COMPRESSION_WORST_CASE equals
 // qoir_lz4_block_encode_worst_case_dst_len(4 * QTS * QTS).
 #define QOIR_TILE_LZ4_COMPRESSION_WORST_CASE \
@@ -4879,6 +5735,81 @@ qoir_private_tile_dimension(  //
 #define QOIR_SWAR_PSUBB(a, b) \
   ((a | 0x80808080) - (b & 0x7F7F7F7F)) ^ ((a ^ ~b) & 0x80808080)
 
+// -------- CPU Feature Detection
+
+#if defined(QOIR_USE_CPU_DISPATCH) && defined(_MSC_VER)
+#define QOIR_CPU_FEATURE__DETECTED 0x01
+#define QOIR_CPU_FEATURE__SSSE3 0x02
+#define QOIR_CPU_FEATURE__AVX2 0x04
+
+// qoir_private_msvc_cpu_features returns a bitmask of QOIR_CPU_FEATURE__ETC
+// bits. The CPUID instruction is relatively slow and so its result is cached.
+// Concurrent first calls race benignly, as they all store the same value.
+static uint32_t                  //
+qoir_private_msvc_cpu_features(  //
+    void) {
+  static volatile uint32_t cached = 0;
+  uint32_t features = cached;
+  if (features) {
+    return features;
+  }
+  features = QOIR_CPU_FEATURE__DETECTED;
+  int info[4] = {0};
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+  __cpuid(info, 1);
+  if (info[2] & (1 << 9)) {
+    features |= QOIR_CPU_FEATURE__SSSE3;
+  }
+  // AVX2 also needs the OS to save and restore the YMM registers: OSXSAVE
+  // (CPUID.1:ECX bit 27), AVX (bit 28) and XCR0's XMM and YMM state bits.
+  if ((max_leaf >= 7) &&                       //
+      ((info[2] & (3 << 27)) == (3 << 27)) &&  //
+      ((_xgetbv(0) & 6) == 6)) {
+    __cpuidex(info, 7, 0);
+    if (info[1] & (1 << 5)) {
+      features |= QOIR_CPU_FEATURE__AVX2;
+    }
+  }
+  cached = features;
+  return features;
+}
+#endif
+
+#if defined(QOIR_USE_SIMD_SSSE3)
+// qoir_private_cpu_has_ssse3 returns whether the QOIR_TARGET_SSSE3 functions
+// can run on this CPU.
+static inline bool           //
+qoir_private_cpu_has_ssse3(  //
+    void) {
+#if defined(__SSSE3__) || defined(__AVX__)
+  return true;
+#elif defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3");
+#else
+  return qoir_private_msvc_cpu_features() & QOIR_CPU_FEATURE__SSSE3;
+#endif
+}
+#endif
+
+#if defined(QOIR_USE_SIMD_AVX2)
+// qoir_private_cpu_has_avx2 returns whether the QOIR_TARGET_AVX2 functions can
+// run on this CPU.
+static inline bool          //
+qoir_private_cpu_has_avx2(  //
+    void) {
+#if defined(__AVX2__)
+  return true;
+#elif defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return qoir_private_msvc_cpu_features() & QOIR_CPU_FEATURE__AVX2;
+#endif
+}
+#endif
+
 // -------- Memory Management
 
 #define QOIR_MALLOC(len)                                                \
@@ -4889,6 +5820,13 @@ qoir_private_tile_dimension(  //
   qoir_private_free(options ? options->contextual_free_func : NULL, \
                     options ? options->memory_func_context : NULL, ptr)
 
+// QOIR_FREE_OWNED_MEMORY is like QOIR_FREE but for what would be returned as a
+// result's owned_memory, which comes from the options' context (if non-NULL).
+#define QOIR_FREE_OWNED_MEMORY(ptr)                      \
+  ((options && options->context)                         \
+       ? qoir_context__recycle(options->context, ptr)    \
+       : QOIR_FREE(ptr))
+
 static inline void*                                  //
 qoir_private_malloc(                                 //
     void* (*contextual_malloc_func)(void*, size_t),  //
@@ -4921,6 +5859,8 @@ const char qoir_lz4_status_message__error_invalid_data[] =  //
 const char qoir_lz4_status_message__error_src_is_too_long[] =  //
     "#qoir/lz4: src is too long";
 
+const char qoir_status_message__error_dst_is_too_short[] =  //
+    "#qoir: dst is too short";
 const char qoir_status_message__error_invalid_argument[] =  //
     "#qoir: invalid argument";
 const char qoir_status_message__error_invalid_data[] =  //
@@ -4968,6 +5908,164 @@ typedef void (*qoir_private_swizzle_func)(  //
     size_t width_in_pixels,                 //
     size_t height_in_pixels);
 
+#if defined(QOIR_USE_SIMD_SSE2)
+// The qoir_private_swizzle_sse2__etc functions each transform 4 pixels (16
+// bytes, 4 bytes per pixel). They produce exactly the same bytes as the
+// scalar code in the qoir_private_swizzle__etc functions.
+
+// qoir_private_swizzle_sse2__swap_rb swaps the 1st and 3rd byte of each pixel.
+static inline __m128i                //
+qoir_private_swizzle_sse2__swap_rb(  //
+    __m128i x) {
+  const __m128i mask_ag = _mm_set1_epi32((int)0xFF00FF00);
+  __m128i rb = _mm_andnot_si128(mask_ag, x);
+  return _mm_or_si128(
+      _mm_and_si128(mask_ag, x),
+      _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16)));
+}
+
+// qoir_private_swizzle_sse2__premul converts from nonpremultiplied to
+// premultiplied alpha. The scalar code calculates (for 8-bit s and a):
+//   ((s * a * 0x101 * 0x101) / 0xFFFF) >> 8
+// which (as an exhaustive check confirms) equals:
+//   ((s * a) * 0x8101) >> 23
+// and (s * a) fits in 16 bits.
+static inline __m128i               //
+qoir_private_swizzle_sse2__premul(  //
+    __m128i x) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask_a = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  const __m128i magic = _mm_set1_epi16((short)0x8101);
+  __m128i lo = _mm_unpacklo_epi8(x, zero);
+  __m128i hi = _mm_unpackhi_epi8(x, zero);
+  __m128i lo_a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+  __m128i hi_a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+  __m128i lo_p =
+      _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(lo, lo_a), magic), 7);
+  __m128i hi_p =
+      _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(hi, hi_a), magic), 7);
+  lo_p = _mm_or_si128(_mm_andnot_si128(mask_a, lo_p),  //
+                      _mm_and_si128(mask_a, lo));
+  hi_p = _mm_or_si128(_mm_andnot_si128(mask_a, hi_p),  //
+                      _mm_and_si128(mask_a, hi));
+  return _mm_packus_epi16(lo_p, hi_p);
+}
+
+// qoir_private_swizzle_sse2__unpremul_1 converts one pixel (as four 32-bit
+// lanes) from premultiplied to nonpremultiplied alpha. The scalar code
+// calculates (for 8-bit s and a, with a zero a giving zero):
+//   (uint8_t)(((s * 0xFFFF * 0x101) / (a * 0x101)) >> 8)
+// which (as an exhaustive check confirms) equals the truncated quotient of
+// (s * 0xFFFF) and (a * 0x100) in single precision floating point. Those
+// operands are exactly representable and IEEE 754 division rounds correctly.
+static inline __m128i                   //
+qoir_private_swizzle_sse2__unpremul_1(  //
+    __m128i x) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask_a = _mm_set_epi32(-1, 0, 0, 0);
+  __m128i a = _mm_shuffle_epi32(x, 0xFF);
+  __m128 num = _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(65535.0f));
+  __m128 den = _mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(a), _mm_set1_ps(256.0f)),
+                          _mm_set1_ps(256.0f));
+  __m128i q = _mm_and_si128(_mm_cvttps_epi32(_mm_div_ps(num, den)),
+                            _mm_set1_epi32(0xFF));
+  q = _mm_andnot_si128(_mm_cmpeq_epi32(a, zero), q);
+  return _mm_or_si128(_mm_andnot_si128(mask_a, q), _mm_and_si128(mask_a, x));
+}
+
+// qoir_private_swizzle_sse2__unpremul converts from premultiplied to
+// nonpremultiplied alpha.
+static inline __m128i                 //
+qoir_private_swizzle_sse2__unpremul(  //
+    __m128i x) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_unpacklo_epi8(x, zero);
+  __m128i hi = _mm_unpackhi_epi8(x, zero);
+  __m128i q0 =
+      qoir_private_swizzle_sse2__unpremul_1(_mm_unpacklo_epi16(lo, zero));
+  __m128i q1 =
+      qoir_private_swizzle_sse2__unpremul_1(_mm_unpackhi_epi16(lo, zero));
+  __m128i q2 =
+      qoir_private_swizzle_sse2__unpremul_1(_mm_unpacklo_epi16(hi, zero));
+  __m128i q3 =
+      qoir_private_swizzle_sse2__unpremul_1(_mm_unpackhi_epi16(hi, zero));
+  return _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3));
+}
+#endif
+
+#if defined(QOIR_USE_SIMD_SSSE3)
+// qoir_private_swizzle_ssse3__store_12 stores the low 12 bytes of x.
+static inline void                     //
+qoir_private_swizzle_ssse3__store_12(  //
+    uint8_t* dst_ptr,                  //
+    __m128i x) {
+  _mm_storel_epi64((__m128i*)(void*)dst_ptr, x);
+  uint32_t x2 = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+  memcpy(dst_ptr + 8, &x2, 4);
+}
+#endif
+
+#if defined(QOIR_USE_SIMD_NEON)
+// The qoir_private_swizzle_neon__etc functions each transform 16 pixels (one
+// 8-bit lane per pixel, per channel), producing the same bytes as the scalar
+// code, just like the qoir_private_swizzle_sse2__etc functions.
+
+// qoir_private_swizzle_neon__premul returns the premultiplied form of the
+// nonpremultiplied color channel c, using the same ((s * a) * 0x8101) >> 23
+// formula as qoir_private_swizzle_sse2__premul.
+static inline uint8x16_t            //
+qoir_private_swizzle_neon__premul(  //
+    uint8x16_t c,                   //
+    uint8x16_t a) {
+  const uint16x4_t magic = vdup_n_u16(0x8101);
+  uint16x8_t lo = vmull_u8(vget_low_u8(c), vget_low_u8(a));
+  uint16x8_t hi = vmull_u8(vget_high_u8(c), vget_high_u8(a));
+  lo = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(lo), magic), 16),
+                    vshrn_n_u32(vmull_u16(vget_high_u16(lo), magic), 16));
+  hi = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(hi), magic), 16),
+                    vshrn_n_u32(vmull_u16(vget_high_u16(hi), magic), 16));
+  return vcombine_u8(vmovn_u16(vshrq_n_u16(lo, 7)),
+                     vmovn_u16(vshrq_n_u16(hi, 7)));
+}
+
+// qoir_private_swizzle_neon__unpremul_4 is like
+// qoir_private_swizzle_sse2__unpremul_1 but for 4 pixels' worth of one color
+// channel (c), not for 1 pixel's worth of all four channels.
+static inline uint32x4_t                //
+qoir_private_swizzle_neon__unpremul_4(  //
+    uint32x4_t c,                       //
+    uint32x4_t a) {
+  float32x4_t num = vmulq_n_f32(vcvtq_f32_u32(c), 65535.0f);
+  float32x4_t den = vmaxq_f32(vmulq_n_f32(vcvtq_f32_u32(a), 256.0f),
+                              vdupq_n_f32(256.0f));
+  uint32x4_t q = vandq_u32(vcvtq_u32_f32(vdivq_f32(num, den)),  //
+                           vdupq_n_u32(0xFF));
+  return vbicq_u32(q, vceqq_u32(a, vdupq_n_u32(0)));
+}
+
+// qoir_private_swizzle_neon__unpremul returns the nonpremultiplied form of
+// the premultiplied color channel c.
+static inline uint8x16_t              //
+qoir_private_swizzle_neon__unpremul(  //
+    uint8x16_t c,                     //
+    uint8x16_t a) {
+  uint16x8_t c_lo = vmovl_u8(vget_low_u8(c));
+  uint16x8_t c_hi = vmovl_u8(vget_high_u8(c));
+  uint16x8_t a_lo = vmovl_u8(vget_low_u8(a));
+  uint16x8_t a_hi = vmovl_u8(vget_high_u8(a));
+  uint32x4_t q0 = qoir_private_swizzle_neon__unpremul_4(
+      vmovl_u16(vget_low_u16(c_lo)), vmovl_u16(vget_low_u16(a_lo)));
+  uint32x4_t q1 = qoir_private_swizzle_neon__unpremul_4(
+      vmovl_u16(vget_high_u16(c_lo)), vmovl_u16(vget_high_u16(a_lo)));
+  uint32x4_t q2 = qoir_private_swizzle_neon__unpremul_4(
+      vmovl_u16(vget_low_u16(c_hi)), vmovl_u16(vget_low_u16(a_hi)));
+  uint32x4_t q3 = qoir_private_swizzle_neon__unpremul_4(
+      vmovl_u16(vget_high_u16(c_hi)), vmovl_u16(vget_high_u16(a_hi)));
+  return vcombine_u8(vmovn_u16(vcombine_u16(vmovn_u32(q0), vmovn_u32(q1))),
+                     vmovn_u16(vcombine_u16(vmovn_u32(q2), vmovn_u32(q3))));
+}
+#endif
+
 static void                                //
 qoir_private_swizzle__copy_4(              //
     uint8_t* QOIR_RESTRICT dst_ptr,        //
@@ -4993,7 +6091,20 @@ qoir_private_swizzle__bgr__bgrn(           //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x3_t y;
+      y.val[0] = qoir_private_swizzle_neon__premul(x.val[0], x.val[3]);
+      y.val[1] = qoir_private_swizzle_neon__premul(x.val[1], x.val[3]);
+      y.val[2] = qoir_private_swizzle_neon__premul(x.val[2], x.val[3]);
+      vst3q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 48;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5017,7 +6128,20 @@ qoir_private_swizzle__bgr__bgrp(           //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x3_t y;
+      y.val[0] = x.val[0];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[2];
+      vst3q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 48;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5040,7 +6164,20 @@ qoir_private_swizzle__bgr__rgbn(           //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x3_t y;
+      y.val[0] = qoir_private_swizzle_neon__premul(x.val[2], x.val[3]);
+      y.val[1] = qoir_private_swizzle_neon__premul(x.val[1], x.val[3]);
+      y.val[2] = qoir_private_swizzle_neon__premul(x.val[0], x.val[3]);
+      vst3q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 48;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5064,7 +6201,20 @@ qoir_private_swizzle__bgr__rgbp(           //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x3_t y;
+      y.val[0] = x.val[2];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[0];
+      vst3q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 48;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5087,7 +6237,21 @@ qoir_private_swizzle__bgra__bgr(           //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x3_t x = vld3q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = x.val[0];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[2];
+      y.val[3] = vdupq_n_u8(0xFF);
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 48;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5110,7 +6274,29 @@ qoir_private_swizzle__bgra__bgrx(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = _mm_or_si128(x, _mm_set1_epi32((int)0xFF000000));
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = x.val[0];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[2];
+      y.val[3] = vdupq_n_u8(0xFF);
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5134,7 +6320,21 @@ qoir_private_swizzle__bgra__rgb(           //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x3_t x = vld3q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = x.val[2];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[0];
+      y.val[3] = vdupq_n_u8(0xFF);
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 48;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5157,7 +6357,29 @@ qoir_private_swizzle__bgra__rgba(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = qoir_private_swizzle_sse2__swap_rb(x);
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = x.val[2];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[0];
+      y.val[3] = x.val[3];
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5181,7 +6403,30 @@ qoir_private_swizzle__bgra__rgbx(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = qoir_private_swizzle_sse2__swap_rb(x);
+      x = _mm_or_si128(x, _mm_set1_epi32((int)0xFF000000));
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = x.val[2];
+      y.val[1] = x.val[1];
+      y.val[2] = x.val[0];
+      y.val[3] = vdupq_n_u8(0xFF);
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5205,7 +6450,29 @@ qoir_private_swizzle__bgrn__bgrp(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = qoir_private_swizzle_sse2__unpremul(x);
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = qoir_private_swizzle_neon__unpremul(x.val[0], x.val[3]);
+      y.val[1] = qoir_private_swizzle_neon__unpremul(x.val[1], x.val[3]);
+      y.val[2] = qoir_private_swizzle_neon__unpremul(x.val[2], x.val[3]);
+      y.val[3] = x.val[3];
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5243,15 +6510,38 @@ qoir_private_swizzle__bgrn__rgbp(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = qoir_private_swizzle_sse2__swap_rb(
+          qoir_private_swizzle_sse2__unpremul(x));
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = qoir_private_swizzle_neon__unpremul(x.val[2], x.val[3]);
+      y.val[1] = qoir_private_swizzle_neon__unpremul(x.val[1], x.val[3]);
+      y.val[2] = qoir_private_swizzle_neon__unpremul(x.val[0], x.val[3]);
+      y.val[3] = x.val[3];
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
       uint8_t s3 = *src_ptr++;
       if (s3 == 0xFF) {
-        *dst_ptr++ = s0;
-        *dst_ptr++ = s1;
         *dst_ptr++ = s2;
+        *dst_ptr++ = s1;
+        *dst_ptr++ = s0;
         *dst_ptr++ = s3;
       } else if (s3 == 0x00) {
         *dst_ptr++ = 0x00;
@@ -5281,7 +6571,29 @@ qoir_private_swizzle__bgrp__bgrn(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = qoir_private_swizzle_sse2__premul(x);
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = qoir_private_swizzle_neon__premul(x.val[0], x.val[3]);
+      y.val[1] = qoir_private_swizzle_neon__premul(x.val[1], x.val[3]);
+      y.val[2] = qoir_private_swizzle_neon__premul(x.val[2], x.val[3]);
+      y.val[3] = x.val[3];
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5306,7 +6618,30 @@ qoir_private_swizzle__bgrp__rgbn(          //
     size_t width_in_pixels,                //
     size_t height_in_pixels) {
   for (; height_in_pixels > 0; height_in_pixels--) {
-    for (size_t n = width_in_pixels; n > 0; n--) {
+    size_t n = width_in_pixels;
+#if defined(QOIR_USE_SIMD_SSE2)
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+      x = qoir_private_swizzle_sse2__swap_rb(
+          qoir_private_swizzle_sse2__premul(x));
+      _mm_storeu_si128((__m128i*)(void*)dst_ptr, x);
+      src_ptr += 16;
+      dst_ptr += 16;
+    }
+#elif defined(QOIR_USE_SIMD_NEON)
+    for (; n >= 16; n -= 16) {
+      uint8x16x4_t x = vld4q_u8(src_ptr);
+      uint8x16x4_t y;
+      y.val[0] = qoir_private_swizzle_neon__premul(x.val[2], x.val[3]);
+      y.val[1] = qoir_private_swizzle_neon__premul(x.val[1], x.val[3]);
+      y.val[2] = qoir_private_swizzle_neon__premul(x.val[0], x.val[3]);
+      y.val[3] = x.val[3];
+      vst4q_u8(dst_ptr, y);
+      src_ptr += 64;
+      dst_ptr += 64;
+    }
+#endif
+    for (; n > 0; n--) {
       uint8_t s0 = *src_ptr++;
       uint8_t s1 = *src_ptr++;
       uint8_t s2 = *src_ptr++;
@@ -5322,17 +6657,558 @@ qoir_private_swizzle__bgrp__rgbn(          //
   }
 }
 
-// -------- LZ4 Decode
+// qoir_private_downscale averages each (1 << downscale_shift) square block of
+// the src_width by src_height source pixels (4 bytes per pixel, with the
+// alpha last) into one destination pixel. Blocks at the right and bottom
+// edges may be partial. If weight_by_alpha, the color channels are
+// alpha-weighted averages (as is appropriate for non-premultiplied alpha).
+//
+// dst may alias src (with a dst_stride no larger than src_stride), since each
+// destination pixel is written no later than its source pixels are read.
+static void                       //
+qoir_private_downscale(           //
+    uint8_t* dst_ptr,             //
+    size_t dst_stride_in_bytes,   //
+    const uint8_t* src_ptr,       //
+    size_t src_stride_in_bytes,   //
+    size_t src_width_in_pixels,   //
+    size_t src_height_in_pixels,  //
+    uint32_t downscale_shift,     //
+    bool weight_by_alpha) {
+  size_t block_size = (size_t)1 << downscale_shift;
+  for (size_t y0 = 0; y0 < src_height_in_pixels; y0 += block_size) {
+    size_t y1 = y0 + block_size;
+    if (y1 > src_height_in_pixels) {
+      y1 = src_height_in_pixels;
+    }
+    uint8_t* d = dst_ptr + ((y0 >> downscale_shift) * dst_stride_in_bytes);
+    for (size_t x0 = 0; x0 < src_width_in_pixels; x0 += block_size) {
+      size_t x1 = x0 + block_size;
+      if (x1 > src_width_in_pixels) {
+        x1 = src_width_in_pixels;
+      }
+      uint32_t n = (uint32_t)((y1 - y0) * (x1 - x0));
+      uint32_t sum0 = 0;
+      uint32_t sum1 = 0;
+      uint32_t sum2 = 0;
+      uint32_t sum3 = 0;
+      for (size_t y = y0; y < y1; y++) {
+        const uint8_t* sp = src_ptr + (y * src_stride_in_bytes) + (4 * x0);
+        for (size_t x = x0; x < x1; x++) {
+          uint32_t a = weight_by_alpha ? sp[3] : 1;
+          sum0 += a * sp[0];
+          sum1 += a * sp[1];
+          sum2 += a * sp[2];
+          sum3 += sp[3];
+          sp += 4;
+        }
+      }
+      uint32_t denominator = weight_by_alpha ? sum3 : n;
+      if (denominator) {
+        d[0] = (uint8_t)((sum0 + (denominator / 2)) / denominator);
+        d[1] = (uint8_t)((sum1 + (denominator / 2)) / denominator);
+        d[2] = (uint8_t)((sum2 + (denominator / 2)) / denominator);
+      } else {
+        d[0] = 0x00;
+        d[1] = 0x00;
+        d[2] = 0x00;
+      }
+      d[3] = (uint8_t)((sum3 + (n / 2)) / n);
+      d += 4;
+    }
+  }
+}
 
-QOIR_MAYBE_STATIC qoir_size_result         //
-qoir_lz4_block_decode(                     //
+// -------- Pixel Swizzlers (Wider Vectors)
+
+// The qoir_private_swizzle_ssse3__etc and qoir_private_swizzle_avx2__etc
+// functions are equivalent to the qoir_private_swizzle__etc functions (which
+// they call for any leftover pixels at the end of each row). Use
+// qoir_private_dispatch_swizzle_func to pick one that this CPU supports.
+
+#if defined(QOIR_USE_SIMD_SSSE3)
+static QOIR_TARGET_SSSE3 void              //
+qoir_private_swizzle_ssse3__bgr__bgrn(     //
     uint8_t* QOIR_RESTRICT dst_ptr,        //
-    size_t dst_len,                        //
+    size_t dst_stride_in_bytes,            //
     const uint8_t* QOIR_RESTRICT src_ptr,  //
-    size_t src_len) {
-  qoir_size_result result = {0};
-
-  if (src_len > QOIR_LZ4_BLOCK_DECODE_MAX_INCL_SRC_LEN) {
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)sp);
+      x = _mm_shuffle_epi8(qoir_private_swizzle_sse2__premul(x),
+                           _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13,
+                                         14, -128, -128, -128, -128));
+      qoir_private_swizzle_ssse3__store_12(dp, x);
+      sp += 16;
+      dp += 12;
+    }
+    qoir_private_swizzle__bgr__bgrn(dp, 3 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_SSSE3 void              //
+qoir_private_swizzle_ssse3__bgr__bgrp(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)sp);
+      x = _mm_shuffle_epi8(x, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12,
+                                            13, 14, -128, -128, -128, -128));
+      qoir_private_swizzle_ssse3__store_12(dp, x);
+      sp += 16;
+      dp += 12;
+    }
+    qoir_private_swizzle__bgr__bgrp(dp, 3 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_SSSE3 void              //
+qoir_private_swizzle_ssse3__bgr__rgbn(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)sp);
+      x = _mm_shuffle_epi8(qoir_private_swizzle_sse2__premul(x),
+                           _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13,
+                                         12, -128, -128, -128, -128));
+      qoir_private_swizzle_ssse3__store_12(dp, x);
+      sp += 16;
+      dp += 12;
+    }
+    qoir_private_swizzle__bgr__rgbn(dp, 3 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_SSSE3 void              //
+qoir_private_swizzle_ssse3__bgr__rgbp(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 4; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)sp);
+      x = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                            13, 12, -128, -128, -128, -128));
+      qoir_private_swizzle_ssse3__store_12(dp, x);
+      sp += 16;
+      dp += 12;
+    }
+    qoir_private_swizzle__bgr__rgbp(dp, 3 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_SSSE3 void              //
+qoir_private_swizzle_ssse3__bgra__bgr(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 6; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)sp);
+      x = _mm_shuffle_epi8(x, _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6,
+                                            7, 8, -128, 9, 10, 11, -128));
+      x = _mm_or_si128(x, _mm_set1_epi32((int)0xFF000000));
+      _mm_storeu_si128((__m128i*)(void*)dp, x);
+      sp += 12;
+      dp += 16;
+    }
+    qoir_private_swizzle__bgra__bgr(dp, 4 * n, sp, 3 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_SSSE3 void              //
+qoir_private_swizzle_ssse3__bgra__rgb(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 6; n -= 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)sp);
+      x = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128, 8,
+                                            7, 6, -128, 11, 10, 9, -128));
+      x = _mm_or_si128(x, _mm_set1_epi32((int)0xFF000000));
+      _mm_storeu_si128((__m128i*)(void*)dp, x);
+      sp += 12;
+      dp += 16;
+    }
+    qoir_private_swizzle__bgra__rgb(dp, 4 * n, sp, 3 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+#endif
+
+#if defined(QOIR_USE_SIMD_AVX2)
+// The qoir_private_swizzle_avx2__swap_rb, etc. functions are like the
+// qoir_private_swizzle_sse2__swap_rb, etc. functions but transform 8 pixels
+// (32 bytes) at a time. AVX2's byte shuffles, unpacks and packs work on each
+// 128-bit half separately, which is fine for 4-byte pixels.
+
+static inline QOIR_TARGET_AVX2 __m256i  //
+qoir_private_swizzle_avx2__swap_rb(     //
+    __m256i x) {
+  return _mm256_shuffle_epi8(
+      x, _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12,
+                          15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13,
+                          12, 15));
+}
+
+static inline QOIR_TARGET_AVX2 __m256i  //
+qoir_private_swizzle_avx2__premul(      //
+    __m256i x) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mask_a = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,  //
+                                          -1, 0, 0, 0, -1, 0, 0, 0);
+  const __m256i magic = _mm256_set1_epi16((short)0x8101);
+  __m256i lo = _mm256_unpacklo_epi8(x, zero);
+  __m256i hi = _mm256_unpackhi_epi8(x, zero);
+  __m256i lo_a =
+      _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xFF), 0xFF);
+  __m256i hi_a =
+      _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xFF), 0xFF);
+  __m256i lo_p = _mm256_srli_epi16(
+      _mm256_mulhi_epu16(_mm256_mullo_epi16(lo, lo_a), magic), 7);
+  __m256i hi_p = _mm256_srli_epi16(
+      _mm256_mulhi_epu16(_mm256_mullo_epi16(hi, hi_a), magic), 7);
+  lo_p = _mm256_or_si256(_mm256_andnot_si256(mask_a, lo_p),  //
+                         _mm256_and_si256(mask_a, lo));
+  hi_p = _mm256_or_si256(_mm256_andnot_si256(mask_a, hi_p),  //
+                         _mm256_and_si256(mask_a, hi));
+  return _mm256_packus_epi16(lo_p, hi_p);
+}
+
+// qoir_private_swizzle_avx2__unpremul_2 converts two pixels (as four 32-bit
+// lanes in each 128-bit half).
+static inline QOIR_TARGET_AVX2 __m256i  //
+qoir_private_swizzle_avx2__unpremul_2(  //
+    __m256i x) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mask_a = _mm256_set_epi32(-1, 0, 0, 0, -1, 0, 0, 0);
+  __m256i a = _mm256_shuffle_epi32(x, 0xFF);
+  __m256 num = _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(65535.0f));
+  __m256 den = _mm256_max_ps(
+      _mm256_mul_ps(_mm256_cvtepi32_ps(a), _mm256_set1_ps(256.0f)),
+      _mm256_set1_ps(256.0f));
+  __m256i q = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(num, den)),
+                               _mm256_set1_epi32(0xFF));
+  q = _mm256_andnot_si256(_mm256_cmpeq_epi32(a, zero), q);
+  return _mm256_or_si256(_mm256_andnot_si256(mask_a, q),
+                         _mm256_and_si256(mask_a, x));
+}
+
+static inline QOIR_TARGET_AVX2 __m256i  //
+qoir_private_swizzle_avx2__unpremul(    //
+    __m256i x) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo = _mm256_unpacklo_epi8(x, zero);
+  __m256i hi = _mm256_unpackhi_epi8(x, zero);
+  __m256i q0 =
+      qoir_private_swizzle_avx2__unpremul_2(_mm256_unpacklo_epi16(lo, zero));
+  __m256i q1 =
+      qoir_private_swizzle_avx2__unpremul_2(_mm256_unpackhi_epi16(lo, zero));
+  __m256i q2 =
+      qoir_private_swizzle_avx2__unpremul_2(_mm256_unpacklo_epi16(hi, zero));
+  __m256i q3 =
+      qoir_private_swizzle_avx2__unpremul_2(_mm256_unpackhi_epi16(hi, zero));
+  return _mm256_packus_epi16(_mm256_packs_epi32(q0, q1),
+                             _mm256_packs_epi32(q2, q3));
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgra__bgrx(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = _mm256_or_si256(x, _mm256_set1_epi32((int)0xFF000000));
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgra__bgrx(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgra__rgba(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = qoir_private_swizzle_avx2__swap_rb(x);
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgra__rgba(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgra__rgbx(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = qoir_private_swizzle_avx2__swap_rb(x);
+      x = _mm256_or_si256(x, _mm256_set1_epi32((int)0xFF000000));
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgra__rgbx(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgrn__bgrp(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = qoir_private_swizzle_avx2__unpremul(x);
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgrn__bgrp(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgrn__rgbp(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = qoir_private_swizzle_avx2__swap_rb(
+          qoir_private_swizzle_avx2__unpremul(x));
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgrn__rgbp(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgrp__bgrn(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = qoir_private_swizzle_avx2__premul(x);
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgrp__bgrn(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static QOIR_TARGET_AVX2 void               //
+qoir_private_swizzle_avx2__bgrp__rgbn(     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    uint8_t* dp = dst_ptr;
+    const uint8_t* sp = src_ptr;
+    size_t n = width_in_pixels;
+    for (; n >= 8; n -= 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)sp);
+      x = qoir_private_swizzle_avx2__swap_rb(
+          qoir_private_swizzle_avx2__premul(x));
+      _mm256_storeu_si256((__m256i*)(void*)dp, x);
+      sp += 32;
+      dp += 32;
+    }
+    qoir_private_swizzle__bgrp__rgbn(dp, 4 * n, sp, 4 * n, n, 1);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+#endif
+
+// qoir_private_dispatch_swizzle_func returns a faster equivalent of f, if
+// there is one that this CPU supports, or f itself otherwise.
+static qoir_private_swizzle_func     //
+qoir_private_dispatch_swizzle_func(  //
+    qoir_private_swizzle_func f) {
+#if defined(QOIR_USE_SIMD_AVX2)
+  if (qoir_private_cpu_has_avx2()) {
+    if (f == qoir_private_swizzle__bgra__bgrx) {
+      return qoir_private_swizzle_avx2__bgra__bgrx;
+    }
+    if (f == qoir_private_swizzle__bgra__rgba) {
+      return qoir_private_swizzle_avx2__bgra__rgba;
+    }
+    if (f == qoir_private_swizzle__bgra__rgbx) {
+      return qoir_private_swizzle_avx2__bgra__rgbx;
+    }
+    if (f == qoir_private_swizzle__bgrn__bgrp) {
+      return qoir_private_swizzle_avx2__bgrn__bgrp;
+    }
+    if (f == qoir_private_swizzle__bgrn__rgbp) {
+      return qoir_private_swizzle_avx2__bgrn__rgbp;
+    }
+    if (f == qoir_private_swizzle__bgrp__bgrn) {
+      return qoir_private_swizzle_avx2__bgrp__bgrn;
+    }
+    if (f == qoir_private_swizzle__bgrp__rgbn) {
+      return qoir_private_swizzle_avx2__bgrp__rgbn;
+    }
+  }
+#endif
+#if defined(QOIR_USE_SIMD_SSSE3)
+  if (qoir_private_cpu_has_ssse3()) {
+    if (f == qoir_private_swizzle__bgr__bgrn) {
+      return qoir_private_swizzle_ssse3__bgr__bgrn;
+    }
+    if (f == qoir_private_swizzle__bgr__bgrp) {
+      return qoir_private_swizzle_ssse3__bgr__bgrp;
+    }
+    if (f == qoir_private_swizzle__bgr__rgbn) {
+      return qoir_private_swizzle_ssse3__bgr__rgbn;
+    }
+    if (f == qoir_private_swizzle__bgr__rgbp) {
+      return qoir_private_swizzle_ssse3__bgr__rgbp;
+    }
+    if (f == qoir_private_swizzle__bgra__bgr) {
+      return qoir_private_swizzle_ssse3__bgra__bgr;
+    }
+    if (f == qoir_private_swizzle__bgra__rgb) {
+      return qoir_private_swizzle_ssse3__bgra__rgb;
+    }
+  }
+#endif
+  return f;
+}
+
+// -------- LZ4 Decode
+
+QOIR_MAYBE_STATIC qoir_size_result         //
+qoir_lz4_block_decode(                     //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len) {
+  qoir_size_result result = {0};
+
+  if (src_len > QOIR_LZ4_BLOCK_DECODE_MAX_INCL_SRC_LEN) {
     result.status_message = qoir_lz4_status_message__error_src_is_too_long;
     return result;
   }
@@ -5421,7 +7297,18 @@ qoir_lz4_block_decode(                     //
       return result;
     }
     dst_len -= copy_len;
-    for (const uint8_t* from = dst_ptr - copy_off; copy_len > 0; copy_len--) {
+    const uint8_t* from = dst_ptr - copy_off;
+    // If the source and destination are at least 8 bytes apart then copying 8
+    // bytes at a time (a single load and store on most CPUs, including
+    // aarch64's) is equivalent to copying 1 byte at a time.
+    if (copy_off >= 8) {
+      for (; copy_len >= 8; copy_len -= 8) {
+        memcpy(dst_ptr, from, 8);
+        dst_ptr += 8;
+        from += 8;
+      }
+    }
+    for (; copy_len > 0; copy_len--) {
       *dst_ptr++ = *from++;
     }
   }
@@ -5639,56 +7526,490 @@ final_literals:
   return result;
 }
 
-// -------- QOIR Decode
-
-QOIR_MAYBE_STATIC qoir_decode_pixel_configuration_result  //
-qoir_decode_pixel_configuration(                          //
-    const uint8_t* src_ptr,                               //
-    size_t src_len) {
-  qoir_decode_pixel_configuration_result result = {0};
-
-  if ((src_len < 20) ||
-      (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
-    result.status_message = qoir_status_message__error_invalid_data;
-    return result;
+// QOIR_LZ4_HC_MAX_INCL_SRC_LEN is the maximum (inclusive) input length for
+// qoir_lz4_private_block_encode_hc, whose hash chains hold 16-bit values.
+#define QOIR_LZ4_HC_MAX_INCL_SRC_LEN 0xFFFE
+
+// qoir_lz4_private_write_sequence writes an LZ4 sequence: a token, the
+// literals and, if match_len is non-zero, the match (which must be at least 4
+// bytes long) that follows them.
+static inline uint8_t*            //
+qoir_lz4_private_write_sequence(  //
+    uint8_t* dp,                  //
+    const uint8_t* literal_ptr,   //
+    size_t literal_len,           //
+    size_t match_off,             //
+    size_t match_len) {
+  uint8_t* token = dp++;
+  if (literal_len < 15) {
+    *token = (uint8_t)(literal_len << 4);
+  } else {
+    size_t n = literal_len - 15;
+    *token = 0xF0;
+    for (; n >= 255; n -= 255) {
+      *dp++ = 0xFF;
+    }
+    *dp++ = (uint8_t)n;
   }
-  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
-  if ((qoir_chunk_payload_len < 8) ||
-      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull)) {
-    result.status_message = qoir_status_message__error_invalid_data;
-    return result;
+  memcpy(dp, literal_ptr, literal_len);
+  dp += literal_len;
+  if (match_len == 0) {
+    return dp;
   }
 
-  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
-  uint32_t width_in_pixels = 0xFFFFFF & header0;
-  qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
-  switch (src_pixfmt) {
-    case QOIR_PIXEL_FORMAT__BGRX:
-    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
-    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
-      break;
-    default:
-      result.status_message = qoir_status_message__error_invalid_data;
-      return result;
+  *dp++ = (uint8_t)(match_off >> 0);
+  *dp++ = (uint8_t)(match_off >> 8);
+  size_t adj_match_len = match_len - 4;
+  if (adj_match_len < 15) {
+    *token |= (uint8_t)adj_match_len;
+  } else {
+    size_t n = adj_match_len - 15;
+    *token |= 0x0F;
+    for (; n >= 255; n -= 255) {
+      *dp++ = 0xFF;
+    }
+    *dp++ = (uint8_t)n;
   }
-  uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
-  uint32_t height_in_pixels = 0xFFFFFF & header1;
-
-  result.dst_pixcfg.pixfmt = src_pixfmt;
-  result.dst_pixcfg.width_in_pixels = width_in_pixels;
-  result.dst_pixcfg.height_in_pixels = height_in_pixels;
-  return result;
+  return dp;
 }
 
-static qoir_private_swizzle_func          //
-qoir_private_choose_decode_swizzle_func(  //
-    qoir_pixel_format dst_pixfmt,         //
-    qoir_pixel_format src_pixfmt) {
-  switch (dst_pixfmt) {
-    case QOIR_PIXEL_FORMAT__BGRX:
-      switch (src_pixfmt) {
-        case QOIR_PIXEL_FORMAT__BGRX:
-          return qoir_private_swizzle__copy_4;
+// qoir_lz4_private_block_encode_hc is like qoir_lz4_block_encode but it
+// spends more time to find longer matches. It follows hash chains (instead of
+// checking only the single most recent position for each hash) of up to
+// max_attempts candidates and it delays accepting a match if the next byte
+// starts a longer one. The output is plain LZ4, as fast to decode as ever.
+//
+// chain must have room for src_len elements and heads for (1 <<
+// QOIR_LZ4_HASH_TABLE_SHIFT) elements. Their previous contents are ignored.
+// Both hold 1-based offsets (relative to src_ptr), so that zero means none.
+// heads[h] is the most recent position whose 4 bytes hash to h and chain[o]
+// is the position before o (o being 0-based) with the same hash.
+static qoir_size_result                    //
+qoir_lz4_private_block_encode_hc(          //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len,                        //
+    uint16_t* chain,                       //
+    uint16_t* heads,                       //
+    uint32_t max_attempts) {
+  qoir_size_result result = qoir_lz4_block_encode_worst_case_dst_len(src_len);
+  if (result.status_message) {
+    return result;
+  } else if (src_len > QOIR_LZ4_HC_MAX_INCL_SRC_LEN) {
+    result.status_message = qoir_lz4_status_message__error_src_is_too_long;
+    result.value = 0;
+    return result;
+  } else if (result.value > dst_len) {
+    result.status_message = qoir_lz4_status_message__error_dst_is_too_short;
+    result.value = 0;
+    return result;
+  }
+  result.value = 0;
+
+  uint8_t* dp = dst_ptr;
+  size_t literal_start = 0;
+
+  // As for qoir_lz4_block_encode, the last match must start at least 12
+  // bytes before the end of block and end at least 5 bytes before it.
+  if (src_len > 12) {
+    const uint8_t* const match_limit = src_ptr + src_len - 5;
+    const size_t match_start_limit = src_len - 12;
+    memset(heads, 0, sizeof(uint16_t) << QOIR_LZ4_HASH_TABLE_SHIFT);
+    size_t num_inserted = 0;
+
+    size_t pos = 0;
+    size_t best_len = 0;
+    size_t best_off = 0;
+    while (pos <= match_start_limit) {
+      // Insert every position before pos into the hash chains and then find
+      // the longest match at pos, setting this_len and this_off.
+      for (; num_inserted < pos; num_inserted++) {
+        uint16_t* head = &heads[qoir_lz4_private_hash(
+            qoir_private_peek_u32le(src_ptr + num_inserted))];
+        chain[num_inserted] = *head;
+        *head = (uint16_t)(num_inserted + 1);
+      }
+      const uint8_t* sp = src_ptr + pos;
+      uint32_t sp_u32 = qoir_private_peek_u32le(sp);
+      size_t this_len = 0;
+      size_t this_off = 0;
+      uint32_t attempts = max_attempts;
+      for (size_t c = heads[qoir_lz4_private_hash(sp_u32)];
+           (c != 0) && (attempts > 0); c = chain[c - 1], attempts--) {
+        const uint8_t* match = src_ptr + (c - 1);
+        if (((size_t)(sp - match) > 0xFFFF) ||
+            (qoir_private_peek_u32le(match) != sp_u32) ||
+            ((this_len > 0) && (match[this_len] != sp[this_len]))) {
+          continue;
+        }
+        size_t n = 4 + qoir_lz4_private_longest_common_prefix(
+                           4 + sp, 4 + match, match_limit);
+        if (this_len < n) {
+          this_len = n;
+          this_off = (size_t)(sp - match);
+        }
+      }
+
+      // If the previous position had a match that's at least as long, emit
+      // it. Otherwise, defer (lazily) to this position's match, if any.
+      if (best_len && (this_len <= best_len)) {
+        dp = qoir_lz4_private_write_sequence(
+            dp, src_ptr + literal_start, pos - 1 - literal_start, best_off,
+            best_len);
+        pos += best_len - 1;
+        literal_start = pos;
+        best_len = 0;
+        continue;
+      }
+      best_len = (this_len >= 4) ? this_len : 0;
+      best_off = this_off;
+      pos++;
+    }
+    if (best_len) {
+      dp = qoir_lz4_private_write_sequence(dp, src_ptr + literal_start,
+                                           pos - 1 - literal_start, best_off,
+                                           best_len);
+      literal_start = pos - 1 + best_len;
+    }
+  }
+
+  dp = qoir_lz4_private_write_sequence(dp, src_ptr + literal_start,
+                                       src_len - literal_start, 0, 0);
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
+
+// -------- Statistics
+
+// qoir_private_monotonic_nanos returns a monotonic clock reading, in
+// nanoseconds. Only the difference between two readings is meaningful. It
+// always returns zero if <time.h> doesn't provide CLOCK_MONOTONIC, as neither
+// wall-clock time (which can jump) nor clock() (which is process CPU time,
+// summed over every thread) is a substitute.
+static uint64_t                //
+qoir_private_monotonic_nanos(  //
+    void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+// qoir_private_tile_stats__count_ops sets the tile_stats' uncompressed_len
+// and op counts, given the tile's ops. It only looks at each op's first byte,
+// which determines the op's length, so it never reads past ops_len.
+static void                          //
+qoir_private_tile_stats__count_ops(  //
+    qoir_tile_stats* tile_stats,     //
+    const uint8_t* ops_ptr,          //
+    size_t ops_len) {
+  tile_stats->uncompressed_len = ops_len;
+  uint32_t* n = tile_stats->num_ops_by_type;
+  size_t i = 0;
+  while (i < ops_len) {
+    uint8_t b = ops_ptr[i];
+    if (b == 0xF7) {
+      n[QOIR_OP_TYPE__BGR8]++;
+      i += 4;
+    } else if ((b & 0x03) == 0) {
+      n[QOIR_OP_TYPE__INDEX]++;
+      i += 1;
+    } else if ((b & 0x03) == 1) {
+      n[QOIR_OP_TYPE__BGR2]++;
+      i += 1;
+    } else if ((b & 0x03) == 2) {
+      n[QOIR_OP_TYPE__LUMA]++;
+      i += 2;
+    } else if ((b & 0x07) == 3) {
+      n[QOIR_OP_TYPE__BGR7]++;
+      i += 3;
+    } else if (b < 0xD7) {
+      n[QOIR_OP_TYPE__RUNS]++;
+      i += 1;
+    } else if (b == 0xD7) {
+      n[QOIR_OP_TYPE__RUNL]++;
+      i += 2;
+    } else if (b == 0xDF) {
+      n[QOIR_OP_TYPE__BGRA2]++;
+      i += 2;
+    } else if (b == 0xE7) {
+      n[QOIR_OP_TYPE__BGRA4]++;
+      i += 3;
+    } else if (b == 0xEF) {
+      n[QOIR_OP_TYPE__BGRA8]++;
+      i += 5;
+    } else {
+      n[QOIR_OP_TYPE__A8]++;
+      i += 2;
+    }
+  }
+}
+
+static void                    //
+qoir_private_stats__add_tile(  //
+    qoir_stats* stats,         //
+    const qoir_tile_stats* tile_stats) {
+  uint32_t f = tile_stats->tile_format;
+  if (f >= QOIR_NUM_TILE_FORMATS) {
+    return;
+  }
+  stats->num_tiles_by_format[f]++;
+  stats->compressed_len_by_format[f] += tile_stats->compressed_len;
+  stats->uncompressed_len_by_format[f] += tile_stats->uncompressed_len;
+  for (int i = 0; i < QOIR_NUM_OP_TYPES; i++) {
+    stats->num_ops_by_type[i] += tile_stats->num_ops_by_type[i];
+  }
+  stats->num_back_reference_tiles += tile_stats->is_back_reference ? 1 : 0;
+}
+
+static void               //
+qoir_private_stats__add(  //
+    qoir_stats* dst,      //
+    const qoir_stats* src) {
+  for (int i = 0; i < QOIR_NUM_TILE_FORMATS; i++) {
+    dst->num_tiles_by_format[i] += src->num_tiles_by_format[i];
+    dst->compressed_len_by_format[i] += src->compressed_len_by_format[i];
+    dst->uncompressed_len_by_format[i] += src->uncompressed_len_by_format[i];
+  }
+  for (int i = 0; i < QOIR_NUM_OP_TYPES; i++) {
+    dst->num_ops_by_type[i] += src->num_ops_by_type[i];
+  }
+  dst->num_back_reference_tiles += src->num_back_reference_tiles;
+  dst->num_clipped_tiles += src->num_clipped_tiles;
+}
+
+// -------- QOIR Context
+
+// Every block in a qoir_context's pool starts with a header, holding the
+// block's length (excluding the header) as a u64le. The header length is 16,
+// not 8, so that the rest of the block is as aligned as malloc's result.
+#define QOIR_CONTEXT_BLOCK_HEADER_LEN 16
+
+// These are the indexes into a qoir_context's scratch_ptrs and scratch_lens.
+// A single qoir_decode or qoir_encode call can use all of them at the same
+// time.
+#define QOIR_CONTEXT_SCRATCH__JOBS 0
+#define QOIR_CONTEXT_SCRATCH__OUTPUT 1
+#define QOIR_CONTEXT_SCRATCH__MIPMAPS 2
+
+static inline void*            //
+qoir_private_context__malloc(  //
+    qoir_context* context,     //
+    size_t len) {
+  return qoir_private_malloc(context->private_impl.contextual_malloc_func,
+                             context->private_impl.memory_func_context, len);
+}
+
+static inline void           //
+qoir_private_context__free(  //
+    qoir_context* context,   //
+    void* ptr) {
+  qoir_private_free(context->private_impl.contextual_free_func,
+                    context->private_impl.memory_func_context, ptr);
+}
+
+// qoir_private_context__decbuf returns the context's decbuf, allocating it on
+// first use. It returns NULL if out of memory.
+static qoir_decode_buffer*     //
+qoir_private_context__decbuf(  //
+    qoir_context* context) {
+  if (!context->private_impl.decbuf) {
+    context->private_impl.decbuf = (qoir_decode_buffer*)
+        qoir_private_context__malloc(context, sizeof(qoir_decode_buffer));
+  }
+  return context->private_impl.decbuf;
+}
+
+// qoir_private_context__encbuf returns the context's encbuf, allocating it on
+// first use. It returns NULL if out of memory.
+static qoir_encode_buffer*     //
+qoir_private_context__encbuf(  //
+    qoir_context* context) {
+  if (!context->private_impl.encbuf) {
+    context->private_impl.encbuf = (qoir_encode_buffer*)
+        qoir_private_context__malloc(context, sizeof(qoir_encode_buffer));
+  }
+  return context->private_impl.encbuf;
+}
+
+// qoir_private_context__scratch returns at least len bytes (whose contents are
+// unspecified) of the context's scratch space for the given purpose, growing
+// it if necessary. It returns NULL if out of memory.
+static uint8_t*                 //
+qoir_private_context__scratch(  //
+    qoir_context* context,      //
+    int purpose,                //
+    size_t len) {
+  if ((context->private_impl.scratch_lens[purpose] < len) ||
+      !context->private_impl.scratch_ptrs[purpose]) {
+    qoir_private_context__free(context,
+                               context->private_impl.scratch_ptrs[purpose]);
+    uint8_t* ptr = (uint8_t*)qoir_private_context__malloc(context, len);
+    context->private_impl.scratch_ptrs[purpose] = ptr;
+    context->private_impl.scratch_lens[purpose] = ptr ? len : 0;
+  }
+  return context->private_impl.scratch_ptrs[purpose];
+}
+
+// qoir_private_context__acquire returns a block (with a header) with room for
+// at least len bytes after the header. It takes the smallest such block from
+// the pool, if there is one, and otherwise allocates a new block. It returns
+// NULL if out of memory.
+static uint8_t*                 //
+qoir_private_context__acquire(  //
+    qoir_context* context,      //
+    uint64_t len) {
+  int best = -1;
+  uint64_t best_len = 0;
+  for (int i = 0; i < QOIR_CONTEXT_POOL_LEN; i++) {
+    const uint8_t* block = (const uint8_t*)context->private_impl.pool[i];
+    if (block) {
+      uint64_t n = qoir_private_peek_u64le(block);
+      if ((n >= len) && ((best < 0) || (n < best_len))) {
+        best = i;
+        best_len = n;
+      }
+    }
+  }
+  if (best >= 0) {
+    uint8_t* block = (uint8_t*)context->private_impl.pool[best];
+    context->private_impl.pool[best] = NULL;
+    return block;
+  } else if (len > (SIZE_MAX - QOIR_CONTEXT_BLOCK_HEADER_LEN)) {
+    return NULL;
+  }
+  uint8_t* block = (uint8_t*)qoir_private_context__malloc(
+      context, QOIR_CONTEXT_BLOCK_HEADER_LEN + (size_t)len);
+  if (block) {
+    qoir_private_poke_u64le(block, len);
+  }
+  return block;
+}
+
+QOIR_MAYBE_STATIC void                                          //
+qoir_context__initialize(                                       //
+    qoir_context* context,                                      //
+    void* (*contextual_malloc_func)(void* memory_func_context,  //
+                                    size_t len),                //
+    void (*contextual_free_func)(void* memory_func_context,     //
+                                 void* ptr),                    //
+    void* memory_func_context) {
+  if (!context) {
+    return;
+  }
+  memset(context, 0, sizeof(*context));
+  context->private_impl.contextual_malloc_func = contextual_malloc_func;
+  context->private_impl.contextual_free_func = contextual_free_func;
+  context->private_impl.memory_func_context = memory_func_context;
+}
+
+QOIR_MAYBE_STATIC void      //
+qoir_context__recycle(      //
+    qoir_context* context,  //
+    void* owned_memory) {
+  if (!context || !owned_memory) {
+    return;
+  }
+
+  // Use an empty slot if there is one. Otherwise, keep the larger blocks.
+  uint64_t len = qoir_private_peek_u64le((const uint8_t*)owned_memory);
+  int smallest = -1;
+  uint64_t smallest_len = 0;
+  for (int i = 0; i < QOIR_CONTEXT_POOL_LEN; i++) {
+    const uint8_t* block = (const uint8_t*)context->private_impl.pool[i];
+    if (!block) {
+      context->private_impl.pool[i] = owned_memory;
+      return;
+    }
+    uint64_t n = qoir_private_peek_u64le(block);
+    if ((smallest < 0) || (n < smallest_len)) {
+      smallest = i;
+      smallest_len = n;
+    }
+  }
+  if (smallest_len < len) {
+    qoir_private_context__free(context, context->private_impl.pool[smallest]);
+    context->private_impl.pool[smallest] = owned_memory;
+  } else {
+    qoir_private_context__free(context, owned_memory);
+  }
+}
+
+QOIR_MAYBE_STATIC void  //
+qoir_context__destroy(  //
+    qoir_context* context) {
+  if (!context) {
+    return;
+  }
+  qoir_private_context__free(context, context->private_impl.decbuf);
+  context->private_impl.decbuf = NULL;
+  qoir_private_context__free(context, context->private_impl.encbuf);
+  context->private_impl.encbuf = NULL;
+  for (int i = 0; i < 3; i++) {
+    qoir_private_context__free(context, context->private_impl.scratch_ptrs[i]);
+    context->private_impl.scratch_ptrs[i] = NULL;
+    context->private_impl.scratch_lens[i] = 0;
+  }
+  for (int i = 0; i < QOIR_CONTEXT_POOL_LEN; i++) {
+    qoir_private_context__free(context, context->private_impl.pool[i]);
+    context->private_impl.pool[i] = NULL;
+  }
+}
+
+// -------- QOIR Decode
+
+QOIR_MAYBE_STATIC qoir_decode_pixel_configuration_result  //
+qoir_decode_pixel_configuration(                          //
+    const uint8_t* src_ptr,                               //
+    size_t src_len) {
+  qoir_decode_pixel_configuration_result result = {0};
+
+  if ((src_len < 20) ||
+      (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if ((qoir_chunk_payload_len < 8) ||
+      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+
+  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
+  uint32_t width_in_pixels = 0xFFFFFF & header0;
+  qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
+  switch (src_pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+      break;
+    default:
+      result.status_message = qoir_status_message__error_invalid_data;
+      return result;
+  }
+  uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
+  uint32_t height_in_pixels = 0xFFFFFF & header1;
+
+  result.dst_pixcfg.pixfmt = src_pixfmt;
+  result.dst_pixcfg.width_in_pixels = width_in_pixels;
+  result.dst_pixcfg.height_in_pixels = height_in_pixels;
+  return result;
+}
+
+static qoir_private_swizzle_func          //
+qoir_private_choose_decode_swizzle_func(  //
+    qoir_pixel_format dst_pixfmt,         //
+    qoir_pixel_format src_pixfmt) {
+  switch (dst_pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+      switch (src_pixfmt) {
+        case QOIR_PIXEL_FORMAT__BGRX:
+          return qoir_private_swizzle__copy_4;
         case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
           return qoir_private_swizzle__bgrp__bgrn;
         case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
@@ -5777,23 +8098,59 @@ qoir_private_choose_decode_swizzle_func(  //
   return NULL;
 }
 
-// Callers should pass (QOIR_LITERALS_PRE_PADDING + (4 * tw * th)) for dst_len,
-// so that the decode loop can always refer (by a simple offset of -4) to the
-// pixel left of the current pixel.
+// qoir_private_decode_tile_ops__split_run writes n copies of pixel, for a run
+// that continues past the end of the current row (which ends at *dq) onto the
+// next (*num_rows - 1) rows. It returns false if the run is too long for
+// those rows.
+static bool                               //
+qoir_private_decode_tile_ops__split_run(  //
+    uint8_t** dp,                         //
+    uint8_t** dq,                         //
+    size_t* num_rows,                     //
+    size_t dst_stride_in_bytes,           //
+    size_t row_len,                       //
+    const uint8_t* pixel,                 //
+    size_t n) {
+  uint8_t* p = *dp;
+  uint8_t* q = *dq;
+  if (n > (((size_t)(q - p) / 4) + ((*num_rows - 1) * (row_len / 4)))) {
+    return false;
+  }
+  while (true) {
+    for (; (p < q) && (n > 0); n--) {
+      memcpy(p, pixel, 4);
+      p += 4;
+    }
+    if (n == 0) {
+      break;
+    }
+    p += dst_stride_in_bytes - row_len;
+    q += dst_stride_in_bytes;
+    (*num_rows)--;
+  }
+  *dp = p;
+  *dq = q;
+  return true;
+}
+
+// qoir_private_decode_tile_ops__rows decodes a tile's ops to num_rows rows of
+// row_len bytes each. The first row starts at dst_ptr and each row starts
+// dst_stride_in_bytes after the previous one. If strided is false then
+// num_rows must be 1 and dst_stride_in_bytes is ignored.
 //
 // Callers should pass (total_ops_length + 8) for src_len so the decode loop
 // can always peek for 8 bytes, even at the end of the stream. Reference: §
-static qoir_size_result        //
-qoir_private_decode_tile_ops(  //
-    uint8_t* dst_ptr,          //
-    size_t dst_len,            //
-    const uint8_t* src_ptr,    //
-    size_t src_len) {
-  qoir_size_result result = {0};
-
-  if ((dst_len < QOIR_LITERALS_PRE_PADDING) || (src_len < 8)) {
-    result.status_message = qoir_status_message__error_invalid_argument;
-    return result;
+static QOIR_ALWAYS_INLINE const char*  //
+qoir_private_decode_tile_ops__rows(    //
+    uint8_t* dst_ptr,                  //
+    size_t dst_stride_in_bytes,        //
+    size_t row_len,                    //
+    size_t num_rows,                   //
+    const uint8_t* src_ptr,            //
+    size_t src_len,                    //
+    bool strided) {
+  if ((num_rows == 0) || (src_len < 8)) {
+    return qoir_status_message__error_invalid_argument;
   }
 
   // color_cache is conceptually "uint8_t color_cache[64][4]" but is flattened
@@ -5808,19 +8165,25 @@ qoir_private_decode_tile_ops(  //
   }
   uint8_t next_color_index = 0;
 
-  uint8_t* dp = dst_ptr + QOIR_LITERALS_PRE_PADDING;
-  uint8_t* dq = dst_ptr + dst_len;
+  // pixel is the previously decoded pixel (or, initially, opaque black).
+  uint8_t pixel[4] = {0x00, 0x00, 0x00, 0xFF};
+
+  uint8_t* dp = dst_ptr;
+  uint8_t* dq = dst_ptr + row_len;  // The end of the current row.
   const uint8_t* sp = src_ptr;
   const uint8_t* sq = src_ptr + src_len - 8;
-  while (dp < dq) {
+  while (true) {
+    if (dp >= dq) {
+      if (!strided || (--num_rows == 0)) {
+        break;
+      }
+      dp += dst_stride_in_bytes - row_len;
+      dq += dst_stride_in_bytes;
+    }
     if (sp >= sq) {
-      result.status_message = qoir_status_message__error_invalid_data;
-      return result;
+      return qoir_status_message__error_invalid_data;
     }
 
-    uint8_t pixel[4];
-    memcpy(pixel, dp - 4, 4);
-
     uint64_t s64 = qoir_private_peek_u64le(sp);
     if ((s64 & 0xFF) == 0xF7) {  // QOIR_OP_BGR8
       pixel[0] += (uint8_t)(s64 >> 0x08);
@@ -5848,6 +8211,12 @@ qoir_private_decode_tile_ops(  //
 #if defined(QOIR_USE_SIMD_SSE2)
       pixel8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_add_epi8(
           _mm_cvtsi32_si128((int)pixel8x4), _mm_cvtsi32_si128((int)delta8x4)));
+#elif defined(QOIR_USE_SIMD_NEON)
+      pixel8x4 = vget_lane_u32(
+          vreinterpret_u32_u8(
+              vadd_u8(vreinterpret_u8_u32(vdup_n_u32(pixel8x4)),
+                      vreinterpret_u8_u32(vdup_n_u32(delta8x4)))),
+          0);
 #else
       pixel8x4 = QOIR_SWAR_PADDB(pixel8x4, delta8x4);
 #endif
@@ -5868,6 +8237,12 @@ qoir_private_decode_tile_ops(  //
 #if defined(QOIR_USE_SIMD_SSE2)
       pixel8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_add_epi8(
           _mm_cvtsi32_si128((int)pixel8x4), _mm_cvtsi32_si128((int)delta8x4)));
+#elif defined(QOIR_USE_SIMD_NEON)
+      pixel8x4 = vget_lane_u32(
+          vreinterpret_u32_u8(
+              vadd_u8(vreinterpret_u8_u32(vdup_n_u32(pixel8x4)),
+                      vreinterpret_u8_u32(vdup_n_u32(delta8x4)))),
+          0);
 #else
       pixel8x4 = QOIR_SWAR_PADDB(pixel8x4, delta8x4);
 #endif
@@ -5894,6 +8269,12 @@ qoir_private_decode_tile_ops(  //
 #if defined(QOIR_USE_SIMD_SSE2)
       pixel8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_add_epi8(
           _mm_cvtsi32_si128((int)pixel8x4), _mm_cvtsi32_si128((int)delta8x4)));
+#elif defined(QOIR_USE_SIMD_NEON)
+      pixel8x4 = vget_lane_u32(
+          vreinterpret_u32_u8(
+              vadd_u8(vreinterpret_u8_u32(vdup_n_u32(pixel8x4)),
+                      vreinterpret_u8_u32(vdup_n_u32(delta8x4)))),
+          0);
 #else
       pixel8x4 = QOIR_SWAR_PADDB(pixel8x4, delta8x4);
 #endif
@@ -5906,26 +8287,32 @@ qoir_private_decode_tile_ops(  //
 
     } else if ((s64 & 0xFF) < 0xD7) {  // QOIR_OP_RUNS
       size_t run_length = (s64 & 0xFF) >> 0x03;
-      if (((size_t)(dq - dp)) < (4 * (run_length + 1))) {
-        result.status_message = qoir_status_message__error_invalid_data;
-        return result;
+      if (((size_t)(dq - dp)) >= (4 * (run_length + 1))) {
+        do {
+          memcpy(dp, pixel, 4);
+          dp += 4;
+        } while (run_length--);
+      } else if (!strided ||
+                 !qoir_private_decode_tile_ops__split_run(
+                     &dp, &dq, &num_rows, dst_stride_in_bytes, row_len, pixel,
+                     run_length + 1)) {
+        return qoir_status_message__error_invalid_data;
       }
-      do {
-        memcpy(dp, pixel, 4);
-        dp += 4;
-      } while (run_length--);
       sp += 1;
 
     } else if ((s64 & 0xFF) == 0xD7) {  // QOIR_OP_RUNL
       size_t run_length = (s64 >> 0x08) & 0xFF;
-      if (((size_t)(dq - dp)) < (4 * (run_length + 1))) {
-        result.status_message = qoir_status_message__error_invalid_data;
-        return result;
+      if (((size_t)(dq - dp)) >= (4 * (run_length + 1))) {
+        do {
+          memcpy(dp, pixel, 4);
+          dp += 4;
+        } while (run_length--);
+      } else if (!strided ||
+                 !qoir_private_decode_tile_ops__split_run(
+                     &dp, &dq, &num_rows, dst_stride_in_bytes, row_len, pixel,
+                     run_length + 1)) {
+        return qoir_status_message__error_invalid_data;
       }
-      do {
-        memcpy(dp, pixel, 4);
-        dp += 4;
-      } while (run_length--);
       sp += 2;
 
     } else if ((s64 & 0xFF) == 0xDF) {  // QOIR_OP_BGRA2
@@ -5972,203 +8359,1576 @@ qoir_private_decode_tile_ops(  //
   }
 
   if (sp != sq) {
-    result.status_message = qoir_status_message__error_invalid_data;
+    return qoir_status_message__error_invalid_data;
+  }
+  return NULL;
+}
+
+// qoir_private_decode_tile_ops decodes a tile's ops to contiguous memory.
+//
+// Callers should pass (QOIR_LITERALS_PRE_PADDING + (4 * tw * th)) for dst_len
+// (but the pre-padding isn't otherwise used) and (total_ops_length + 8) for
+// src_len. Reference: §
+static qoir_size_result        //
+qoir_private_decode_tile_ops(  //
+    uint8_t* dst_ptr,          //
+    size_t dst_len,            //
+    const uint8_t* src_ptr,    //
+    size_t src_len) {
+  qoir_size_result result = {0};
+  if (dst_len < QOIR_LITERALS_PRE_PADDING) {
+    result.status_message = qoir_status_message__error_invalid_argument;
     return result;
   }
-  result.value = (size_t)(dp - dst_ptr);
+  result.status_message = qoir_private_decode_tile_ops__rows(
+      dst_ptr + QOIR_LITERALS_PRE_PADDING, 0,
+      dst_len - QOIR_LITERALS_PRE_PADDING, 1, src_ptr, src_len, false);
+  if (!result.status_message) {
+    result.value = dst_len;
+  }
   return result;
 }
 
-static const char*                      //
-qoir_private_decode_qpix_payload(       //
-    qoir_decode_buffer* decbuf,         //
-    qoir_pixel_buffer dst_pixbuf,       //
-    qoir_rectangle dst_clip_rectangle,  //
-    qoir_pixel_format src_pixfmt,       //
-    uint32_t src_width_in_pixels,       //
-    uint32_t src_height_in_pixels,      //
-    const uint8_t* src_ptr,             //
-    size_t src_len,                     //
-    qoir_rectangle src_clip_rectangle,  //
-    int32_t offset_x,                   //
-    int32_t offset_y,                   //
-    uint32_t lossiness) {
-  do {
-    qoir_rectangle dst_clip_rect =
-        qoir_make_rectangle(0, 0, (int32_t)dst_pixbuf.pixcfg.width_in_pixels,
-                            (int32_t)dst_pixbuf.pixcfg.height_in_pixels);
-    dst_clip_rect =
-        qoir_rectangle__intersect(dst_clip_rect, dst_clip_rectangle);
-    qoir_rectangle dst_clip_rect_in_src_space;
-    dst_clip_rect_in_src_space.x0 = dst_clip_rect.x0 - offset_x;
-    dst_clip_rect_in_src_space.y0 = dst_clip_rect.y0 - offset_y;
-    dst_clip_rect_in_src_space.x1 = dst_clip_rect.x1 - offset_x;
-    dst_clip_rect_in_src_space.y1 = dst_clip_rect.y1 - offset_y;
-
-    size_t height_in_tiles =
-        qoir_calculate_number_of_tiles_1d(src_height_in_pixels);
-    size_t width_in_tiles =
-        qoir_calculate_number_of_tiles_1d(src_width_in_pixels);
-    if ((height_in_tiles == 0) || (width_in_tiles == 0)) {
-      goto done;
-    }
-    size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
-    size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
+// qoir_private_decode_tile_ops_to_rows decodes a tile's ops straight to a
+// destination pixel buffer's (4 bytes per pixel) rows. Its src_len argument
+// is like qoir_private_decode_tile_ops'.
+static const char*                     //
+qoir_private_decode_tile_ops_to_rows(  //
+    uint8_t* dst_ptr,                  //
+    size_t dst_stride_in_bytes,        //
+    size_t tw,                         //
+    size_t th,                         //
+    const uint8_t* src_ptr,            //
+    size_t src_len) {
+  return qoir_private_decode_tile_ops__rows(dst_ptr, dst_stride_in_bytes,
+                                            4 * tw, th, src_ptr, src_len, true);
+}
 
-    qoir_private_swizzle_func swizzle_func =
-        qoir_private_choose_decode_swizzle_func(dst_pixbuf.pixcfg.pixfmt,
-                                                src_pixfmt);
-    if (!swizzle_func) {
-      return qoir_status_message__error_unsupported_pixfmt;
+// qoir_private_decode_unlossify (and its _etc variants) sets dst[i] to
+// qoir_private_table_unlossify[lossiness - 1][src[i]] for i in 0 .. len. The
+// table's values (see script/gen_table_unlossify.go) are also (x | (x >> s) |
+// (x >> 2s) | etc), where x is ((src[i] << lossiness) & 0xFF) and s is (8 -
+// lossiness), and that form is what the SIMD code paths calculate.
+//
+// If swap_rb then it also swaps the 1st and 3rd bytes of each 4 byte pixel
+// (converting BGRA to RGBA or vice versa), and len must be a multiple of 4.
+static void                                //
+qoir_private_decode_unlossify_scalar(      //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t len,                            //
+    uint32_t lossiness,                    //
+    bool swap_rb) {
+  const uint8_t* unlossify = qoir_private_table_unlossify[lossiness - 1];
+  if (swap_rb) {
+    for (; len >= 4; len -= 4) {
+      dst_ptr[0] = unlossify[src_ptr[2]];
+      dst_ptr[1] = unlossify[src_ptr[1]];
+      dst_ptr[2] = unlossify[src_ptr[0]];
+      dst_ptr[3] = unlossify[src_ptr[3]];
+      dst_ptr += 4;
+      src_ptr += 4;
     }
-    size_t num_dst_channels =
-        qoir_pixel_format__bytes_per_pixel(dst_pixbuf.pixcfg.pixfmt);
+    return;
+  }
+  for (; len > 0; len--) {
+    *dst_ptr++ = unlossify[*src_ptr++];
+  }
+}
 
-    uint8_t* literals_pre_padding = decbuf->private_impl.literals;
-    for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
-      literals_pre_padding[i + 0] = 0x00;
-      literals_pre_padding[i + 1] = 0x00;
-      literals_pre_padding[i + 2] = 0x00;
-      literals_pre_padding[i + 3] = 0xFF;
+#if defined(QOIR_USE_SIMD_AVX2)
+static QOIR_TARGET_AVX2 void               //
+qoir_private_decode_unlossify_avx2(        //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t len,                            //
+    uint32_t lossiness,                    //
+    bool swap_rb) {
+  const uint32_t s = 8 - lossiness;
+  const __m128i l_count = _mm_cvtsi32_si128((int)lossiness);
+  const __m128i s_count = _mm_cvtsi32_si128((int)s);
+  const __m256i l_mask = _mm256_set1_epi8((char)(0xFF << lossiness));
+  const __m256i s_mask = _mm256_set1_epi8((char)(0xFF >> s));
+  const __m256i rb_mask = _mm256_set1_epi32(0x00FF00FF);
+  for (; len >= 32; len -= 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)src_ptr);
+    x = _mm256_and_si256(_mm256_sll_epi16(x, l_count), l_mask);
+    __m256i v = x;
+    for (uint32_t i = 7 / s; i > 0; i--) {
+      x = _mm256_and_si256(_mm256_srl_epi16(x, s_count), s_mask);
+      v = _mm256_or_si256(v, x);
     }
-
-    // ty, tx, tw and th are the tile's top-left offset, width and height, all
-    // measured in pixels.
-    for (size_t ty = 0; ty <= ty1; ty += QOIR_TILE_SIZE) {
-      for (size_t tx = 0; tx <= tx1; tx += QOIR_TILE_SIZE) {
-        size_t tw = qoir_private_tile_dimension(tx < tx1, src_width_in_pixels);
-        size_t th = qoir_private_tile_dimension(ty < ty1, src_height_in_pixels);
-        qoir_rectangle src_clip_rect =
-            qoir_make_rectangle((int32_t)(tx + 0), (int32_t)(ty + 0),
-                                (int32_t)(tx + tw), (int32_t)(ty + th));
-        src_clip_rect =
-            qoir_rectangle__intersect(src_clip_rect, src_clip_rectangle);
-        src_clip_rect = qoir_rectangle__intersect(src_clip_rect,
-                                                  dst_clip_rect_in_src_space);
-
-        if (src_len < 4) {
-          return qoir_status_message__error_invalid_data;
-        }
-        uint32_t prefix = qoir_private_peek_u32le(src_ptr);
-        src_ptr += 4;
-        src_len -= 4;
-        size_t tile_len = prefix & 0xFFFFFF;
-        if ((src_len < (tile_len + 8)) ||  //
-            (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
-          return qoir_status_message__error_invalid_data;
-        }
-
-        if (qoir_rectangle__is_empty(src_clip_rect)) {
-          src_ptr += tile_len;
-          src_len -= tile_len;
-          continue;
-        }
-
-        const uint8_t* literals = NULL;
-        switch (prefix >> 24) {
-          case 0: {  // Literals tile format.
-            if (tile_len != (4 * tw * th)) {
-              return qoir_status_message__error_invalid_data;
-            }
-            literals = src_ptr;
-            break;
-          }
-          case 1: {  // Ops tile format.
-            qoir_size_result r = qoir_private_decode_tile_ops(
-                decbuf->private_impl.literals,              //
-                QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
-                src_ptr, tile_len + 8);                     // See § for +8.
-            if (r.status_message) {
-              return r.status_message;
-            } else if (r.value != (QOIR_LITERALS_PRE_PADDING + (4 * tw * th))) {
-              return qoir_status_message__error_invalid_data;
-            }
-            literals =
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
-            break;
-          }
-          case 2: {  // LZ4-Literals tile format.
-            qoir_size_result r = qoir_lz4_block_decode(
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-                sizeof(decbuf->private_impl.literals) -
-                    QOIR_LITERALS_PRE_PADDING,
-                src_ptr, tile_len);
-            if (r.status_message) {
-              return qoir_status_message__error_invalid_data;
-            } else if (r.value != (4 * tw * th)) {
-              return qoir_status_message__error_invalid_data;
-            }
-            literals =
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
-            break;
-          }
-          case 3: {  // LZ4-Ops tile format.
-            qoir_size_result r0 = qoir_lz4_block_decode(
-                decbuf->private_impl.ops, sizeof(decbuf->private_impl.ops),
-                src_ptr, tile_len);
-            if (r0.status_message) {
-              return qoir_status_message__error_invalid_data;
-            }
-            qoir_size_result r1 = qoir_private_decode_tile_ops(
-                decbuf->private_impl.literals,              //
-                QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
-                decbuf->private_impl.ops, r0.value + 8);    // See § for +8.
-            if (r1.status_message) {
-              return r1.status_message;
-            } else if (r1.value !=
-                       (QOIR_LITERALS_PRE_PADDING + (4 * tw * th))) {
-              return qoir_status_message__error_invalid_data;
-            }
-            literals =
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
-            break;
-          }
-          default:
-            return qoir_status_message__error_unsupported_tile_format;
-        }
-
-        src_ptr += tile_len;
-        src_len -= tile_len;
-
-        if (lossiness) {
-          uint8_t* p = decbuf->private_impl.ops;
-          const uint8_t* q = literals;
-          const uint8_t* unlossify =
-              qoir_private_table_unlossify[lossiness - 1];
-          for (uint32_t i = 4 * tw * th; i > 0; i--) {
-            *p++ = unlossify[*q++];
-          }
-          literals = decbuf->private_impl.ops;
-        }
-
-        uint8_t* dp =
-            dst_pixbuf.data +
-            ((src_clip_rect.y0 + offset_y) * dst_pixbuf.stride_in_bytes) +
-            ((src_clip_rect.x0 + offset_x) * num_dst_channels);
-        const uint8_t* sp = literals +
-                            ((src_clip_rect.y0 & QOIR_TILE_MASK) * 4 * tw) +
-                            ((src_clip_rect.x0 & QOIR_TILE_MASK) * 4);
-        (*swizzle_func)(dp, dst_pixbuf.stride_in_bytes, sp, 4 * tw,
-                        qoir_rectangle__width(src_clip_rect),
-                        qoir_rectangle__height(src_clip_rect));
-      }
+    if (swap_rb) {
+      __m256i rb = _mm256_and_si256(v, rb_mask);
+      rb = _mm256_or_si256(_mm256_slli_epi32(rb, 16),  //
+                           _mm256_srli_epi32(rb, 16));
+      v = _mm256_or_si256(_mm256_andnot_si256(rb_mask, v), rb);
     }
-  } while (false);
-
-done:
-  if (src_len != 8) {
-    return qoir_status_message__error_invalid_data;
+    _mm256_storeu_si256((__m256i*)(void*)dst_ptr, v);
+    src_ptr += 32;
+    dst_ptr += 32;
   }
-  return NULL;
+  qoir_private_decode_unlossify_scalar(dst_ptr, src_ptr, len, lossiness,
+                                       swap_rb);
 }
+#endif
 
-static qoir_decode_result               //
-qoir_private_make_decode_result_error(  //
-    const char* status_message) {
-  qoir_decode_result result = {0};
-  result.status_message = status_message;
-  return result;
-}
+static void                                //
+qoir_private_decode_unlossify(             //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t len,                            //
+    uint32_t lossiness,                    //
+    bool swap_rb) {
+#if defined(QOIR_USE_SIMD_AVX2)
+  if (qoir_private_cpu_has_avx2()) {
+    qoir_private_decode_unlossify_avx2(dst_ptr, src_ptr, len, lossiness,
+                                       swap_rb);
+    return;
+  }
+#endif
+#if defined(QOIR_USE_SIMD_SSE2)
+  const uint32_t s = 8 - lossiness;
+  const __m128i l_count = _mm_cvtsi32_si128((int)lossiness);
+  const __m128i s_count = _mm_cvtsi32_si128((int)s);
+  const __m128i l_mask = _mm_set1_epi8((char)(0xFF << lossiness));
+  const __m128i s_mask = _mm_set1_epi8((char)(0xFF >> s));
+  const __m128i rb_mask = _mm_set1_epi32(0x00FF00FF);
+  for (; len >= 16; len -= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(const void*)src_ptr);
+    x = _mm_and_si128(_mm_sll_epi16(x, l_count), l_mask);
+    __m128i v = x;
+    for (uint32_t i = 7 / s; i > 0; i--) {
+      x = _mm_and_si128(_mm_srl_epi16(x, s_count), s_mask);
+      v = _mm_or_si128(v, x);
+    }
+    if (swap_rb) {
+      __m128i rb = _mm_and_si128(v, rb_mask);
+      rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+      v = _mm_or_si128(_mm_andnot_si128(rb_mask, v), rb);
+    }
+    _mm_storeu_si128((__m128i*)(void*)dst_ptr, v);
+    src_ptr += 16;
+    dst_ptr += 16;
+  }
+#elif defined(QOIR_USE_SIMD_NEON)
+  static const uint8_t swap_rb_indexes[16] = {
+      0x02, 0x01, 0x00, 0x03, 0x06, 0x05, 0x04, 0x07,  //
+      0x0A, 0x09, 0x08, 0x0B, 0x0E, 0x0D, 0x0C, 0x0F,  //
+  };
+  const uint8x16_t swap_rb_shuffle = vld1q_u8(swap_rb_indexes);
+  const int8x16_t l_count = vdupq_n_s8((int8_t)lossiness);
+  const int8x16_t s_count = vdupq_n_s8((int8_t)((int)lossiness - 8));
+  for (; len >= 16; len -= 16) {
+    uint8x16_t x = vshlq_u8(vld1q_u8(src_ptr), l_count);
+    uint8x16_t v = x;
+    for (uint32_t i = 7 / (8 - lossiness); i > 0; i--) {
+      x = vshlq_u8(x, s_count);
+      v = vorrq_u8(v, x);
+    }
+    if (swap_rb) {
+      v = vqtbl1q_u8(v, swap_rb_shuffle);
+    }
+    vst1q_u8(dst_ptr, v);
+    src_ptr += 16;
+    dst_ptr += 16;
+  }
+#endif
+  qoir_private_decode_unlossify_scalar(dst_ptr, src_ptr, len, lossiness,
+                                       swap_rb);
+}
+
+// qoir_private_unlossify_swizzle_func is like qoir_private_swizzle_func but
+// also unlossifies (see qoir_private_decode_unlossify) the pixels, in a single
+// pass. Only those swizzles that commute with unlossifying (ones that only
+// move whole bytes) have such a variant.
+typedef void (*qoir_private_unlossify_swizzle_func)(  //
+    uint8_t* QOIR_RESTRICT dst_ptr,                   //
+    size_t dst_stride_in_bytes,                       //
+    const uint8_t* QOIR_RESTRICT src_ptr,             //
+    size_t src_stride_in_bytes,                       //
+    size_t width_in_pixels,                           //
+    size_t height_in_pixels,                          //
+    uint32_t lossiness);
+
+static void                                //
+qoir_private_unlossify_swizzle__copy_4(    //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_stride_in_bytes,            //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_stride_in_bytes,            //
+    size_t width_in_pixels,                //
+    size_t height_in_pixels,               //
+    uint32_t lossiness) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    qoir_private_decode_unlossify(dst_ptr, src_ptr, 4 * width_in_pixels,
+                                  lossiness, false);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+static void                                  //
+qoir_private_unlossify_swizzle__bgra__rgba(  //
+    uint8_t* QOIR_RESTRICT dst_ptr,          //
+    size_t dst_stride_in_bytes,              //
+    const uint8_t* QOIR_RESTRICT src_ptr,    //
+    size_t src_stride_in_bytes,              //
+    size_t width_in_pixels,                  //
+    size_t height_in_pixels,                 //
+    uint32_t lossiness) {
+  for (; height_in_pixels > 0; height_in_pixels--) {
+    qoir_private_decode_unlossify(dst_ptr, src_ptr, 4 * width_in_pixels,
+                                  lossiness, true);
+    dst_ptr += dst_stride_in_bytes;
+    src_ptr += src_stride_in_bytes;
+  }
+}
+
+// qoir_private_choose_unlossify_swizzle_func returns the single pass
+// equivalent of unlossifying and then calling swizzle_func, or NULL if there
+// isn't one.
+static qoir_private_unlossify_swizzle_func   //
+qoir_private_choose_unlossify_swizzle_func(  //
+    qoir_private_swizzle_func swizzle_func) {
+  if (swizzle_func == qoir_private_swizzle__copy_4) {
+    return qoir_private_unlossify_swizzle__copy_4;
+  } else if (swizzle_func == qoir_private_swizzle__bgra__rgba) {
+    return qoir_private_unlossify_swizzle__bgra__rgba;
+  }
+  return NULL;
+}
+
+// qoir_private_decode_placement holds the qoir_decode_options' clipping
+// rectangles, offsets and downscaling, after defaults and range checks have
+// been applied.
+typedef struct qoir_private_decode_placement_struct {
+  qoir_rectangle dst_clip_rectangle;
+  qoir_rectangle src_clip_rectangle;
+  int32_t offset_x;
+  int32_t offset_y;
+  uint32_t downscale_shift;
+} qoir_private_decode_placement;
+
+// qoir_private_decode_state holds everything (other than the scratch space)
+// needed to decode any one of the tiles in a QPIX chunk's payload.
+typedef struct qoir_private_decode_state_struct {
+  qoir_pixel_buffer dst_pixbuf;
+  qoir_private_swizzle_func swizzle_func;
+  qoir_private_unlossify_swizzle_func unlossify_swizzle_func;
+  int32_t offset_x;
+  int32_t offset_y;
+  uint32_t downscale_shift;
+  uint32_t lossiness;
+  qoir_pixel_format src_pixfmt;
+  uint32_t src_width_in_pixels;
+  uint32_t src_height_in_pixels;
+  const uint8_t* src_ptr;
+  size_t src_len;
+
+  // The tile index is either a TIDX chunk's payload or an equivalent,
+  // synthesized by qoir_private_make_tile_index. It can be NULL, but only when
+  // not using the qoir_private_decode_tile_range function.
+  const uint8_t* tile_index_ptr;
+
+  // clip is the intersection of the source image's bounds and the clipping
+  // rectangles, in the (downscaled, if downscale_shift is non-zero) source
+  // coordinate space. The tiles that intersect it
+  // form a rectangle (measured in tiles, not pixels) whose top-left tile is
+  // at (clip_tx0, clip_ty0) and whose width and height are clip_tw and
+  // clip_th. Those four fields are zero if the clip is empty.
+  qoir_rectangle clip;
+  uint32_t clip_tx0;
+  uint32_t clip_ty0;
+  uint32_t clip_tw;
+  uint32_t clip_th;
+
+  // Tiles' stats are gathered if either of stats (the qoir_decode_options'
+  // field) or tile_func is non-NULL.
+  qoir_stats* stats;
+  qoir_tile_func tile_func;
+  void* tile_func_context;
+} qoir_private_decode_state;
+
+// qoir_private_decode_state__tile_clip returns the part of the state's clip
+// covered by the tw by th tile whose top-left corner is at (tx, ty). The tile
+// position and dimensions are in the (full size) source image's pixels. The
+// returned rectangle is in the state's (possibly downscaled) coordinates.
+static inline qoir_rectangle                 //
+qoir_private_decode_state__tile_clip(        //
+    const qoir_private_decode_state* state,  //
+    size_t tx,                               //
+    size_t ty,                               //
+    size_t tw,                               //
+    size_t th) {
+  uint32_t s = state->downscale_shift;
+  size_t m = ((size_t)1 << s) - 1;
+  return qoir_rectangle__intersect(
+      qoir_make_rectangle((int32_t)(tx >> s), (int32_t)(ty >> s),
+                          (int32_t)((tx + tw + m) >> s),
+                          (int32_t)((ty + th + m) >> s)),
+      state->clip);
+}
+
+// qoir_private_decode_tile_constant fills the clip_width by clip_height
+// destination pixels at dst_ptr with the Constant tile format's 4 byte BGRA
+// value at src_ptr, after unlossifying and swizzling it.
+static void                                  //
+qoir_private_decode_tile_constant(           //
+    const qoir_private_decode_state* state,  //
+    uint8_t* dst_ptr,                        //
+    const uint8_t* src_ptr,                  //
+    size_t clip_width,                       //
+    size_t clip_height) {
+  uint8_t bgra[4];
+  if (state->lossiness) {
+    qoir_private_decode_unlossify(bgra, src_ptr, 4, state->lossiness, false);
+  } else {
+    memcpy(bgra, src_ptr, 4);
+  }
+  uint8_t pixel[4];
+  (*state->swizzle_func)(pixel, 4, bgra, 4, 1, 1);
+  size_t num_dst_channels =
+      qoir_pixel_format__bytes_per_pixel(state->dst_pixbuf.pixcfg.pixfmt);
+  size_t row_len = num_dst_channels * clip_width;
+
+  // Fill the first row, doubling the filled part each time, and then copy
+  // that row to the others.
+  memcpy(dst_ptr, pixel, num_dst_channels);
+  for (size_t n = num_dst_channels; n < row_len;) {
+    size_t m = ((row_len - n) < n) ? (row_len - n) : n;
+    memcpy(dst_ptr + n, dst_ptr, m);
+    n += m;
+  }
+  for (size_t y = 1; y < clip_height; y++) {
+    memcpy(dst_ptr + (y * state->dst_pixbuf.stride_in_bytes), dst_ptr,
+           row_len);
+  }
+}
+
+// The Huffman-Ops tile format's payload starts with a header: 256 code
+// lengths (4 bits each, low nibble first), the u16le number of ops bytes and
+// the u16le lengths of the first 3 of its 4 streams. The m'th ops byte is in
+// stream (m & 3). Each stream is an LSB-first bit stream of canonical
+// Huffman codes, being at most QOIR_HUFFMAN_MAX_CODE_LEN bits long.
+#define QOIR_HUFFMAN_HEADER_LEN 136
+#define QOIR_HUFFMAN_MAX_CODE_LEN 12
+
+// qoir_private_huffman_reverse_code returns the code's n bits in reverse
+// order, as codes are written in LSB-first order but assigned MSB-first.
+static inline uint32_t              //
+qoir_private_huffman_reverse_code(  //
+    uint32_t code,                  //
+    uint32_t n) {
+  uint32_t r = 0;
+  for (; n > 0; n--) {
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+// qoir_private_huffman_reader reads one stream of a Huffman-Ops tile. The low
+// num_bits of bits are unread. Any higher bits are the start of the byte at
+// ptr, the next byte to load. The stream's bytes end at end but loading can
+// read (and ignore) up to 8 bytes beyond that.
+typedef struct qoir_private_huffman_reader_struct {
+  uint64_t bits;
+  uint32_t num_bits;
+  const uint8_t* ptr;
+  const uint8_t* start;
+  const uint8_t* end;
+} qoir_private_huffman_reader;
+
+static inline void                    //
+qoir_private_huffman_reader__refill(  //
+    qoir_private_huffman_reader* r) {
+  if (r->ptr <= r->end) {
+    r->bits |= qoir_private_peek_u64le(r->ptr) << r->num_bits;
+    r->ptr += (63 - r->num_bits) >> 3;
+    r->num_bits |= 56;
+  }
+}
+
+// qoir_private_huffman_reader__decode decodes one symbol, returning false if
+// it is invalid or if it used bits that weren't loaded.
+static inline bool                        //
+qoir_private_huffman_reader__decode(      //
+    qoir_private_huffman_reader* r,       //
+    const uint16_t* QOIR_RESTRICT table,  //
+    uint8_t* QOIR_RESTRICT dst_ptr) {
+  uint32_t entry = table[r->bits & ((1u << QOIR_HUFFMAN_MAX_CODE_LEN) - 1)];
+  uint32_t n = entry >> 8;
+  if ((n == 0) || (n > r->num_bits)) {
+    return false;
+  }
+  *dst_ptr = (uint8_t)entry;
+  r->bits >>= n;
+  r->num_bits -= n;
+  return true;
+}
+
+// qoir_private_decode_tile_huffman decodes the Huffman-Ops tile format's
+// payload (src_ptr, src_len) to decbuf's ops, returning the number of ops
+// bytes. Callers should ensure that (src_len + 8) bytes are readable.
+static qoir_size_result            //
+qoir_private_decode_tile_huffman(  //
+    qoir_decode_buffer* decbuf,    //
+    const uint8_t* src_ptr,        //
+    size_t src_len) {
+  qoir_size_result result = {0};
+  if (src_len < QOIR_HUFFMAN_HEADER_LEN) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+
+  // Build the decoding table from the canonical code lengths. Unused table
+  // elements (for incomplete codes) stay zero, which is invalid.
+  uint32_t counts[16] = {0};
+  for (uint32_t i = 0; i < 128; i++) {
+    counts[src_ptr[i] & 0x0F]++;
+    counts[src_ptr[i] >> 4]++;
+  }
+  uint32_t next_codes[QOIR_HUFFMAN_MAX_CODE_LEN + 1] = {0};
+  uint32_t code = 0;
+  uint32_t kraft = 0;
+  for (uint32_t n = 1; n <= QOIR_HUFFMAN_MAX_CODE_LEN; n++) {
+    code = (code + ((n > 1) ? counts[n - 1] : 0)) << 1;
+    next_codes[n] = code;
+    kraft += counts[n] << (QOIR_HUFFMAN_MAX_CODE_LEN - n);
+  }
+  if (kraft > (1u << QOIR_HUFFMAN_MAX_CODE_LEN)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  uint16_t* table = decbuf->private_impl.huffman_table;
+  memset(table, 0, sizeof(decbuf->private_impl.huffman_table));
+  for (uint32_t symbol = 0; symbol < 256; symbol++) {
+    uint32_t n = (src_ptr[symbol >> 1] >> (4 * (symbol & 1))) & 0x0F;
+    if (n == 0) {
+      continue;
+    } else if (n > QOIR_HUFFMAN_MAX_CODE_LEN) {
+      result.status_message = qoir_status_message__error_invalid_data;
+      return result;
+    }
+    uint16_t entry = (uint16_t)((n << 8) | symbol);
+    for (uint32_t i = qoir_private_huffman_reverse_code(next_codes[n]++, n);
+         i < (1u << QOIR_HUFFMAN_MAX_CODE_LEN); i += 1u << n) {
+      table[i] = entry;
+    }
+  }
+
+  // Set up the 4 streams' readers.
+  size_t ops_len = qoir_private_peek_u16le(src_ptr + 128);
+  if (ops_len > sizeof(decbuf->private_impl.ops)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  qoir_private_huffman_reader readers[4];
+  const uint8_t* p = src_ptr + QOIR_HUFFMAN_HEADER_LEN;
+  size_t remaining = src_len - QOIR_HUFFMAN_HEADER_LEN;
+  for (int j = 0; j < 4; j++) {
+    size_t n = (j < 3) ? qoir_private_peek_u16le(src_ptr + 130 + (2 * j))
+                       : remaining;
+    if (n > remaining) {
+      result.status_message = qoir_status_message__error_invalid_data;
+      return result;
+    }
+    readers[j].bits = 0;
+    readers[j].num_bits = 0;
+    readers[j].ptr = p;
+    readers[j].start = p;
+    readers[j].end = p + n;
+    p += n;
+    remaining -= n;
+  }
+
+  // Decode 16 symbols (4 from each stream) at a time and then the rest. A
+  // refill loads at least 56 bits, enough for 4 codes.
+  uint8_t* dp = decbuf->private_impl.ops;
+  size_t m = 0;
+  bool ok = true;
+  for (; ok && ((m + 16) <= ops_len); m += 16) {
+    for (int j = 0; j < 4; j++) {
+      qoir_private_huffman_reader__refill(&readers[j]);
+    }
+    for (int i = 0; i < 16; i += 4) {
+      for (int j = 0; j < 4; j++) {
+        ok &= qoir_private_huffman_reader__decode(&readers[j], table,
+                                                  dp + m + i + j);
+      }
+    }
+  }
+  for (; ok && (m < ops_len); m++) {
+    qoir_private_huffman_reader__refill(&readers[m & 3]);
+    ok = qoir_private_huffman_reader__decode(&readers[m & 3], table, dp + m);
+  }
+  for (int j = 0; ok && (j < 4); j++) {
+    ok = (((size_t)(readers[j].ptr - readers[j].start) * 8) -
+          readers[j].num_bits) <=
+         ((size_t)(readers[j].end - readers[j].start) * 8);
+  }
+  if (!ok) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  result.value = ops_len;
+  return result;
+}
+
+// qoir_private_decode_tile decodes the tile whose 4 byte prefix is given and
+// whose encoded bytes start at src_ptr, writing the src_clip_rect part of it
+// to the state's dst_pixbuf. Callers should ensure that at least
+// ((prefix & 0xFFFFFF) + 8) bytes are readable from src_ptr. Reference: §
+//
+// If tile_stats is non-NULL then it also sets tile_stats' fields other than
+// the tile's position, size and duration. Those fields must be zero on entry.
+static const char*                           //
+qoir_private_decode_tile(                    //
+    qoir_decode_buffer* decbuf,              //
+    const qoir_private_decode_state* state,  //
+    qoir_rectangle src_clip_rect,            //
+    size_t tw,                               //
+    size_t th,                               //
+    uint32_t prefix,                         //
+    const uint8_t* src_ptr,                  //
+    qoir_tile_stats* tile_stats) {
+  qoir_pixel_buffer dst_pixbuf = state->dst_pixbuf;
+  qoir_private_swizzle_func swizzle_func = state->swizzle_func;
+  uint32_t downscale_shift = state->downscale_shift;
+  uint32_t lossiness = state->lossiness;
+  size_t tile_len = prefix & 0xFFFFFF;
+
+  // The Back-Reference tile format decodes the earlier tile that it refers to
+  // (by its byte offset in the QPIX payload) as if it were this tile. The
+  // incremental decoder, whose state has no src_ptr, can't look back.
+  if ((prefix >> 24) == 5) {
+    if (!state->src_ptr) {
+      return qoir_status_message__error_unsupported_tile_format;
+    } else if (tile_len != 8) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint64_t tile_pos = (uint64_t)(src_ptr - state->src_ptr) - 4;
+    uint64_t ref_pos = qoir_private_peek_u64le(src_ptr);
+    if ((tile_pos < 4) || (ref_pos > (tile_pos - 4))) {
+      return qoir_status_message__error_invalid_data;
+    }
+    prefix = qoir_private_peek_u32le(state->src_ptr + ref_pos);
+    tile_len = prefix & 0xFFFFFF;
+    if (((prefix >> 24) == 5) || (tile_len > (tile_pos - ref_pos - 4)) ||
+        (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
+      return qoir_status_message__error_invalid_data;
+    }
+    src_ptr = state->src_ptr + ref_pos + 4;
+    if (tile_stats) {
+      tile_stats->is_back_reference = true;
+    }
+  }
+  if (tile_stats) {
+    tile_stats->tile_format = prefix >> 24;
+    tile_stats->compressed_len = tile_len;
+    tile_stats->uncompressed_len = tile_len;
+  }
+
+  size_t num_dst_channels =
+      qoir_pixel_format__bytes_per_pixel(dst_pixbuf.pixcfg.pixfmt);
+  uint8_t* dp =
+      dst_pixbuf.data +
+      ((src_clip_rect.y0 + state->offset_y) * dst_pixbuf.stride_in_bytes) +
+      ((src_clip_rect.x0 + state->offset_x) * num_dst_channels);
+
+  // The Constant tile format (unless downscaling) fills the destination.
+  if (((prefix >> 24) == 4) && (downscale_shift == 0)) {
+    if (tile_len != 4) {
+      return qoir_status_message__error_invalid_data;
+    }
+    qoir_private_decode_tile_constant(state, dp, src_ptr,
+                                      qoir_rectangle__width(src_clip_rect),
+                                      qoir_rectangle__height(src_clip_rect));
+    return NULL;
+  }
+
+  // If the whole tile is visible and needs no conversion (other than a
+  // copy), decode the Ops (and, when contiguous, LZ4-Literals) tile formats
+  // straight to dst_pixbuf instead of to decbuf and then copying. The
+  // Literals tile format is always just copied from src_ptr.
+  if ((lossiness == 0) && (downscale_shift == 0) &&
+      (swizzle_func == qoir_private_swizzle__copy_4) &&
+      (qoir_rectangle__width(src_clip_rect) == tw) &&
+      (qoir_rectangle__height(src_clip_rect) == th)) {
+    switch (prefix >> 24) {
+      case 1:  // Ops tile format.
+        if (tile_stats) {
+          qoir_private_tile_stats__count_ops(tile_stats, src_ptr, tile_len);
+        }
+        return qoir_private_decode_tile_ops_to_rows(
+            dp, dst_pixbuf.stride_in_bytes, tw, th,  //
+            src_ptr, tile_len + 8);                  // See § for +8.
+      case 2: {  // LZ4-Literals tile format.
+        if (dst_pixbuf.stride_in_bytes != (4 * tw)) {
+          break;
+        }
+        qoir_size_result r =
+            qoir_lz4_block_decode(dp, 4 * tw * th, src_ptr, tile_len);
+        if (r.status_message || (r.value != (4 * tw * th))) {
+          return qoir_status_message__error_invalid_data;
+        } else if (tile_stats) {
+          tile_stats->uncompressed_len = r.value;
+        }
+        return NULL;
+      }
+      case 3: {  // LZ4-Ops tile format.
+        qoir_size_result r = qoir_lz4_block_decode(
+            decbuf->private_impl.ops, sizeof(decbuf->private_impl.ops), src_ptr,
+            tile_len);
+        if (r.status_message) {
+          return qoir_status_message__error_invalid_data;
+        } else if (tile_stats) {
+          qoir_private_tile_stats__count_ops(
+              tile_stats, decbuf->private_impl.ops, r.value);
+        }
+        return qoir_private_decode_tile_ops_to_rows(
+            dp, dst_pixbuf.stride_in_bytes, tw, th,  //
+            decbuf->private_impl.ops, r.value + 8);  // See § for +8.
+      }
+      case 6: {  // Huffman-Ops tile format.
+        qoir_size_result r =
+            qoir_private_decode_tile_huffman(decbuf, src_ptr, tile_len);
+        if (r.status_message) {
+          return r.status_message;
+        } else if (tile_stats) {
+          qoir_private_tile_stats__count_ops(
+              tile_stats, decbuf->private_impl.ops, r.value);
+        }
+        return qoir_private_decode_tile_ops_to_rows(
+            dp, dst_pixbuf.stride_in_bytes, tw, th,  //
+            decbuf->private_impl.ops, r.value + 8);  // See § for +8.
+      }
+    }
+  }
+
+  const uint8_t* literals = NULL;
+  switch (prefix >> 24) {
+    case 0: {  // Literals tile format.
+      if (tile_len != (4 * tw * th)) {
+        return qoir_status_message__error_invalid_data;
+      }
+      literals = src_ptr;
+      break;
+    }
+    case 1: {  // Ops tile format.
+      if (tile_stats) {
+        qoir_private_tile_stats__count_ops(tile_stats, src_ptr, tile_len);
+      }
+      qoir_size_result r = qoir_private_decode_tile_ops(
+          decbuf->private_impl.literals,              //
+          QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
+          src_ptr, tile_len + 8);                     // See § for +8.
+      if (r.status_message) {
+        return r.status_message;
+      } else if (r.value != (QOIR_LITERALS_PRE_PADDING + (4 * tw * th))) {
+        return qoir_status_message__error_invalid_data;
+      }
+      literals = decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+      break;
+    }
+    case 2: {  // LZ4-Literals tile format.
+      qoir_size_result r = qoir_lz4_block_decode(
+          decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
+          sizeof(decbuf->private_impl.literals) - QOIR_LITERALS_PRE_PADDING,
+          src_ptr, tile_len);
+      if (r.status_message) {
+        return qoir_status_message__error_invalid_data;
+      } else if (r.value != (4 * tw * th)) {
+        return qoir_status_message__error_invalid_data;
+      } else if (tile_stats) {
+        tile_stats->uncompressed_len = r.value;
+      }
+      literals = decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+      break;
+    }
+    case 3:    // LZ4-Ops tile format.
+    case 6: {  // Huffman-Ops tile format.
+      qoir_size_result r0 =
+          ((prefix >> 24) == 3)
+              ? qoir_lz4_block_decode(decbuf->private_impl.ops,
+                                      sizeof(decbuf->private_impl.ops),
+                                      src_ptr, tile_len)
+              : qoir_private_decode_tile_huffman(decbuf, src_ptr, tile_len);
+      if (r0.status_message) {
+        return qoir_status_message__error_invalid_data;
+      } else if (tile_stats) {
+        qoir_private_tile_stats__count_ops(
+            tile_stats, decbuf->private_impl.ops, r0.value);
+      }
+      qoir_size_result r1 = qoir_private_decode_tile_ops(
+          decbuf->private_impl.literals,              //
+          QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
+          decbuf->private_impl.ops, r0.value + 8);    // See § for +8.
+      if (r1.status_message) {
+        return r1.status_message;
+      } else if (r1.value != (QOIR_LITERALS_PRE_PADDING + (4 * tw * th))) {
+        return qoir_status_message__error_invalid_data;
+      }
+      literals = decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+      break;
+    }
+    case 4: {  // Constant tile format.
+      if (tile_len != 4) {
+        return qoir_status_message__error_invalid_data;
+      }
+      uint8_t* p = decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+      for (size_t i = 0; i < (tw * th); i++) {
+        memcpy(p + (4 * i), src_ptr, 4);
+      }
+      literals = p;
+      break;
+    }
+    default:
+      return qoir_status_message__error_unsupported_tile_format;
+  }
+
+  size_t clip_width = qoir_rectangle__width(src_clip_rect);
+  size_t clip_height = qoir_rectangle__height(src_clip_rect);
+  if (downscale_shift) {
+    // lx0 and ly0 are the clip's top-left corner, relative to the tile, in
+    // downscaled pixels. fx0, fy0, fw and fh are the full size pixels that
+    // the clip's destination pixels are averaged from.
+    size_t tile_mask = QOIR_TILE_MASK >> downscale_shift;
+    size_t lx0 = src_clip_rect.x0 & tile_mask;
+    size_t ly0 = src_clip_rect.y0 & tile_mask;
+    size_t fx0 = lx0 << downscale_shift;
+    size_t fy0 = ly0 << downscale_shift;
+    size_t fx1 = (lx0 + clip_width) << downscale_shift;
+    size_t fy1 = (ly0 + clip_height) << downscale_shift;
+    size_t fw = ((fx1 < tw) ? fx1 : tw) - fx0;
+    size_t fh = ((fy1 < th) ? fy1 : th) - fy0;
+    size_t full_offset = (fy0 * 4 * tw) + (fx0 * 4);
+    if (lossiness) {
+      for (size_t y = 0; y < fh; y++) {
+        size_t offset = full_offset + (y * 4 * tw);
+        qoir_private_decode_unlossify(decbuf->private_impl.ops + offset,
+                                      literals + offset, 4 * fw, lossiness,
+                                      false);
+      }
+      literals = decbuf->private_impl.ops;
+    }
+    // Downscale (to decbuf's ops, whose stride is now that of a downscaled
+    // tile) and then swizzle from there.
+    size_t tws = qoir_private_downscaled_dimension((uint32_t)tw,  //
+                                                   downscale_shift);
+    uint8_t* downscaled =
+        decbuf->private_impl.ops + (ly0 * 4 * tws) + (lx0 * 4);
+    qoir_private_downscale(
+        downscaled, 4 * tws, literals + full_offset, 4 * tw, fw, fh,
+        downscale_shift,
+        state->src_pixfmt == QOIR_PIXEL_FORMAT__BGRA_NONPREMUL);
+    (*swizzle_func)(dp, dst_pixbuf.stride_in_bytes,  //
+                    downscaled, 4 * tws,             //
+                    clip_width, clip_height);
+    return NULL;
+  }
+
+  size_t clip_offset = ((src_clip_rect.y0 & QOIR_TILE_MASK) * 4 * tw) +
+                       ((src_clip_rect.x0 & QOIR_TILE_MASK) * 4);
+  if (lossiness) {
+    qoir_private_unlossify_swizzle_func unlossify_swizzle_func =
+        state->unlossify_swizzle_func;
+    if (unlossify_swizzle_func) {
+      (*unlossify_swizzle_func)(dp, dst_pixbuf.stride_in_bytes,
+                                literals + clip_offset, 4 * tw,  //
+                                clip_width, clip_height, lossiness);
+      return NULL;
+    }
+    // Unlossify (to decbuf's ops, with the same layout as literals) only the
+    // part of the tile that swizzle_func will read.
+    for (size_t y = 0; y < clip_height; y++) {
+      size_t offset = clip_offset + (y * 4 * tw);
+      qoir_private_decode_unlossify(decbuf->private_impl.ops + offset,
+                                    literals + offset, 4 * clip_width,
+                                    lossiness, false);
+    }
+    literals = decbuf->private_impl.ops;
+  }
+
+  (*swizzle_func)(dp, dst_pixbuf.stride_in_bytes,  //
+                  literals + clip_offset, 4 * tw,  //
+                  clip_width, clip_height);
+  return NULL;
+}
+
+// qoir_private_decode_tile_with_stats is like qoir_private_decode_tile but,
+// if the state asks for them, it also gathers the tile's stats, adding them to
+// the decbuf's and passing them to the state's tile_func. The tile's top-left
+// offset, tx and ty, is measured in pixels.
+static const char*                           //
+qoir_private_decode_tile_with_stats(         //
+    qoir_decode_buffer* decbuf,              //
+    const qoir_private_decode_state* state,  //
+    qoir_rectangle src_clip_rect,            //
+    size_t tx,                               //
+    size_t ty,                               //
+    size_t tw,                               //
+    size_t th,                               //
+    uint32_t prefix,                         //
+    const uint8_t* src_ptr) {
+  if (!state->stats && !state->tile_func) {
+    return qoir_private_decode_tile(decbuf, state, src_clip_rect, tw, th,
+                                    prefix, src_ptr, NULL);
+  }
+  qoir_tile_stats tile_stats = {0};
+  tile_stats.tile_x = (uint32_t)(tx >> QOIR_TILE_SHIFT);
+  tile_stats.tile_y = (uint32_t)(ty >> QOIR_TILE_SHIFT);
+  tile_stats.width_in_pixels = (uint32_t)tw;
+  tile_stats.height_in_pixels = (uint32_t)th;
+  uint64_t t0 = state->tile_func ? qoir_private_monotonic_nanos() : 0;
+  const char* status_message = qoir_private_decode_tile(
+      decbuf, state, src_clip_rect, tw, th, prefix, src_ptr, &tile_stats);
+  if (status_message) {
+    return status_message;
+  }
+  qoir_private_stats__add_tile(&decbuf->private_impl.stats, &tile_stats);
+  if (state->tile_func) {
+    tile_stats.duration_in_nanoseconds = qoir_private_monotonic_nanos() - t0;
+    (*state->tile_func)(state->tile_func_context, &tile_stats);
+  }
+  return NULL;
+}
+
+// qoir_private_decode_init_state sets the state's fields other than src_ptr,
+// src_len, tile_index_ptr and the stats related ones.
+static const char*                                   //
+qoir_private_decode_init_state(                      //
+    qoir_private_decode_state* state,                //
+    qoir_pixel_buffer dst_pixbuf,                    //
+    const qoir_private_decode_placement* placement,  //
+    qoir_pixel_format src_pixfmt,                    //
+    uint32_t src_width_in_pixels,                    //
+    uint32_t src_height_in_pixels,                   //
+    uint32_t lossiness) {
+  state->dst_pixbuf = dst_pixbuf;
+  state->swizzle_func = qoir_private_choose_decode_swizzle_func(
+      dst_pixbuf.pixcfg.pixfmt, src_pixfmt);
+  if (!state->swizzle_func) {
+    return qoir_status_message__error_unsupported_pixfmt;
+  }
+  state->unlossify_swizzle_func =
+      lossiness
+          ? qoir_private_choose_unlossify_swizzle_func(state->swizzle_func)
+          : NULL;
+  state->swizzle_func = qoir_private_dispatch_swizzle_func(state->swizzle_func);
+  state->offset_x = placement->offset_x;
+  state->offset_y = placement->offset_y;
+  state->downscale_shift = placement->downscale_shift;
+  state->lossiness = lossiness;
+  state->src_pixfmt = src_pixfmt;
+  state->src_width_in_pixels = src_width_in_pixels;
+  state->src_height_in_pixels = src_height_in_pixels;
+
+  qoir_rectangle dst_clip_rect =
+      qoir_make_rectangle(0, 0, (int32_t)dst_pixbuf.pixcfg.width_in_pixels,
+                          (int32_t)dst_pixbuf.pixcfg.height_in_pixels);
+  dst_clip_rect =
+      qoir_rectangle__intersect(dst_clip_rect, placement->dst_clip_rectangle);
+  qoir_rectangle dst_clip_rect_in_src_space;
+  dst_clip_rect_in_src_space.x0 = dst_clip_rect.x0 - placement->offset_x;
+  dst_clip_rect_in_src_space.y0 = dst_clip_rect.y0 - placement->offset_y;
+  dst_clip_rect_in_src_space.x1 = dst_clip_rect.x1 - placement->offset_x;
+  dst_clip_rect_in_src_space.y1 = dst_clip_rect.y1 - placement->offset_y;
+  state->clip = qoir_make_rectangle(
+      0, 0,
+      (int32_t)qoir_private_downscaled_dimension(src_width_in_pixels,
+                                                 state->downscale_shift),
+      (int32_t)qoir_private_downscaled_dimension(src_height_in_pixels,
+                                                 state->downscale_shift));
+  state->clip =
+      qoir_rectangle__intersect(state->clip, placement->src_clip_rectangle);
+  state->clip =
+      qoir_rectangle__intersect(state->clip, dst_clip_rect_in_src_space);
+
+  if (qoir_rectangle__is_empty(state->clip)) {
+    state->clip_tx0 = 0;
+    state->clip_ty0 = 0;
+    state->clip_tw = 0;
+    state->clip_th = 0;
+  } else {
+    // A tile is (QOIR_TILE_SIZE >> downscale_shift) pixels wide and high in
+    // the clip's coordinate space.
+    uint32_t shift = QOIR_TILE_SHIFT - state->downscale_shift;
+    uint32_t mask = (1u << shift) - 1;
+    state->clip_tx0 = (uint32_t)state->clip.x0 >> shift;
+    state->clip_ty0 = (uint32_t)state->clip.y0 >> shift;
+    state->clip_tw =
+        (((uint32_t)state->clip.x1 + mask) >> shift) - state->clip_tx0;
+    state->clip_th =
+        (((uint32_t)state->clip.y1 + mask) >> shift) - state->clip_ty0;
+  }
+  return NULL;
+}
+
+// qoir_private_decode_buffer__init_pre_padding sets the decbuf's literals'
+// pre-padding (the pixel before the first pixel) to opaque black.
+static void                                    //
+qoir_private_decode_buffer__init_pre_padding(  //
+    qoir_decode_buffer* decbuf) {
+  uint8_t* literals_pre_padding = decbuf->private_impl.literals;
+  for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
+    literals_pre_padding[i + 0] = 0x00;
+    literals_pre_padding[i + 1] = 0x00;
+    literals_pre_padding[i + 2] = 0x00;
+    literals_pre_padding[i + 3] = 0xFF;
+  }
+}
+
+// qoir_private_decode_tiles_sequentially walks (and validates) every tile's
+// prefix, decoding those tiles that intersect the state's clip. Unlike
+// qoir_private_decode_tile_range, it does not need a tile index.
+static const char*                           //
+qoir_private_decode_tiles_sequentially(      //
+    const qoir_private_decode_state* state,  //
+    qoir_decode_buffer* decbuf) {
+  qoir_private_decode_buffer__init_pre_padding(decbuf);
+  memset(&decbuf->private_impl.stats, 0, sizeof(decbuf->private_impl.stats));
+
+  const uint8_t* src_ptr = state->src_ptr;
+  size_t src_len = state->src_len;
+  size_t height_in_tiles =
+      qoir_calculate_number_of_tiles_1d(state->src_height_in_pixels);
+  size_t width_in_tiles =
+      qoir_calculate_number_of_tiles_1d(state->src_width_in_pixels);
+  if ((height_in_tiles == 0) || (width_in_tiles == 0)) {
+    return (src_len != 8) ? qoir_status_message__error_invalid_data : NULL;
+  }
+  size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
+  size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
+
+  // ty, tx, tw and th are the tile's top-left offset, width and height, all
+  // measured in pixels.
+  for (size_t ty = 0; ty <= ty1; ty += QOIR_TILE_SIZE) {
+    for (size_t tx = 0; tx <= tx1; tx += QOIR_TILE_SIZE) {
+      size_t tw =
+          qoir_private_tile_dimension(tx < tx1, state->src_width_in_pixels);
+      size_t th =
+          qoir_private_tile_dimension(ty < ty1, state->src_height_in_pixels);
+      qoir_rectangle src_clip_rect =
+          qoir_private_decode_state__tile_clip(state, tx, ty, tw, th);
+
+      if (src_len < 4) {
+        return qoir_status_message__error_invalid_data;
+      }
+      uint32_t prefix = qoir_private_peek_u32le(src_ptr);
+      src_ptr += 4;
+      src_len -= 4;
+      size_t tile_len = prefix & 0xFFFFFF;
+      if ((src_len < (tile_len + 8)) ||  //
+          (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
+        return qoir_status_message__error_invalid_data;
+      }
+
+      if (!qoir_rectangle__is_empty(src_clip_rect)) {
+        const char* status_message = qoir_private_decode_tile_with_stats(
+            decbuf, state, src_clip_rect, tx, ty, tw, th, prefix, src_ptr);
+        if (status_message) {
+          return status_message;
+        }
+      }
+
+      src_ptr += tile_len;
+      src_len -= tile_len;
+    }
+  }
+
+  if (src_len != 8) {
+    return qoir_status_message__error_invalid_data;
+  }
+  return NULL;
+}
+
+// qoir_private_decode_tile_range decodes a range of the tiles that intersect
+// the state's clip. The begin (inclusive) and end (exclusive) range bounds
+// are tile counts, in the natural order but only counting the clip_tw wide
+// rectangle of tiles.
+static const char*                           //
+qoir_private_decode_tile_range(              //
+    const qoir_private_decode_state* state,  //
+    qoir_decode_buffer* decbuf,              //
+    uint64_t begin,                          //
+    uint64_t end) {
+  qoir_private_decode_buffer__init_pre_padding(decbuf);
+  memset(&decbuf->private_impl.stats, 0, sizeof(decbuf->private_impl.stats));
+
+  uint64_t height_in_tiles =
+      qoir_calculate_number_of_tiles_1d(state->src_height_in_pixels);
+  uint64_t width_in_tiles =
+      qoir_calculate_number_of_tiles_1d(state->src_width_in_pixels);
+  uint64_t number_of_tiles = width_in_tiles * height_in_tiles;
+  size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
+  size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
+  uint64_t payload_len = state->src_len - 8;
+
+  for (uint64_t k = begin; k < end; k++) {
+    uint64_t ti = state->clip_tx0 + (k % state->clip_tw);
+    uint64_t tj = state->clip_ty0 + (k / state->clip_tw);
+
+    // ty, tx, tw and th are the tile's top-left offset, width and height, all
+    // measured in pixels.
+    size_t ty = (size_t)tj << QOIR_TILE_SHIFT;
+    size_t tx = (size_t)ti << QOIR_TILE_SHIFT;
+    size_t tw =
+        qoir_private_tile_dimension(tx < tx1, state->src_width_in_pixels);
+    size_t th =
+        qoir_private_tile_dimension(ty < ty1, state->src_height_in_pixels);
+    qoir_rectangle src_clip_rect =
+        qoir_private_decode_state__tile_clip(state, tx, ty, tw, th);
+
+    uint64_t i = (tj * width_in_tiles) + ti;
+    uint64_t tile_pos =
+        qoir_private_peek_u64le(state->tile_index_ptr + (8 * i));
+    uint64_t tile_end =
+        ((i + 1) < number_of_tiles)
+            ? qoir_private_peek_u64le(state->tile_index_ptr + (8 * (i + 1)))
+            : payload_len;
+    if ((tile_end > payload_len) || (tile_pos > tile_end) ||
+        ((tile_end - tile_pos) < 4)) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint32_t prefix = qoir_private_peek_u32le(state->src_ptr + tile_pos);
+    size_t tile_len = prefix & 0xFFFFFF;
+    if ((tile_len != (tile_end - tile_pos - 4)) ||
+        (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
+      return qoir_status_message__error_invalid_data;
+    }
+
+    const char* status_message = qoir_private_decode_tile_with_stats(
+        decbuf, state, src_clip_rect, tx, ty, tw, th, prefix,
+        state->src_ptr + tile_pos + 4);
+    if (status_message) {
+      return status_message;
+    }
+  }
+  return NULL;
+}
+
+// qoir_private_make_tile_index writes (8 * number_of_tiles) bytes to dst_ptr,
+// in the same format as a TIDX chunk's payload, by walking every tile's
+// prefix. Like qoir_private_decode_qpix_payload, src_len includes the 8 bytes
+// of slack. Reference: §
+static const char*             //
+qoir_private_make_tile_index(  //
+    uint8_t* dst_ptr,          //
+    uint64_t number_of_tiles,  //
+    const uint8_t* src_ptr,    //
+    size_t src_len) {
+  uint64_t payload_len = src_len - 8;
+  uint64_t tile_pos = 0;
+  for (uint64_t i = 0; i < number_of_tiles; i++) {
+    if ((payload_len - tile_pos) < 4) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint32_t prefix = qoir_private_peek_u32le(src_ptr + tile_pos);
+    size_t tile_len = prefix & 0xFFFFFF;
+    if (((payload_len - tile_pos - 4) < tile_len) ||
+        (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
+      return qoir_status_message__error_invalid_data;
+    }
+    qoir_private_poke_u64le(dst_ptr + (8 * i), tile_pos);
+    tile_pos += 4 + tile_len;
+  }
+  if (tile_pos != payload_len) {
+    return qoir_status_message__error_invalid_data;
+  }
+  return NULL;
+}
+
+typedef struct qoir_private_decode_jobs_struct {
+  const qoir_private_decode_state* state;
+  qoir_decode_buffer* decbuf0;
+  qoir_decode_buffer* other_decbufs;
+  const char** status_messages;
+  uint64_t number_of_tiles;
+  uint32_t num_jobs;
+} qoir_private_decode_jobs;
+
+static void                    //
+qoir_private_decode_job_func(  //
+    void* job_context,         //
+    uint32_t job_index) {
+  qoir_private_decode_jobs* jobs = (qoir_private_decode_jobs*)job_context;
+  if (job_index >= jobs->num_jobs) {
+    return;
+  }
+  uint64_t begin = (jobs->number_of_tiles * (job_index + 0)) / jobs->num_jobs;
+  uint64_t end = (jobs->number_of_tiles * (job_index + 1)) / jobs->num_jobs;
+  jobs->status_messages[job_index] = qoir_private_decode_tile_range(
+      jobs->state,
+      job_index ? &jobs->other_decbufs[job_index - 1] : jobs->decbuf0,  //
+      begin, end);
+}
+
+// qoir_private_decode_qpix_payload decodes the QPIX chunk's payload. If
+// tile_index_ptr is non-NULL then it points to a TIDX chunk's payload, whose
+// length the caller has already verified to be (8 * number_of_tiles), and
+// only those tiles that intersect the clipping rectangles are visited.
+// Otherwise, every tile's prefix is visited (and validated).
+//
+// It allocates and frees its own scratch space (for each job, if
+// multi-threaded) if the options don't provide any.
+static const char*                                   //
+qoir_private_decode_qpix_payload(                    //
+    const qoir_decode_options* options,              //
+    qoir_pixel_buffer dst_pixbuf,                    //
+    const qoir_private_decode_placement* placement,  //
+    qoir_pixel_format src_pixfmt,                    //
+    uint32_t src_width_in_pixels,                    //
+    uint32_t src_height_in_pixels,                   //
+    const uint8_t* src_ptr,                          //
+    size_t src_len,                                  //
+    const uint8_t* tile_index_ptr,                   //
+    uint32_t lossiness) {
+  qoir_private_decode_state state = {0};
+  const char* status_message = qoir_private_decode_init_state(
+      &state, dst_pixbuf, placement, src_pixfmt, src_width_in_pixels,
+      src_height_in_pixels, lossiness);
+  if (status_message) {
+    return status_message;
+  }
+  state.src_ptr = src_ptr;
+  state.src_len = src_len;
+  state.tile_index_ptr = tile_index_ptr;
+  if (options) {
+    state.stats = options->stats;
+    state.tile_func = options->contextual_tile_func;
+    state.tile_func_context = options->tile_func_context;
+  }
+  uint64_t number_of_tiles = (uint64_t)state.clip_tw * state.clip_th;
+
+  uint32_t num_jobs = 1;
+  if (options && options->contextual_run_jobs_func &&
+      (options->max_num_jobs > 1)) {
+    num_jobs = (options->max_num_jobs < QOIR_MAX_NUM_JOBS)
+                   ? options->max_num_jobs
+                   : QOIR_MAX_NUM_JOBS;
+    if (number_of_tiles < num_jobs) {
+      num_jobs = (uint32_t)number_of_tiles;
+    }
+  }
+
+  qoir_context* context = options ? options->context : NULL;
+  qoir_decode_buffer* decbuf = options ? options->decbuf : NULL;
+  bool free_decbuf = false;
+  if (decbuf) {
+    // No-op.
+  } else if (context) {
+    decbuf = qoir_private_context__decbuf(context);
+    if (!decbuf) {
+      return qoir_status_message__error_out_of_memory;
+    }
+  } else {
+    decbuf = (qoir_decode_buffer*)QOIR_MALLOC(sizeof(qoir_decode_buffer));
+    if (!decbuf) {
+      return qoir_status_message__error_out_of_memory;
+    }
+    free_decbuf = true;
+  }
+
+  if (num_jobs <= 1) {
+    if (state.tile_index_ptr) {
+      status_message = qoir_private_decode_tile_range(&state, decbuf, 0,
+                                                      number_of_tiles);
+    } else {
+      status_message =
+          qoir_private_decode_tiles_sequentially(&state, decbuf);
+    }
+    if (!status_message && state.stats) {
+      qoir_private_stats__add(state.stats, &decbuf->private_impl.stats);
+    }
+
+  } else {
+    // Every job needs its own scratch space and status message. If there's no
+    // TIDX chunk, we also synthesize the equivalent.
+    uint64_t all_tiles = qoir_calculate_number_of_tiles_2d(
+        src_width_in_pixels, src_height_in_pixels);
+    size_t alloc_len = ((num_jobs - 1) * sizeof(qoir_decode_buffer)) +
+                       (num_jobs * sizeof(const char*));
+    if (!tile_index_ptr) {
+      if ((all_tiles > ((SIZE_MAX - alloc_len) / 8))) {
+        status_message =
+            qoir_status_message__error_unsupported_pixbuf_dimensions;
+        goto cleanup;
+      }
+      alloc_len += 8 * (size_t)all_tiles;
+    }
+    uint8_t* alloc_ptr =
+        context ? qoir_private_context__scratch(
+                      context, QOIR_CONTEXT_SCRATCH__JOBS, alloc_len)
+                : (uint8_t*)QOIR_MALLOC(alloc_len);
+    if (!alloc_ptr) {
+      status_message = qoir_status_message__error_out_of_memory;
+      goto cleanup;
+    }
+
+    qoir_private_decode_jobs jobs;
+    jobs.state = &state;
+    jobs.decbuf0 = decbuf;
+    jobs.status_messages = (const char**)(void*)alloc_ptr;
+    jobs.other_decbufs =
+        (qoir_decode_buffer*)(void*)(alloc_ptr +
+                                     (num_jobs * sizeof(const char*)));
+    jobs.number_of_tiles = number_of_tiles;
+    jobs.num_jobs = num_jobs;
+    for (uint32_t i = 0; i < num_jobs; i++) {
+      jobs.status_messages[i] = NULL;
+    }
+
+    if (!tile_index_ptr) {
+      uint8_t* synthesized = alloc_ptr + ((num_jobs - 1) *
+                                          sizeof(qoir_decode_buffer)) +
+                             (num_jobs * sizeof(const char*));
+      status_message = qoir_private_make_tile_index(synthesized, all_tiles,
+                                                    src_ptr, src_len);
+      state.tile_index_ptr = synthesized;
+    }
+
+    if (!status_message) {
+      (*options->contextual_run_jobs_func)(options->run_jobs_func_context,
+                                           &qoir_private_decode_job_func,
+                                           &jobs, num_jobs);
+      for (uint32_t i = 0; i < num_jobs; i++) {
+        if (jobs.status_messages[i]) {
+          status_message = jobs.status_messages[i];
+          break;
+        }
+      }
+    }
+    if (!status_message && state.stats) {
+      for (uint32_t i = 0; i < num_jobs; i++) {
+        qoir_private_stats__add(
+            state.stats,
+            &(i ? &jobs.other_decbufs[i - 1] : decbuf)->private_impl.stats);
+      }
+    }
+    if (!context) {
+      QOIR_FREE(alloc_ptr);
+    }
+  }
+
+cleanup:
+  if (!status_message && state.stats) {
+    state.stats->num_clipped_tiles +=
+        qoir_calculate_number_of_tiles_2d(src_width_in_pixels,
+                                          src_height_in_pixels) -
+        number_of_tiles;
+  }
+  if (free_decbuf) {
+    QOIR_FREE(decbuf);
+  }
+  return status_message;
+}
+
+static qoir_decode_result               //
+qoir_private_make_decode_result_error(  //
+    const char* status_message) {
+  qoir_decode_result result = {0};
+  result.status_message = status_message;
+  return result;
+}
+
+// qoir_private_decode_placement__initialize applies the options' clipping
+// rectangles, offsets and downscaling (or their defaults).
+static const char*                             //
+qoir_private_decode_placement__initialize(     //
+    qoir_private_decode_placement* placement,  //
+    const qoir_decode_options* options) {
+  placement->dst_clip_rectangle = qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
+  placement->src_clip_rectangle = qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
+  placement->offset_x = 0;
+  placement->offset_y = 0;
+  placement->downscale_shift = 0;
+  if (options) {
+    if ((options->pixbuf.pixcfg.width_in_pixels > 0xFFFFFF) ||
+        (options->pixbuf.pixcfg.height_in_pixels > 0xFFFFFF)) {
+      return qoir_status_message__error_unsupported_pixbuf_dimensions;
+    }
+    if (options->use_dst_clip_rectangle) {
+      memcpy(&placement->dst_clip_rectangle, &options->dst_clip_rectangle,
+             sizeof(options->dst_clip_rectangle));
+    }
+    if (options->use_src_clip_rectangle) {
+      memcpy(&placement->src_clip_rectangle, &options->src_clip_rectangle,
+             sizeof(options->src_clip_rectangle));
+    }
+    if ((-0xFFFFFF <= options->offset_x) && (options->offset_x <= 0xFFFFFF) &&
+        (-0xFFFFFF <= options->offset_y) && (options->offset_y <= 0xFFFFFF)) {
+      placement->offset_x = options->offset_x;
+      placement->offset_y = options->offset_y;
+    } else {
+      placement->dst_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
+      placement->src_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
+    }
+    placement->downscale_shift =
+        (options->downscale_shift < 3) ? options->downscale_shift : 3;
+  }
+  return NULL;
+}
+
+// qoir_private_decode_select_mipmap_level replaces the source image (its
+// dimensions and QPIX payload) with the smallest of the MIPS chunk's levels
+// that is at least min_width by min_height, if any level is. Only level 0 has
+// a tile index, so that is then dropped. Like the QPIX chunk's payload, every
+// level is followed by at least 8 bytes (the next level's length or the next
+// chunk's header). Reference: §
+static const char*                        //
+qoir_private_decode_select_mipmap_level(  //
+    uint32_t* width_in_pixels,            //
+    uint32_t* height_in_pixels,           //
+    const uint8_t** qpix_ptr,             //
+    size_t* qpix_len,                     //
+    const uint8_t** tidx_ptr,             //
+    const uint8_t* mips_ptr,              //
+    size_t mips_len,                      //
+    uint32_t min_width_in_pixels,         //
+    uint32_t min_height_in_pixels) {
+  uint32_t width0 = *width_in_pixels;
+  uint32_t height0 = *height_in_pixels;
+  uint32_t max_num_levels =
+      qoir_private_num_mipmap_levels(width0, height0, 0xFFFFFFFF);
+  size_t pos = 0;
+  for (uint32_t k = 1; pos < mips_len; k++) {
+    if ((k > max_num_levels) || ((mips_len - pos) < 8)) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint64_t n = qoir_private_peek_u64le(mips_ptr + pos);
+    if (n > (mips_len - pos - 8)) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint32_t w = qoir_private_downscaled_dimension(width0, k);
+    uint32_t h = qoir_private_downscaled_dimension(height0, k);
+    if ((w < min_width_in_pixels) || (h < min_height_in_pixels)) {
+      break;
+    }
+    *width_in_pixels = w;
+    *height_in_pixels = h;
+    *qpix_ptr = mips_ptr + pos + 8;
+    *qpix_len = (size_t)n;
+    *tidx_ptr = NULL;
+    pos += 8 + (size_t)n;
+  }
+  return NULL;
+}
+
+// qoir_private_decode_allocate_pixbuf sets the result's dst_pixbuf, either to
+// the options' pixbuf or (if that is zero) to newly allocated memory, whose
+// ownership is recorded as the result's owned_memory. The returned value is
+// the pixel buffer's length if it were allocated, which the caller can check
+// for zero, since zero-sized images have no pixels to decode.
+static qoir_size_result                  //
+qoir_private_decode_allocate_pixbuf(     //
+    qoir_decode_result* result,          //
+    const qoir_decode_options* options,  //
+    uint32_t width_in_pixels,            //
+    uint32_t height_in_pixels) {
+  qoir_size_result size_result = {0};
+  if (options) {
+    memcpy(&result->dst_pixbuf, &options->pixbuf, sizeof(options->pixbuf));
+  }
+  qoir_pixel_format dst_pixfmt =
+      (options && !qoir_pixel_buffer__is_zero(options->pixbuf))
+          ? options->pixbuf.pixcfg.pixfmt
+          : ((options && options->pixfmt) ? options->pixfmt
+                                          : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL);
+  uint64_t dst_width_in_bytes =
+      width_in_pixels * qoir_pixel_format__bytes_per_pixel(dst_pixfmt);
+  uint64_t pixbuf_len = dst_width_in_bytes * (uint64_t)height_in_pixels;
+  if (pixbuf_len > SIZE_MAX) {
+    size_result.status_message =
+        qoir_status_message__error_unsupported_pixbuf_dimensions;
+    return size_result;
+  } else if ((pixbuf_len > 0) &&
+             qoir_pixel_buffer__is_zero(result->dst_pixbuf)) {
+    uint8_t* data = NULL;
+    if (options && options->context) {
+      uint8_t* block =
+          qoir_private_context__acquire(options->context, pixbuf_len);
+      result->owned_memory = block;
+      data = block ? (block + QOIR_CONTEXT_BLOCK_HEADER_LEN) : NULL;
+    } else {
+      result->owned_memory = QOIR_MALLOC((size_t)pixbuf_len);
+      data = (uint8_t*)result->owned_memory;
+    }
+    if (!result->owned_memory) {
+      size_result.status_message = qoir_status_message__error_out_of_memory;
+      return size_result;
+    }
+    if (options &&
+        (options->use_dst_clip_rectangle || options->use_src_clip_rectangle)) {
+      memset(data, 0, pixbuf_len);
+    }
+    result->dst_pixbuf.pixcfg.pixfmt = dst_pixfmt;
+    result->dst_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
+    result->dst_pixbuf.pixcfg.height_in_pixels = height_in_pixels;
+    result->dst_pixbuf.data = data;
+    result->dst_pixbuf.stride_in_bytes = dst_width_in_bytes;
+  }
+  size_result.value = (size_t)pixbuf_len;
+  return size_result;
+}
+
+// qoir_private_decode_walk_chunks parses the QOIR chunk and walks the other
+// chunks, validating them and noting the QPIX and MIPS chunks' payloads (in
+// addition to the metadata's fields), before any pixels are decoded. The TIDX
+// chunk (if present) comes after the QPIX chunk.
+static const char*                          //
+qoir_private_decode_walk_chunks(            //
+    qoir_decode_metadata_result* metadata,  //
+    const uint8_t** qpix_ptr,               //
+    size_t* qpix_len,                       //
+    const uint8_t** mips_ptr,               //
+    const uint8_t* src_ptr,                 //
+    size_t src_len) {
+  memset(metadata, 0, sizeof(*metadata));
+  if ((src_len < 44) ||
+      (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
+    return qoir_status_message__error_invalid_data;
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if ((qoir_chunk_payload_len < 8) ||
+      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull) ||
+      (qoir_chunk_payload_len > (src_len - 44))) {
+    return qoir_status_message__error_invalid_data;
+  }
+
+  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
+  uint32_t width_in_pixels = 0xFFFFFF & header0;
+  qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
+  switch (src_pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+      break;
+    default:
+      return qoir_status_message__error_invalid_data;
+  }
+  uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
+  uint32_t height_in_pixels = 0xFFFFFF & header1;
+  metadata->src_pixcfg.pixfmt = src_pixfmt;
+  metadata->src_pixcfg.width_in_pixels = width_in_pixels;
+  metadata->src_pixcfg.height_in_pixels = height_in_pixels;
+  metadata->lossiness = 0x07 & (header1 >> 24);
+
+  *qpix_ptr = NULL;
+  *qpix_len = 0;
+  *mips_ptr = NULL;
+  size_t tidx_len = 0;
+  const uint8_t* sp = src_ptr + (12 + qoir_chunk_payload_len);
+  size_t sn = src_len - (12 + qoir_chunk_payload_len);
+  while (1) {
+    if (sn < 12) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
+    uint64_t payload_len = qoir_private_peek_u64le(sp + 4);
+    if (payload_len > 0x7FFFFFFFFFFFFFFFull) {
+      return qoir_status_message__error_invalid_data;
+    }
+    sp += 12;
+    sn -= 12;
+
+    if (chunk_type == 0x52494F51) {  // "QOIR"le.
+      return qoir_status_message__error_invalid_data;
+    } else if (chunk_type == 0x444E4551) {  // "QEND"le.
+      if ((payload_len != 0) || (sn != 0)) {
+        return qoir_status_message__error_invalid_data;
+      }
+      break;
+    }
+
+    // This chunk must be followed by at least the QEND chunk (12 bytes).
+    if ((sn < payload_len) || ((sn - payload_len) < 12)) {
+      return qoir_status_message__error_invalid_data;
+    }
+
+    if (chunk_type == 0x58495051) {  // "QPIX"le.
+      if (*qpix_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      *qpix_ptr = sp;
+      *qpix_len = payload_len;
+
+    } else if (chunk_type == 0x58444954) {  // "TIDX"le.
+      if (metadata->tile_index_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      metadata->tile_index_ptr = sp;
+      tidx_len = payload_len;
+
+    } else if (chunk_type == 0x5350494D) {  // "MIPS"le.
+      if (*mips_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      *mips_ptr = sp;
+      metadata->mipmap_len = payload_len;
+
+    } else if (chunk_type == 0x50434943) {  // "CICP"le.
+      if (metadata->metadata_cicp_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      metadata->metadata_cicp_ptr = sp;
+      metadata->metadata_cicp_len = payload_len;
+
+    } else if (chunk_type == 0x50434349) {  // "ICCP"le.
+      if (metadata->metadata_iccp_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      metadata->metadata_iccp_ptr = sp;
+      metadata->metadata_iccp_len = payload_len;
+
+    } else if (chunk_type == 0x46495845) {  // "EXIF"le.
+      if (metadata->metadata_exif_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      metadata->metadata_exif_ptr = sp;
+      metadata->metadata_exif_len = payload_len;
+
+    } else if (chunk_type == 0x20504D58) {  // "XMP "le.
+      if (metadata->metadata_xmp_ptr) {
+        return qoir_status_message__error_invalid_data;
+      }
+      metadata->metadata_xmp_ptr = sp;
+      metadata->metadata_xmp_len = payload_len;
+    }
+
+    sp += payload_len;
+    sn -= payload_len;
+  }
+
+  if (!*qpix_ptr) {
+    return qoir_status_message__error_invalid_data;
+  } else if (metadata->tile_index_ptr) {
+    metadata->number_of_tiles =
+        qoir_calculate_number_of_tiles_2d(width_in_pixels, height_in_pixels);
+    if (tidx_len != (8 * metadata->number_of_tiles)) {
+      return qoir_status_message__error_invalid_data;
+    }
+  }
+  return NULL;
+}
+
+QOIR_MAYBE_STATIC qoir_decode_metadata_result  //
+qoir_decode_metadata(                          //
+    const uint8_t* src_ptr,                    //
+    size_t src_len) {
+  qoir_decode_metadata_result result;
+  const uint8_t* qpix_ptr = NULL;
+  size_t qpix_len = 0;
+  const uint8_t* mips_ptr = NULL;
+  const char* status_message = qoir_private_decode_walk_chunks(
+      &result, &qpix_ptr, &qpix_len, &mips_ptr, src_ptr, src_len);
+  if (status_message) {
+    memset(&result, 0, sizeof(result));
+    result.status_message = status_message;
+  }
+  return result;
+}
 
 QOIR_MAYBE_STATIC qoir_decode_result  //
 qoir_decode(                          //
@@ -6178,214 +9938,719 @@ qoir_decode(                          //
   qoir_decode_result result = {0};
 
   do {
-    qoir_rectangle dst_clip_rectangle =
-        qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
-    qoir_rectangle src_clip_rectangle =
-        qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
-    int32_t offset_x = 0;
-    int32_t offset_y = 0;
-    if (options) {
-      if ((options->pixbuf.pixcfg.width_in_pixels > 0xFFFFFF) ||
-          (options->pixbuf.pixcfg.height_in_pixels > 0xFFFFFF)) {
-        return qoir_private_make_decode_result_error(
-            qoir_status_message__error_unsupported_pixbuf_dimensions);
+    qoir_private_decode_placement placement;
+    const char* status_message =
+        qoir_private_decode_placement__initialize(&placement, options);
+    if (status_message) {
+      return qoir_private_make_decode_result_error(status_message);
+    }
+
+    qoir_decode_metadata_result metadata;
+    const uint8_t* qpix_ptr = NULL;
+    size_t qpix_len = 0;
+    const uint8_t* mips_ptr = NULL;
+    status_message = qoir_private_decode_walk_chunks(
+        &metadata, &qpix_ptr, &qpix_len, &mips_ptr, src_ptr, src_len);
+    if (status_message) {
+      return qoir_private_make_decode_result_error(status_message);
+    }
+    result.metadata_cicp_ptr = metadata.metadata_cicp_ptr;
+    result.metadata_cicp_len = metadata.metadata_cicp_len;
+    result.metadata_iccp_ptr = metadata.metadata_iccp_ptr;
+    result.metadata_iccp_len = metadata.metadata_iccp_len;
+    result.metadata_exif_ptr = metadata.metadata_exif_ptr;
+    result.metadata_exif_len = metadata.metadata_exif_len;
+    result.metadata_xmp_ptr = metadata.metadata_xmp_ptr;
+    result.metadata_xmp_len = metadata.metadata_xmp_len;
+    qoir_pixel_format src_pixfmt = metadata.src_pixcfg.pixfmt;
+    uint32_t width_in_pixels = metadata.src_pixcfg.width_in_pixels;
+    uint32_t height_in_pixels = metadata.src_pixcfg.height_in_pixels;
+    uint32_t lossiness = metadata.lossiness;
+    const uint8_t* tidx_ptr = metadata.tile_index_ptr;
+
+    if (mips_ptr && options && options->mipmap_min_width_in_pixels &&
+        options->mipmap_min_height_in_pixels) {
+      status_message = qoir_private_decode_select_mipmap_level(
+          &width_in_pixels, &height_in_pixels, &qpix_ptr, &qpix_len,
+          &tidx_ptr, mips_ptr, metadata.mipmap_len,
+          options->mipmap_min_width_in_pixels,
+          options->mipmap_min_height_in_pixels);
+      if (status_message) {
+        return qoir_private_make_decode_result_error(status_message);
+      }
+    }
+
+    qoir_size_result pixbuf_len = qoir_private_decode_allocate_pixbuf(
+        &result, options,
+        qoir_private_downscaled_dimension(width_in_pixels,
+                                          placement.downscale_shift),
+        qoir_private_downscaled_dimension(height_in_pixels,
+                                          placement.downscale_shift));
+    if (pixbuf_len.status_message) {
+      return qoir_private_make_decode_result_error(pixbuf_len.status_message);
+
+    } else if (pixbuf_len.value > 0) {
+      status_message = qoir_private_decode_qpix_payload(
+          options, result.dst_pixbuf, &placement, src_pixfmt, width_in_pixels,
+          height_in_pixels, qpix_ptr,
+          qpix_len + 8,  // See § for +8.
+          tidx_ptr, lossiness);
+      if (status_message) {
+        QOIR_FREE_OWNED_MEMORY(result.owned_memory);
+        return qoir_private_make_decode_result_error(status_message);
+      }
+
+    } else if (qpix_len != 0) {
+      goto fail_invalid_data;
+    }
+    return result;
+  } while (false);
+
+fail_invalid_data:
+  QOIR_FREE_OWNED_MEMORY(result.owned_memory);
+  return qoir_private_make_decode_result_error(
+      qoir_status_message__error_invalid_data);
+}
+
+// -------- QOIR Batch Decode
+
+typedef struct qoir_private_decode_batch_jobs_struct {
+  qoir_decode_batch_item* items;
+  size_t num_items;
+  const qoir_decode_options* options;
+  qoir_decode_buffer* decbuf0;
+  qoir_decode_buffer* other_decbufs;
+  uint32_t num_jobs;
+} qoir_private_decode_batch_jobs;
+
+static void                          //
+qoir_private_decode_batch_job_func(  //
+    void* job_context,               //
+    uint32_t job_index) {
+  qoir_private_decode_batch_jobs* jobs =
+      (qoir_private_decode_batch_jobs*)job_context;
+  if (job_index >= jobs->num_jobs) {
+    return;
+  }
+  size_t begin = (size_t)(((uint64_t)jobs->num_items * (job_index + 0)) /
+                          jobs->num_jobs);
+  size_t end = (size_t)(((uint64_t)jobs->num_items * (job_index + 1)) /
+                        jobs->num_jobs);
+
+  qoir_decode_options item_opts;
+  memcpy(&item_opts, jobs->options, sizeof(item_opts));
+  item_opts.decbuf =
+      job_index ? &jobs->other_decbufs[job_index - 1] : jobs->decbuf0;
+  qoir_stats job_stats = {0};
+  if (jobs->num_jobs > 1) {
+    // The context's scratch space and the caller's run_jobs_func aren't
+    // necessarily safe to use concurrently. Nor are the caller's stats, so
+    // each job sums its own, which qoir_decode_batch then adds up.
+    item_opts.context = NULL;
+    item_opts.contextual_run_jobs_func = NULL;
+    if (item_opts.stats) {
+      item_opts.stats = &job_stats;
+    }
+  }
+
+  for (size_t i = begin; i < end; i++) {
+    qoir_decode_batch_item* item = &jobs->items[i];
+    item_opts.offset_x = item->dst_rectangle.x0;
+    item_opts.offset_y = item->dst_rectangle.y0;
+    item_opts.dst_clip_rectangle =
+        jobs->options->use_dst_clip_rectangle
+            ? qoir_rectangle__intersect(item->dst_rectangle,
+                                        jobs->options->dst_clip_rectangle)
+            : item->dst_rectangle;
+    item_opts.use_dst_clip_rectangle = true;
+    qoir_decode_result result =
+        qoir_decode(item->src_ptr, item->src_len, &item_opts);
+    item->status_message = result.status_message;
+  }
+
+  // Each item's qoir_decode call re-uses (and so overwrites) the decbuf's
+  // stats, so only afterwards can they hold this job's total.
+  if (item_opts.stats == &job_stats) {
+    item_opts.decbuf->private_impl.stats = job_stats;
+  }
+}
+
+QOIR_MAYBE_STATIC const char*       //
+qoir_decode_batch(                  //
+    qoir_decode_batch_item* items,  //
+    size_t num_items,               //
+    const qoir_decode_options* options) {
+  if (!options || qoir_pixel_buffer__is_zero(options->pixbuf) ||
+      (!items && (num_items > 0))) {
+    return qoir_status_message__error_invalid_argument;
+  }
+  for (size_t i = 0; i < num_items; i++) {
+    items[i].status_message = NULL;
+  }
+
+  uint32_t num_jobs = 1;
+  if (options->contextual_run_jobs_func && (options->max_num_jobs > 1)) {
+    num_jobs = (options->max_num_jobs < QOIR_MAX_NUM_JOBS)
+                   ? options->max_num_jobs
+                   : QOIR_MAX_NUM_JOBS;
+    if (num_items < num_jobs) {
+      num_jobs = (uint32_t)num_items;
+    }
+  }
+  if (num_jobs == 0) {
+    return NULL;
+  }
+
+  qoir_context* context = options->context;
+  qoir_decode_buffer* decbuf = options->decbuf;
+  bool free_decbuf = false;
+  if (decbuf) {
+    // No-op.
+  } else if (context) {
+    decbuf = qoir_private_context__decbuf(context);
+    if (!decbuf) {
+      return qoir_status_message__error_out_of_memory;
+    }
+  } else {
+    decbuf = (qoir_decode_buffer*)QOIR_MALLOC(sizeof(qoir_decode_buffer));
+    if (!decbuf) {
+      return qoir_status_message__error_out_of_memory;
+    }
+    free_decbuf = true;
+  }
+
+  const char* status_message = NULL;
+  qoir_private_decode_batch_jobs jobs;
+  jobs.items = items;
+  jobs.num_items = num_items;
+  jobs.options = options;
+  jobs.decbuf0 = decbuf;
+  jobs.other_decbufs = NULL;
+  jobs.num_jobs = num_jobs;
+
+  if (num_jobs <= 1) {
+    qoir_private_decode_batch_job_func(&jobs, 0);
+
+  } else {
+    size_t alloc_len = (num_jobs - 1) * sizeof(qoir_decode_buffer);
+    jobs.other_decbufs =
+        (qoir_decode_buffer*)(void*)(context
+                                         ? qoir_private_context__scratch(
+                                               context,
+                                               QOIR_CONTEXT_SCRATCH__JOBS,
+                                               alloc_len)
+                                         : QOIR_MALLOC(alloc_len));
+    if (!jobs.other_decbufs) {
+      status_message = qoir_status_message__error_out_of_memory;
+      goto cleanup;
+    }
+    for (uint32_t i = 0; i < num_jobs; i++) {
+      qoir_decode_buffer* b = i ? &jobs.other_decbufs[i - 1] : decbuf;
+      memset(&b->private_impl.stats, 0, sizeof(b->private_impl.stats));
+    }
+    (*options->contextual_run_jobs_func)(options->run_jobs_func_context,
+                                         &qoir_private_decode_batch_job_func,
+                                         &jobs, num_jobs);
+    if (options->stats) {
+      for (uint32_t i = 0; i < num_jobs; i++) {
+        qoir_private_stats__add(
+            options->stats,
+            &(i ? &jobs.other_decbufs[i - 1] : decbuf)->private_impl.stats);
+      }
+    }
+    if (!context) {
+      QOIR_FREE(jobs.other_decbufs);
+    }
+  }
+
+  for (size_t i = 0; i < num_items; i++) {
+    if (items[i].status_message) {
+      status_message = items[i].status_message;
+      break;
+    }
+  }
+
+cleanup:
+  if (free_decbuf) {
+    QOIR_FREE(decbuf);
+  }
+  return status_message;
+}
+
+// -------- QOIR Incremental Decode
+
+#define QOIR_DECODER_PHASE__QOIR_CHUNK 0
+#define QOIR_DECODER_PHASE__CHUNK_HEADER 1
+#define QOIR_DECODER_PHASE__SKIP_PAYLOAD 2
+#define QOIR_DECODER_PHASE__QPIX_PAYLOAD 3
+#define QOIR_DECODER_PHASE__DONE 4
+
+// These bits are for the qoir_decoder's seen_chunks field.
+#define QOIR_DECODER_SEEN__QPIX 0x01
+#define QOIR_DECODER_SEEN__TIDX 0x02
+#define QOIR_DECODER_SEEN__CICP 0x04
+#define QOIR_DECODER_SEEN__ICCP 0x08
+#define QOIR_DECODER_SEEN__EXIF 0x10
+#define QOIR_DECODER_SEEN__XMP 0x20
+#define QOIR_DECODER_SEEN__MIPS 0x40
+
+// qoir_private_decoder__decode_tiles decodes (and consumes) those tiles whose
+// bytes (and the 8 bytes after them) are in *src_ptr and *src_len, advancing
+// both past what was consumed. Once all of the tiles are consumed, the
+// decoder moves on to the next chunk.
+static const char*                   //
+qoir_private_decoder__decode_tiles(  //
+    qoir_decoder* decoder,           //
+    const uint8_t** src_ptr,         //
+    size_t* src_len) {
+  uint64_t width_in_tiles = qoir_calculate_number_of_tiles_1d(
+      decoder->private_impl.src_width_in_pixels);
+  uint64_t height_in_tiles = qoir_calculate_number_of_tiles_1d(
+      decoder->private_impl.src_height_in_pixels);
+  uint64_t number_of_tiles = width_in_tiles * height_in_tiles;
+  uint64_t k = decoder->private_impl.num_decoded_tiles;
+
+  if (k < number_of_tiles) {
+    qoir_private_decode_placement placement;
+    qoir_private_decode_state state = {0};
+    const char* status_message = qoir_private_decode_placement__initialize(
+        &placement, &decoder->private_impl.options);
+    if (!status_message) {
+      status_message = qoir_private_decode_init_state(
+          &state, decoder->private_impl.result.dst_pixbuf, &placement,
+          decoder->private_impl.src_pixfmt,
+          decoder->private_impl.src_width_in_pixels,
+          decoder->private_impl.src_height_in_pixels,
+          decoder->private_impl.lossiness);
+    }
+    if (status_message) {
+      return status_message;
+    }
+    qoir_private_decode_buffer__init_pre_padding(decoder->private_impl.decbuf);
+    size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
+    size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
+
+    const uint8_t* sp = *src_ptr;
+    size_t sn = *src_len;
+    for (; (k < number_of_tiles) && (sn >= 4); k++) {
+      uint32_t prefix = qoir_private_peek_u32le(sp);
+      size_t tile_len = prefix & 0xFFFFFF;
+      uint64_t qpix_remaining = decoder->private_impl.qpix_remaining;
+      if ((qpix_remaining < 4) || ((qpix_remaining - 4) < tile_len) ||
+          (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
+        return qoir_status_message__error_invalid_data;
+      } else if ((sn - 4) < (tile_len + 8)) {  // See § for +8.
+        break;
       }
-      memcpy(&result.dst_pixbuf, &options->pixbuf, sizeof(options->pixbuf));
-      if (options->use_dst_clip_rectangle) {
-        memcpy(&dst_clip_rectangle, &options->dst_clip_rectangle,
-               sizeof(options->dst_clip_rectangle));
+
+      // ty, tx, tw and th are the tile's top-left offset, width and height,
+      // all measured in pixels.
+      uint64_t ti = k % width_in_tiles;
+      uint64_t tj = k / width_in_tiles;
+      size_t ty = (size_t)tj << QOIR_TILE_SHIFT;
+      size_t tx = (size_t)ti << QOIR_TILE_SHIFT;
+      size_t tw =
+          qoir_private_tile_dimension(tx < tx1, state.src_width_in_pixels);
+      size_t th =
+          qoir_private_tile_dimension(ty < ty1, state.src_height_in_pixels);
+      qoir_rectangle src_clip_rect =
+          qoir_private_decode_state__tile_clip(&state, tx, ty, tw, th);
+      if (!qoir_rectangle__is_empty(src_clip_rect)) {
+        status_message =
+            qoir_private_decode_tile(decoder->private_impl.decbuf, &state,
+                                     src_clip_rect, tw, th, prefix, sp + 4,
+                                     NULL);
+        if (status_message) {
+          return status_message;
+        }
+      }
+
+      sp += 4 + tile_len;
+      sn -= 4 + tile_len;
+      *src_ptr = sp;
+      *src_len = sn;
+      decoder->private_impl.qpix_remaining -= 4 + tile_len;
+      decoder->private_impl.num_decoded_tiles = k + 1;
+      if ((ti + 1) == width_in_tiles) {
+        decoder->private_impl.num_decoded_rows =
+            qoir_private_downscaled_dimension((uint32_t)(ty + th),
+                                              state.downscale_shift);
       }
-      if (options->use_src_clip_rectangle) {
-        memcpy(&src_clip_rectangle, &options->src_clip_rectangle,
-               sizeof(options->src_clip_rectangle));
+    }
+  }
+
+  if (k == number_of_tiles) {
+    if (decoder->private_impl.qpix_remaining != 0) {
+      return qoir_status_message__error_invalid_data;
+    }
+    decoder->private_impl.phase = QOIR_DECODER_PHASE__CHUNK_HEADER;
+  }
+  return NULL;
+}
+
+// qoir_private_decoder__start_chunk handles a chunk header (other than the
+// first chunk's), whose chunk_type and payload_len are given.
+static const char*                  //
+qoir_private_decoder__start_chunk(  //
+    qoir_decoder* decoder,          //
+    uint32_t chunk_type,            //
+    uint64_t payload_len) {
+  if (payload_len > 0x7FFFFFFFFFFFFFFFull) {
+    return qoir_status_message__error_invalid_data;
+  }
+
+  uint32_t seen = 0;
+  switch (chunk_type) {
+    case 0x52494F51:  // "QOIR"le.
+      return qoir_status_message__error_invalid_data;
+    case 0x444E4551:  // "QEND"le.
+      if ((payload_len != 0) ||
+          !(decoder->private_impl.seen_chunks & QOIR_DECODER_SEEN__QPIX)) {
+        return qoir_status_message__error_invalid_data;
       }
-      if ((-0xFFFFFF <= options->offset_x) && (options->offset_x <= 0xFFFFFF) &&
-          (-0xFFFFFF <= options->offset_y) && (options->offset_y <= 0xFFFFFF)) {
-        offset_x = options->offset_x;
-        offset_y = options->offset_y;
-      } else {
-        dst_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
-        src_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
+      decoder->private_impl.phase = QOIR_DECODER_PHASE__DONE;
+      return NULL;
+    case 0x58495051:  // "QPIX"le.
+      seen = QOIR_DECODER_SEEN__QPIX;
+      break;
+    case 0x58444954: {  // "TIDX"le.
+      uint64_t number_of_tiles = qoir_calculate_number_of_tiles_2d(
+          decoder->private_impl.src_width_in_pixels,
+          decoder->private_impl.src_height_in_pixels);
+      if (payload_len != (8 * number_of_tiles)) {
+        return qoir_status_message__error_invalid_data;
       }
+      seen = QOIR_DECODER_SEEN__TIDX;
+      break;
     }
+    case 0x50434943:  // "CICP"le.
+      seen = QOIR_DECODER_SEEN__CICP;
+      break;
+    case 0x50434349:  // "ICCP"le.
+      seen = QOIR_DECODER_SEEN__ICCP;
+      break;
+    case 0x46495845:  // "EXIF"le.
+      seen = QOIR_DECODER_SEEN__EXIF;
+      break;
+    case 0x20504D58:  // "XMP "le.
+      seen = QOIR_DECODER_SEEN__XMP;
+      break;
+    case 0x5350494D:  // "MIPS"le.
+      seen = QOIR_DECODER_SEEN__MIPS;
+      break;
+  }
+  if (decoder->private_impl.seen_chunks & seen) {
+    return qoir_status_message__error_invalid_data;
+  }
+  decoder->private_impl.seen_chunks |= seen;
+
+  if (chunk_type == 0x58495051) {  // "QPIX"le.
+    decoder->private_impl.qpix_remaining = payload_len;
+    decoder->private_impl.phase = QOIR_DECODER_PHASE__QPIX_PAYLOAD;
+  } else {
+    decoder->private_impl.skip_len = payload_len;
+    decoder->private_impl.phase = QOIR_DECODER_PHASE__SKIP_PAYLOAD;
+  }
+  return NULL;
+}
+
+// qoir_private_decoder__start is like qoir_private_decoder__start_chunk but
+// for the first (QOIR) chunk, whose header and first 8 payload bytes are at
+// src_ptr. It also allocates the pixel buffer, if necessary.
+static const char*            //
+qoir_private_decoder__start(  //
+    qoir_decoder* decoder,    //
+    const uint8_t* src_ptr) {
+  if (qoir_private_peek_u32le(src_ptr) != 0x52494F51) {  // "QOIR"le.
+    return qoir_status_message__error_invalid_data;
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if ((qoir_chunk_payload_len < 8) ||
+      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull)) {
+    return qoir_status_message__error_invalid_data;
+  }
+
+  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
+  qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
+  switch (src_pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+      break;
+    default:
+      return qoir_status_message__error_invalid_data;
+  }
+  uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
+  decoder->private_impl.src_pixfmt = src_pixfmt;
+  decoder->private_impl.src_width_in_pixels = 0xFFFFFF & header0;
+  decoder->private_impl.src_height_in_pixels = 0xFFFFFF & header1;
+  decoder->private_impl.lossiness = 0x07 & (header1 >> 24);
+
+  qoir_private_decode_placement placement;
+  const char* status_message = qoir_private_decode_placement__initialize(
+      &placement, &decoder->private_impl.options);
+  if (status_message) {
+    return status_message;
+  }
+  qoir_size_result pixbuf_len = qoir_private_decode_allocate_pixbuf(
+      &decoder->private_impl.result, &decoder->private_impl.options,
+      qoir_private_downscaled_dimension(
+          decoder->private_impl.src_width_in_pixels, placement.downscale_shift),
+      qoir_private_downscaled_dimension(
+          decoder->private_impl.src_height_in_pixels,
+          placement.downscale_shift));
+  if (pixbuf_len.status_message) {
+    return pixbuf_len.status_message;
+  }
+  decoder->private_impl.skip_len = qoir_chunk_payload_len - 8;
+  decoder->private_impl.phase = QOIR_DECODER_PHASE__SKIP_PAYLOAD;
+  return NULL;
+}
 
-    if ((src_len < 44) ||
-        (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
-      return qoir_private_make_decode_result_error(
-          qoir_status_message__error_invalid_data);
+QOIR_MAYBE_STATIC const char*  //
+qoir_decoder__initialize(      //
+    qoir_decoder* decoder,     //
+    const qoir_decode_options* options) {
+  if (!decoder) {
+    return qoir_status_message__error_invalid_argument;
+  }
+  memset(decoder, 0, sizeof(*decoder));
+  qoir_private_decode_placement placement;
+  const char* status_message =
+      qoir_private_decode_placement__initialize(&placement, options);
+  if (status_message) {
+    return status_message;
+  }
+  if (options) {
+    memcpy(&decoder->private_impl.options, options, sizeof(*options));
+    decoder->private_impl.options.contextual_run_jobs_func = NULL;
+    decoder->private_impl.options.run_jobs_func_context = NULL;
+    decoder->private_impl.options.max_num_jobs = 0;
+  }
+  options = &decoder->private_impl.options;
+
+  decoder->private_impl.decbuf = options->decbuf;
+  if (!decoder->private_impl.decbuf && options->context) {
+    decoder->private_impl.decbuf =
+        qoir_private_context__decbuf(options->context);
+    if (!decoder->private_impl.decbuf) {
+      return qoir_status_message__error_out_of_memory;
     }
-    uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
-    if ((qoir_chunk_payload_len < 8) ||
-        (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull) ||
-        (qoir_chunk_payload_len > (src_len - 44))) {
-      return qoir_private_make_decode_result_error(
-          qoir_status_message__error_invalid_data);
+  } else if (!decoder->private_impl.decbuf) {
+    decoder->private_impl.decbuf =
+        (qoir_decode_buffer*)QOIR_MALLOC(sizeof(qoir_decode_buffer));
+    if (!decoder->private_impl.decbuf) {
+      return qoir_status_message__error_out_of_memory;
     }
+    decoder->private_impl.free_decbuf = true;
+  }
+  decoder->private_impl.phase = QOIR_DECODER_PHASE__QOIR_CHUNK;
+  return NULL;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_decoder__decode(               //
+    qoir_decoder* decoder,          //
+    const uint8_t* src_ptr,         //
+    size_t src_len) {
+  qoir_size_result result = {0};
+  if (!decoder || !decoder->private_impl.decbuf) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  } else if (decoder->private_impl.result.status_message) {
+    result.status_message = decoder->private_impl.result.status_message;
+    return result;
+  }
 
-    uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
-    uint32_t width_in_pixels = 0xFFFFFF & header0;
-    qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
-    switch (src_pixfmt) {
-      case QOIR_PIXEL_FORMAT__BGRX:
-      case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
-      case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+  const uint8_t* sp = src_ptr;
+  size_t sn = src_len;
+  const char* status_message = NULL;
+  while (!status_message) {
+    uint32_t phase = decoder->private_impl.phase;
+    if (phase == QOIR_DECODER_PHASE__QOIR_CHUNK) {
+      if (sn < 20) {
         break;
-      default:
-        goto fail_invalid_data;
-    }
-    uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
-    uint32_t height_in_pixels = 0xFFFFFF & header1;
-    uint32_t lossiness = 0x07 & (header1 >> 24);
-
-    qoir_pixel_format dst_pixfmt =
-        (options && !qoir_pixel_buffer__is_zero(options->pixbuf))
-            ? options->pixbuf.pixcfg.pixfmt
-            : ((options && options->pixfmt)
-                   ? options->pixfmt
-                   : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL);
-    uint64_t dst_width_in_bytes =
-        width_in_pixels * qoir_pixel_format__bytes_per_pixel(dst_pixfmt);
-
-    bool seen_qpix = false;
-    const uint8_t* sp = src_ptr + (12 + qoir_chunk_payload_len);
-    size_t sn = src_len - (12 + qoir_chunk_payload_len);
-    while (1) {
-      if (sn < 12) {
-        goto fail_invalid_data;
       }
-      uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
-      uint64_t payload_len = qoir_private_peek_u64le(sp + 4);
-      if (payload_len > 0x7FFFFFFFFFFFFFFFull) {
-        goto fail_invalid_data;
+      status_message = qoir_private_decoder__start(decoder, sp);
+      sp += 20;
+      sn -= 20;
+
+    } else if (phase == QOIR_DECODER_PHASE__CHUNK_HEADER) {
+      if (sn < 12) {
+        break;
       }
+      status_message = qoir_private_decoder__start_chunk(
+          decoder, qoir_private_peek_u32le(sp + 0),
+          qoir_private_peek_u64le(sp + 4));
       sp += 12;
       sn -= 12;
 
-      if (chunk_type == 0x52494F51) {  // "QOIR"le.
-        goto fail_invalid_data;
-      } else if (chunk_type == 0x444E4551) {  // "QEND"le.
-        if ((payload_len != 0) || (sn != 0)) {
-          goto fail_invalid_data;
-        }
+    } else if (phase == QOIR_DECODER_PHASE__SKIP_PAYLOAD) {
+      uint64_t skip_len = decoder->private_impl.skip_len;
+      if (skip_len == 0) {
+        decoder->private_impl.phase = QOIR_DECODER_PHASE__CHUNK_HEADER;
+        continue;
+      } else if (sn == 0) {
         break;
       }
-
-      // This chunk must be followed by at least the QEND chunk (12 bytes).
-      if ((sn < payload_len) || ((sn - payload_len) < 12)) {
-        goto fail_invalid_data;
+      size_t n = (skip_len < sn) ? (size_t)skip_len : sn;
+      sp += n;
+      sn -= n;
+      decoder->private_impl.skip_len -= n;
+
+    } else if (phase == QOIR_DECODER_PHASE__QPIX_PAYLOAD) {
+      size_t old_sn = sn;
+      status_message = qoir_private_decoder__decode_tiles(decoder, &sp, &sn);
+      if ((sn == old_sn) &&
+          (decoder->private_impl.phase == QOIR_DECODER_PHASE__QPIX_PAYLOAD)) {
+        break;
       }
 
-      if (chunk_type == 0x58495051) {  // "QPIX"le.
-        if (seen_qpix) {
-          goto fail_invalid_data;
-        }
-        seen_qpix = true;
-
-        uint64_t pixbuf_len = dst_width_in_bytes * (uint64_t)height_in_pixels;
-        if (pixbuf_len > SIZE_MAX) {
-          return qoir_private_make_decode_result_error(
-              qoir_status_message__error_unsupported_pixbuf_dimensions);
-
-        } else if (pixbuf_len > 0) {
-          if (qoir_pixel_buffer__is_zero(result.dst_pixbuf)) {
-            result.owned_memory = QOIR_MALLOC((size_t)pixbuf_len);
-            if (!result.owned_memory) {
-              return qoir_private_make_decode_result_error(
-                  qoir_status_message__error_out_of_memory);
-            }
-            if (options && (options->use_dst_clip_rectangle ||
-                            options->use_src_clip_rectangle)) {
-              memset(result.owned_memory, 0, pixbuf_len);
-            }
-            result.dst_pixbuf.pixcfg.pixfmt = dst_pixfmt;
-            result.dst_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
-            result.dst_pixbuf.pixcfg.height_in_pixels = height_in_pixels;
-            result.dst_pixbuf.data = (uint8_t*)result.owned_memory;
-            result.dst_pixbuf.stride_in_bytes = dst_width_in_bytes;
-          }
-          qoir_decode_buffer* decbuf = options ? options->decbuf : NULL;
-          bool free_decbuf = false;
-          if (!decbuf) {
-            decbuf =
-                (qoir_decode_buffer*)QOIR_MALLOC(sizeof(qoir_decode_buffer));
-            if (!decbuf) {
-              QOIR_FREE(result.owned_memory);
-              return qoir_private_make_decode_result_error(
-                  qoir_status_message__error_out_of_memory);
-            }
-            free_decbuf = true;
-          }
-          const char* status_message = qoir_private_decode_qpix_payload(
-              decbuf, result.dst_pixbuf, dst_clip_rectangle, src_pixfmt,
-              width_in_pixels, height_in_pixels, sp,
-              payload_len + 8,  // See § for +8.
-              src_clip_rectangle, offset_x, offset_y, lossiness);
-          if (free_decbuf) {
-            QOIR_FREE(decbuf);
-          }
-          if (status_message) {
-            QOIR_FREE(result.owned_memory);
-            return qoir_private_make_decode_result_error(status_message);
-          }
-
-        } else if (payload_len != 0) {
-          goto fail_invalid_data;
-        }
-
-      } else if (chunk_type == 0x50434943) {  // "CICP"le.
-        if (result.metadata_cicp_ptr) {
-          goto fail_invalid_data;
-        }
-        result.metadata_cicp_ptr = sp;
-        result.metadata_cicp_len = payload_len;
+    } else {
+      if (sn > 0) {
+        status_message = qoir_status_message__error_invalid_data;
+      }
+      break;
+    }
+  }
 
-      } else if (chunk_type == 0x50434349) {  // "ICCP"le.
-        if (result.metadata_iccp_ptr) {
-          goto fail_invalid_data;
-        }
-        result.metadata_iccp_ptr = sp;
-        result.metadata_iccp_len = payload_len;
+  if (status_message) {
+    decoder->private_impl.result.status_message = status_message;
+    result.status_message = status_message;
+    return result;
+  }
+  result.value = (size_t)(sp - src_ptr);
+  return result;
+}
 
-      } else if (chunk_type == 0x46495845) {  // "EXIF"le.
-        if (result.metadata_exif_ptr) {
-          goto fail_invalid_data;
-        }
-        result.metadata_exif_ptr = sp;
-        result.metadata_exif_len = payload_len;
+QOIR_MAYBE_STATIC const qoir_pixel_buffer*  //
+qoir_decoder__dst_pixbuf(                   //
+    const qoir_decoder* decoder) {
+  return &decoder->private_impl.result.dst_pixbuf;
+}
 
-      } else if (chunk_type == 0x20504D58) {  // "XMP "le.
-        if (result.metadata_xmp_ptr) {
-          goto fail_invalid_data;
-        }
-        result.metadata_xmp_ptr = sp;
-        result.metadata_xmp_len = payload_len;
-      }
+QOIR_MAYBE_STATIC uint32_t       //
+qoir_decoder__num_decoded_rows(  //
+    const qoir_decoder* decoder) {
+  return decoder->private_impl.num_decoded_rows;
+}
 
-      sp += payload_len;
-      sn -= payload_len;
-    }
+QOIR_MAYBE_STATIC bool  //
+qoir_decoder__is_done(  //
+    const qoir_decoder* decoder) {
+  return decoder->private_impl.phase == QOIR_DECODER_PHASE__DONE;
+}
 
-    if (!seen_qpix) {
-      goto fail_invalid_data;
-    }
+QOIR_MAYBE_STATIC qoir_decode_result  //
+qoir_decoder__finish(                 //
+    qoir_decoder* decoder) {
+  qoir_decode_result result = {0};
+  if (!decoder) {
+    result.status_message = qoir_status_message__error_invalid_argument;
     return result;
-  } while (false);
+  } else if (decoder->private_impl.result.status_message) {
+    result.status_message = decoder->private_impl.result.status_message;
+  } else if (!decoder->private_impl.decbuf) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+  } else if (decoder->private_impl.phase != QOIR_DECODER_PHASE__DONE) {
+    result.status_message = qoir_status_message__error_invalid_data;
+  } else {
+    result.owned_memory = decoder->private_impl.result.owned_memory;
+    result.dst_pixbuf = decoder->private_impl.result.dst_pixbuf;
+    decoder->private_impl.result.owned_memory = NULL;
+  }
+  qoir_decoder__destroy(decoder);
+  return result;
+}
 
-fail_invalid_data:
-  QOIR_FREE(result.owned_memory);
-  return qoir_private_make_decode_result_error(
-      qoir_status_message__error_invalid_data);
+QOIR_MAYBE_STATIC void  //
+qoir_decoder__destroy(  //
+    qoir_decoder* decoder) {
+  if (!decoder) {
+    return;
+  }
+  const qoir_decode_options* options = &decoder->private_impl.options;
+  if (decoder->private_impl.free_decbuf) {
+    QOIR_FREE(decoder->private_impl.decbuf);
+  }
+  QOIR_FREE_OWNED_MEMORY(decoder->private_impl.result.owned_memory);
+  decoder->private_impl.decbuf = NULL;
+  decoder->private_impl.free_decbuf = false;
+  decoder->private_impl.result.owned_memory = NULL;
+  memset(&decoder->private_impl.result.dst_pixbuf, 0,
+         sizeof(decoder->private_impl.result.dst_pixbuf));
 }
 
 // -------- QOIR Encode
 
 #define QOIR_HASH_TABLE_SHIFT 10
 
+// qoir_private_encode_lossify (and its _etc variants) sets ptr[i] to (ptr[i]
+// >> lossiness) for i in 0 .. len.
+static void                          //
+qoir_private_encode_lossify_scalar(  //
+    uint8_t* ptr,                    //
+    size_t len,                      //
+    uint32_t lossiness) {
+  for (; len > 0; len--) {
+    *ptr++ >>= lossiness;
+  }
+}
+
+#if defined(QOIR_USE_SIMD_AVX2)
+static QOIR_TARGET_AVX2 void       //
+qoir_private_encode_lossify_avx2(  //
+    uint8_t* ptr,                  //
+    size_t len,                    //
+    uint32_t lossiness) {
+  const __m128i count = _mm_cvtsi32_si128((int)lossiness);
+  const __m256i mask = _mm256_set1_epi8((char)(0xFF >> lossiness));
+  for (; len >= 32; len -= 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)ptr);
+    x = _mm256_and_si256(_mm256_srl_epi16(x, count), mask);
+    _mm256_storeu_si256((__m256i*)(void*)ptr, x);
+    ptr += 32;
+  }
+  qoir_private_encode_lossify_scalar(ptr, len, lossiness);
+}
+#endif
+
+static void                   //
+qoir_private_encode_lossify(  //
+    uint8_t* ptr,             //
+    size_t len,               //
+    uint32_t lossiness) {
+#if defined(QOIR_USE_SIMD_AVX2)
+  if (qoir_private_cpu_has_avx2()) {
+    qoir_private_encode_lossify_avx2(ptr, len, lossiness);
+    return;
+  }
+#endif
+#if defined(QOIR_USE_SIMD_SSE2)
+  const __m128i count = _mm_cvtsi32_si128((int)lossiness);
+  const __m128i mask = _mm_set1_epi8((char)(0xFF >> lossiness));
+  for (; len >= 16; len -= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(const void*)ptr);
+    x = _mm_and_si128(_mm_srl_epi16(x, count), mask);
+    _mm_storeu_si128((__m128i*)(void*)ptr, x);
+    ptr += 16;
+  }
+#elif defined(QOIR_USE_SIMD_NEON)
+  const int8x16_t count = vdupq_n_s8((int8_t)(0 - (int)lossiness));
+  for (; len >= 16; len -= 16) {
+    vst1q_u8(ptr, vshlq_u8(vld1q_u8(ptr), count));
+    ptr += 16;
+  }
+#endif
+  qoir_private_encode_lossify_scalar(ptr, len, lossiness);
+}
+
 static QOIR_ALWAYS_INLINE void  //
 qoir_private_encode_dither(     //
     uint8_t* ptr,               //
     uint32_t lossiness,         //
-    uint32_t noise) {
+    uint32_t noise,             //
+    bool gamma_aware) {
   if (*ptr >= 0xFF) {
     *ptr = 0xFF >> lossiness;
     return;
@@ -6406,21 +10671,36 @@ qoir_private_encode_dither(     //
     upper = unshift[low_shifted + 2];
   }
 
-  // Compare the pixel's position in that bracket to the noise.
+  // Compare the pixel's position in that bracket to the noise, either as
+  // gamma encoded (8-bit) or linear light (16-bit) values.
   uint32_t p = *ptr;
   uint32_t l = lower;
   uint32_t u = upper;
-  uint32_t m = ((256 * (p - l)) > (noise * (u - l))) ? u : l;
+  if (gamma_aware) {
+    p = qoir_private_table_linearize[p];
+    l = qoir_private_table_linearize[l];
+    u = qoir_private_table_linearize[u];
+  }
+  uint32_t m = ((256 * (p - l)) > (noise * (u - l))) ? upper : lower;
   *ptr = (uint8_t)(m >> lossiness);
 }
 
+// qoir_private_encode_tile_ops encodes a tile's pixels (4 bytes per pixel, in
+// B, G, R, A order, with the given stride) as ops, quantizing them on the fly
+// (as per lossy, dither and gamma_aware). This is the same as (but faster
+// than) quantizing a copy of the pixels and then encoding that copy.
 static QOIR_ALWAYS_INLINE qoir_size_result  //
 qoir_private_encode_tile_ops(               //
     uint8_t* dst_ptr,                       //
     const uint8_t* src_ptr,                 //
+    size_t src_stride_in_bytes,             //
     uint32_t tw,                            //
     uint32_t th,                            //
-    bool has_alpha) {
+    uint32_t lossiness,                     //
+    bool has_alpha,                         //
+    bool lossy,                             //
+    bool dither,                            //
+    bool gamma_aware) {
   // dists holds the log2 distance from zero (with modular arithmetic).
   //  - There is    1 element  such that (dists[i] <   1).
   //  - There are   2 elements such that (dists[i] <   2).
@@ -6466,151 +10746,832 @@ qoir_private_encode_tile_ops(               //
       0x08, 0x08, 0x08, 0x08, 0x04, 0x04, 0x02, 0x01,  //
   };
 
-  qoir_size_result result = {0};
+  qoir_size_result result = {0};
+
+  uint32_t run_length = 0;
+
+  // color_cache is conceptually "uint8_t color_cache[64][4]" but is flattened
+  // for performance. It is always indexed by a uint8_t value that is a
+  // multiple of four. The four uint8_t elements are in B, G, R, A order.
+  uint8_t color_cache[256];
+  for (int i = 0; i < 256; i += 4) {
+    color_cache[i + 0] = 0x00;
+    color_cache[i + 1] = 0x00;
+    color_cache[i + 2] = 0x00;
+    color_cache[i + 3] = 0xFF;
+  }
+  uint8_t next_color_index = 0;
+  uint8_t color_indexes[1 << QOIR_HASH_TABLE_SHIFT] = {0};
+
+  // cp8x4 and pl8x4 are the current pixel and the pixel left, as uint32_t
+  // values in 0xAARRGGBB form. The pixel left of the first pixel is opaque
+  // black.
+  uint32_t cp8x4 = 0xFF000000u;
+  uint32_t pl8x4 = 0;
+  const uint32_t lossy_mask = 0x01010101u * (0xFFu >> lossiness);
+
+  uint8_t* dp = dst_ptr;
+  for (uint32_t y = 0; y < th; y++) {
+    const uint8_t* sp = src_ptr + (y * src_stride_in_bytes);
+    for (uint32_t x = 0; x < tw; x++, sp += 4) {
+      pl8x4 = cp8x4;
+      cp8x4 = qoir_private_peek_u32le(sp);
+      if (!lossy) {
+        // No-op.
+      } else if (!dither) {
+        cp8x4 = (cp8x4 >> lossiness) & lossy_mask;
+      } else {
+        uint8_t cp[4];
+        qoir_private_poke_u32le(cp, cp8x4);
+        uint8_t noise = qoir_private_table_noise[y & 15][x & 15];
+        qoir_private_encode_dither(cp + 0, lossiness, noise, gamma_aware);
+        qoir_private_encode_dither(cp + 1, lossiness, noise, gamma_aware);
+        qoir_private_encode_dither(cp + 2, lossiness, noise, gamma_aware);
+        qoir_private_encode_dither(cp + 3, lossiness, noise, false);
+        cp8x4 = qoir_private_peek_u32le(cp);
+      }
+
+      if (cp8x4 == pl8x4) {
+        run_length++;
+        if (run_length == 256) {
+          *dp++ = 0xD7;  // QOIR_OP_RUNL
+          *dp++ = 0xFF;
+          run_length = 0;
+        }
+        continue;
+      }
+
+      if (run_length > 0) {
+        if (run_length <= 26) {
+          *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
+          run_length = 0;
+        } else {
+          *dp++ = 0xD7;  // QOIR_OP_RUNL
+          *dp++ = (uint8_t)(run_length - 1);
+          run_length = 0;
+        }
+      }
+
+      // 2654435761u is Knuth's magic constant.
+      uint32_t hash = (cp8x4 * 2654435761u) >> (32 - QOIR_HASH_TABLE_SHIFT);
+      uint8_t index = color_indexes[hash];
+      if (qoir_private_peek_u32le(color_cache + index) == cp8x4) {
+        *dp++ = (uint8_t)(0x00 | index);  // QOIR_OP_INDEX
+        continue;
+      }
+
+      color_indexes[hash] = next_color_index;
+      qoir_private_poke_u32le(color_cache + next_color_index, cp8x4);
+      next_color_index += 4;
+
+      uint8_t delta[4];
+      // Either code path is equivalent to (but faster than) subtracting each
+      // of pl8x4's bytes from the corresponding byte of cp8x4 (modulo 256).
+#if defined(QOIR_USE_SIMD_SSE2)
+      uint32_t delta8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_sub_epi8(
+          _mm_cvtsi32_si128((int)cp8x4), _mm_cvtsi32_si128((int)pl8x4)));
+#elif defined(QOIR_USE_SIMD_NEON)
+      uint32_t delta8x4 = vget_lane_u32(
+          vreinterpret_u32_u8(vsub_u8(vreinterpret_u8_u32(vdup_n_u32(cp8x4)),
+                                      vreinterpret_u8_u32(vdup_n_u32(pl8x4)))),
+          0);
+#else
+      uint32_t delta8x4 = QOIR_SWAR_PSUBB(cp8x4, pl8x4);
+#endif
+      qoir_private_poke_u32le(delta, delta8x4);
+
+      if (!has_alpha || (delta[3] == 0)) {
+        uint8_t dist02 = dists[delta[0]] | dists[delta[2]];
+        uint8_t dist1 = dists[delta[1]];
+        uint8_t dist = dist02 | dist1;
+
+        uint8_t d0d1 = delta[0] - delta[1];
+        uint8_t d2d1 = delta[2] - delta[1];
+
+        if (dist < 0x04) {
+          *dp++ = 0x01 |                         // QOIR_OP_BGR2
+                  ((delta[0] + 0x02) << 0x02) |  //
+                  ((delta[1] + 0x02) << 0x04) |  //
+                  ((delta[2] + 0x02) << 0x06);
+
+        } else if (!((dist1 >> 6) | (dists[d0d1] >> 4) | (dists[d2d1] >> 4))) {
+          *dp++ = 0x02 |                        // QOIR_OP_LUMA
+                  ((delta[1] + 0x20) << 0x02);  //
+          *dp++ = ((d0d1 + 0x08) << 0x00) |     //
+                  ((d2d1 + 0x08) << 0x04);
+
+        } else if (dist < 0x80) {
+          qoir_private_poke_u32le(
+              dp,
+              0x03 |  // QOIR_OP_BGR7
+                  ((uint32_t)(uint8_t)(delta[0] + 0x40) << 0x03) |
+                  ((uint32_t)(uint8_t)(delta[1] + 0x40) << 0x0A) |
+                  ((uint32_t)(uint8_t)(delta[2] + 0x40) << 0x11));
+          dp += 3;
+
+        } else {
+          *dp++ = 0xF7;  // QOIR_OP_BGR8
+          *dp++ = delta[0];
+          *dp++ = delta[1];
+          *dp++ = delta[2];
+        }
+
+      } else if ((delta[0] | delta[1] | delta[2]) == 0) {
+        *dp++ = 0xFF;  // QOIR_OP_A8
+        *dp++ = delta[3];
+
+      } else {
+        uint8_t dist =
+            dists[delta[0]] | dists[delta[1]] | dists[delta[2]] |
+            dists[delta[3]];
+        if (dist < 0x04) {
+          *dp++ = 0xDF;                          // QOIR_OP_BGRA2
+          *dp++ = ((delta[0] + 0x02) << 0x00) |  //
+                  ((delta[1] + 0x02) << 0x02) |  //
+                  ((delta[2] + 0x02) << 0x04) |  //
+                  ((delta[3] + 0x02) << 0x06);
+        } else if (dist < 0x10) {
+          *dp++ = 0xE7;                          // QOIR_OP_BGRA4
+          *dp++ = ((delta[0] + 0x08) << 0x00) |  //
+                  ((delta[1] + 0x08) << 0x04);   //
+          *dp++ = ((delta[2] + 0x08) << 0x00) |  //
+                  ((delta[3] + 0x08) << 0x04);
+        } else {
+          *dp++ = 0xEF;  // QOIR_OP_BGRA8
+          *dp++ = delta[0];
+          *dp++ = delta[1];
+          *dp++ = delta[2];
+          *dp++ = delta[3];
+        }
+      }
+    }
+  }
+
+  if (run_length > 0) {
+    if (run_length <= 26) {
+      *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
+      run_length = 0;
+    } else {
+      *dp++ = 0xD7;  // QOIR_OP_RUNL
+      *dp++ = (uint8_t)(run_length - 1);
+      run_length = 0;
+    }
+  }
+
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
+
+// qoir_private_encode_tile_ops_func is a qoir_private_encode_tile_ops that is
+// specialized for one combination of its bool arguments.
+typedef qoir_size_result (*qoir_private_encode_tile_ops_func)(  //
+    uint8_t* dst_ptr,                                           //
+    const uint8_t* src_ptr,                                     //
+    size_t src_stride_in_bytes,                                 //
+    uint32_t tw,                                                //
+    uint32_t th,                                                //
+    uint32_t lossiness);
+
+#define QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(name, has_alpha, lossy, dither, \
+                                          gamma_aware)                    \
+  static qoir_size_result qoir_private_encode_tile_ops__##name(           \
+      uint8_t* dst_ptr, const uint8_t* src_ptr,                           \
+      size_t src_stride_in_bytes, uint32_t tw, uint32_t th,               \
+      uint32_t lossiness) {                                               \
+    return qoir_private_encode_tile_ops(                                  \
+        dst_ptr, src_ptr, src_stride_in_bytes, tw, th, lossiness,         \
+        has_alpha, lossy, dither, gamma_aware);                           \
+  }
+
+// clang-format off
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(sans_alpha__lossless, false, false, false, false)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(sans_alpha__lossy,    false, true,  false, false)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(sans_alpha__dither,   false, true,  true,  false)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(sans_alpha__gamma,    false, true,  true,  true)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(with_alpha__lossless, true,  false, false, false)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(with_alpha__lossy,    true,  true,  false, false)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(with_alpha__dither,   true,  true,  true,  false)
+QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC(with_alpha__gamma,    true,  true,  true,  true)
+// clang-format on
+
+#undef QOIR_PRIVATE_ENCODE_TILE_OPS_FUNC
+
+// qoir_private_encode_tile_ops_funcs is indexed by whether the source pixel
+// format has alpha and then by the quantization (lossless, lossy, lossy with
+// dither or lossy with gamma-aware dither).
+static const qoir_private_encode_tile_ops_func
+    qoir_private_encode_tile_ops_funcs[2][4] = {
+        {
+            qoir_private_encode_tile_ops__sans_alpha__lossless,
+            qoir_private_encode_tile_ops__sans_alpha__lossy,
+            qoir_private_encode_tile_ops__sans_alpha__dither,
+            qoir_private_encode_tile_ops__sans_alpha__gamma,
+        },
+        {
+            qoir_private_encode_tile_ops__with_alpha__lossless,
+            qoir_private_encode_tile_ops__with_alpha__lossy,
+            qoir_private_encode_tile_ops__with_alpha__dither,
+            qoir_private_encode_tile_ops__with_alpha__gamma,
+        },
+};
+
+// QOIR_ENCODE_JOB_SLACK is the number of bytes (beyond the literal tile
+// format's worst case) that each encoding job might temporarily write when LZ4
+// compressing its last tile.
+#define QOIR_ENCODE_JOB_SLACK \
+  (QOIR_TILE_LZ4_COMPRESSION_WORST_CASE - (4 * QOIR_TS2))
+
+// qoir_private_encode_state holds everything (other than the scratch space)
+// needed to encode any one of the tiles of a source image.
+typedef struct qoir_private_encode_state_struct {
+  // The src_pixbuf's pixcfg is the entire source image's but, when encoding
+  // incrementally, its data (the pixel at its top-left corner) is the pixel at
+  // (0, src_y0) in the entire source image.
+  const qoir_pixel_buffer* src_pixbuf;
+  size_t src_y0;
+  qoir_private_swizzle_func swizzle_func;
+  // swizzle_before_encode is whether the source pixels need converting to
+  // BGRA order (as per swizzle_func) before encode_func can read them. If
+  // false, encode_func reads (and quantizes) the source pixels directly.
+  bool swizzle_before_encode;
+  qoir_private_encode_tile_ops_func encode_func;
+  // constant_mask selects the source pixels' bytes (those that survive
+  // quantization) that must all match for a tile to use the Constant tile
+  // format. Zero means to never use that format, either because the options
+  // don't ask for it or because dithered tiles are rarely uniform after
+  // quantization.
+  uint32_t constant_mask;
+  size_t num_src_channels;
+  uint32_t lossiness;
+  bool dither;
+  bool gamma_aware_dither;
+  // lz4_max_attempts is the number of candidates that the high effort LZ4
+  // match finder checks per position. Zero means to use the default one.
+  uint32_t lz4_max_attempts;
+  // lz4_min_savings_percent is the options' field, clamped to 100.
+  uint32_t lz4_min_savings_percent;
+  bool use_huffman_tile_format;
+  uint64_t width_in_tiles;
+  uint64_t height_in_tiles;
+  // When re-encoding (see qoir_encode_dirty_rectangles), prev_tiles is a
+  // previous encoding's QPIX payload and prev_tile_index holds (as u64le
+  // values) its tiles' positions. Tiles whose dirty_mask byte is zero are
+  // copied from there instead of being encoded. A NULL dirty_mask means to
+  // encode every tile.
+  const uint8_t* prev_tiles;
+  const uint8_t* prev_tile_index;
+  const uint8_t* dirty_mask;
+  // Tiles' stats are gathered if either of stats (the qoir_encode_options'
+  // field) or tile_func is non-NULL.
+  qoir_stats* stats;
+  qoir_tile_func tile_func;
+  void* tile_func_context;
+} qoir_private_encode_state;
+
+// qoir_private_encode_tile_literals writes a tile's pixels, swizzled to BGRA
+// order and quantized, to dst_ptr. If already_swizzled then dst_ptr already
+// holds the swizzled (but not yet quantized) pixels.
+static void                                  //
+qoir_private_encode_tile_literals(           //
+    const qoir_private_encode_state* state,  //
+    uint8_t* dst_ptr,                        //
+    const uint8_t* src_ptr,                  //
+    size_t tw,                               //
+    size_t th,                               //
+    bool already_swizzled) {
+  if (!already_swizzled) {
+    (*state->swizzle_func)(dst_ptr, 4 * tw,                              //
+                           src_ptr, state->src_pixbuf->stride_in_bytes,  //
+                           tw, th);
+  }
+
+  uint32_t lossiness = state->lossiness;
+  if (lossiness == 0) {
+    // No-op.
+  } else if (!state->dither) {
+    qoir_private_encode_lossify(dst_ptr, 4 * tw * th, lossiness);
+  } else {
+    bool gamma_aware = state->gamma_aware_dither;
+    uint8_t* ptr = dst_ptr;
+    for (size_t y = 0; y < th; y++) {
+      for (size_t x = 0; x < tw; x++) {
+        uint8_t noise = qoir_private_table_noise[y & 15][x & 15];
+        qoir_private_encode_dither(ptr + 0, lossiness, noise, gamma_aware);
+        qoir_private_encode_dither(ptr + 1, lossiness, noise, gamma_aware);
+        qoir_private_encode_dither(ptr + 2, lossiness, noise, gamma_aware);
+        qoir_private_encode_dither(ptr + 3, lossiness, noise, false);
+        ptr += 4;
+      }
+    }
+  }
+}
+
+// qoir_private_encode_tile_constant returns whether every one of the tw by th
+// source pixels (sp points to the top-left one) has the same bytes, under the
+// state's constant_mask. If so, it writes the Constant tile format's 4 byte
+// payload (the first pixel, converted to BGRA and quantized) to dst_ptr.
+static bool                                  //
+qoir_private_encode_tile_constant(           //
+    const qoir_private_encode_state* state,  //
+    uint8_t* dst_ptr,                        //
+    const uint8_t* sp,                       //
+    size_t tw,                               //
+    size_t th) {
+  uint32_t mask = state->constant_mask;
+  size_t n = state->num_src_channels;
+  size_t stride = state->src_pixbuf->stride_in_bytes;
+  uint32_t c0 = 0;
+  if (n == 4) {
+    c0 = qoir_private_peek_u32le(sp) & mask;
+    for (size_t y = 0; y < th; y++) {
+      const uint8_t* p = sp + (y * stride);
+      for (size_t x = 0; x < tw; x++, p += 4) {
+        if ((qoir_private_peek_u32le(p) & mask) != c0) {
+          return false;
+        }
+      }
+    }
+  } else {
+    c0 = ((uint32_t)sp[0] | ((uint32_t)sp[1] << 8) | ((uint32_t)sp[2] << 16)) &
+         mask;
+    for (size_t y = 0; y < th; y++) {
+      const uint8_t* p = sp + (y * stride);
+      for (size_t x = 0; x < tw; x++, p += 3) {
+        if ((((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+              ((uint32_t)p[2] << 16)) &
+             mask) != c0) {
+          return false;
+        }
+      }
+    }
+  }
+
+  uint8_t bgra[4];
+  (*state->swizzle_func)(bgra, 4, sp, stride, 1, 1);
+  uint32_t lossiness = state->lossiness;
+  uint32_t c = qoir_private_peek_u32le(bgra);
+  c = (c >> lossiness) & (0x01010101u * (0xFFu >> lossiness));
+  if ((mask >> 24) == 0) {
+    c |= 0xFF000000u;
+  }
+  qoir_private_poke_u32le(dst_ptr, c);
+  return true;
+}
+
+// qoir_private_encode_huffman_code_lengths sets the code lengths (in bits,
+// zero meaning unused) of a Huffman code for the 256 symbol frequencies. The
+// lengths are at most QOIR_HUFFMAN_MAX_CODE_LEN. Each frequency must be
+// below (1 << 24).
+static void                                //
+qoir_private_encode_huffman_code_lengths(  //
+    uint8_t* lengths,                      //
+    const uint32_t* freqs) {
+  memset(lengths, 0, 256);
+
+  // keys are the used symbols, sorted by frequency (in the high 24 bits).
+  uint32_t keys[256];
+  uint32_t n = 0;
+  for (uint32_t symbol = 0; symbol < 256; symbol++) {
+    if (freqs[symbol]) {
+      uint32_t key = (freqs[symbol] << 8) | symbol;
+      uint32_t i = n++;
+      for (; (i > 0) && (keys[i - 1] > key); i--) {
+        keys[i] = keys[i - 1];
+      }
+      keys[i] = key;
+    }
+  }
+  if (n == 0) {
+    return;
+  } else if (n == 1) {
+    lengths[keys[0] & 0xFF] = 1;
+    return;
+  }
+
+  // Build the tree with the two-queue method. Nodes [0, n) and [n, (2*n)-1)
+  // are leaves and internal nodes, both in ascending weight order.
+  uint32_t weights[511];
+  uint16_t parents[511];
+  uint32_t depths[511];
+  for (uint32_t i = 0; i < n; i++) {
+    weights[i] = keys[i] >> 8;
+  }
+  uint32_t next_leaf = 0;
+  uint32_t next_internal = n;
+  for (uint32_t node = n; node < ((2 * n) - 1); node++) {
+    weights[node] = 0;
+    for (int k = 0; k < 2; k++) {
+      uint32_t child =
+          ((next_leaf < n) && ((next_internal >= node) ||
+                               (weights[next_leaf] <= weights[next_internal])))
+              ? next_leaf++
+              : next_internal++;
+      weights[node] += weights[child];
+      parents[child] = (uint16_t)node;
+    }
+  }
+  depths[(2 * n) - 2] = 0;
+  for (uint32_t i = (2 * n) - 2; i-- > 0;) {
+    depths[i] = depths[parents[i]] + 1;
+  }
+
+  // Limit the lengths: clamp them and then, while the Kraft sum (scaled by
+  // (1 << QOIR_HUFFMAN_MAX_CODE_LEN)) overflows, lengthen the longest code
+  // that can be lengthened. As leaves are in ascending weight order, their
+  // depths are in descending order.
+  uint32_t kraft = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (depths[i] > QOIR_HUFFMAN_MAX_CODE_LEN) {
+      depths[i] = QOIR_HUFFMAN_MAX_CODE_LEN;
+    }
+    kraft += 1u << (QOIR_HUFFMAN_MAX_CODE_LEN - depths[i]);
+  }
+  while (kraft > (1u << QOIR_HUFFMAN_MAX_CODE_LEN)) {
+    uint32_t i = 0;
+    while (depths[i] == QOIR_HUFFMAN_MAX_CODE_LEN) {
+      i++;
+    }
+    kraft -= 1u << (QOIR_HUFFMAN_MAX_CODE_LEN - 1 - depths[i]);
+    depths[i]++;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    lengths[keys[i] & 0xFF] = (uint8_t)depths[i];
+  }
+}
+
+// qoir_private_encode_tile_huffman writes a tile's src_len bytes of ops (at
+// most (4 * QOIR_TS2) bytes), in the Huffman-Ops tile format, to dst_ptr if
+// that is shorter than max_len bytes. It returns the number of bytes written,
+// or zero if it wrote nothing.
+static size_t                              //
+qoir_private_encode_tile_huffman(          //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t max_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len) {
+  if (max_len <= QOIR_HUFFMAN_HEADER_LEN) {
+    return 0;
+  }
+
+  // Count each stream's symbol frequencies, choose the code lengths and so
+  // calculate the exact encoded length, before writing anything.
+  uint32_t stream_freqs[4][256] = {{0}};
+  for (size_t m = 0; m < src_len; m++) {
+    stream_freqs[m & 3][src_ptr[m]]++;
+  }
+  uint32_t freqs[256];
+  for (uint32_t symbol = 0; symbol < 256; symbol++) {
+    freqs[symbol] = stream_freqs[0][symbol] + stream_freqs[1][symbol] +
+                    stream_freqs[2][symbol] + stream_freqs[3][symbol];
+  }
+  uint8_t lengths[256];
+  qoir_private_encode_huffman_code_lengths(lengths, freqs);
+  size_t stream_lens[4];
+  size_t total_len = QOIR_HUFFMAN_HEADER_LEN;
+  for (int j = 0; j < 4; j++) {
+    size_t num_bits = 0;
+    for (uint32_t symbol = 0; symbol < 256; symbol++) {
+      num_bits += (size_t)stream_freqs[j][symbol] * lengths[symbol];
+    }
+    stream_lens[j] = (num_bits + 7) / 8;
+    total_len += stream_lens[j];
+  }
+  if (total_len >= max_len) {
+    return 0;
+  }
 
-  uint32_t run_length = 0;
+  // Assign the canonical codes, bit-reversed for LSB-first writing.
+  uint32_t counts[QOIR_HUFFMAN_MAX_CODE_LEN + 1] = {0};
+  for (uint32_t symbol = 0; symbol < 256; symbol++) {
+    counts[lengths[symbol]]++;
+  }
+  uint32_t next_codes[QOIR_HUFFMAN_MAX_CODE_LEN + 1] = {0};
+  uint32_t code = 0;
+  for (uint32_t n = 1; n <= QOIR_HUFFMAN_MAX_CODE_LEN; n++) {
+    code = (code + ((n > 1) ? counts[n - 1] : 0)) << 1;
+    next_codes[n] = code;
+  }
+  uint32_t codes[256];
+  for (uint32_t symbol = 0; symbol < 256; symbol++) {
+    uint32_t n = lengths[symbol];
+    codes[symbol] =
+        n ? qoir_private_huffman_reverse_code(next_codes[n]++, n) : 0;
+  }
 
-  // color_cache is conceptually "uint8_t color_cache[64][4]" but is flattened
-  // for performance. It is always indexed by a uint8_t value that is a
-  // multiple of four. The four uint8_t elements are in B, G, R, A order.
-  uint8_t color_cache[256];
-  for (int i = 0; i < 256; i += 4) {
-    color_cache[i + 0] = 0x00;
-    color_cache[i + 1] = 0x00;
-    color_cache[i + 2] = 0x00;
-    color_cache[i + 3] = 0xFF;
+  // Write the header and then the streams.
+  uint8_t* dp = dst_ptr;
+  for (uint32_t i = 0; i < 128; i++) {
+    dp[i] = (uint8_t)(lengths[(2 * i) + 0] | (lengths[(2 * i) + 1] << 4));
   }
-  uint8_t next_color_index = 0;
-  uint8_t color_indexes[1 << QOIR_HASH_TABLE_SHIFT] = {0};
+  qoir_private_poke_u16le(dp + 128, (uint16_t)src_len);
+  for (int j = 0; j < 3; j++) {
+    qoir_private_poke_u16le(dp + 130 + (2 * j), (uint16_t)stream_lens[j]);
+  }
+  dp += QOIR_HUFFMAN_HEADER_LEN;
+  for (size_t j = 0; j < 4; j++) {
+    uint64_t bits = 0;
+    uint32_t num_bits = 0;
+    for (size_t m = j; m < src_len; m += 4) {
+      bits |= (uint64_t)codes[src_ptr[m]] << num_bits;
+      num_bits += lengths[src_ptr[m]];
+      if (num_bits >= 32) {
+        qoir_private_poke_u32le(dp, (uint32_t)bits);
+        dp += 4;
+        bits >>= 32;
+        num_bits -= 32;
+      }
+    }
+    for (; num_bits > 0; num_bits = (num_bits > 8) ? (num_bits - 8) : 0) {
+      *dp++ = (uint8_t)bits;
+      bits >>= 8;
+    }
+  }
+  return total_len;
+}
+
+// qoir_private_encode_tile_lz4 LZ4 compresses a tile's ops or literals,
+// with the state's choice of match finder, to dst_ptr. That destination has
+// room for QOIR_TILE_LZ4_COMPRESSION_WORST_CASE bytes.
+//
+// It returns the compressed length if that is worth using instead of an
+// uncompressed tile format (Literals or Ops) that is uncompressed_len bytes
+// long, per the state's lz4_min_savings_percent, or zero otherwise. It
+// doesn't bother compressing if even LZ4's shortest output isn't worth it:
+// LZ4 can't shorten 12 or fewer bytes and, for longer input, it produces at
+// least 9 bytes (two tokens, an offset and 5 final literals).
+static inline size_t                         //
+qoir_private_encode_tile_lz4(                //
+    const qoir_private_encode_state* state,  //
+    qoir_encode_buffer* encbuf,              //
+    uint8_t* dst_ptr,                        //
+    const uint8_t* src_ptr,                  //
+    size_t src_len,                          //
+    size_t uncompressed_len) {
+  // max_len is the maximum compressed length worth using, times 100.
+  size_t max_len = uncompressed_len * (100 - state->lz4_min_savings_percent);
+  if ((src_len <= 12) || (max_len < 900)) {
+    return 0;
+  }
+  qoir_size_result r =
+      state->lz4_max_attempts
+          ? qoir_lz4_private_block_encode_hc(
+                dst_ptr, QOIR_TILE_LZ4_COMPRESSION_WORST_CASE, src_ptr,
+                src_len, encbuf->private_impl.lz4_chain,
+                encbuf->private_impl.lz4_heads, state->lz4_max_attempts)
+          : qoir_lz4_block_encode(dst_ptr,
+                                  QOIR_TILE_LZ4_COMPRESSION_WORST_CASE,
+                                  src_ptr, src_len);
+  if (r.status_message || (r.value >= uncompressed_len) ||
+      ((r.value * 100) > max_len)) {
+    return 0;
+  }
+  return r.value;
+}
+
+// qoir_private_encode_copy_tile copies the k'th tile (its prefix and
+// payload) of the state's previous encoding to dst_ptr, returning the number
+// of bytes written, or zero if that tile is invalid. A Back-Reference tile is
+// replaced by a copy of the tile that it refers to, as the two encodings'
+// byte offsets differ.
+static size_t                                //
+qoir_private_encode_copy_tile(               //
+    const qoir_private_encode_state* state,  //
+    uint8_t* dst_ptr,                        //
+    uint64_t k) {
+  uint64_t tile_pos = qoir_private_peek_u64le(state->prev_tile_index + (8 * k));
+  const uint8_t* sp = state->prev_tiles + tile_pos;
+  uint32_t prefix = qoir_private_peek_u32le(sp);
+  if ((prefix >> 24) == 5) {  // Back-Reference tile format.
+    uint64_t ref_pos = qoir_private_peek_u64le(sp + 4);
+    if (((prefix & 0xFFFFFF) != 8) || (tile_pos < 4) ||
+        (ref_pos > (tile_pos - 4))) {
+      return 0;
+    }
+    sp = state->prev_tiles + ref_pos;
+    prefix = qoir_private_peek_u32le(sp);
+    if (((prefix >> 24) == 5) ||
+        ((prefix & 0xFFFFFF) > (tile_pos - ref_pos - 4))) {
+      return 0;
+    }
+  }
+  size_t n = 4 + (prefix & 0xFFFFFF);
+  if (((prefix >> 24) > 6) || (n > (4 + (4 * QOIR_TS2)))) {
+    return 0;
+  }
+  memcpy(dst_ptr, sp, n);
+  return n;
+}
 
+// qoir_private_encode_tile encodes the tile whose top-left offset, width and
+// height (all measured in pixels) are tx, ty, tw and th to dst_ptr, returning
+// the number of bytes written. If tile_stats is non-NULL then, for tile
+// formats that hold ops, it also sets tile_stats' uncompressed_len and op
+// counts. Those fields must be zero on entry.
+static qoir_size_result                      //
+qoir_private_encode_tile(                    //
+    const qoir_private_encode_state* state,  //
+    qoir_encode_buffer* encbuf,              //
+    uint8_t* dst_ptr,                        //
+    size_t tx,                               //
+    size_t ty,                               //
+    size_t tw,                               //
+    size_t th,                               //
+    qoir_tile_stats* tile_stats) {
+  qoir_size_result result = {0};
+  const qoir_pixel_buffer* src_pixbuf = state->src_pixbuf;
+  uint32_t lossiness = state->lossiness;
   uint8_t* dp = dst_ptr;
-  const uint8_t* sp = src_ptr + QOIR_LITERALS_PRE_PADDING;
-  const uint8_t* sq =
-      src_ptr + QOIR_LITERALS_PRE_PADDING + (4 * (size_t)tw * (size_t)th);
-  for (; sp < sq; sp += 4) {
-    if (!memcmp(sp, sp - 4, 4)) {
-      run_length++;
-      if (run_length == 256) {
-        *dp++ = 0xD7;  // QOIR_OP_RUNL
-        *dp++ = 0xFF;
-        run_length = 0;
+  uint8_t* literals = encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+
+  const uint8_t* sp = src_pixbuf->data +
+                      (src_pixbuf->stride_in_bytes * (ty - state->src_y0)) +
+                      (state->num_src_channels * tx);
+  if (state->constant_mask &&
+      qoir_private_encode_tile_constant(state, dp + 4, sp, tw, th)) {
+    qoir_private_poke_u32le(dp, 0x04000004);  // Constant tile format.
+    result.value = 8;
+    return result;
+  }
+
+  // Sources already in BGRA order are encoded (as ops) directly. Only if
+  // the Literals or LZ4-Literals tile format wins do we need a copy.
+  qoir_size_result r0 = {0};
+  if (state->swizzle_before_encode) {
+    (*state->swizzle_func)(literals, 4 * tw,                 //
+                           sp, src_pixbuf->stride_in_bytes,  //
+                           tw, th);
+    r0 = (*state->encode_func)(encbuf->private_impl.ops, literals, 4 * tw, tw,
+                               th, lossiness);
+  } else {
+    r0 = (*state->encode_func)(encbuf->private_impl.ops, sp,
+                               src_pixbuf->stride_in_bytes, tw, th, lossiness);
+  }
+  if (r0.status_message) {
+    return r0;
+  } else if (tile_stats) {
+    // Count the ops now, as the ops buffer may be re-used below. Our caller
+    // discards the counts if the chosen tile format doesn't hold ops.
+    qoir_private_tile_stats__count_ops(tile_stats, encbuf->private_impl.ops,
+                                       r0.value);
+  }
+  size_t literals_len = 4 * tw * th;
+  if (r0.value >= literals_len) {
+    // Use the Literals or LZ4-Literals tile format.
+    qoir_private_encode_tile_literals(state, literals, sp, tw, th,
+                                      state->swizzle_before_encode);
+    size_t n = qoir_private_encode_tile_lz4(state, encbuf, dp + 4, literals,
+                                            literals_len, literals_len);
+    if (n) {
+      qoir_private_poke_u32le(dp, 0x02000000 | (uint32_t)n);
+    } else {
+      memcpy(dp + 4, literals, literals_len);
+      qoir_private_poke_u32le(dp, 0x00000000 | (uint32_t)literals_len);
+      n = literals_len;
+    }
+
+    // Even longer-than-literals ops can be shorter once entropy coded.
+    if (state->use_huffman_tile_format && (r0.value <= (4 * QOIR_TS2))) {
+      size_t n2 = qoir_private_encode_tile_huffman(
+          dp + 4, n, encbuf->private_impl.ops, r0.value);
+      if (n2) {
+        qoir_private_poke_u32le(dp, 0x06000000 | (uint32_t)n2);
+        n = n2;
       }
-      continue;
+    }
+    dp += 4 + n;
+
+  } else {
+    // Use the Ops or LZ4-Ops tile format.
+    size_t n = qoir_private_encode_tile_lz4(state, encbuf, dp + 4,
+                                            encbuf->private_impl.ops, r0.value,
+                                            r0.value);
+    if (n) {
+      qoir_private_poke_u32le(dp, 0x03000000 | (uint32_t)n);
+    } else {
+      memcpy(dp + 4, encbuf->private_impl.ops, r0.value);
+      qoir_private_poke_u32le(dp, 0x01000000 | (uint32_t)r0.value);
+      n = r0.value;
     }
 
-    if (run_length > 0) {
-      if (run_length <= 26) {
-        *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
-        run_length = 0;
-      } else {
-        *dp++ = 0xD7;  // QOIR_OP_RUNL
-        *dp++ = (uint8_t)(run_length - 1);
-        run_length = 0;
+    // Try the Huffman-Ops tile format (which only writes to dp if it's
+    // shorter) before the ops buffer is re-used below.
+    if (state->use_huffman_tile_format) {
+      size_t n2 = qoir_private_encode_tile_huffman(
+          dp + 4, n, encbuf->private_impl.ops, r0.value);
+      if (n2) {
+        qoir_private_poke_u32le(dp, 0x06000000 | (uint32_t)n2);
+        n = n2;
       }
     }
 
-    // 2654435761u is Knuth's magic constant.
-    uint32_t hash = (qoir_private_peek_u32le(sp) * 2654435761u) >>
-                    (32 - QOIR_HASH_TABLE_SHIFT);
-    uint8_t index = color_indexes[hash];
-    if (!memcmp(color_cache + index, sp, 4)) {
-      *dp++ = (uint8_t)(0x00 | index);  // QOIR_OP_INDEX
-      continue;
+    // With a high effort, also try the LZ4-Literals tile format, which
+    // sometimes beats the LZ4-Ops one, e.g. for repeating patterns that
+    // span more than a few pixels. The literals are compressed to the
+    // (no longer needed) ops buffer and, like the LZ4-Ops tile format, have
+    // to be worth using instead of the (uncompressed) Ops tile format.
+    if (state->lz4_max_attempts) {
+      qoir_private_encode_tile_literals(state, literals, sp, tw, th,
+                                        state->swizzle_before_encode);
+      size_t n2 = qoir_private_encode_tile_lz4(
+          state, encbuf, encbuf->private_impl.ops, literals, literals_len,
+          r0.value);
+      if (n2 && (n2 < n)) {
+        memcpy(dp + 4, encbuf->private_impl.ops, n2);
+        qoir_private_poke_u32le(dp, 0x02000000 | (uint32_t)n2);
+        n = n2;
+      }
     }
+    dp += 4 + n;
+  }
 
-    color_indexes[hash] = next_color_index;
-    memcpy(color_cache + next_color_index, sp, 4);
-    next_color_index += 4;
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
 
-    uint8_t delta[4];
-    uint32_t cp8x4;  // Current pixel.
-    uint32_t pl8x4;  // Pixel left.
-    memcpy(&cp8x4, sp, 4);
-    memcpy(&pl8x4, sp - 4, 4);
-    // Either code path is equivalent to (but faster than):
-    //   delta[i] = sp[i] - sp[i - 4];
-    // for i in 0..4.
-#if defined(QOIR_USE_SIMD_SSE2)
-    uint32_t delta8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_sub_epi8(
-        _mm_cvtsi32_si128((int)cp8x4), _mm_cvtsi32_si128((int)pl8x4)));
-#else
-    uint32_t delta8x4 = QOIR_SWAR_PSUBB(cp8x4, pl8x4);
-#endif
-    memcpy(delta, &delta8x4, 4);
-
-    if (!has_alpha || (delta[3] == 0)) {
-      uint8_t dist02 = dists[delta[0]] | dists[delta[2]];
-      uint8_t dist1 = dists[delta[1]];
-      uint8_t dist = dist02 | dist1;
-
-      uint8_t d0d1 = delta[0] - delta[1];
-      uint8_t d2d1 = delta[2] - delta[1];
-
-      if (dist < 0x04) {
-        *dp++ = 0x01 |                         // QOIR_OP_BGR2
-                ((delta[0] + 0x02) << 0x02) |  //
-                ((delta[1] + 0x02) << 0x04) |  //
-                ((delta[2] + 0x02) << 0x06);
-
-      } else if (!((dist1 >> 6) | (dists[d0d1] >> 4) | (dists[d2d1] >> 4))) {
-        *dp++ = 0x02 |                        // QOIR_OP_LUMA
-                ((delta[1] + 0x20) << 0x02);  //
-        *dp++ = ((d0d1 + 0x08) << 0x00) |     //
-                ((d2d1 + 0x08) << 0x04);
-
-      } else if (dist < 0x80) {
-        qoir_private_poke_u32le(
-            dp,
-            0x03 |  // QOIR_OP_BGR7
-                ((uint32_t)(uint8_t)(delta[0] + 0x40) << 0x03) |
-                ((uint32_t)(uint8_t)(delta[1] + 0x40) << 0x0A) |
-                ((uint32_t)(uint8_t)(delta[2] + 0x40) << 0x11));
-        dp += 3;
+// qoir_private_encode_tile_range encodes the tiles in the range begin
+// (inclusive) to end (exclusive), in the natural order, to consecutive bytes
+// starting at dst_ptr. It writes at most ((end - begin) * (4 + (4 *
+// QOIR_TS2))) + QOIR_ENCODE_JOB_SLACK bytes but the result's value (the number
+// of bytes written, excluding any temporary slack) does not exceed the first
+// term of that sum.
+//
+// If the state asks for them, it also gathers the encoded tiles' stats,
+// setting the encbuf's to their sum and passing each to the state's
+// tile_func.
+static qoir_size_result                      //
+qoir_private_encode_tile_range(              //
+    const qoir_private_encode_state* state,  //
+    qoir_encode_buffer* encbuf,              //
+    uint8_t* dst_ptr,                        //
+    uint64_t begin,                          //
+    uint64_t end) {
+  qoir_size_result result = {0};
+  const qoir_pixel_buffer* src_pixbuf = state->src_pixbuf;
+  size_t ty1 = (state->height_in_tiles - 1) << QOIR_TILE_SHIFT;
+  size_t tx1 = (state->width_in_tiles - 1) << QOIR_TILE_SHIFT;
+  uint8_t* dp = dst_ptr;
+  bool with_stats = state->stats || state->tile_func;
+  memset(&encbuf->private_impl.stats, 0, sizeof(encbuf->private_impl.stats));
 
-      } else {
-        *dp++ = 0xF7;  // QOIR_OP_BGR8
-        *dp++ = delta[0];
-        *dp++ = delta[1];
-        *dp++ = delta[2];
+  for (uint64_t k = begin; k < end; k++) {
+    if (state->dirty_mask && !state->dirty_mask[k]) {
+      size_t n = qoir_private_encode_copy_tile(state, dp, k);
+      if (!n) {
+        result.status_message = qoir_status_message__error_invalid_data;
+        return result;
       }
+      dp += n;
+      continue;
+    }
 
-    } else if ((delta[0] | delta[1] | delta[2]) == 0) {
-      *dp++ = 0xFF;  // QOIR_OP_A8
-      *dp++ = delta[3];
-
-    } else {
-      uint8_t dist =
-          dists[delta[0]] | dists[delta[1]] | dists[delta[2]] | dists[delta[3]];
-      if (dist < 0x04) {
-        *dp++ = 0xDF;                          // QOIR_OP_BGRA2
-        *dp++ = ((delta[0] + 0x02) << 0x00) |  //
-                ((delta[1] + 0x02) << 0x02) |  //
-                ((delta[2] + 0x02) << 0x04) |  //
-                ((delta[3] + 0x02) << 0x06);
-      } else if (dist < 0x10) {
-        *dp++ = 0xE7;                          // QOIR_OP_BGRA4
-        *dp++ = ((delta[0] + 0x08) << 0x00) |  //
-                ((delta[1] + 0x08) << 0x04);   //
-        *dp++ = ((delta[2] + 0x08) << 0x00) |  //
-                ((delta[3] + 0x08) << 0x04);
-      } else {
-        *dp++ = 0xEF;  // QOIR_OP_BGRA8
-        *dp++ = delta[0];
-        *dp++ = delta[1];
-        *dp++ = delta[2];
-        *dp++ = delta[3];
+    // ty, tx, tw and th are the tile's top-left offset, width and height, all
+    // measured in pixels.
+    size_t ty = (size_t)(k / state->width_in_tiles) << QOIR_TILE_SHIFT;
+    size_t tx = (size_t)(k % state->width_in_tiles) << QOIR_TILE_SHIFT;
+    size_t tw = qoir_private_tile_dimension(tx < tx1,
+                                            src_pixbuf->pixcfg.width_in_pixels);
+    size_t th = qoir_private_tile_dimension(
+        ty < ty1, src_pixbuf->pixcfg.height_in_pixels);
+
+    if (!with_stats) {
+      qoir_size_result r =
+          qoir_private_encode_tile(state, encbuf, dp, tx, ty, tw, th, NULL);
+      if (r.status_message) {
+        return r;
       }
+      dp += r.value;
+      continue;
     }
-  }
 
-  if (run_length > 0) {
-    if (run_length <= 26) {
-      *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
-      run_length = 0;
-    } else {
-      *dp++ = 0xD7;  // QOIR_OP_RUNL
-      *dp++ = (uint8_t)(run_length - 1);
-      run_length = 0;
+    qoir_tile_stats tile_stats = {0};
+    uint64_t t0 = state->tile_func ? qoir_private_monotonic_nanos() : 0;
+    qoir_size_result r = qoir_private_encode_tile(state, encbuf, dp, tx, ty,
+                                                  tw, th, &tile_stats);
+    if (r.status_message) {
+      return r;
+    }
+    uint32_t prefix = qoir_private_peek_u32le(dp);
+    dp += r.value;
+    tile_stats.tile_x = (uint32_t)(tx >> QOIR_TILE_SHIFT);
+    tile_stats.tile_y = (uint32_t)(ty >> QOIR_TILE_SHIFT);
+    tile_stats.width_in_pixels = (uint32_t)tw;
+    tile_stats.height_in_pixels = (uint32_t)th;
+    tile_stats.tile_format = prefix >> 24;
+    tile_stats.compressed_len = prefix & 0xFFFFFF;
+    switch (tile_stats.tile_format) {
+      case 0:  // Literals tile format.
+      case 2:  // LZ4-Literals tile format.
+      case 4:  // Constant tile format.
+        tile_stats.uncompressed_len =
+            (tile_stats.tile_format == 4) ? 4 : (4 * tw * th);
+        memset(tile_stats.num_ops_by_type, 0,
+               sizeof(tile_stats.num_ops_by_type));
+        break;
+    }
+    qoir_private_stats__add_tile(&encbuf->private_impl.stats, &tile_stats);
+    if (state->tile_func) {
+      tile_stats.duration_in_nanoseconds = qoir_private_monotonic_nanos() - t0;
+      (*state->tile_func)(state->tile_func_context, &tile_stats);
     }
   }
 
@@ -6618,223 +11579,703 @@ qoir_private_encode_tile_ops(               //
   return result;
 }
 
-static qoir_size_result                   //
-qoir_private_encode_tile_ops_sans_alpha(  //
-    uint8_t* dst_ptr,                     //
-    const uint8_t* src_ptr,               //
-    uint32_t tw,                          //
-    uint32_t th) {
-  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, false);
+// qoir_private_encode_job_begin returns the first tile of the job_index'th of
+// num_jobs jobs. A job's tiles are from its begin (inclusive) to the next
+// job's begin (exclusive).
+static inline uint64_t          //
+qoir_private_encode_job_begin(  //
+    uint64_t number_of_tiles,   //
+    uint32_t job_index,         //
+    uint32_t num_jobs) {
+  return (number_of_tiles * job_index) / num_jobs;
 }
 
-static qoir_size_result                   //
-qoir_private_encode_tile_ops_with_alpha(  //
-    uint8_t* dst_ptr,                     //
-    const uint8_t* src_ptr,               //
-    uint32_t tw,                          //
-    uint32_t th) {
-  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, true);
+// qoir_private_encode_job_dst_ptr returns where the job_index'th job writes
+// its tiles, so that every job's worst case output (including its own slack)
+// lies in its own disjoint region.
+static inline uint8_t*            //
+qoir_private_encode_job_dst_ptr(  //
+    uint8_t* dst_ptr,             //
+    uint64_t number_of_tiles,     //
+    uint32_t job_index,           //
+    uint32_t num_jobs) {
+  uint64_t begin =
+      qoir_private_encode_job_begin(number_of_tiles, job_index, num_jobs);
+  return dst_ptr + (begin * (4 + (4 * QOIR_TS2))) +
+         ((uint64_t)job_index * QOIR_ENCODE_JOB_SLACK);
 }
 
-static qoir_size_result                   //
-qoir_private_encode_qpix_payload(         //
-    qoir_encode_buffer* encbuf,           //
-    uint8_t* dst_ptr,                     //
+// qoir_private_encode_jobs is a batch of (num_jobs) jobs that, together,
+// encode number_of_tiles tiles (starting at the begin'th tile) to dst_ptr.
+// Each batch can use up to max_num_jobs jobs.
+typedef struct qoir_private_encode_jobs_struct {
+  const qoir_encode_options* options;
+  const qoir_private_encode_state* state;
+  qoir_encode_buffer* encbuf0;
+  qoir_encode_buffer* other_encbufs;
+  qoir_size_result* results;
+  uint32_t max_num_jobs;
+
+  uint8_t* dst_ptr;
+  uint64_t begin;
+  uint64_t number_of_tiles;
+  uint32_t num_jobs;
+} qoir_private_encode_jobs;
+
+static void                    //
+qoir_private_encode_job_func(  //
+    void* job_context,         //
+    uint32_t job_index) {
+  qoir_private_encode_jobs* jobs = (qoir_private_encode_jobs*)job_context;
+  if (job_index >= jobs->num_jobs) {
+    return;
+  }
+  uint64_t begin = qoir_private_encode_job_begin(jobs->number_of_tiles,
+                                                 job_index + 0, jobs->num_jobs);
+  uint64_t end = qoir_private_encode_job_begin(jobs->number_of_tiles,
+                                               job_index + 1, jobs->num_jobs);
+  jobs->results[job_index] = qoir_private_encode_tile_range(
+      jobs->state,
+      job_index ? &jobs->other_encbufs[job_index - 1] : jobs->encbuf0,
+      qoir_private_encode_job_dst_ptr(jobs->dst_ptr, jobs->number_of_tiles,
+                                      job_index, jobs->num_jobs),
+      jobs->begin + begin, jobs->begin + end);
+}
+
+// qoir_private_encode_num_jobs returns how many jobs qoir_encode will use.
+static uint32_t                          //
+qoir_private_encode_num_jobs(            //
+    const qoir_encode_options* options,  //
+    uint64_t number_of_tiles) {
+  if (!options || !options->contextual_run_jobs_func ||
+      (options->max_num_jobs <= 1)) {
+    return 1;
+  }
+  uint32_t n = (options->max_num_jobs < QOIR_MAX_NUM_JOBS)
+                   ? options->max_num_jobs
+                   : QOIR_MAX_NUM_JOBS;
+  if (number_of_tiles < n) {
+    return (number_of_tiles > 1) ? (uint32_t)number_of_tiles : 1;
+  }
+  return n;
+}
+
+// qoir_private_encode_init_state sets the state's fields that depend on the
+// source pixel buffer and the encoding options (which may be NULL). The
+// lossiness argument overrides the options' lossiness, having been clamped.
+static const char*                        //
+qoir_private_encode_init_state(           //
+    qoir_private_encode_state* state,     //
     const qoir_pixel_buffer* src_pixbuf,  //
     uint32_t lossiness,                   //
-    bool dither) {
-  qoir_size_result result = {0};
-
-  size_t height_in_tiles =
+    const qoir_encode_options* options) {
+  bool dither = options && options->dither;
+  bool gamma_aware_dither = dither && options->gamma_aware_dither;
+  state->src_pixbuf = src_pixbuf;
+  state->height_in_tiles =
       qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.height_in_pixels);
-  size_t width_in_tiles =
+  state->width_in_tiles =
       qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.width_in_pixels);
-  if ((height_in_tiles == 0) || (width_in_tiles == 0)) {
-    return result;
-  }
-  size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
-  size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
 
-  qoir_private_swizzle_func swizzle_func = NULL;
   switch (src_pixbuf->pixcfg.pixfmt) {
     case QOIR_PIXEL_FORMAT__BGRX:
     case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
     case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
-      swizzle_func = qoir_private_swizzle__copy_4;
+      state->swizzle_func = qoir_private_swizzle__copy_4;
       break;
     case QOIR_PIXEL_FORMAT__BGR:
-      swizzle_func = qoir_private_swizzle__bgra__bgr;
+      state->swizzle_func = qoir_private_swizzle__bgra__bgr;
       break;
     case QOIR_PIXEL_FORMAT__RGBX:
     case QOIR_PIXEL_FORMAT__RGBA_NONPREMUL:
     case QOIR_PIXEL_FORMAT__RGBA_PREMUL:
-      swizzle_func = qoir_private_swizzle__bgra__rgba;
+      state->swizzle_func = qoir_private_swizzle__bgra__rgba;
       break;
     case QOIR_PIXEL_FORMAT__RGB:
-      swizzle_func = qoir_private_swizzle__bgra__rgb;
+      state->swizzle_func = qoir_private_swizzle__bgra__rgb;
       break;
     default:
-      result.status_message = qoir_status_message__error_unsupported_pixfmt;
-      return result;
+      return qoir_status_message__error_unsupported_pixfmt;
+  }
+  state->swizzle_before_encode =
+      state->swizzle_func != qoir_private_swizzle__copy_4;
+  state->swizzle_func = qoir_private_dispatch_swizzle_func(state->swizzle_func);
+
+  bool has_alpha = (src_pixbuf->pixcfg.pixfmt &
+                    QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) !=
+                   QOIR_PIXEL_ALPHA_TRANSPARENCY__OPAQUE;
+  uint32_t quantization = 0;
+  if (lossiness) {
+    quantization = !dither ? 1 : !gamma_aware_dither ? 2 : 3;
+  }
+  state->encode_func =
+      qoir_private_encode_tile_ops_funcs[has_alpha ? 1 : 0][quantization];
+  if (!options || !options->use_constant_tile_format ||
+      (lossiness && dither)) {
+    state->constant_mask = 0;
+  } else {
+    state->constant_mask = 0x01010101u * ((0xFFu << lossiness) & 0xFFu);
+    if (!has_alpha || (src_pixbuf->pixcfg.pixfmt == QOIR_PIXEL_FORMAT__BGR) ||
+        (src_pixbuf->pixcfg.pixfmt == QOIR_PIXEL_FORMAT__RGB)) {
+      state->constant_mask &= 0x00FFFFFFu;
+    }
+  }
+  state->num_src_channels =
+      qoir_pixel_format__bytes_per_pixel(src_pixbuf->pixcfg.pixfmt);
+  state->lossiness = lossiness;
+  state->dither = dither;
+  state->gamma_aware_dither = gamma_aware_dither;
+  uint32_t effort = options ? options->effort : 0;
+  state->lz4_max_attempts = effort ? (4u << ((effort < 9) ? effort : 9)) : 0;
+  uint32_t percent = options ? options->lz4_min_savings_percent : 0;
+  state->lz4_min_savings_percent = (percent < 100) ? percent : 100;
+  state->use_huffman_tile_format = options && options->use_huffman_tile_format;
+  if (options) {
+    state->stats = options->stats;
+    state->tile_func = options->contextual_tile_func;
+    state->tile_func_context = options->tile_func_context;
+  }
+  return NULL;
+}
+
+// qoir_private_encode_jobs__initialize allocates the scratch space (other than
+// the first job's, which is encbuf0) and results for up to num_jobs jobs.
+static const char*                           //
+qoir_private_encode_jobs__initialize(        //
+    qoir_private_encode_jobs* jobs,          //
+    const qoir_encode_options* options,      //
+    const qoir_private_encode_state* state,  //
+    qoir_encode_buffer* encbuf0,             //
+    uint32_t num_jobs) {
+  memset(jobs, 0, sizeof(*jobs));
+  jobs->options = options;
+  jobs->state = state;
+  jobs->encbuf0 = encbuf0;
+  jobs->max_num_jobs = num_jobs;
+  if (num_jobs <= 1) {
+    return NULL;
+  }
+  size_t alloc_len = ((num_jobs - 1) * sizeof(qoir_encode_buffer)) +
+                     (num_jobs * sizeof(qoir_size_result));
+  uint8_t* alloc_ptr =
+      (options && options->context)
+          ? qoir_private_context__scratch(options->context,
+                                          QOIR_CONTEXT_SCRATCH__JOBS, alloc_len)
+          : (uint8_t*)QOIR_MALLOC(alloc_len);
+  if (!alloc_ptr) {
+    return qoir_status_message__error_out_of_memory;
   }
+  jobs->results = (qoir_size_result*)(void*)alloc_ptr;
+  jobs->other_encbufs =
+      (qoir_encode_buffer*)(void*)(alloc_ptr +
+                                   (num_jobs * sizeof(qoir_size_result)));
+  return NULL;
+}
 
-  qoir_size_result (*encode_func)(uint8_t * dst_ptr,       //
-                                  const uint8_t* src_ptr,  //
-                                  uint32_t tw,             //
-                                  uint32_t th) =
-      ((src_pixbuf->pixcfg.pixfmt &
-        QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) ==
-       QOIR_PIXEL_ALPHA_TRANSPARENCY__OPAQUE)
-          ? qoir_private_encode_tile_ops_sans_alpha
-          : qoir_private_encode_tile_ops_with_alpha;
+static void                         //
+qoir_private_encode_jobs__destroy(  //
+    qoir_private_encode_jobs* jobs) {
+  const qoir_encode_options* options = jobs->options;
+  if (jobs->results) {
+    if (!options || !options->context) {
+      QOIR_FREE(jobs->results);
+    }
+    jobs->results = NULL;
+    jobs->other_encbufs = NULL;
+  }
+}
 
-  size_t num_src_channels =
-      qoir_pixel_format__bytes_per_pixel(src_pixbuf->pixcfg.pixfmt);
+// qoir_private_encode_tiles encodes the tiles from begin (inclusive) to end
+// (exclusive). With more than one job, each job writes to its own region of
+// dst_ptr (see qoir_private_encode_job_dst_ptr) and those regions are then
+// compacted. The dst_ptr buffer must have room for ((end - begin) * (4 + (4 *
+// QOIR_TS2))) + (num_jobs * QOIR_ENCODE_JOB_SLACK) bytes.
+static qoir_size_result              //
+qoir_private_encode_tiles(           //
+    qoir_private_encode_jobs* jobs,  //
+    uint8_t* dst_ptr,                //
+    uint64_t begin,                  //
+    uint64_t end) {
+  qoir_size_result result = {0};
+  uint64_t number_of_tiles = end - begin;
+  uint32_t num_jobs = (number_of_tiles < jobs->max_num_jobs)
+                          ? (uint32_t)number_of_tiles
+                          : jobs->max_num_jobs;
+  if (num_jobs <= 1) {
+    result = qoir_private_encode_tile_range(jobs->state, jobs->encbuf0,
+                                            dst_ptr, begin, end);
+    if (!result.status_message && jobs->state->stats) {
+      qoir_private_stats__add(jobs->state->stats,
+                              &jobs->encbuf0->private_impl.stats);
+    }
+    return result;
+  }
+
+  jobs->dst_ptr = dst_ptr;
+  jobs->begin = begin;
+  jobs->number_of_tiles = number_of_tiles;
+  jobs->num_jobs = num_jobs;
+  for (uint32_t i = 0; i < num_jobs; i++) {
+    // This is overwritten when the job runs. Leaving it unchanged means that
+    // the contextual_run_jobs_func was buggy.
+    jobs->results[i].status_message =
+        qoir_status_message__error_invalid_argument;
+    jobs->results[i].value = 0;
+  }
+
+  (*jobs->options->contextual_run_jobs_func)(
+      jobs->options->run_jobs_func_context, &qoir_private_encode_job_func,
+      jobs, num_jobs);
+
+  // Compact the jobs' output. Each job's region starts at or after where the
+  // previous jobs' (compacted) output ends, so memmove works front to back.
   uint8_t* dp = dst_ptr;
+  for (uint32_t i = 0; i < num_jobs; i++) {
+    if (jobs->results[i].status_message) {
+      result.status_message = jobs->results[i].status_message;
+      return result;
+    }
+    uint8_t* sp = qoir_private_encode_job_dst_ptr(dst_ptr, number_of_tiles, i,
+                                                  num_jobs);
+    if (dp != sp) {
+      memmove(dp, sp, jobs->results[i].value);
+    }
+    dp += jobs->results[i].value;
+  }
+  if (jobs->state->stats) {
+    for (uint32_t i = 0; i < num_jobs; i++) {
+      qoir_private_stats__add(
+          jobs->state->stats,
+          &(i ? &jobs->other_encbufs[i - 1] : jobs->encbuf0)
+               ->private_impl.stats);
+    }
+  }
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
 
-  uint8_t* literals_pre_padding = encbuf->private_impl.literals;
-  for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
-    literals_pre_padding[i + 0] = 0x00;
-    literals_pre_padding[i + 1] = 0x00;
-    literals_pre_padding[i + 2] = 0x00;
-    literals_pre_padding[i + 3] = 0xFF;
+// qoir_private_encode_output is where qoir_encode writes to: either a buffer
+// (if dst_ptr is non-NULL) or the options' contextual_write_func.
+typedef struct qoir_private_encode_output_struct {
+  const qoir_encode_options* options;
+  uint8_t* dst_ptr;
+  uint64_t position;
+} qoir_private_encode_output;
+
+static const char*                       //
+qoir_private_encode_output__write_at(    //
+    qoir_private_encode_output* output,  //
+    uint64_t position,                   //
+    const uint8_t* src_ptr,              //
+    size_t src_len) {
+  if (src_len == 0) {
+    return NULL;
+  } else if (output->dst_ptr) {
+    memcpy(output->dst_ptr + position, src_ptr, src_len);
+    return NULL;
   }
+  return (*output->options->contextual_write_func)(
+      output->options->write_func_context, position, src_ptr, src_len);
+}
 
-  // ty, tx, tw and th are the tile's top-left offset, width and height, all
-  // measured in pixels.
-  for (size_t ty = 0; ty <= ty1; ty += QOIR_TILE_SIZE) {
-    for (size_t tx = 0; tx <= tx1; tx += QOIR_TILE_SIZE) {
-      size_t tw = qoir_private_tile_dimension(
-          tx < tx1, src_pixbuf->pixcfg.width_in_pixels);
-      size_t th = qoir_private_tile_dimension(
-          ty < ty1, src_pixbuf->pixcfg.height_in_pixels);
-
-      const uint8_t* sp = src_pixbuf->data +
-                          (src_pixbuf->stride_in_bytes * ty) +
-                          (num_src_channels * tx);
-      (*swizzle_func)(encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-                      4 * tw,                           //
-                      sp, src_pixbuf->stride_in_bytes,  //
-                      tw, th);
-
-      if (lossiness == 0) {
-        // No-op.
-      } else if (!dither) {
-        for (size_t i = 0; i < 4 * tw * th; i++) {
-          encbuf->private_impl.literals[i + QOIR_LITERALS_PRE_PADDING] >>=
-              lossiness;
-        }
-      } else {
-        uint8_t* ptr =
-            &encbuf->private_impl.literals[QOIR_LITERALS_PRE_PADDING];
-        for (size_t y = 0; y < th; y++) {
-          for (size_t x = 0; x < tw; x++) {
-            uint8_t noise = qoir_private_table_noise[y & 15][x & 15];
-            qoir_private_encode_dither(ptr + 0, lossiness, noise);
-            qoir_private_encode_dither(ptr + 1, lossiness, noise);
-            qoir_private_encode_dither(ptr + 2, lossiness, noise);
-            qoir_private_encode_dither(ptr + 3, lossiness, noise);
-            ptr += 4;
-          }
-        }
-      }
+static const char*                       //
+qoir_private_encode_output__write(       //
+    qoir_private_encode_output* output,  //
+    const uint8_t* src_ptr,              //
+    size_t src_len) {
+  const char* status_message = qoir_private_encode_output__write_at(
+      output, output->position, src_ptr, src_len);
+  output->position += src_len;
+  return status_message;
+}
 
-      qoir_size_result r0 = (*encode_func)(
-          encbuf->private_impl.ops, encbuf->private_impl.literals, tw, th);
-      if (r0.status_message) {
-        result.status_message = r0.status_message;
-        return r0;
-      }
-      size_t literals_len = 4 * tw * th;
-      if (r0.value >= literals_len) {
-        // Use the Literals or LZ4-Literals tile format.
-        qoir_size_result r1 = qoir_lz4_block_encode(
-            dp + 4, QOIR_TILE_LZ4_COMPRESSION_WORST_CASE,
-            encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-            literals_len);
-        if (!r1.status_message && (r1.value < r0.value)) {
-          qoir_private_poke_u32le(dp, 0x02000000 | (uint32_t)r1.value);
-          dp += 4 + r1.value;
-        } else {
-          memcpy(dp + 4,
-                 encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-                 literals_len);
-          qoir_private_poke_u32le(dp, 0x00000000 | (uint32_t)literals_len);
-          dp += 4 + literals_len;
-        }
+static const char*                        //
+qoir_private_encode_output__write_chunk(  //
+    qoir_private_encode_output* output,   //
+    uint32_t chunk_type,                  //
+    const uint8_t* payload_ptr,           //
+    size_t payload_len) {
+  uint8_t header[12];
+  qoir_private_poke_u32le(header + 0, chunk_type);
+  qoir_private_poke_u64le(header + 4, payload_len);
+  const char* status_message =
+      qoir_private_encode_output__write(output, header, 12);
+  if (status_message) {
+    return status_message;
+  }
+  return qoir_private_encode_output__write(output, payload_ptr, payload_len);
+}
 
-      } else {
-        // Use the Ops or LZ4-Ops tile format.
-        qoir_size_result r1 =
-            qoir_lz4_block_encode(dp + 4, QOIR_TILE_LZ4_COMPRESSION_WORST_CASE,
-                                  encbuf->private_impl.ops, r0.value);
-        if (!r1.status_message && (r1.value < r0.value)) {
-          qoir_private_poke_u32le(dp, 0x03000000 | (uint32_t)r1.value);
-          dp += 4 + r1.value;
-        } else {
-          memcpy(dp + 4, encbuf->private_impl.ops, r0.value);
-          qoir_private_poke_u32le(dp, 0x01000000 | (uint32_t)r0.value);
-          dp += 4 + r0.value;
+// qoir_private_encode_walk_tile_prefixes writes (as u64le values) the
+// positions of number_of_tiles consecutive tiles, the first one at src_ptr
+// and tile_pos, to dst_ptr.
+static void                              //
+qoir_private_encode_walk_tile_prefixes(  //
+    uint8_t* dst_ptr,                    //
+    uint64_t number_of_tiles,            //
+    const uint8_t* src_ptr,              //
+    uint64_t tile_pos) {
+  for (uint64_t i = 0; i < number_of_tiles; i++) {
+    qoir_private_poke_u64le(dst_ptr + (8 * i), tile_pos);
+    size_t n = 4 + (0xFFFFFF & qoir_private_peek_u32le(src_ptr));
+    src_ptr += n;
+    tile_pos += n;
+  }
+}
+
+// QOIR_TILE_HASH_TABLE_SHIFT is the log2 of the number of u64le entries in
+// the hash table used by qoir_private_encode_reference_duplicate_tiles, which
+// borrows an encbuf's ops as its storage.
+#define QOIR_TILE_HASH_TABLE_SHIFT 11
+
+// qoir_private_encode_reference_duplicate_tiles rewrites, in place, the
+// number_of_tiles encoded tiles starting at ptr so that every tile whose
+// encoding (prefix and payload) is identical to an earlier tile's becomes a
+// Back-Reference to it. It returns the new, shorter or equal, total length.
+// If stats is non-NULL, its num_back_reference_tiles is incremented for each
+// such tile.
+//
+// The hash table maps each tile encoding's hash to the most recent (1-based,
+// so that zero means empty) byte offset of a tile with that hash. A hash
+// collision only misses a duplicate, as candidates are compared in full.
+static size_t                                   //
+qoir_private_encode_reference_duplicate_tiles(  //
+    qoir_encode_buffer* encbuf,                 //
+    uint8_t* ptr,                               //
+    uint64_t number_of_tiles,                   //
+    qoir_stats* stats) {
+  uint8_t* table = encbuf->private_impl.ops;
+  memset(table, 0, 8 << QOIR_TILE_HASH_TABLE_SHIFT);
+
+  size_t src_pos = 0;
+  size_t dst_pos = 0;
+  for (uint64_t i = 0; i < number_of_tiles; i++) {
+    uint32_t prefix = qoir_private_peek_u32le(ptr + src_pos);
+    size_t n = 4 + (prefix & 0xFFFFFF);
+    if (n > 12) {  // 12 is the length of a Back-Reference tile.
+      uint64_t hash = 0;
+      size_t j = 0;
+      for (; (j + 8) <= n; j += 8) {
+        hash = (hash ^ qoir_private_peek_u64le(ptr + src_pos + j)) *
+               0x9E3779B97F4A7C15ull;
+      }
+      for (; j < n; j++) {
+        hash = (hash ^ ptr[src_pos + j]) * 0x9E3779B97F4A7C15ull;
+      }
+      uint8_t* entry =
+          table + (8 * (hash >> (64 - QOIR_TILE_HASH_TABLE_SHIFT)));
+      uint64_t ref_pos = qoir_private_peek_u64le(entry);
+      if (ref_pos &&
+          (prefix == qoir_private_peek_u32le(ptr + (ref_pos - 1))) &&
+          !memcmp(ptr + (ref_pos - 1), ptr + src_pos, n)) {
+        qoir_private_poke_u32le(ptr + dst_pos, 0x05000008);
+        qoir_private_poke_u64le(ptr + dst_pos + 4, ref_pos - 1);
+        dst_pos += 12;
+        src_pos += n;
+        if (stats) {
+          stats->num_back_reference_tiles++;
         }
+        continue;
       }
+      qoir_private_poke_u64le(entry, dst_pos + 1);
     }
+    if (dst_pos != src_pos) {
+      memmove(ptr + dst_pos, ptr + src_pos, n);
+    }
+    dst_pos += n;
+    src_pos += n;
   }
+  return dst_pos;
+}
 
-  result.value = (size_t)(dp - dst_ptr);
-  return result;
+// qoir_private_encode_qpix_payload encodes the QPIX chunk's payload directly
+// into the output's dst_ptr, which has room for the worst case. It also writes
+// the TIDX chunk, if any, immediately afterwards.
+static const char*                       //
+qoir_private_encode_qpix_payload(        //
+    qoir_private_encode_output* output,  //
+    qoir_private_encode_jobs* jobs,      //
+    uint64_t* qpix_len,                  //
+    bool write_tile_index) {
+  uint64_t number_of_tiles =
+      jobs->state->width_in_tiles * jobs->state->height_in_tiles;
+  uint8_t* qpix_payload = output->dst_ptr + output->position;
+  qoir_size_result r =
+      qoir_private_encode_tiles(jobs, qpix_payload, 0, number_of_tiles);
+  if (r.status_message) {
+    return r.status_message;
+  } else if (jobs->options && jobs->options->reference_duplicate_tiles) {
+    r.value = qoir_private_encode_reference_duplicate_tiles(
+        jobs->encbuf0, qpix_payload, number_of_tiles, jobs->state->stats);
+  }
+  *qpix_len = r.value;
+  output->position += r.value;
+
+  if (write_tile_index) {
+    uint8_t* tidx = output->dst_ptr + output->position;
+    qoir_private_poke_u32le(tidx + 0, 0x58444954);  // "TIDX"le.
+    qoir_private_poke_u64le(tidx + 4, 8 * number_of_tiles);
+    qoir_private_encode_walk_tile_prefixes(tidx + 12, number_of_tiles,
+                                           qpix_payload, 0);
+    output->position += 12 + (8 * number_of_tiles);
+  }
+  return NULL;
 }
 
-QOIR_MAYBE_STATIC qoir_encode_result      //
-qoir_encode(                              //
+// qoir_private_encode_qpix_payload_to_sink is like
+// qoir_private_encode_qpix_payload but it writes to the output's
+// contextual_write_func. It encodes one row of tiles per job at a time into a
+// temporary buffer, so that the whole encoded image is never held in memory
+// (other than the TIDX chunk, if any, which is only 8 bytes per tile).
+static const char*                         //
+qoir_private_encode_qpix_payload_to_sink(  //
+    qoir_private_encode_output* output,    //
+    qoir_private_encode_jobs* jobs,        //
+    uint64_t* qpix_len,                    //
+    bool write_tile_index) {
+  const qoir_encode_options* options = jobs->options;
+  uint64_t width_in_tiles = jobs->state->width_in_tiles;
+  uint64_t number_of_tiles = width_in_tiles * jobs->state->height_in_tiles;
+  uint64_t tiles_per_round = width_in_tiles * jobs->max_num_jobs;
+  if (tiles_per_round > number_of_tiles) {
+    tiles_per_round = number_of_tiles;
+  }
+  uint64_t buf_len = (tiles_per_round * (4 + (4 * QOIR_TS2))) +
+                     ((uint64_t)jobs->max_num_jobs * QOIR_ENCODE_JOB_SLACK);
+  uint64_t tidx_len = write_tile_index ? (8 * number_of_tiles) : 0;
+  if ((buf_len > SIZE_MAX) || (tidx_len > (SIZE_MAX - buf_len))) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+  }
+  uint8_t* buf =
+      (options && options->context)
+          ? qoir_private_context__scratch(options->context,
+                                          QOIR_CONTEXT_SCRATCH__OUTPUT,
+                                          (size_t)(buf_len + tidx_len))
+          : (uint8_t*)QOIR_MALLOC((size_t)(buf_len + tidx_len));
+  if (!buf) {
+    return qoir_status_message__error_out_of_memory;
+  }
+  uint8_t* tidx = buf + buf_len;
+
+  const char* status_message = NULL;
+  uint64_t tile_pos = 0;
+  for (uint64_t begin = 0; begin < number_of_tiles;) {
+    uint64_t end = ((number_of_tiles - begin) < tiles_per_round)
+                       ? number_of_tiles
+                       : (begin + tiles_per_round);
+    qoir_size_result r = qoir_private_encode_tiles(jobs, buf, begin, end);
+    if (r.status_message) {
+      status_message = r.status_message;
+      break;
+    }
+    if (write_tile_index) {
+      qoir_private_encode_walk_tile_prefixes(tidx + (8 * begin), end - begin,
+                                             buf, tile_pos);
+    }
+    status_message = qoir_private_encode_output__write(output, buf, r.value);
+    if (status_message) {
+      break;
+    }
+    tile_pos += r.value;
+    begin = end;
+  }
+  *qpix_len = tile_pos;
+
+  if (!status_message && write_tile_index) {
+    status_message = qoir_private_encode_output__write_chunk(
+        output, 0x58444954,  // "TIDX"le.
+        tidx, (size_t)tidx_len);
+  }
+  if (!options || !options->context) {
+    QOIR_FREE(buf);
+  }
+  return status_message;
+}
+
+// qoir_private_encode_mipmap_pixcfg sets the mipmap_pixbuf's pixel
+// configuration and stride (but not its data) for level 1 of the src_pixcfg
+// image, encoded as dst_pixfmt.
+static void                                      //
+qoir_private_encode_mipmap_pixcfg(               //
+    qoir_pixel_buffer* mipmap_pixbuf,            //
+    const qoir_pixel_configuration* src_pixcfg,  //
+    qoir_pixel_format dst_pixfmt) {
+  mipmap_pixbuf->pixcfg.pixfmt = dst_pixfmt;
+  mipmap_pixbuf->pixcfg.width_in_pixels =
+      qoir_private_downscaled_dimension(src_pixcfg->width_in_pixels, 1);
+  mipmap_pixbuf->pixcfg.height_in_pixels =
+      qoir_private_downscaled_dimension(src_pixcfg->height_in_pixels, 1);
+  mipmap_pixbuf->stride_in_bytes =
+      4 * (size_t)mipmap_pixbuf->pixcfg.width_in_pixels;
+}
+
+// qoir_private_encode_mipmap_rows downscales num_rows rows of the source image
+// (the state's src_pixbuf's format and width), whose first row is row src_y0
+// (an even number) of the entire image, into the level 1 mipmap, whose 4 byte
+// pixels are in the encoded image's pixel format.
+static void                                  //
+qoir_private_encode_mipmap_rows(             //
+    const qoir_private_encode_state* state,  //
+    const qoir_pixel_buffer* mipmap_pixbuf,  //
+    const uint8_t* src_data,                 //
+    size_t src_stride_in_bytes,              //
+    uint32_t src_y0,                         //
+    uint32_t num_rows) {
+  uint32_t width = state->src_pixbuf->pixcfg.width_in_pixels;
+  bool weight_by_alpha = (state->src_pixbuf->pixcfg.pixfmt &
+                          QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) ==
+                         QOIR_PIXEL_ALPHA_TRANSPARENCY__NONPREMULTIPLIED_ALPHA;
+  uint8_t* dst_data =
+      mipmap_pixbuf->data + ((src_y0 >> 1) * mipmap_pixbuf->stride_in_bytes);
+  if (!state->swizzle_before_encode) {
+    qoir_private_downscale(dst_data, mipmap_pixbuf->stride_in_bytes,  //
+                           src_data, src_stride_in_bytes,             //
+                           width, num_rows, 1, weight_by_alpha);
+    return;
+  }
+
+  // Swizzle (to 4 byte pixels) and then downscale two rows at a time, a tile
+  // width at a time.
+  uint8_t buf[2 * 4 * QOIR_TILE_SIZE];
+  for (uint32_t y = 0; y < num_rows; y += 2) {
+    uint32_t h = ((num_rows - y) < 2) ? (num_rows - y) : 2;
+    uint8_t* dp = dst_data + ((y >> 1) * mipmap_pixbuf->stride_in_bytes);
+    const uint8_t* sp = src_data + (y * src_stride_in_bytes);
+    for (uint32_t x = 0; x < width; x += QOIR_TILE_SIZE) {
+      uint32_t w =
+          ((width - x) < QOIR_TILE_SIZE) ? (width - x) : QOIR_TILE_SIZE;
+      (*state->swizzle_func)(buf, 4 * QOIR_TILE_SIZE,             //
+                             sp + (x * state->num_src_channels),  //
+                             src_stride_in_bytes,                 //
+                             w, h);
+      qoir_private_downscale(dp + (2 * x), mipmap_pixbuf->stride_in_bytes,  //
+                             buf, 4 * QOIR_TILE_SIZE,                       //
+                             w, h, 1, weight_by_alpha);
+    }
+  }
+}
+
+// qoir_private_encode_output__write_mips_chunk writes the MIPS chunk, whose
+// payload is num_levels mipmap levels, each an 8 byte (u64le) length and then
+// that many bytes of tiles (in the same format as the QPIX chunk's payload).
+// The mipmap_pixbuf holds level 1 and is overwritten (downscaled in place) by
+// each subsequent level. Reference: §
+static const char*                             //
+qoir_private_encode_output__write_mips_chunk(  //
+    qoir_private_encode_output* output,        //
+    qoir_pixel_buffer mipmap_pixbuf,           //
+    uint32_t num_levels,                       //
+    qoir_encode_buffer* encbuf,                //
+    uint32_t lossiness) {
+  const qoir_encode_options* options = output->options;
+  bool weight_by_alpha =
+      mipmap_pixbuf.pixcfg.pixfmt == QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  uint64_t mips_pos = output->position;
+  const char* status_message =
+      qoir_private_encode_output__write_chunk(output,
+                                              0x5350494D,  // "MIPS"le.
+                                              NULL, 0);
+  for (uint32_t k = 1; !status_message && (k <= num_levels); k++) {
+    if (k > 1) {
+      uint32_t w = mipmap_pixbuf.pixcfg.width_in_pixels;
+      uint32_t h = mipmap_pixbuf.pixcfg.height_in_pixels;
+      size_t stride_in_bytes = 4 * (size_t)((w + 1) >> 1);
+      qoir_private_downscale(mipmap_pixbuf.data, stride_in_bytes,  //
+                             mipmap_pixbuf.data,                   //
+                             mipmap_pixbuf.stride_in_bytes,        //
+                             w, h, 1, weight_by_alpha);
+      mipmap_pixbuf.pixcfg.width_in_pixels = (w + 1) >> 1;
+      mipmap_pixbuf.pixcfg.height_in_pixels = (h + 1) >> 1;
+      mipmap_pixbuf.stride_in_bytes = stride_in_bytes;
+    }
+
+    qoir_private_encode_state state = {0};
+    status_message = qoir_private_encode_init_state(
+        &state, &mipmap_pixbuf, lossiness, options);
+    if (status_message) {
+      break;
+    }
+    qoir_private_encode_jobs jobs;
+    status_message = qoir_private_encode_jobs__initialize(
+        &jobs, options, &state, encbuf,
+        qoir_private_encode_num_jobs(
+            options, state.width_in_tiles * state.height_in_tiles));
+    if (status_message) {
+      break;
+    }
+    uint8_t level_len_bytes[8] = {0};
+    uint64_t level_pos = output->position;
+    uint64_t level_len = 0;
+    status_message = qoir_private_encode_output__write(output, level_len_bytes,
+                                                       8);
+    if (!status_message) {
+      status_message =
+          output->dst_ptr ? qoir_private_encode_qpix_payload(
+                                output, &jobs, &level_len, false)
+                          : qoir_private_encode_qpix_payload_to_sink(
+                                output, &jobs, &level_len, false);
+    }
+    qoir_private_encode_jobs__destroy(&jobs);
+    if (!status_message) {
+      qoir_private_poke_u64le(level_len_bytes, level_len);
+      status_message = qoir_private_encode_output__write_at(
+          output, level_pos, level_len_bytes, 8);
+    }
+  }
+
+  if (!status_message) {
+    uint8_t mips_len_bytes[8];
+    qoir_private_poke_u64le(mips_len_bytes, output->position - mips_pos - 12);
+    status_message = qoir_private_encode_output__write_at(
+        output, mips_pos + 4, mips_len_bytes, 8);
+  }
+  return status_message;
+}
+
+// qoir_private_encode_worst_case_dst_len returns an upper bound on
+// qoir_encode's output length. It also checks the options' metadata lengths
+// but, like the public qoir_encode_worst_case_dst_len, it does not depend on
+// (or check) the pixel format.
+static qoir_size_result                   //
+qoir_private_encode_worst_case_dst_len(   //
     const qoir_pixel_buffer* src_pixbuf,  //
     const qoir_encode_options* options) {
-  qoir_encode_result result = {0};
+  qoir_size_result result = {0};
   if (!src_pixbuf) {
     result.status_message = qoir_status_message__error_invalid_argument;
     return result;
   } else if ((src_pixbuf->pixcfg.width_in_pixels > 0xFFFFFF) ||
-             (src_pixbuf->pixcfg.height_in_pixels > 0xFFFFFF)) {
-    result.status_message =
-        qoir_status_message__error_unsupported_pixbuf_dimensions;
-    return result;
-  }
-
-  qoir_pixel_format dst_pixfmt = 0;
-  switch (src_pixbuf->pixcfg.pixfmt) {
-    case QOIR_PIXEL_FORMAT__BGRX:
-    case QOIR_PIXEL_FORMAT__BGR:
-    case QOIR_PIXEL_FORMAT__RGBX:
-    case QOIR_PIXEL_FORMAT__RGB:
-      dst_pixfmt = QOIR_PIXEL_FORMAT__BGRX;
-      break;
-    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
-    case QOIR_PIXEL_FORMAT__RGBA_NONPREMUL:
-      dst_pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
-      break;
-    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
-    case QOIR_PIXEL_FORMAT__RGBA_PREMUL:
-      dst_pixfmt = QOIR_PIXEL_FORMAT__BGRA_PREMUL;
-      break;
-    default:
-      result.status_message = qoir_status_message__error_unsupported_pixfmt;
-      return result;
+             (src_pixbuf->pixcfg.height_in_pixels > 0xFFFFFF)) {
+    result.status_message =
+        qoir_status_message__error_unsupported_pixbuf_dimensions;
+    return result;
   }
 
   uint64_t width_in_tiles =
       qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.width_in_pixels);
   uint64_t height_in_tiles =
       qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.height_in_pixels);
+  uint32_t num_jobs = qoir_private_encode_num_jobs(
+      options, width_in_tiles * height_in_tiles);
   uint64_t tile_len_worst_case =
       4 + (4 * QOIR_TS2);  // Prefix + literal format.
   uint64_t dst_len_worst_case =
       (width_in_tiles * height_in_tiles * tile_len_worst_case) +
       44 +  // QOIR, QPIX and QEND chunk headers are 12 bytes each.
             // QOIR also has an 8 byte payload.
-      (QOIR_TILE_LZ4_COMPRESSION_WORST_CASE -
-       (4 * QOIR_TS2));  // We might temporarily write more than (4 * QOIR_TS2)
-                         // bytes when LZ4 compressing each tile.
+      (num_jobs *
+       QOIR_ENCODE_JOB_SLACK);  // We might temporarily write more than (4 *
+                                // QOIR_TS2) bytes when LZ4 compressing each
+                                // job's last tile.
   if (options) {
     bool overflow = false;
+    if (options->write_tile_index) {
+      overflow = overflow ||
+                 qoir_private_u64_overflow_add(&dst_len_worst_case, 12) ||
+                 qoir_private_u64_overflow_add(
+                     &dst_len_worst_case,
+                     8 * width_in_tiles * height_in_tiles);
+    }
     if (options->metadata_cicp_len) {
       overflow = overflow ||
                  qoir_private_u64_overflow_add(&dst_len_worst_case, 12) ||
@@ -6865,123 +12306,935 @@ qoir_encode(                              //
       return result;
     }
   }
+  uint32_t num_mipmap_levels =
+      options ? qoir_private_num_mipmap_levels(
+                    src_pixbuf->pixcfg.width_in_pixels,
+                    src_pixbuf->pixcfg.height_in_pixels,
+                    options->num_mipmap_levels)
+              : 0;
+  if (num_mipmap_levels) {
+    dst_len_worst_case += 12;  // MIPS chunk header.
+    for (uint32_t k = 1; k <= num_mipmap_levels; k++) {
+      uint64_t number_of_tiles = qoir_calculate_number_of_tiles_2d(
+          qoir_private_downscaled_dimension(src_pixbuf->pixcfg.width_in_pixels,
+                                            k),
+          qoir_private_downscaled_dimension(
+              src_pixbuf->pixcfg.height_in_pixels, k));
+      dst_len_worst_case +=
+          8 + (number_of_tiles * tile_len_worst_case) +
+          (qoir_private_encode_num_jobs(options, number_of_tiles) *
+           QOIR_ENCODE_JOB_SLACK);
+    }
+  }
   if (dst_len_worst_case > SIZE_MAX) {
     result.status_message =
         qoir_status_message__error_unsupported_pixbuf_dimensions;
     return result;
   }
-  uint8_t* const original_dst_ptr =
-      (uint8_t*)QOIR_MALLOC((size_t)dst_len_worst_case);
-  if (!original_dst_ptr) {
-    result.status_message = qoir_status_message__error_out_of_memory;
-    return result;
-  }
-  uint32_t lossiness = 0;
-  if (options) {
-    lossiness = options->lossiness;
-    if (lossiness > 7) {
-      lossiness = 7;
-    }
+  result.value = (size_t)dst_len_worst_case;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result        //
+qoir_encode_worst_case_dst_len(           //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  return qoir_private_encode_worst_case_dst_len(src_pixbuf, options);
+}
+
+// qoir_private_encode_dst_pixfmt returns the pixel format of the encoded
+// image, or QOIR_PIXEL_FORMAT__INVALID if the source's is unsupported.
+static qoir_pixel_format         //
+qoir_private_encode_dst_pixfmt(  //
+    const qoir_pixel_configuration* src_pixcfg) {
+  switch (src_pixcfg->pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+    case QOIR_PIXEL_FORMAT__BGR:
+    case QOIR_PIXEL_FORMAT__RGBX:
+    case QOIR_PIXEL_FORMAT__RGB:
+      return QOIR_PIXEL_FORMAT__BGRX;
+    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__RGBA_NONPREMUL:
+      return QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+    case QOIR_PIXEL_FORMAT__RGBA_PREMUL:
+      return QOIR_PIXEL_FORMAT__BGRA_PREMUL;
   }
-  uint8_t* dst_ptr = original_dst_ptr;
+  return QOIR_PIXEL_FORMAT__INVALID;
+}
+
+// qoir_private_encode_output__write_prefix writes the chunks before the QPIX
+// chunk's payload: the QOIR chunk, any CICP and ICCP chunks and the QPIX
+// chunk's header, with a placeholder (zero) payload length.
+static const char*                               //
+qoir_private_encode_output__write_prefix(        //
+    qoir_private_encode_output* output,          //
+    const qoir_pixel_configuration* src_pixcfg,  //
+    qoir_pixel_format dst_pixfmt,                //
+    uint32_t lossiness) {
+  const qoir_encode_options* options = output->options;
+  const char* status_message = NULL;
 
   // QOIR chunk.
-  qoir_private_poke_u32le(dst_ptr + 0, 0x52494F51);  // "QOIR"le.
-  qoir_private_poke_u64le(dst_ptr + 4, 8);
-  qoir_private_poke_u32le(dst_ptr + 12, src_pixbuf->pixcfg.width_in_pixels);
-  qoir_private_poke_u32le(dst_ptr + 16, src_pixbuf->pixcfg.height_in_pixels);
-  dst_ptr[15] = dst_pixfmt;
-  dst_ptr[19] = lossiness;
-  dst_ptr += 20;
+  uint8_t qoir_payload[8];
+  qoir_private_poke_u32le(qoir_payload + 0, src_pixcfg->width_in_pixels);
+  qoir_private_poke_u32le(qoir_payload + 4, src_pixcfg->height_in_pixels);
+  qoir_payload[3] = dst_pixfmt;
+  qoir_payload[7] = lossiness;
+  status_message = qoir_private_encode_output__write_chunk(
+      output, 0x52494F51,  // "QOIR"le.
+      qoir_payload, 8);
+  if (status_message) {
+    return status_message;
+  }
 
   // CICP chunk.
   if (options && options->metadata_cicp_len) {
-    qoir_private_poke_u32le(dst_ptr + 0, 0x50434943);  // "CICP"le.
-    qoir_private_poke_u64le(dst_ptr + 4, options->metadata_cicp_len);
-    memcpy(dst_ptr + 12, options->metadata_cicp_ptr,
-           options->metadata_cicp_len);
-    dst_ptr += 12 + options->metadata_cicp_len;
+    status_message = qoir_private_encode_output__write_chunk(
+        output, 0x50434943,  // "CICP"le.
+        options->metadata_cicp_ptr, options->metadata_cicp_len);
+    if (status_message) {
+      return status_message;
+    }
   }
 
   // ICCP chunk.
   if (options && options->metadata_iccp_len) {
-    qoir_private_poke_u32le(dst_ptr + 0, 0x50434349);  // "ICCP"le.
-    qoir_private_poke_u64le(dst_ptr + 4, options->metadata_iccp_len);
-    memcpy(dst_ptr + 12, options->metadata_iccp_ptr,
-           options->metadata_iccp_len);
-    dst_ptr += 12 + options->metadata_iccp_len;
+    status_message = qoir_private_encode_output__write_chunk(
+        output, 0x50434349,  // "ICCP"le.
+        options->metadata_iccp_ptr, options->metadata_iccp_len);
+    if (status_message) {
+      return status_message;
+    }
+  }
+
+  // QPIX chunk header.
+  return qoir_private_encode_output__write_chunk(output,
+                                                 0x58495051,  // "QPIX"le.
+                                                 NULL, 0);
+}
+
+// qoir_private_encode_output__write_suffix patches the QPIX chunk's payload
+// length (the QPIX chunk starts at qpix_pos) and writes the chunks after the
+// QPIX chunk: TIDX (if tidx_ptr is non-NULL), MIPS (if num_mipmap_levels is
+// non-zero, starting from mipmap_pixbuf's level 1), any EXIF and XMP chunks
+// and the QEND chunk.
+static const char*                         //
+qoir_private_encode_output__write_suffix(  //
+    qoir_private_encode_output* output,    //
+    uint64_t qpix_pos,                     //
+    uint64_t qpix_len,                     //
+    const uint8_t* tidx_ptr,               //
+    uint64_t number_of_tiles,              //
+    qoir_pixel_buffer mipmap_pixbuf,       //
+    uint32_t num_mipmap_levels,            //
+    qoir_encode_buffer* encbuf,            //
+    uint32_t lossiness) {
+  const qoir_encode_options* options = output->options;
+  const char* status_message = NULL;
+  if (qpix_len > 0x7FFFFFFFFFFFFFFFull) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+  }
+  uint8_t qpix_len_bytes[8];
+  qoir_private_poke_u64le(qpix_len_bytes, qpix_len);
+  status_message = qoir_private_encode_output__write_at(output, qpix_pos + 4,
+                                                        qpix_len_bytes, 8);
+  if (status_message) {
+    return status_message;
+  }
+
+  // TIDX chunk.
+  if (tidx_ptr) {
+    status_message = qoir_private_encode_output__write_chunk(
+        output, 0x58444954,  // "TIDX"le.
+        tidx_ptr, (size_t)(8 * number_of_tiles));
+    if (status_message) {
+      return status_message;
+    }
+  }
+
+  // MIPS chunk.
+  if (num_mipmap_levels) {
+    status_message = qoir_private_encode_output__write_mips_chunk(
+        output, mipmap_pixbuf, num_mipmap_levels, encbuf, lossiness);
+    if (status_message) {
+      return status_message;
+    }
+  }
+
+  // EXIF chunk.
+  if (options && options->metadata_exif_len) {
+    status_message = qoir_private_encode_output__write_chunk(
+        output, 0x46495845,  // "EXIF"le.
+        options->metadata_exif_ptr, options->metadata_exif_len);
+    if (status_message) {
+      return status_message;
+    }
+  }
+
+  // XMP chunk.
+  if (options && options->metadata_xmp_len) {
+    status_message = qoir_private_encode_output__write_chunk(
+        output, 0x20504D58,  // "XMP "le.
+        options->metadata_xmp_ptr, options->metadata_xmp_len);
+    if (status_message) {
+      return status_message;
+    }
+  }
+
+  // QEND chunk.
+  return qoir_private_encode_output__write_chunk(output,
+                                                 0x444E4551,  // "QEND"le.
+                                                 NULL, 0);
+}
+
+// qoir_private_encode_init_dirty_state checks that prev (the previous
+// encoding) has the same dimensions, pixel format and lossiness as the image
+// being encoded and then sets the state's prev_etc and dirty_mask fields. The
+// tile index and dirty mask are allocated as one block, returned as
+// *alloc_ptr, which the caller should free.
+static const char*                           //
+qoir_private_encode_init_dirty_state(        //
+    qoir_private_encode_state* state,        //
+    uint8_t** alloc_ptr,                     //
+    const qoir_encode_options* options,      //
+    qoir_pixel_format dst_pixfmt,            //
+    const uint8_t* prev_ptr,                 //
+    size_t prev_len,                         //
+    const qoir_rectangle* dirty_rectangles,  //
+    size_t num_dirty_rectangles) {
+  qoir_decode_metadata_result metadata;
+  const uint8_t* qpix_ptr = NULL;
+  size_t qpix_len = 0;
+  const uint8_t* mips_ptr = NULL;
+  const char* status_message = qoir_private_decode_walk_chunks(
+      &metadata, &qpix_ptr, &qpix_len, &mips_ptr, prev_ptr, prev_len);
+  if (status_message) {
+    return status_message;
+  }
+  uint32_t width = state->src_pixbuf->pixcfg.width_in_pixels;
+  uint32_t height = state->src_pixbuf->pixcfg.height_in_pixels;
+  if ((metadata.src_pixcfg.pixfmt != dst_pixfmt) ||
+      (metadata.src_pixcfg.width_in_pixels != width) ||
+      (metadata.src_pixcfg.height_in_pixels != height) ||
+      (metadata.lossiness != state->lossiness)) {
+    return qoir_status_message__error_invalid_argument;
+  }
+  uint64_t number_of_tiles = state->width_in_tiles * state->height_in_tiles;
+  if (number_of_tiles == 0) {
+    return NULL;
+  } else if (number_of_tiles > (SIZE_MAX / 9)) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+  }
+  uint8_t* tile_index = (uint8_t*)QOIR_MALLOC(9 * (size_t)number_of_tiles);
+  if (!tile_index) {
+    return qoir_status_message__error_out_of_memory;
+  }
+  // Like qoir_decode, we don't trust any TIDX chunk. Walking the tile
+  // prefixes ourselves also validates their lengths.
+  status_message = qoir_private_make_tile_index(
+      tile_index, number_of_tiles, qpix_ptr,
+      qpix_len + 8);  // See § for +8.
+  if (status_message) {
+    QOIR_FREE(tile_index);
+    return status_message;
+  }
+
+  uint8_t* dirty_mask = tile_index + (8 * number_of_tiles);
+  memset(dirty_mask, 0, (size_t)number_of_tiles);
+  qoir_rectangle bounds =
+      qoir_make_rectangle(0, 0, (int32_t)width, (int32_t)height);
+  for (size_t i = 0; i < num_dirty_rectangles; i++) {
+    qoir_rectangle r = qoir_rectangle__intersect(bounds, dirty_rectangles[i]);
+    if (qoir_rectangle__is_empty(r)) {
+      continue;
+    }
+    uint32_t tx0 = (uint32_t)r.x0 >> QOIR_TILE_SHIFT;
+    uint32_t ty0 = (uint32_t)r.y0 >> QOIR_TILE_SHIFT;
+    uint32_t tx1 = ((uint32_t)r.x1 + QOIR_TILE_MASK) >> QOIR_TILE_SHIFT;
+    uint32_t ty1 = ((uint32_t)r.y1 + QOIR_TILE_MASK) >> QOIR_TILE_SHIFT;
+    for (uint32_t ty = ty0; ty < ty1; ty++) {
+      memset(dirty_mask + (ty * state->width_in_tiles) + tx0, 1, tx1 - tx0);
+    }
+  }
+
+  state->prev_tiles = qpix_ptr;
+  state->prev_tile_index = tile_index;
+  state->dirty_mask = dirty_mask;
+  *alloc_ptr = tile_index;
+  return NULL;
+}
+
+// qoir_private_encode implements qoir_encode and, if prev_ptr is non-NULL,
+// qoir_encode_dirty_rectangles.
+static qoir_encode_result                    //
+qoir_private_encode(                         //
+    const qoir_pixel_buffer* src_pixbuf,     //
+    const uint8_t* prev_ptr,                 //
+    size_t prev_len,                         //
+    const qoir_rectangle* dirty_rectangles,  //
+    size_t num_dirty_rectangles,             //
+    const qoir_encode_options* options) {
+  qoir_encode_result result = {0};
+  qoir_size_result worst_case =
+      qoir_private_encode_worst_case_dst_len(src_pixbuf, options);
+  if (worst_case.status_message) {
+    result.status_message = worst_case.status_message;
+    return result;
+  } else if (options && options->dst_ptr && options->contextual_write_func) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+  qoir_pixel_format dst_pixfmt =
+      qoir_private_encode_dst_pixfmt(&src_pixbuf->pixcfg);
+  if (!dst_pixfmt) {
+    result.status_message = qoir_status_message__error_unsupported_pixfmt;
+    return result;
+  }
+
+  uint32_t lossiness = 0;
+  if (options) {
+    lossiness = options->lossiness;
+    if (lossiness > 7) {
+      lossiness = 7;
+    }
+  }
+  qoir_private_encode_state state = {0};
+  result.status_message = qoir_private_encode_init_state(
+      &state, src_pixbuf, lossiness, options);
+  if (result.status_message) {
+    return result;
+  }
+  uint8_t* dirty_alloc_ptr = NULL;
+  qoir_pixel_buffer mipmap_pixbuf = {0};
+  uint32_t num_mipmap_levels =
+      options ? qoir_private_num_mipmap_levels(
+                    src_pixbuf->pixcfg.width_in_pixels,
+                    src_pixbuf->pixcfg.height_in_pixels,
+                    options->num_mipmap_levels)
+              : 0;
+
+  qoir_private_encode_output output = {0};
+  output.options = options;
+  void* owned_memory = NULL;
+  if (options && options->contextual_write_func) {
+    // No-op. We write to the sink instead of dst_ptr.
+  } else if (options && options->dst_ptr) {
+    if (options->dst_len < worst_case.value) {
+      result.status_message = qoir_status_message__error_dst_is_too_short;
+      return result;
+    }
+    output.dst_ptr = options->dst_ptr;
+  } else if (options && options->context) {
+    uint8_t* block =
+        qoir_private_context__acquire(options->context, worst_case.value);
+    if (!block) {
+      result.status_message = qoir_status_message__error_out_of_memory;
+      return result;
+    }
+    owned_memory = block;
+    output.dst_ptr = block + QOIR_CONTEXT_BLOCK_HEADER_LEN;
+  } else {
+    output.dst_ptr = (uint8_t*)QOIR_MALLOC(worst_case.value);
+    if (!output.dst_ptr) {
+      result.status_message = qoir_status_message__error_out_of_memory;
+      return result;
+    }
+    owned_memory = output.dst_ptr;
   }
 
-  // QPIX chunk.
-  qoir_private_poke_u32le(dst_ptr, 0x58495051);  // "QPIX"le.
   qoir_encode_buffer* encbuf = options ? options->encbuf : NULL;
   bool free_encbuf = false;
-  if (!encbuf) {
+  if (!encbuf && options && options->context) {
+    encbuf = qoir_private_context__encbuf(options->context);
+    if (!encbuf) {
+      result.status_message = qoir_status_message__error_out_of_memory;
+      goto cleanup0;
+    }
+  } else if (!encbuf) {
     encbuf = (qoir_encode_buffer*)QOIR_MALLOC(sizeof(qoir_encode_buffer));
     if (!encbuf) {
       result.status_message = qoir_status_message__error_out_of_memory;
-      QOIR_FREE(original_dst_ptr);
-      return result;
+      goto cleanup0;
     }
     free_encbuf = true;
   }
-  qoir_size_result r = qoir_private_encode_qpix_payload(
-      encbuf, dst_ptr + 12, src_pixbuf, lossiness, options && options->dither);
+  qoir_private_encode_jobs jobs;
+  result.status_message = qoir_private_encode_jobs__initialize(
+      &jobs, options, &state, encbuf,
+      qoir_private_encode_num_jobs(
+          options, state.width_in_tiles * state.height_in_tiles));
+  if (result.status_message) {
+    goto cleanup1;
+  }
+  if (prev_ptr) {
+    result.status_message = qoir_private_encode_init_dirty_state(
+        &state, &dirty_alloc_ptr, options, dst_pixfmt, prev_ptr, prev_len,
+        dirty_rectangles, num_dirty_rectangles);
+    if (result.status_message) {
+      goto cleanup2;
+    }
+  }
+
+  if (num_mipmap_levels) {
+    qoir_private_encode_mipmap_pixcfg(&mipmap_pixbuf, &src_pixbuf->pixcfg,
+                                      dst_pixfmt);
+    size_t mipmap_len = mipmap_pixbuf.stride_in_bytes *
+                        (size_t)mipmap_pixbuf.pixcfg.height_in_pixels;
+    mipmap_pixbuf.data =
+        options->context
+            ? qoir_private_context__scratch(
+                  options->context, QOIR_CONTEXT_SCRATCH__MIPMAPS, mipmap_len)
+            : (uint8_t*)QOIR_MALLOC(mipmap_len);
+    if (!mipmap_pixbuf.data) {
+      result.status_message = qoir_status_message__error_out_of_memory;
+      goto cleanup2;
+    }
+    qoir_private_encode_mipmap_rows(&state, &mipmap_pixbuf, src_pixbuf->data,
+                                    src_pixbuf->stride_in_bytes, 0,
+                                    src_pixbuf->pixcfg.height_in_pixels);
+  }
+
+  do {
+    result.status_message = qoir_private_encode_output__write_prefix(
+        &output, &src_pixbuf->pixcfg, dst_pixfmt, lossiness);
+    if (result.status_message) {
+      break;
+    }
+    uint64_t qpix_pos = output.position - 12;
+    uint64_t qpix_len = 0;
+    bool write_tile_index = options && options->write_tile_index;
+    result.status_message =
+        output.dst_ptr ? qoir_private_encode_qpix_payload(
+                             &output, &jobs, &qpix_len, write_tile_index)
+                       : qoir_private_encode_qpix_payload_to_sink(
+                             &output, &jobs, &qpix_len, write_tile_index);
+    if (result.status_message) {
+      break;
+    }
+    result.status_message = qoir_private_encode_output__write_suffix(
+        &output, qpix_pos, qpix_len, NULL, 0, mipmap_pixbuf, num_mipmap_levels,
+        encbuf, lossiness);
+  } while (false);
+
+  if (mipmap_pixbuf.data && !options->context) {
+    QOIR_FREE(mipmap_pixbuf.data);
+  }
+cleanup2:
+  if (dirty_alloc_ptr) {
+    QOIR_FREE(dirty_alloc_ptr);
+  }
+  qoir_private_encode_jobs__destroy(&jobs);
+cleanup1:
   if (free_encbuf) {
     QOIR_FREE(encbuf);
   }
-  if (r.status_message) {
-    result.status_message = r.status_message;
-    QOIR_FREE(original_dst_ptr);
+cleanup0:
+  if (result.status_message) {
+    QOIR_FREE_OWNED_MEMORY(owned_memory);
     return result;
-  } else if ((uint64_t)r.value > 0x7FFFFFFFFFFFFFFFull) {
-    result.status_message =
-        qoir_status_message__error_unsupported_pixbuf_dimensions;
-    QOIR_FREE(original_dst_ptr);
+  }
+  result.owned_memory = owned_memory;
+  result.dst_ptr = output.dst_ptr;
+  result.dst_len = (size_t)output.position;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_encode_result      //
+qoir_encode(                              //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  return qoir_private_encode(src_pixbuf, NULL, 0, NULL, 0, options);
+}
+
+QOIR_MAYBE_STATIC qoir_encode_result         //
+qoir_encode_dirty_rectangles(                //
+    const qoir_pixel_buffer* src_pixbuf,     //
+    const uint8_t* prev_ptr,                 //
+    size_t prev_len,                         //
+    const qoir_rectangle* dirty_rectangles,  //
+    size_t num_dirty_rectangles,             //
+    const qoir_encode_options* options) {
+  if (!prev_ptr || (!dirty_rectangles && (num_dirty_rectangles > 0))) {
+    qoir_encode_result result = {0};
+    result.status_message = qoir_status_message__error_invalid_argument;
     return result;
   }
-  qoir_private_poke_u64le(dst_ptr + 4, r.value);
-  dst_ptr += 12 + r.value;
+  return qoir_private_encode(src_pixbuf, prev_ptr, prev_len, dirty_rectangles,
+                             num_dirty_rectangles, options);
+}
 
-  // EXIF chunk.
-  if (options && options->metadata_exif_len) {
-    qoir_private_poke_u32le(dst_ptr + 0, 0x46495845);  // "EXIF"le.
-    qoir_private_poke_u64le(dst_ptr + 4, options->metadata_exif_len);
-    memcpy(dst_ptr + 12, options->metadata_exif_ptr,
-           options->metadata_exif_len);
-    dst_ptr += 12 + options->metadata_exif_len;
+// -------- QOIR Incremental Encode
+
+// qoir_private_encoder__jobs sets up the jobs (and their state) to encode the
+// rows of tiles whose pixels start at src_pixbuf's data, which is row src_y0
+// of the entire source image.
+static const char*                     //
+qoir_private_encoder__jobs(            //
+    qoir_encoder* encoder,             //
+    qoir_private_encode_jobs* jobs,    //
+    qoir_private_encode_state* state,  //
+    qoir_pixel_buffer* src_pixbuf,     //
+    size_t src_y0) {
+  src_pixbuf->pixcfg = encoder->private_impl.pixcfg;
+  const char* status_message = qoir_private_encode_init_state(
+      state, src_pixbuf, encoder->private_impl.lossiness,
+      &encoder->private_impl.options);
+  if (status_message) {
+    return status_message;
   }
+  state->src_y0 = src_y0;
+
+  memset(jobs, 0, sizeof(*jobs));
+  jobs->options = &encoder->private_impl.options;
+  jobs->state = state;
+  jobs->encbuf0 = encoder->private_impl.encbuf;
+  jobs->other_encbufs = encoder->private_impl.other_encbufs;
+  jobs->results = encoder->private_impl.results;
+  jobs->max_num_jobs = encoder->private_impl.max_num_jobs;
+  return NULL;
+}
 
-  // XMP chunk.
-  if (options && options->metadata_xmp_len) {
-    qoir_private_poke_u32le(dst_ptr + 0, 0x20504D58);  // "XMP "le.
-    qoir_private_poke_u64le(dst_ptr + 4, options->metadata_xmp_len);
-    memcpy(dst_ptr + 12, options->metadata_xmp_ptr, options->metadata_xmp_len);
-    dst_ptr += 12 + options->metadata_xmp_len;
+// qoir_private_encoder__encode_tile_rows encodes num_rows rows of pixels, a
+// whole number of rows of tiles (other than the image's last row of tiles,
+// which can be shorter), that start at row num_pushed_rows of the entire
+// source image.
+static const char*                       //
+qoir_private_encoder__encode_tile_rows(  //
+    qoir_encoder* encoder,               //
+    const uint8_t* src_data,             //
+    size_t src_stride_in_bytes,          //
+    uint32_t num_rows) {
+  qoir_private_encode_output output = {0};
+  output.options = &encoder->private_impl.options;
+  output.position = encoder->private_impl.position;
+
+  qoir_pixel_buffer src_pixbuf = {0};
+  src_pixbuf.data = (uint8_t*)src_data;
+  src_pixbuf.stride_in_bytes = src_stride_in_bytes;
+  qoir_private_encode_state state = {0};
+  qoir_private_encode_jobs jobs;
+  const char* status_message = qoir_private_encoder__jobs(
+      encoder, &jobs, &state, &src_pixbuf,
+      encoder->private_impl.num_pushed_rows);
+  if (status_message) {
+    return status_message;
+  }
+
+  if (encoder->private_impl.num_mipmap_levels) {
+    qoir_private_encode_mipmap_rows(
+        &state, &encoder->private_impl.mipmap_pixbuf, src_data,
+        src_stride_in_bytes, encoder->private_impl.num_pushed_rows, num_rows);
+  }
+
+  uint64_t width_in_tiles = state.width_in_tiles;
+  uint64_t tj = encoder->private_impl.num_pushed_rows >> QOIR_TILE_SHIFT;
+  uint64_t tj_end =
+      ((uint64_t)encoder->private_impl.num_pushed_rows + num_rows +
+       QOIR_TILE_MASK) >>
+      QOIR_TILE_SHIFT;
+  for (; tj < tj_end; tj++) {
+    qoir_size_result r = qoir_private_encode_tiles(
+        &jobs, encoder->private_impl.row_ptr, (tj + 0) * width_in_tiles,
+        (tj + 1) * width_in_tiles);
+    if (r.status_message) {
+      return r.status_message;
+    }
+    if (encoder->private_impl.tidx_ptr) {
+      qoir_private_encode_walk_tile_prefixes(
+          encoder->private_impl.tidx_ptr + (8 * tj * width_in_tiles),
+          width_in_tiles, encoder->private_impl.row_ptr,
+          encoder->private_impl.qpix_len);
+    }
+    status_message = qoir_private_encode_output__write(
+        &output, encoder->private_impl.row_ptr, r.value);
+    if (status_message) {
+      return status_message;
+    }
+    encoder->private_impl.position = output.position;
+    encoder->private_impl.qpix_len += r.value;
+  }
+  encoder->private_impl.num_pushed_rows += num_rows;
+  return NULL;
+}
+
+QOIR_MAYBE_STATIC const char*                    //
+qoir_encoder__initialize(                        //
+    qoir_encoder* encoder,                       //
+    const qoir_pixel_configuration* src_pixcfg,  //
+    const qoir_encode_options* options) {
+  if (!encoder) {
+    return qoir_status_message__error_invalid_argument;
+  }
+  memset(encoder, 0, sizeof(*encoder));
+  if (!src_pixcfg || !options || !options->contextual_write_func ||
+      options->dst_ptr) {
+    return qoir_status_message__error_invalid_argument;
+  }
+  encoder->private_impl.options = *options;
+  encoder->private_impl.pixcfg = *src_pixcfg;
+  options = &encoder->private_impl.options;
+
+  qoir_pixel_buffer src_pixbuf = {0};
+  src_pixbuf.pixcfg = *src_pixcfg;
+  qoir_size_result worst_case =
+      qoir_private_encode_worst_case_dst_len(&src_pixbuf, options);
+  if (worst_case.status_message) {
+    return worst_case.status_message;
+  }
+  qoir_pixel_format dst_pixfmt = qoir_private_encode_dst_pixfmt(src_pixcfg);
+  if (!dst_pixfmt) {
+    return qoir_status_message__error_unsupported_pixfmt;
+  }
+  uint32_t lossiness = (options->lossiness < 7) ? options->lossiness : 7;
+  encoder->private_impl.lossiness = lossiness;
+
+  // Allocate (in one block) one row of tiles' input (pixels) and output (the
+  // encoded tiles), the TIDX chunk's payload, the level 1 mipmap and the
+  // jobs' scratch space.
+  uint64_t width_in_tiles =
+      qoir_calculate_number_of_tiles_1d(src_pixcfg->width_in_pixels);
+  uint64_t number_of_tiles =
+      width_in_tiles *
+      qoir_calculate_number_of_tiles_1d(src_pixcfg->height_in_pixels);
+  uint32_t max_num_jobs =
+      qoir_private_encode_num_jobs(options, width_in_tiles);
+  encoder->private_impl.max_num_jobs = max_num_jobs;
+  uint64_t band_len = (uint64_t)QOIR_TILE_SIZE *
+                      src_pixcfg->width_in_pixels *
+                      qoir_pixel_format__bytes_per_pixel(src_pixcfg->pixfmt);
+  uint64_t row_len = (width_in_tiles * (4 + (4 * QOIR_TS2))) +
+                     ((uint64_t)max_num_jobs * QOIR_ENCODE_JOB_SLACK);
+  uint64_t tidx_len = options->write_tile_index ? (8 * number_of_tiles) : 0;
+  uint64_t jobs_len = (max_num_jobs - 1) * sizeof(qoir_encode_buffer) +
+                      (max_num_jobs * sizeof(qoir_size_result));
+  uint32_t num_mipmap_levels = qoir_private_num_mipmap_levels(
+      src_pixcfg->width_in_pixels, src_pixcfg->height_in_pixels,
+      options->num_mipmap_levels);
+  encoder->private_impl.num_mipmap_levels = num_mipmap_levels;
+  uint64_t mipmap_len = 0;
+  if (num_mipmap_levels) {
+    qoir_private_encode_mipmap_pixcfg(&encoder->private_impl.mipmap_pixbuf,
+                                      src_pixcfg, dst_pixfmt);
+    mipmap_len =
+        encoder->private_impl.mipmap_pixbuf.stride_in_bytes *
+        (uint64_t)encoder->private_impl.mipmap_pixbuf.pixcfg.height_in_pixels;
+  }
+  uint64_t alloc_len = jobs_len + band_len + row_len + tidx_len + mipmap_len;
+  if (alloc_len > SIZE_MAX) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+  }
+  uint8_t* alloc_ptr = (uint8_t*)QOIR_MALLOC((size_t)alloc_len);
+  if (!alloc_ptr) {
+    return qoir_status_message__error_out_of_memory;
+  }
+  encoder->private_impl.alloc_ptr = alloc_ptr;
+  encoder->private_impl.results = (qoir_size_result*)(void*)alloc_ptr;
+  encoder->private_impl.other_encbufs =
+      (qoir_encode_buffer*)(void*)(alloc_ptr +
+                                   (max_num_jobs * sizeof(qoir_size_result)));
+  encoder->private_impl.band_ptr = alloc_ptr + jobs_len;
+  encoder->private_impl.row_ptr = alloc_ptr + jobs_len + band_len;
+  if (tidx_len) {
+    encoder->private_impl.tidx_ptr = alloc_ptr + jobs_len + band_len + row_len;
+  }
+  if (mipmap_len) {
+    encoder->private_impl.mipmap_pixbuf.data =
+        alloc_ptr + jobs_len + band_len + row_len + tidx_len;
+  }
+
+  encoder->private_impl.encbuf = options->encbuf;
+  if (!encoder->private_impl.encbuf && options->context) {
+    encoder->private_impl.encbuf =
+        qoir_private_context__encbuf(options->context);
+    if (!encoder->private_impl.encbuf) {
+      return qoir_status_message__error_out_of_memory;
+    }
+  } else if (!encoder->private_impl.encbuf) {
+    encoder->private_impl.encbuf =
+        (qoir_encode_buffer*)QOIR_MALLOC(sizeof(qoir_encode_buffer));
+    if (!encoder->private_impl.encbuf) {
+      return qoir_status_message__error_out_of_memory;
+    }
+    encoder->private_impl.free_encbuf = true;
+  }
+
+  qoir_private_encode_output output = {0};
+  output.options = options;
+  const char* status_message = qoir_private_encode_output__write_prefix(
+      &output, src_pixcfg, dst_pixfmt, lossiness);
+  encoder->private_impl.qpix_pos = output.position - 12;
+  encoder->private_impl.position = output.position;
+  return status_message;
+}
+
+QOIR_MAYBE_STATIC const char*  //
+qoir_encoder__push_rows(       //
+    qoir_encoder* encoder,     //
+    const qoir_pixel_buffer* src_pixbuf) {
+  if (!encoder || !encoder->private_impl.alloc_ptr || !src_pixbuf ||
+      (src_pixbuf->pixcfg.pixfmt != encoder->private_impl.pixcfg.pixfmt) ||
+      (src_pixbuf->pixcfg.width_in_pixels !=
+       encoder->private_impl.pixcfg.width_in_pixels) ||
+      (src_pixbuf->pixcfg.height_in_pixels >
+       (encoder->private_impl.pixcfg.height_in_pixels -
+        encoder->private_impl.num_pushed_rows -
+        encoder->private_impl.num_band_rows))) {
+    return qoir_status_message__error_invalid_argument;
+  }
+
+  uint32_t height_in_pixels = encoder->private_impl.pixcfg.height_in_pixels;
+  size_t width_in_bytes =
+      (size_t)encoder->private_impl.pixcfg.width_in_pixels *
+      qoir_pixel_format__bytes_per_pixel(encoder->private_impl.pixcfg.pixfmt);
+  const uint8_t* sp = src_pixbuf->data;
+  uint32_t n = src_pixbuf->pixcfg.height_in_pixels;
+  while (n > 0) {
+    // band_height is the height of the next row of tiles.
+    uint32_t num_pushed_rows = encoder->private_impl.num_pushed_rows;
+    uint32_t band_height =
+        ((height_in_pixels - num_pushed_rows) < QOIR_TILE_SIZE)
+            ? (height_in_pixels - num_pushed_rows)
+            : QOIR_TILE_SIZE;
+
+    // If nothing is buffered, encode whole rows of tiles in place.
+    if ((encoder->private_impl.num_band_rows == 0) && (n >= band_height)) {
+      uint32_t m = (n < (height_in_pixels - num_pushed_rows))
+                       ? (n & ~(uint32_t)QOIR_TILE_MASK)
+                       : n;
+      const char* status_message = qoir_private_encoder__encode_tile_rows(
+          encoder, sp, src_pixbuf->stride_in_bytes, m);
+      if (status_message) {
+        return status_message;
+      }
+      sp += src_pixbuf->stride_in_bytes * m;
+      n -= m;
+      continue;
+    }
+
+    // Otherwise, buffer the rows until there's a complete row of tiles.
+    uint32_t m = band_height - encoder->private_impl.num_band_rows;
+    if (m > n) {
+      m = n;
+    }
+    for (uint32_t y = 0; y < m; y++) {
+      memcpy(encoder->private_impl.band_ptr +
+                 (width_in_bytes * encoder->private_impl.num_band_rows),
+             sp, width_in_bytes);
+      sp += src_pixbuf->stride_in_bytes;
+      encoder->private_impl.num_band_rows++;
+    }
+    n -= m;
+    if (encoder->private_impl.num_band_rows == band_height) {
+      encoder->private_impl.num_band_rows = 0;
+      const char* status_message = qoir_private_encoder__encode_tile_rows(
+          encoder, encoder->private_impl.band_ptr, width_in_bytes,
+          band_height);
+      if (status_message) {
+        return status_message;
+      }
+    }
+  }
+  return NULL;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_encoder__finish(               //
+    qoir_encoder* encoder) {
+  qoir_size_result result = {0};
+  if (!encoder || !encoder->private_impl.alloc_ptr ||
+      (encoder->private_impl.num_pushed_rows !=
+       encoder->private_impl.pixcfg.height_in_pixels)) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+
+  qoir_private_encode_output output = {0};
+  output.options = &encoder->private_impl.options;
+  output.position = encoder->private_impl.position;
+  uint64_t number_of_tiles =
+      qoir_calculate_number_of_tiles_2d(
+          encoder->private_impl.pixcfg.width_in_pixels,
+          encoder->private_impl.pixcfg.height_in_pixels);
+  result.status_message = qoir_private_encode_output__write_suffix(
+      &output, encoder->private_impl.qpix_pos, encoder->private_impl.qpix_len,
+      encoder->private_impl.tidx_ptr, number_of_tiles,
+      encoder->private_impl.mipmap_pixbuf,
+      encoder->private_impl.num_mipmap_levels, encoder->private_impl.encbuf,
+      encoder->private_impl.lossiness);
+  if (!result.status_message) {
+    result.value = (size_t)output.position;
+  }
+  qoir_encoder__destroy(encoder);
+  return result;
+}
+
+QOIR_MAYBE_STATIC void  //
+qoir_encoder__destroy(  //
+    qoir_encoder* encoder) {
+  if (!encoder) {
+    return;
+  }
+  const qoir_encode_options* options = &encoder->private_impl.options;
+  if (encoder->private_impl.free_encbuf) {
+    QOIR_FREE(encoder->private_impl.encbuf);
+  }
+  if (encoder->private_impl.alloc_ptr) {
+    QOIR_FREE(encoder->private_impl.alloc_ptr);
+  }
+  memset(&encoder->private_impl, 0, sizeof(encoder->private_impl));
+}
+
+// -------- QOIC Container
+
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_container_encode_dst_len(      //
+    const size_t* frame_lens,       //
+    size_t num_frames) {
+  qoir_size_result result = {0};
+  // The QOIC chunk (with a 16 byte directory entry per frame), a QFRM chunk
+  // header per frame and the QEND chunk.
+  if (num_frames > ((SIZE_MAX - 32) / 28)) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+  uint64_t n = 32 + (28 * (uint64_t)num_frames);
+  for (size_t i = 0; i < num_frames; i++) {
+    if ((frame_lens[i] > 0x7FFFFFFFFFFFFFFFull) ||
+        (frame_lens[i] > (SIZE_MAX - n))) {
+      result.status_message = qoir_status_message__error_invalid_argument;
+      return result;
+    }
+    n += frame_lens[i];
+  }
+  result.value = (size_t)n;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result     //
+qoir_container_encode(                 //
+    uint8_t* dst_ptr,                  //
+    size_t dst_len,                    //
+    const uint8_t* const* frame_ptrs,  //
+    const size_t* frame_lens,          //
+    size_t num_frames) {
+  qoir_size_result result =
+      qoir_container_encode_dst_len(frame_lens, num_frames);
+  if (result.status_message) {
+    return result;
+  } else if (dst_len < result.value) {
+    result.status_message = qoir_status_message__error_dst_is_too_short;
+    result.value = 0;
+    return result;
+  }
+
+  // QOIC chunk.
+  qoir_private_poke_u32le(dst_ptr + 0, 0x43494F51);  // "QOIC"le.
+  qoir_private_poke_u64le(dst_ptr + 4, 8 + (16 * (uint64_t)num_frames));
+  qoir_private_poke_u64le(dst_ptr + 12, num_frames);
+  uint8_t* directory = dst_ptr + 20;
+  uint8_t* d = directory + (16 * num_frames);
+
+  // QFRM chunks.
+  for (size_t i = 0; i < num_frames; i++) {
+    qoir_private_poke_u32le(d + 0, 0x4D524651);  // "QFRM"le.
+    qoir_private_poke_u64le(d + 4, frame_lens[i]);
+    d += 12;
+    qoir_private_poke_u64le(directory + (16 * i) + 0, (uint64_t)(d - dst_ptr));
+    qoir_private_poke_u64le(directory + (16 * i) + 8, frame_lens[i]);
+    if (frame_lens[i] > 0) {
+      memcpy(d, frame_ptrs[i], frame_lens[i]);
+      d += frame_lens[i];
+    }
   }
 
   // QEND chunk.
-  qoir_private_poke_u32le(dst_ptr + 0, 0x444E4551);  // "QEND"le.
-  qoir_private_poke_u64le(dst_ptr + 4, 0);
-  dst_ptr += 12;
+  qoir_private_poke_u32le(d + 0, 0x444E4551);  // "QEND"le.
+  qoir_private_poke_u64le(d + 4, 0);
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result       //
+qoir_container_decode_number_of_frames(  //
+    const uint8_t* src_ptr,              //
+    size_t src_len) {
+  qoir_size_result result = {0};
+  if ((src_len < 32) ||
+      (qoir_private_peek_u32le(src_ptr) != 0x43494F51)) {  // "QOIC"le.
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  uint64_t qoic_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if ((qoic_chunk_payload_len < 8) ||
+      (qoic_chunk_payload_len > (src_len - 24))) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  uint64_t number_of_frames = qoir_private_peek_u64le(src_ptr + 12);
+  if (number_of_frames > ((qoic_chunk_payload_len - 8) / 16)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  result.value = (size_t)number_of_frames;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_container_frame_result  //
+qoir_container_decode_frame(                   //
+    const uint8_t* src_ptr,                    //
+    size_t src_len,                            //
+    size_t frame_index) {
+  qoir_container_frame_result result = {0};
+  qoir_size_result number_of_frames =
+      qoir_container_decode_number_of_frames(src_ptr, src_len);
+  if (number_of_frames.status_message) {
+    result.status_message = number_of_frames.status_message;
+    return result;
+  } else if (frame_index >= number_of_frames.value) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
 
-  result.owned_memory = original_dst_ptr;
-  result.dst_ptr = original_dst_ptr;
-  result.dst_len = dst_ptr - original_dst_ptr;
+  // The frame must be a QFRM chunk's payload, after the QOIC chunk.
+  const uint8_t* entry = src_ptr + 20 + (16 * frame_index);
+  uint64_t offset = qoir_private_peek_u64le(entry + 0);
+  uint64_t length = qoir_private_peek_u64le(entry + 8);
+  uint64_t min_offset = 24 + qoir_private_peek_u64le(src_ptr + 4);
+  if ((offset < min_offset) || (offset > src_len) ||
+      (length > (src_len - offset))) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  const uint8_t* qfrm = src_ptr + offset - 12;
+  if ((qoir_private_peek_u32le(qfrm + 0) != 0x4D524651) ||  // "QFRM"le.
+      (qoir_private_peek_u64le(qfrm + 4) != length)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  result.dst_ptr = src_ptr + offset;
+  result.dst_len = (size_t)length;
   return result;
 }
 
 // -------- Private Macros
 
 #undef QOIR_ALWAYS_INLINE
+#undef QOIR_FREE_OWNED_MEMORY
 #undef QOIR_FREE
 #undef QOIR_HASH_TABLE_SHIFT
 #undef QOIR_LZ4_HASH_TABLE_SHIFT
+#undef QOIR_LZ4_HC_MAX_INCL_SRC_LEN
 #undef QOIR_MALLOC
 #undef QOIR_SWAR_PADDB
 #undef QOIR_SWAR_PSUBB
 #undef QOIR_USE_MEMCPY_LE_PEEK_POKE
+#undef QOIR_TARGET_AVX2
+#undef QOIR_TARGET_SSSE3
+#undef QOIR_USE_CPU_DISPATCH
+#undef QOIR_USE_SIMD_AVX2
+#undef QOIR_USE_SIMD_NEON
 #undef QOIR_USE_SIMD_SSE2
+#undef QOIR_USE_SIMD_SSSE3
 
 // ================================ -Private Implementation
 
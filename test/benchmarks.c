@@ -13,8 +13,10 @@
 // limitations under the License.
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <time.h>
 
 #define QOIR_IMPLEMENTATION
 #include "../src/qoir.h"
@@ -44,6 +46,112 @@ const char error_not_implemented[] =  //
 int g_number_of_reps;
 int g_verbose;
 
+// g_kernels is whether to benchmark the individual stages (e.g. LZ4, tile
+// ops, swizzles) instead of whole codecs.
+int g_kernels;
+
+#define OUTPUT_FORMAT__TEXT 0
+#define OUTPUT_FORMAT__CSV 1
+#define OUTPUT_FORMAT__JSON 2
+
+// g_output_format is OUTPUT_FORMAT__TEXT (the default) or one of the machine
+// readable formats. Those have more columns: thread counts, latency
+// percentiles and peak memory.
+int g_output_format;
+int g_printed_csv_header;
+
+#define MAX_INCL_NUMBER_OF_THREAD_COUNTS 8
+#define MAX_INCL_NUM_JOBS 64
+
+// g_thread_counts are the -threads=T,etc values. An empty list is like "1",
+// except that the QOIR codecs' names don't get a "/tT" suffix.
+uint32_t g_thread_counts[MAX_INCL_NUMBER_OF_THREAD_COUNTS];
+size_t g_number_of_thread_counts;
+
+// g_num_jobs is the current variant's max_num_jobs, used by the QOIR codecs.
+uint32_t g_num_jobs;
+
+// monotonic_nanos returns the time (in nanoseconds) from a clock that, unlike
+// gettimeofday, doesn't jump when the system's wall clock is adjusted.
+static uint64_t   //
+monotonic_nanos(  //
+    void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)ts.tv_sec) * 1000000000) + ((uint64_t)ts.tv_nsec);
+}
+
+// print_number prints x (with the given precision) or, if x is not positive,
+// the missing string.
+static void         //
+print_number(       //
+    double x,       //
+    int precision,  //
+    const char* missing) {
+  if (x > 0) {
+    printf("%.*f", precision, x);
+  } else {
+    fputs(missing, stdout);
+  }
+}
+
+// print_escaped_name prints name0, name1 and name2 (concatenated) as a CSV
+// field or as a JSON string, depending on g_output_format.
+static void             //
+print_escaped_name(     //
+    const char* name0,  //
+    const char* name1,  //
+    const char* name2) {
+  const char* names[3] = {name0, name1, name2};
+  putchar('"');
+  for (int i = 0; i < 3; i++) {
+    for (const char* p = names[i]; *p; p++) {
+      uint8_t c = (uint8_t)(*p);
+      if (c == '"') {
+        bool csv = g_output_format == OUTPUT_FORMAT__CSV;
+        fputs(csv ? "\"\"" : "\\\"", stdout);
+      } else if (g_output_format == OUTPUT_FORMAT__CSV) {
+        putchar(c);
+      } else if (c == '\\') {
+        fputs("\\\\", stdout);
+      } else if (c < 0x20) {
+        printf("\\u%04X", c);
+      } else {
+        putchar(c);
+      }
+    }
+  }
+  putchar('"');
+}
+
+// my_cpu_config describes the CPU architecture and SIMD code paths that
+// qoir.h was built with, so that numbers from different machines (e.g. x86_64
+// desktops and aarch64 servers) can be told apart. It mirrors qoir.h's
+// QOIR_USE_SIMD_ETC logic, as those macros are #undef'ed at the end of qoir.h.
+const char*     //
+my_cpu_config(  //
+    void) {
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(QOIR_CONFIG__DISABLE_SIMD)
+  return "x86_64 (SIMD disabled)";
+#elif defined(__SSSE3__) || defined(__AVX__)
+  return "x86_64 (SSE2, SSSE3)";
+#else
+  return "x86_64 (SSE2)";
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#if defined(QOIR_CONFIG__DISABLE_SIMD)
+  return "aarch64 (SIMD disabled)";
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+  return "aarch64 (NEON)";
+#else
+  return "aarch64 (no SIMD)";
+#endif
+#else
+  return "other (no SIMD)";
+#endif
+}
+
 typedef struct timings_struct {
   uint64_t original_size;
   uint64_t compressed_size;
@@ -51,8 +159,28 @@ typedef struct timings_struct {
   uint64_t encode_micros;
   uint64_t decode_pixels;
   uint64_t decode_micros;
+
+  // The latency percentiles are over a single image's reps. Adding timings
+  // (e.g. for a directory's summary) takes their maximum: the slowest image's.
+  uint64_t encode_p50_nanos;
+  uint64_t encode_p99_nanos;
+  uint64_t decode_p50_nanos;
+  uint64_t decode_p99_nanos;
+
+  // The peak number of bytes allocated, during a single call, or zero if not
+  // measured (the non-QOIR codecs don't take QOIR's memory functions). Adding
+  // timings also takes their maximum.
+  uint64_t encode_peak_bytes;
+  uint64_t decode_peak_bytes;
 } timings;
 
+static inline uint64_t  //
+max_u64(                //
+    uint64_t x,         //
+    uint64_t y) {
+  return (x > y) ? x : y;
+}
+
 void               //
 add_timings(       //
     timings* dst,  //
@@ -63,12 +191,22 @@ add_timings(       //
   dst->encode_micros += src->encode_micros;
   dst->decode_pixels += src->decode_pixels;
   dst->decode_micros += src->decode_micros;
+  dst->encode_p50_nanos = max_u64(dst->encode_p50_nanos, src->encode_p50_nanos);
+  dst->encode_p99_nanos = max_u64(dst->encode_p99_nanos, src->encode_p99_nanos);
+  dst->decode_p50_nanos = max_u64(dst->decode_p50_nanos, src->decode_p50_nanos);
+  dst->decode_p99_nanos = max_u64(dst->decode_p99_nanos, src->decode_p99_nanos);
+  dst->encode_peak_bytes =
+      max_u64(dst->encode_peak_bytes, src->encode_peak_bytes);
+  dst->decode_peak_bytes =
+      max_u64(dst->decode_peak_bytes, src->decode_peak_bytes);
 }
 
 void                         //
 print_timings(               //
     timings* t,              //
     const char* formatname,  //
+    const char* fullname,    //
+    uint32_t num_jobs,       //
     const char* name0,       //
     const char* name1,       //
     const char* name2) {
@@ -80,14 +218,66 @@ print_timings(               //
   double dspeed = t->decode_micros
                       ? (t->decode_pixels / ((double)(t->decode_micros)))
                       : nan;
+
+  if (g_output_format == OUTPUT_FORMAT__TEXT) {
 #if defined(CONFIG_FULL_BENCHMARKS)
-  printf(
-      "%-16s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  %s%s%s\n",
-      formatname, cratio, espeed, dspeed, name0, name1, name2);
+    printf(
+        "%-16s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  "
+        "%s%s%s\n",
+        fullname, cratio, espeed, dspeed, name0, name1, name2);
 #else
-  printf("%-8s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  %s%s%s\n",
-         formatname, cratio, espeed, dspeed, name0, name1, name2);
+    printf(
+        "%-8s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  %s%s%s\n",
+        fullname, cratio, espeed, dspeed, name0, name1, name2);
 #endif
+    return;
+  }
+
+  const char* missing = "null";
+  if (g_output_format == OUTPUT_FORMAT__CSV) {
+    missing = "";
+    if (!g_printed_csv_header) {
+      g_printed_csv_header = 1;
+      printf(
+          "format,threads,cmp_ratio,enc_mpixels_per_s,dec_mpixels_per_s,"
+          "enc_p50_ms,enc_p99_ms,dec_p50_ms,dec_p99_ms,"
+          "enc_peak_bytes,dec_peak_bytes,name\n");
+    }
+    printf("%s,%" PRIu32 ",", formatname, num_jobs);
+  } else {
+    printf("{\"format\":\"%s\",\"threads\":%" PRIu32 ",\"cmp_ratio\":",
+           formatname, num_jobs);
+  }
+
+  const bool json = g_output_format == OUTPUT_FORMAT__JSON;
+  const char* keys[10] = {
+      "enc_mpixels_per_s", "dec_mpixels_per_s", "enc_p50_ms",
+      "enc_p99_ms",        "dec_p50_ms",        "dec_p99_ms",
+      "enc_peak_bytes",    "dec_peak_bytes",    NULL,
+  };
+  double values[10] = {
+      espeed,
+      dspeed,
+      t->encode_p50_nanos / 1e6,
+      t->encode_p99_nanos / 1e6,
+      t->decode_p50_nanos / 1e6,
+      t->decode_p99_nanos / 1e6,
+      (double)(t->encode_peak_bytes),
+      (double)(t->decode_peak_bytes),
+  };
+  int precisions[10] = {2, 2, 3, 3, 3, 3, 0, 0};
+  print_number(cratio, 4, missing);
+  for (int i = 0; keys[i]; i++) {
+    if (json) {
+      printf(",\"%s\":", keys[i]);
+    } else {
+      putchar(',');
+    }
+    print_number(values[i], precisions[i], missing);
+  }
+  printf(json ? ",\"name\":" : ",");
+  print_escaped_name(name0, name1, name2);
+  printf(json ? "}\n" : "\n");
 }
 
 typedef struct timings_result_struct {
@@ -103,18 +293,193 @@ make_timings_result_error(  //
   return result;
 }
 
+static int          //
+compare_u64(        //
+    const void* x,  //
+    const void* y) {
+  uint64_t a = *(const uint64_t*)x;
+  uint64_t b = *(const uint64_t*)y;
+  return (a > b) - (a < b);
+}
+
+// percentile returns the p'th percentile (using the nearest-rank method) of
+// the n (which must be positive) values, which must already be sorted.
+static uint64_t                  //
+percentile(                      //
+    const uint64_t* sorted_ptr,  //
+    size_t n,                    //
+    size_t p) {
+  size_t rank = ((p * n) + 99) / 100;
+  return sorted_ptr[(rank > 0) ? (rank - 1) : 0];
+}
+
+// ----
+
+typedef struct job_data_struct {
+  qoir_job_func job_func;
+  void* job_context;
+  uint32_t job_index;
+} job_data;
+
+static void*  //
+run_job(      //
+    void* data) {
+  job_data* jd = (job_data*)data;
+  (*jd->job_func)(jd->job_context, jd->job_index);
+  return NULL;
+}
+
+// run_jobs is a qoir_run_jobs_func that runs each job on its own pthread. If a
+// thread cannot be created then that job runs on the calling thread.
+//
+// Creating threads per call (instead of using a thread pool) is simple, and
+// its overhead is part of what the multi-threaded numbers measure.
+static void                  //
+run_jobs(                    //
+    void* context,           //
+    qoir_job_func job_func,  //
+    void* job_context,       //
+    uint32_t num_jobs) {
+  job_data data[MAX_INCL_NUM_JOBS];
+  pthread_t threads[MAX_INCL_NUM_JOBS];
+  bool started[MAX_INCL_NUM_JOBS];
+  for (uint32_t i = 0; i < num_jobs; i += MAX_INCL_NUM_JOBS) {
+    uint32_t n = num_jobs - i;
+    if (n > MAX_INCL_NUM_JOBS) {
+      n = MAX_INCL_NUM_JOBS;
+    }
+    for (uint32_t j = 0; j < n; j++) {
+      data[j].job_func = job_func;
+      data[j].job_context = job_context;
+      data[j].job_index = i + j;
+      started[j] = !pthread_create(&threads[j], NULL, &run_job, &data[j]);
+      if (!started[j]) {
+        run_job(&data[j]);
+      }
+    }
+    for (uint32_t j = 0; j < n; j++) {
+      if (started[j]) {
+        pthread_join(threads[j], NULL);
+      }
+    }
+  }
+}
+
+// ----
+
+typedef struct memory_tracker_struct {
+  pthread_mutex_t mutex;
+  uint64_t current_bytes;
+  uint64_t peak_bytes;
+} memory_tracker;
+
+// MEMORY_TRACKER_HEADER_LEN is the number of bytes (holding the allocation
+// length) before each tracking_malloc pointer. 16 keeps the pointers aligned.
+#define MEMORY_TRACKER_HEADER_LEN 16
+
+static void*                    //
+tracking_malloc(                //
+    void* memory_func_context,  //
+    size_t len) {
+  memory_tracker* t = (memory_tracker*)memory_func_context;
+  if (len > (SIZE_MAX - MEMORY_TRACKER_HEADER_LEN)) {
+    return NULL;
+  }
+  uint8_t* ptr = (uint8_t*)malloc(MEMORY_TRACKER_HEADER_LEN + len);
+  if (!ptr) {
+    return NULL;
+  }
+  memcpy(ptr, &len, sizeof(len));
+  pthread_mutex_lock(&t->mutex);
+  t->current_bytes += len;
+  t->peak_bytes = max_u64(t->peak_bytes, t->current_bytes);
+  pthread_mutex_unlock(&t->mutex);
+  return ptr + MEMORY_TRACKER_HEADER_LEN;
+}
+
+static void                     //
+tracking_free(                  //
+    void* memory_func_context,  //
+    void* ptr) {
+  memory_tracker* t = (memory_tracker*)memory_func_context;
+  if (!ptr) {
+    return;
+  }
+  uint8_t* p = ((uint8_t*)ptr) - MEMORY_TRACKER_HEADER_LEN;
+  size_t len = 0;
+  memcpy(&len, p, sizeof(len));
+  pthread_mutex_lock(&t->mutex);
+  t->current_bytes -= len;
+  pthread_mutex_unlock(&t->mutex);
+  free(p);
+}
+
+// measure_qoir_peak_memory encodes and then decodes src_pixbuf, once each,
+// recording the most memory (including the encoded or decoded output) that
+// each call had allocated at any one time. It uses no qoir_context, so that
+// nothing is re-used from earlier calls.
+static const char*                  //
+measure_qoir_peak_memory(           //
+    qoir_pixel_buffer* src_pixbuf,  //
+    uint32_t lossiness,             //
+    uint64_t* encode_peak_bytes,    //
+    uint64_t* decode_peak_bytes) {
+  memory_tracker enc_tracker = {0};
+  memory_tracker dec_tracker = {0};
+  pthread_mutex_init(&enc_tracker.mutex, NULL);
+  pthread_mutex_init(&dec_tracker.mutex, NULL);
+
+  qoir_encode_options encopts = {0};
+  encopts.contextual_malloc_func = &tracking_malloc;
+  encopts.contextual_free_func = &tracking_free;
+  encopts.memory_func_context = &enc_tracker;
+  encopts.lossiness = lossiness;
+  if (g_num_jobs > 1) {
+    encopts.contextual_run_jobs_func = &run_jobs;
+    encopts.max_num_jobs = g_num_jobs;
+  }
+  qoir_encode_result enc = qoir_encode(src_pixbuf, &encopts);
+  *encode_peak_bytes = enc_tracker.peak_bytes;
+
+  const char* status_message = enc.status_message;
+  if (!status_message) {
+    qoir_decode_options decopts = {0};
+    decopts.contextual_malloc_func = &tracking_malloc;
+    decopts.contextual_free_func = &tracking_free;
+    decopts.memory_func_context = &dec_tracker;
+    if (g_num_jobs > 1) {
+      decopts.contextual_run_jobs_func = &run_jobs;
+      decopts.max_num_jobs = g_num_jobs;
+    }
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    *decode_peak_bytes = dec_tracker.peak_bytes;
+    status_message = dec.status_message;
+    tracking_free(&dec_tracker, dec.owned_memory);
+  }
+  tracking_free(&enc_tracker, enc.owned_memory);
+
+  pthread_mutex_destroy(&enc_tracker.mutex);
+  pthread_mutex_destroy(&dec_tracker.mutex);
+  return status_message;
+}
+
 // ----
 
 static qoir_decode_result    //
 my_decode_qoir(              //
     const uint8_t* src_ptr,  //
     const size_t src_len) {
-  // static avoids an allocation every time this function is called, but it
-  // means that this function is not thread-safe.
-  static qoir_decode_buffer decbuf;
+  // static avoids allocating scratch space every time this function is
+  // called, but it means that this function is not thread-safe. A
+  // multi-threaded program would use one qoir_context per thread.
+  static qoir_context context;
 
   qoir_decode_options decopts = {0};
-  decopts.decbuf = &decbuf;
+  decopts.context = &context;
+  if (g_num_jobs > 1) {
+    decopts.contextual_run_jobs_func = &run_jobs;
+    decopts.max_num_jobs = g_num_jobs;
+  }
   return qoir_decode(src_ptr, src_len, &decopts);
 }
 
@@ -123,30 +488,58 @@ my_encode_qoir_lossless(     //
     const uint8_t* png_ptr,  //
     const size_t png_len,    //
     qoir_pixel_buffer* src_pixbuf) {
-  // static avoids an allocation every time this function is called, but it
-  // means that this function is not thread-safe.
-  static qoir_encode_buffer encbuf;
+  // static avoids allocating scratch space every time this function is
+  // called, but it means that this function is not thread-safe. A
+  // multi-threaded program would use one qoir_context per thread.
+  static qoir_context context;
 
   qoir_encode_options encopts = {0};
-  encopts.encbuf = &encbuf;
+  encopts.context = &context;
+  if (g_num_jobs > 1) {
+    encopts.contextual_run_jobs_func = &run_jobs;
+    encopts.max_num_jobs = g_num_jobs;
+  }
   return qoir_encode(src_pixbuf, &encopts);
 }
 
+static const char*                  //
+my_peak_memory_qoir_lossless(       //
+    qoir_pixel_buffer* src_pixbuf,  //
+    uint64_t* encode_peak_bytes,    //
+    uint64_t* decode_peak_bytes) {
+  return measure_qoir_peak_memory(src_pixbuf, 0, encode_peak_bytes,
+                                  decode_peak_bytes);
+}
+
 #if defined(CONFIG_FULL_BENCHMARKS)
 static qoir_encode_result    //
 my_encode_qoir_lossy(        //
     const uint8_t* png_ptr,  //
     const size_t png_len,    //
     qoir_pixel_buffer* src_pixbuf) {
-  // static avoids an allocation every time this function is called, but it
-  // means that this function is not thread-safe.
-  static qoir_encode_buffer encbuf;
+  // static avoids allocating scratch space every time this function is
+  // called, but it means that this function is not thread-safe. A
+  // multi-threaded program would use one qoir_context per thread.
+  static qoir_context context;
 
   qoir_encode_options encopts = {0};
-  encopts.encbuf = &encbuf;
+  encopts.context = &context;
   encopts.lossiness = 2;
+  if (g_num_jobs > 1) {
+    encopts.contextual_run_jobs_func = &run_jobs;
+    encopts.max_num_jobs = g_num_jobs;
+  }
   return qoir_encode(src_pixbuf, &encopts);
 }
+
+static const char*                  //
+my_peak_memory_qoir_lossy(          //
+    qoir_pixel_buffer* src_pixbuf,  //
+    uint64_t* encode_peak_bytes,    //
+    uint64_t* decode_peak_bytes) {
+  return measure_qoir_peak_memory(src_pixbuf, 2, encode_peak_bytes,
+                                  decode_peak_bytes);
+}
 #endif
 
 typedef struct format_struct {
@@ -156,6 +549,12 @@ typedef struct format_struct {
   qoir_encode_result (*encode_func)(const uint8_t* png_ptr,
                                     const size_t png_len,
                                     qoir_pixel_buffer* src_pixbuf);
+
+  // peak_memory_func is only non-NULL for the QOIR codecs, which are also the
+  // only ones that are multi-threaded (honoring g_num_jobs).
+  const char* (*peak_memory_func)(qoir_pixel_buffer* src_pixbuf,
+                                  uint64_t* encode_peak_bytes,
+                                  uint64_t* decode_peak_bytes);
 } format;
 
 format my_formats[] = {
@@ -174,8 +573,10 @@ format my_formats[] = {
     {"PNG/stb", &my_decode_png_stb, &my_encode_png_stb},
     {"PNG/wuffs", &my_decode_png_wuffs, &my_encode_png_wuffs},
     {"QOI", &my_decode_qoi, &my_encode_qoi},
-    {"QOIR_Lossless", &my_decode_qoir, &my_encode_qoir_lossless},
-    {"QOIR_Lossy", &my_decode_qoir, &my_encode_qoir_lossy},
+    {"QOIR_Lossless", &my_decode_qoir, &my_encode_qoir_lossless,
+     &my_peak_memory_qoir_lossless},
+    {"QOIR_Lossy", &my_decode_qoir, &my_encode_qoir_lossy,
+     &my_peak_memory_qoir_lossy},
     {"WebP_Lossless", &my_decode_webp, &my_encode_webp_lossless},
     {"WebP_Lossy", &my_decode_webp, &my_encode_webp_lossy},
     {"WebP_Lossy2", &my_decode_webp, &my_encode_webp_lossy2},
@@ -183,7 +584,8 @@ format my_formats[] = {
     {"ZPNG_Lossy2", &my_decode_zpng, &my_encode_zpng_lossy2},
     {"ZPNG_NofilLsl", &my_decode_zpng, &my_encode_zpng_nofilter_lossless},
 #else
-    {"QOIR", &my_decode_qoir, &my_encode_qoir_lossless},
+    {"QOIR", &my_decode_qoir, &my_encode_qoir_lossless,
+     &my_peak_memory_qoir_lossless},
 #endif
 };
 
@@ -195,6 +597,42 @@ number_of_formats() {
   return (n < MAX_INCL_NUMBER_OF_FORMATS) ? n : MAX_INCL_NUMBER_OF_FORMATS;
 }
 
+// A variant is a format and, for multi-threaded formats, a thread count.
+typedef struct variant_struct {
+  const format* f;
+  uint32_t num_jobs;
+  char name[32];
+} variant;
+
+#define MAX_INCL_NUMBER_OF_VARIANTS \
+  (MAX_INCL_NUMBER_OF_FORMATS * MAX_INCL_NUMBER_OF_THREAD_COUNTS)
+
+variant g_variants[MAX_INCL_NUMBER_OF_VARIANTS];
+size_t g_number_of_variants;
+
+void            //
+make_variants(  //
+    void) {
+  g_number_of_variants = 0;
+  for (size_t i = 0; i < number_of_formats(); i++) {
+    const format* f = &my_formats[i];
+    if (!f->peak_memory_func || (g_number_of_thread_counts == 0)) {
+      variant* v = &g_variants[g_number_of_variants++];
+      v->f = f;
+      v->num_jobs = 1;
+      snprintf(v->name, sizeof(v->name), "%s", f->name);
+      continue;
+    }
+    for (size_t j = 0; j < g_number_of_thread_counts; j++) {
+      variant* v = &g_variants[g_number_of_variants++];
+      v->f = f;
+      v->num_jobs = g_thread_counts[j];
+      snprintf(v->name, sizeof(v->name), "%s/t%" PRIu32, f->name,
+               v->num_jobs);
+    }
+  }
+}
+
 // ----
 
 static timings_result        //
@@ -202,11 +640,19 @@ encode_decode(               //
     const char* benchname,   //
     const char* dirname,     //
     const char* filename,    //
-    const format* f,         //
+    const variant* v,        //
     const uint8_t* png_ptr,  //
     const size_t png_len,    //
     qoir_pixel_buffer* src_pixbuf) {
   timings_result result = {0};
+  const format* f = v->f;
+  g_num_jobs = v->num_jobs;
+
+  uint64_t* latencies =
+      (uint64_t*)malloc(sizeof(uint64_t) * (size_t)(g_number_of_reps + 1));
+  if (!latencies) {
+    return make_timings_result_error("out of memory");
+  }
 
   const uint8_t* enc_ptr = NULL;
   size_t enc_len = 0;
@@ -218,6 +664,7 @@ encode_decode(               //
     printf("%s%s%s: could not encode %s\n", benchname, dirname, filename,
            f->name);
     free(enc.owned_memory);
+    free(latencies);
     return make_timings_result_error(enc.status_message);
   } else {
     enc_ptr = enc.dst_ptr;
@@ -234,20 +681,26 @@ encode_decode(               //
   result.value.compressed_size = enc_len;
 
   {
-    struct timeval timeval0;
-    gettimeofday(&timeval0, NULL);
+    uint64_t nanos = 0;
     for (int i = 0; i < g_number_of_reps; i++) {
+      uint64_t nanos0 = monotonic_nanos();
       free((*f->encode_func)(png_ptr, png_len, src_pixbuf).owned_memory);
+      latencies[i] = monotonic_nanos() - nanos0;
+      nanos += latencies[i];
     }
-    struct timeval timeval1;
-    gettimeofday(&timeval1, NULL);
 
-    int64_t micros = ((int64_t)(timeval1.tv_sec - timeval0.tv_sec)) * 1000000 +
-                     ((int64_t)(timeval1.tv_usec - timeval0.tv_usec));
+    int64_t micros = (int64_t)(nanos / 1000);
     result.value.encode_pixels = g_number_of_reps * original_num_pixels;
     result.value.encode_micros = (enc.status_message == error_not_implemented)
                                      ? 0
                                      : ((micros > 0) ? micros : 1);
+    if (result.value.encode_micros && (g_number_of_reps > 0)) {
+      qsort(latencies, g_number_of_reps, sizeof(uint64_t), &compare_u64);
+      result.value.encode_p50_nanos =
+          percentile(latencies, g_number_of_reps, 50);
+      result.value.encode_p99_nanos =
+          percentile(latencies, g_number_of_reps, 99);
+    }
   }
 
   qoir_decode_result dec = (*f->decode_func)(enc_ptr, enc_len);
@@ -258,33 +711,283 @@ encode_decode(               //
     printf("%s%s%s: could not decode %s\n", benchname, dirname, filename,
            f->name);
     free(enc.owned_memory);
+    free(latencies);
     return make_timings_result_error(dec.status_message);
   } else {
-    struct timeval timeval0;
-    gettimeofday(&timeval0, NULL);
+    uint64_t nanos = 0;
     for (int i = 0; i < g_number_of_reps; i++) {
+      uint64_t nanos0 = monotonic_nanos();
       free((*f->decode_func)(enc_ptr, enc_len).owned_memory);
+      latencies[i] = monotonic_nanos() - nanos0;
+      nanos += latencies[i];
     }
-    struct timeval timeval1;
-    gettimeofday(&timeval1, NULL);
 
-    int64_t micros = ((int64_t)(timeval1.tv_sec - timeval0.tv_sec)) * 1000000 +
-                     ((int64_t)(timeval1.tv_usec - timeval0.tv_usec));
+    int64_t micros = (int64_t)(nanos / 1000);
     result.value.decode_pixels = g_number_of_reps * original_num_pixels;
     result.value.decode_micros = (micros > 0) ? micros : 1;
+    if (g_number_of_reps > 0) {
+      qsort(latencies, g_number_of_reps, sizeof(uint64_t), &compare_u64);
+      result.value.decode_p50_nanos =
+          percentile(latencies, g_number_of_reps, 50);
+      result.value.decode_p99_nanos =
+          percentile(latencies, g_number_of_reps, 99);
+    }
+  }
+
+  // Only the machine readable output formats print the peak memory.
+  if (f->peak_memory_func && (g_output_format != OUTPUT_FORMAT__TEXT)) {
+    const char* status_message =
+        (*f->peak_memory_func)(src_pixbuf, &result.value.encode_peak_bytes,
+                               &result.value.decode_peak_bytes);
+    if (status_message) {
+      printf("%s%s%s: could not measure %s\n", benchname, dirname, filename,
+             f->name);
+      result = make_timings_result_error(status_message);
+    }
   }
 
   free(enc.owned_memory);
+  free(latencies);
   return result;
 }
 
 // ----
 
+// A kernel is one stage of the QOIR codec, benchmarked in isolation. The tile
+// kernels work on each tile of the image in turn (with g_number_of_reps calls
+// per tile, so that the tile's data stays in the cache). The swizzle kernels
+// (after dispatching to the fastest version that the CPU supports) work on
+// the whole image.
+
+#define KERNEL__ENCODE_TILE_OPS 0
+#define KERNEL__LZ4_BLOCK_ENCODE 1
+#define KERNEL__LZ4_BLOCK_DECODE 2
+#define KERNEL__DECODE_TILE_OPS 3
+#define NUMBER_OF_TILE_KERNELS 4
+
+const char* my_tile_kernel_names[NUMBER_OF_TILE_KERNELS] = {
+    "encode_tile_ops",
+    "lz4_block_encode",
+    "lz4_block_decode",
+    "decode_tile_ops",
+};
+
+typedef struct swizzle_kernel_struct {
+  const char* name;
+  qoir_private_swizzle_func func;
+  uint32_t dst_bytes_per_pixel;
+  uint32_t src_bytes_per_pixel;
+} swizzle_kernel;
+
+swizzle_kernel my_swizzle_kernels[] = {
+    {"swizzle__copy_4", &qoir_private_swizzle__copy_4, 4, 4},
+    {"swizzle__bgr__bgrn", &qoir_private_swizzle__bgr__bgrn, 3, 4},
+    {"swizzle__bgr__bgrp", &qoir_private_swizzle__bgr__bgrp, 3, 4},
+    {"swizzle__bgr__rgbn", &qoir_private_swizzle__bgr__rgbn, 3, 4},
+    {"swizzle__bgr__rgbp", &qoir_private_swizzle__bgr__rgbp, 3, 4},
+    {"swizzle__bgra__bgr", &qoir_private_swizzle__bgra__bgr, 4, 3},
+    {"swizzle__bgra__bgrx", &qoir_private_swizzle__bgra__bgrx, 4, 4},
+    {"swizzle__bgra__rgb", &qoir_private_swizzle__bgra__rgb, 4, 3},
+    {"swizzle__bgra__rgba", &qoir_private_swizzle__bgra__rgba, 4, 4},
+    {"swizzle__bgra__rgbx", &qoir_private_swizzle__bgra__rgbx, 4, 4},
+    {"swizzle__bgrn__bgrp", &qoir_private_swizzle__bgrn__bgrp, 4, 4},
+    {"swizzle__bgrn__rgbp", &qoir_private_swizzle__bgrn__rgbp, 4, 4},
+    {"swizzle__bgrp__bgrn", &qoir_private_swizzle__bgrp__bgrn, 4, 4},
+    {"swizzle__bgrp__rgbn", &qoir_private_swizzle__bgrp__rgbn, 4, 4},
+};
+
+#define NUMBER_OF_KERNELS \
+  (NUMBER_OF_TILE_KERNELS + ARRAY_SIZE(my_swizzle_kernels))
+
+static const char*  //
+kernel_name(        //
+    size_t k) {
+  return (k < NUMBER_OF_TILE_KERNELS)
+             ? my_tile_kernel_names[k]
+             : my_swizzle_kernels[k - NUMBER_OF_TILE_KERNELS].name;
+}
+
+typedef struct kernel_timings_struct {
+  uint64_t pixels;
+  uint64_t nanos;
+} kernel_timings;
+
+void                         //
+print_kernel_timings(        //
+    kernel_timings* t,       //
+    const char* kernelname,  //
+    const char* name0,       //
+    const char* name1,       //
+    const char* name2) {
+  double speed = t->nanos ? ((1000.0 * t->pixels) / t->nanos) : (0.0 / 0.0);
+  if (g_output_format == OUTPUT_FORMAT__TEXT) {
+    printf("%-24s%8.2f MPixels/s  %s%s%s\n", kernelname, speed, name0, name1,
+           name2);
+    return;
+  }
+
+  bool json = g_output_format == OUTPUT_FORMAT__JSON;
+  if (json) {
+    printf("{\"kernel\":\"%s\",\"mpixels_per_s\":", kernelname);
+  } else {
+    if (!g_printed_csv_header) {
+      g_printed_csv_header = 1;
+      printf("kernel,mpixels_per_s,name\n");
+    }
+    printf("%s,", kernelname);
+  }
+  print_number(speed, 2, json ? "null" : "");
+  printf(json ? ",\"name\":" : ",");
+  print_escaped_name(name0, name1, name2);
+  printf(json ? "}\n" : "\n");
+}
+
+// bench_kernels adds to t (an array of NUMBER_OF_KERNELS elements) the
+// kernels' timings for the BGRA (non-premultiplied) image at bgra_ptr.
+const char*                   //
+bench_kernels(                //
+    kernel_timings* t,        //
+    const uint8_t* bgra_ptr,  //
+    size_t width,             //
+    size_t height,            //
+    bool has_alpha) {
+  const int n = (g_number_of_reps > 0) ? g_number_of_reps : 1;
+  const size_t ops_len = (5 * QOIR_TS2) + 64;
+  const size_t lz4_len =
+      qoir_lz4_block_encode_worst_case_dst_len(ops_len).value;
+  const size_t literals_len = QOIR_LITERALS_PRE_PADDING + (4 * QOIR_TS2);
+  // The decode_tile_ops kernel reads (up to) 8 bytes past the ops.
+  uint8_t* ops_ptr = (uint8_t*)calloc(1, ops_len + 8);
+  uint8_t* lz4_ptr = (uint8_t*)malloc(lz4_len);
+  uint8_t* literals_ptr = (uint8_t*)malloc(literals_len);
+  uint8_t* dst_ptr = (uint8_t*)malloc(4 * width * height);
+  const char* ret = NULL;
+  if (!ops_ptr || !lz4_ptr || !literals_ptr || !dst_ptr) {
+    ret = "out of memory";
+    goto cleanup;
+  }
+
+  const size_t stride = 4 * width;
+  qoir_private_encode_tile_ops_func encode_tile_ops =
+      qoir_private_encode_tile_ops_funcs[has_alpha][0];
+  for (size_t y0 = 0; y0 < height; y0 += QOIR_TILE_SIZE) {
+    size_t th = ((height - y0) < QOIR_TILE_SIZE) ? (height - y0)  //
+                                                  : QOIR_TILE_SIZE;
+    for (size_t x0 = 0; x0 < width; x0 += QOIR_TILE_SIZE) {
+      size_t tw = ((width - x0) < QOIR_TILE_SIZE) ? (width - x0)  //
+                                                   : QOIR_TILE_SIZE;
+      const uint8_t* tile_ptr = bgra_ptr + (y0 * stride) + (4 * x0);
+      uint64_t nanos[NUMBER_OF_TILE_KERNELS + 1];
+      qoir_size_result r[NUMBER_OF_TILE_KERNELS] = {0};
+
+      nanos[0] = monotonic_nanos();
+      for (int i = 0; i < n; i++) {
+        r[0] = (*encode_tile_ops)(ops_ptr, tile_ptr, stride, tw, th, 0);
+      }
+      nanos[1] = monotonic_nanos();
+      for (int i = 0; (i < n) && !r[0].status_message; i++) {
+        r[1] = qoir_lz4_block_encode(lz4_ptr, lz4_len, ops_ptr, r[0].value);
+      }
+      nanos[2] = monotonic_nanos();
+      for (int i = 0; (i < n) && !r[1].status_message; i++) {
+        r[2] = qoir_lz4_block_decode(ops_ptr, ops_len, lz4_ptr, r[1].value);
+      }
+      nanos[3] = monotonic_nanos();
+      for (int i = 0; (i < n) && !r[2].status_message; i++) {
+        r[3] = qoir_private_decode_tile_ops(
+            literals_ptr, QOIR_LITERALS_PRE_PADDING + (4 * tw * th),
+            ops_ptr, r[0].value + 8);
+      }
+      nanos[4] = monotonic_nanos();
+
+      for (int k = 0; k < NUMBER_OF_TILE_KERNELS; k++) {
+        if (r[k].status_message) {
+          ret = r[k].status_message;
+          goto cleanup;
+        }
+        t[k].pixels += n * tw * th;
+        t[k].nanos += nanos[k + 1] - nanos[k];
+      }
+      if (r[2].value != r[0].value) {
+        ret = "LZ4 round trip mismatch";
+        goto cleanup;
+      }
+      for (size_t y = 0; y < th; y++) {
+        if (memcmp(literals_ptr + QOIR_LITERALS_PRE_PADDING + (4 * tw * y),
+                   tile_ptr + (stride * y), 4 * tw)) {
+          ret = "tile ops round trip mismatch";
+          goto cleanup;
+        }
+      }
+    }
+  }
+
+  for (size_t k = 0; k < ARRAY_SIZE(my_swizzle_kernels); k++) {
+    const swizzle_kernel* s = &my_swizzle_kernels[k];
+    qoir_private_swizzle_func func =
+        qoir_private_dispatch_swizzle_func(s->func);
+    uint64_t nanos0 = monotonic_nanos();
+    for (int i = 0; i < n; i++) {
+      (*func)(dst_ptr, s->dst_bytes_per_pixel * width, bgra_ptr,
+              s->src_bytes_per_pixel * width, width, height);
+    }
+    t[NUMBER_OF_TILE_KERNELS + k].pixels += n * width * height;
+    t[NUMBER_OF_TILE_KERNELS + k].nanos += monotonic_nanos() - nanos0;
+  }
+
+cleanup:
+  free(dst_ptr);
+  free(literals_ptr);
+  free(lz4_ptr);
+  free(ops_ptr);
+  return ret;
+}
+
+// ----
+
 typedef struct my_context_struct {
   const char* benchname;
-  timings timings[MAX_INCL_NUMBER_OF_FORMATS][WALK_DIRECTORY_MAX_EXCL_DEPTH];
+  timings timings[MAX_INCL_NUMBER_OF_VARIANTS][WALK_DIRECTORY_MAX_EXCL_DEPTH];
+  kernel_timings kernels[NUMBER_OF_KERNELS][WALK_DIRECTORY_MAX_EXCL_DEPTH];
 } my_context;
 
+void                //
+reset_context(      //
+    my_context* z,  //
+    uint32_t depth) {
+  for (size_t i = 0; i < g_number_of_variants; i++) {
+    memset(&z->timings[i][depth], 0, sizeof(z->timings[i][depth]));
+  }
+  for (size_t k = 0; k < NUMBER_OF_KERNELS; k++) {
+    memset(&z->kernels[k][depth], 0, sizeof(z->kernels[k][depth]));
+  }
+}
+
+void                      //
+print_context(            //
+    my_context* z,        //
+    uint32_t depth,       //
+    bool skip_empty,      //
+    const char* dirname,  //
+    const char* filename) {
+  if (g_kernels) {
+    for (size_t k = 0; k < NUMBER_OF_KERNELS; k++) {
+      if (!skip_empty || (z->kernels[k][depth].pixels > 0)) {
+        print_kernel_timings(&z->kernels[k][depth], kernel_name(k),
+                             z->benchname, dirname, filename);
+      }
+    }
+    return;
+  }
+  for (size_t i = 0; i < g_number_of_variants; i++) {
+    if (!skip_empty || (z->timings[i][depth].original_size > 0)) {
+      print_timings(&z->timings[i][depth], g_variants[i].f->name,
+                    g_variants[i].name, g_variants[i].num_jobs,
+                    z->benchname, dirname, filename);
+    }
+  }
+}
+
 const char*                  //
 bench_one_png(               //
     my_context* z,           //
@@ -324,9 +1027,41 @@ bench_one_png(               //
   pixbuf.stride_in_bytes = (size_t)channels * (size_t)width;
 
   const char* ret = NULL;
-  for (size_t i = 0; i < number_of_formats(); i++) {
+  if (g_kernels) {
+    // The tile kernels work on BGRA pixels, like qoir_encode's internals.
+    size_t num_pixels = (size_t)width * (size_t)height;
+    uint8_t* bgra_ptr = (uint8_t*)malloc(4 * num_pixels);
+    if (!bgra_ptr) {
+      stbi_image_free(pixbuf_data);
+      return "out of memory";
+    }
+    for (size_t i = 0; i < num_pixels; i++) {
+      const uint8_t* p = pixbuf_data + ((size_t)channels * i);
+      bgra_ptr[(4 * i) + 0] = p[2];
+      bgra_ptr[(4 * i) + 1] = p[1];
+      bgra_ptr[(4 * i) + 2] = p[0];
+      bgra_ptr[(4 * i) + 3] = (channels == 4) ? p[3] : 0xFF;
+    }
+    kernel_timings t[NUMBER_OF_KERNELS] = {0};
+    ret = bench_kernels(t, bgra_ptr, width, height, channels == 4);
+    if (ret) {
+      printf("%s%s%s: could not benchmark kernels: %s\n", z->benchname,
+             dirname, filename, ret);
+    }
+    for (size_t k = 0; (ret == NULL) && (k < NUMBER_OF_KERNELS); k++) {
+      for (int d = 0; d <= depth; d++) {
+        z->kernels[k][d].pixels += t[k].pixels;
+        z->kernels[k][d].nanos += t[k].nanos;
+      }
+    }
+    free(bgra_ptr);
+    stbi_image_free(pixbuf_data);
+    return ret;
+  }
+
+  for (size_t i = 0; i < g_number_of_variants; i++) {
     timings_result t = encode_decode(z->benchname, dirname, filename,
-                                     &my_formats[i], src_ptr, src_len, &pixbuf);
+                                     &g_variants[i], src_ptr, src_len, &pixbuf);
     if (t.status_message) {
       ret = t.status_message;
       break;
@@ -345,9 +1080,7 @@ my_enter_callback(   //
     uint32_t depth,  //
     const char* dirname) {
   my_context* z = (my_context*)context;
-  for (size_t i = 0; i < number_of_formats(); i++) {
-    memset(&z->timings[i][depth], 0, sizeof(z->timings[i][depth]));
-  }
+  reset_context(z, depth);
   return NULL;
 }
 
@@ -357,12 +1090,7 @@ my_exit_callback(    //
     uint32_t depth,  //
     const char* dirname) {
   my_context* z = (my_context*)context;
-  for (size_t i = 0; i < number_of_formats(); i++) {
-    if (z->timings[i][depth].original_size > 0) {
-      print_timings(&z->timings[i][depth], my_formats[i].name, z->benchname,
-                    dirname, "");
-    }
-  }
+  print_context(z, depth, true, dirname, "");
   return NULL;
 }
 
@@ -384,35 +1112,35 @@ my_file_callback(         //
            strerror(errno));
     return "fopen failed";
   }
-  load_file_result r = load_file(f, UINT64_MAX);
+  load_file_result r = map_file(f, UINT64_MAX);
   fclose(f);
   const char* result = r.status_message;
   if (!result) {
-    for (size_t i = 0; i < number_of_formats(); i++) {
-      memset(&z->timings[i][depth], 0, sizeof(z->timings[i][depth]));
-    }
+    reset_context(z, depth);
     result = bench_one_png(z, depth, dirname, filename, r.dst_ptr, r.dst_len);
     if (g_verbose || (z->benchname[0] == '\x00')) {
-      for (size_t i = 0; i < number_of_formats(); i++) {
-        print_timings(&z->timings[i][depth], my_formats[i].name, z->benchname,
-                      dirname, filename);
-      }
+      print_context(z, depth, false, dirname, filename);
     }
   }
-  free(r.owned_memory);
+  unload_file(&r);
   return result;
 }
 
 int         //
 benchmark(  //
     const char* src_filename) {
-  my_context z = {0};
+  // my_context is too large to comfortably live on the stack.
+  my_context* z = (my_context*)calloc(1, sizeof(my_context));
+  if (!z) {
+    printf("could not allocate the benchmark context\n");
+    return 1;
+  }
   const char* status_message = NULL;
 
   DIR* d = opendir(src_filename);
   if (d) {
-    z.benchname = src_filename;
-    status_message = walk_directory(d, &z, &my_enter_callback,
+    z->benchname = src_filename;
+    status_message = walk_directory(d, z, &my_enter_callback,
                                     &my_exit_callback, &my_file_callback);
     closedir(d);
   } else {
@@ -420,11 +1148,11 @@ benchmark(  //
     if (stat(src_filename, &s)) {
       status_message = strerror(errno);
     } else {
-      z.benchname = "";
-      memset(&z.timings[0], 0, sizeof(z.timings[0]));
-      status_message = my_file_callback(&z, 0, "", src_filename);
+      z->benchname = "";
+      status_message = my_file_callback(z, 0, "", src_filename);
     }
   }
+  free(z);
 
   if (status_message) {
     printf("could not walk \"%s\": %s\n", src_filename, status_message);
@@ -433,8 +1161,44 @@ benchmark(  //
   return 0;
 }
 
+// parse_thread_counts parses a comma-separated list, like "1,2,4,8", into
+// g_thread_counts. It returns whether the list was valid.
+bool                  //
+parse_thread_counts(  //
+    const char* arg) {
+  g_number_of_thread_counts = 0;
+  while (true) {
+    char* end = NULL;
+    unsigned long x = strtoul(arg, &end, 10);
+    if ((end == arg) || (x < 1) || (x > MAX_INCL_NUM_JOBS) ||
+        (g_number_of_thread_counts >= MAX_INCL_NUMBER_OF_THREAD_COUNTS)) {
+      return false;
+    }
+    g_thread_counts[g_number_of_thread_counts++] = (uint32_t)x;
+    if (*end == '\x00') {
+      return true;
+    } else if (*end != ',') {
+      return false;
+    }
+    arg = end + 1;
+  }
+}
+
 // ----
 
+// Usage: benchmarks [flags] paths. Paths can be .png files or directories
+// (which are walked recursively). Flags apply to later paths. They are:
+//  - -n=N        the number of reps (timed calls) per image, default 5.
+//  - -v          print every image's numbers, not just directories'.
+//  - -threads=T  a comma-separated list of thread counts (each in 1 ..= 64)
+//                for the multi-threaded (QOIR) codecs, for scaling curves.
+//  - -kernels    benchmark the codec's individual stages instead.
+//  - -csv        print comma-separated values.
+//  - -json       print JSON Lines (one JSON object per line).
+//
+// Other than -threads' "/tT" name suffixes, the default text output does not
+// change with these flags: only CSV and JSON have the extra columns (thread
+// counts, latency percentiles and peak memory).
 int            //
 main(          //
     int argc,  //
@@ -447,8 +1211,13 @@ main(          //
     return 1;
   }
 
+  // This goes to stderr so that it isn't mixed up in run_benchmarks.sh's
+  // sorted output.
+  fprintf(stderr, "CPU: %s\n", my_cpu_config());
+
   for (int i = 1; i < argc; i++) {
     if (*argv[i] != '-') {
+      make_variants();
       int result = benchmark(argv[i]);
       if (result) {
         return result;
@@ -468,6 +1237,17 @@ main(          //
       }
     } else if (!strncmp(arg, "v", 2)) {
       g_verbose = 1;
+    } else if (!strncmp(arg, "threads=", 8)) {
+      if (!parse_thread_counts(arg + 8)) {
+        printf("invalid thread counts: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (!strcmp(arg, "kernels")) {
+      g_kernels = 1;
+    } else if (!strcmp(arg, "csv")) {
+      g_output_format = OUTPUT_FORMAT__CSV;
+    } else if (!strcmp(arg, "json")) {
+      g_output_format = OUTPUT_FORMAT__JSON;
     } else {
       printf("unsupported argument: %s\n", argv[i]);
       return 1;
@@ -204,6 +204,153 @@ test_swizzle(  //
   return 0;
 }
 
+// test_swizzle_all_pixels checks that the swizzle functions' fast paths (e.g.
+// SIMD code that converts multiple pixels at a time) produce the same output
+// as their simple paths, for every combination of color and alpha byte values
+// and for widths that do and don't divide evenly into groups of pixels. Its
+// reference output comes from converting one pixel at a time. It also checks
+// any faster variant (e.g. AVX2) that the CPU dispatcher picks for each one.
+int                       //
+test_swizzle_all_pixels(  //
+    void) {
+  static const struct {
+    const char* funcname;
+    qoir_private_swizzle_func func;
+    size_t dst_bpp;
+    size_t src_bpp;
+  } funcs[] = {
+      {"copy_4", qoir_private_swizzle__copy_4, 4, 4},
+      {"bgr__bgrn", qoir_private_swizzle__bgr__bgrn, 3, 4},
+      {"bgr__bgrp", qoir_private_swizzle__bgr__bgrp, 3, 4},
+      {"bgr__rgbn", qoir_private_swizzle__bgr__rgbn, 3, 4},
+      {"bgr__rgbp", qoir_private_swizzle__bgr__rgbp, 3, 4},
+      {"bgra__bgr", qoir_private_swizzle__bgra__bgr, 4, 3},
+      {"bgra__bgrx", qoir_private_swizzle__bgra__bgrx, 4, 4},
+      {"bgra__rgb", qoir_private_swizzle__bgra__rgb, 4, 3},
+      {"bgra__rgba", qoir_private_swizzle__bgra__rgba, 4, 4},
+      {"bgra__rgbx", qoir_private_swizzle__bgra__rgbx, 4, 4},
+      {"bgrn__bgrp", qoir_private_swizzle__bgrn__bgrp, 4, 4},
+      {"bgrn__rgbp", qoir_private_swizzle__bgrn__rgbp, 4, 4},
+      {"bgrp__bgrn", qoir_private_swizzle__bgrp__bgrn, 4, 4},
+      {"bgrp__rgbn", qoir_private_swizzle__bgrp__rgbn, 4, 4},
+  };
+  static const size_t widths[] = {256, 255, 254, 253, 250, 9, 6, 5};
+
+  // The src image is 256 × 256 pixels with 3 bytes of row padding. Its
+  // colors vary along the x axis and its alphas vary along the y axis.
+  const size_t src_stride = (4 * 256) + 3;
+  const size_t dst_stride = (4 * 256) + 5;
+  uint8_t* src = malloc(src_stride * 256);
+  uint8_t* have = malloc(dst_stride * 256);
+  uint8_t* want = malloc(dst_stride * 256);
+  if (!src || !have || !want) {
+    free(src);
+    free(have);
+    free(want);
+    printf("%s: out of memory\n", __func__);
+    return 1;
+  }
+  for (size_t y = 0; y < 256; y++) {
+    uint8_t* row = src + (y * src_stride);
+    for (size_t x = 0; x < 256; x++) {
+      row[(4 * x) + 0] = (uint8_t)x;
+      row[(4 * x) + 1] = (uint8_t)(x * 7);
+      row[(4 * x) + 2] = (uint8_t)(0xFF - x);
+      row[(4 * x) + 3] = (uint8_t)y;
+    }
+    memset(row + (4 * 256), 0x99, src_stride - (4 * 256));
+  }
+
+  int ret = 0;
+  for (size_t f = 0; (f < 2 * sizeof(funcs) / sizeof(funcs[0])) && !ret; f++) {
+    bool dispatch = f & 1;
+    qoir_private_swizzle_func func = funcs[f / 2].func;
+    if (dispatch) {
+      func = qoir_private_dispatch_swizzle_func(func);
+    }
+    for (size_t w = 0; (w < sizeof(widths) / sizeof(widths[0])) && !ret; w++) {
+      size_t width = widths[w];
+      memset(have, 0x77, dst_stride * 256);
+      memset(want, 0x77, dst_stride * 256);
+      (*func)(have, dst_stride, src, src_stride, width, 256);
+      for (size_t y = 0; y < 256; y++) {
+        for (size_t x = 0; x < width; x++) {
+          (*funcs[f / 2].func)(
+              want + (y * dst_stride) + (x * funcs[f / 2].dst_bpp), dst_stride,
+              src + (y * src_stride) + (x * funcs[f / 2].src_bpp), src_stride,
+              1, 1);
+        }
+      }
+      for (size_t i = 0; i < dst_stride * 256; i++) {
+        if (have[i] != want[i]) {
+          printf("%s: %s%s: width %zu: byte %zu: have 0x%02X, want 0x%02X\n",
+                 __func__, funcs[f / 2].funcname, dispatch ? " (dispatch)" : "",
+                 width, i, have[i], want[i]);
+          ret = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  free(src);
+  free(have);
+  free(want);
+  if (!ret) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int            //
+test_lossify(  //
+    void) {
+  // The buffers are a little longer than 256 bytes so that the SIMD code
+  // paths' leftovers are also exercised.
+  uint8_t src[256 + 37];
+  uint8_t have[256 + 37];
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = (uint8_t)(i * 7);
+  }
+  for (uint32_t lossiness = 1; lossiness < 8; lossiness++) {
+    for (size_t len = sizeof(src) - 3; len <= sizeof(src); len++) {
+      for (int swap_rb = 0; swap_rb < 2; swap_rb++) {
+        if (swap_rb && (len % 4)) {
+          continue;
+        }
+        memset(have, 0x77, sizeof(have));
+        qoir_private_decode_unlossify(have, src, len, lossiness, swap_rb);
+        for (size_t i = 0; i < sizeof(have); i++) {
+          size_t j = (swap_rb && ((i & 1) == 0)) ? (i ^ 2) : i;
+          uint8_t want =
+              (i < len) ? qoir_private_table_unlossify[lossiness - 1][src[j]]
+                        : 0x77;
+          if (have[i] != want) {
+            printf("%s: unlossify: lossiness %u: len %zu: swap_rb %d: byte "
+                   "%zu: have 0x%02X, want 0x%02X\n",
+                   __func__, lossiness, len, swap_rb, i, have[i], want);
+            return 1;
+          }
+        }
+      }
+
+      memcpy(have, src, sizeof(have));
+      qoir_private_encode_lossify(have, len, lossiness);
+      for (size_t i = 0; i < sizeof(have); i++) {
+        uint8_t want = (i < len) ? (src[i] >> lossiness) : src[i];
+        if (have[i] != want) {
+          printf("%s: lossify: lossiness %u: len %zu: byte %zu: have 0x%02X, "
+                 "want 0x%02X\n",
+                 __func__, lossiness, len, i, have[i], want);
+          return 1;
+        }
+      }
+    }
+  }
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
 // ----
 
 int                        //
@@ -239,10 +386,2617 @@ test_round_trip(  //
 
 // ----
 
+// load_png_pixbuf returns the decoded pixels, which the caller should
+// stbi_image_free, or NULL on failure.
+uint8_t*                     //
+load_png_pixbuf(             //
+    qoir_pixel_buffer* dst,  //
+    const char* testname,    //
+    const char* filename,    //
+    int channels) {
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
+    printf("%s: %s: %s\n", testname, filename, strerror(errno));
+    return NULL;
+  }
+  load_file_result r = load_file(f, UINT64_MAX);
+  fclose(f);
+  if (r.status_message) {
+    printf("%s: %s: %s\n", testname, filename, r.status_message);
+    free(r.owned_memory);
+    return NULL;
+  }
+  int width = 0;
+  int height = 0;
+  unsigned char* data = stbi_load_from_memory(r.dst_ptr, r.dst_len, &width,
+                                              &height, NULL, channels);
+  free(r.owned_memory);
+  if (!data) {
+    printf("%s: %s: STBI could not decode image\n", testname, filename);
+    return NULL;
+  }
+  dst->pixcfg.pixfmt = (channels == 3) ? QOIR_PIXEL_FORMAT__RGB
+                                       : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  dst->pixcfg.width_in_pixels = width;
+  dst->pixcfg.height_in_pixels = height;
+  dst->data = (uint8_t*)data;
+  dst->stride_in_bytes = (size_t)channels * (size_t)width;
+  return (uint8_t*)data;
+}
+
+// ----
+
+int               //
+test_tile_index(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  int ret = 1;
+  qoir_encode_result enc0 = {0};
+  qoir_encode_result enc1 = {0};
+  uint8_t* dst_data0 = NULL;
+  uint8_t* dst_data1 = NULL;
+
+  do {
+    qoir_encode_options encopts = {0};
+    enc0 = qoir_encode(&src_pixbuf, &encopts);
+    encopts.write_tile_index = true;
+    enc1 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc0.status_message || enc1.status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      break;
+    }
+    uint64_t number_of_tiles = qoir_calculate_number_of_tiles_2d(
+        src_pixbuf.pixcfg.width_in_pixels, src_pixbuf.pixcfg.height_in_pixels);
+    if (enc1.dst_len != (enc0.dst_len + 12 + (8 * number_of_tiles))) {
+      printf("%s: dst_len: have %zu, want %zu\n", __func__, enc1.dst_len,
+             (size_t)(enc0.dst_len + 12 + (8 * number_of_tiles)));
+      break;
+    }
+    const char* check = check_round_trip_3(&src_pixbuf, enc1.dst_ptr,
+                                           enc1.dst_len);
+    if (check) {
+      printf("%s: check_round_trip_3: %s\n", __func__, check);
+      break;
+    }
+
+    // Decode clipped regions, both with and without the tile index, into
+    // pre-allocated pixel buffers. The results should be identical.
+    size_t dst_len = src_pixbuf.stride_in_bytes *
+                     (size_t)src_pixbuf.pixcfg.height_in_pixels;
+    dst_data0 = malloc(dst_len);
+    dst_data1 = malloc(dst_len);
+    if (!dst_data0 || !dst_data1) {
+      printf("%s: out of memory\n", __func__);
+      break;
+    }
+    static const int32_t clips[4][4] = {
+        {200, 300, 312, 442},
+        {70, 5, 71, 6},
+        {-10, -10, 65, 65},
+        {0, 400, 999, 999},
+    };
+    bool ok = true;
+    for (int i = 0; ok && (i < 4); i++) {
+      qoir_decode_options decopts = {0};
+      decopts.pixbuf = src_pixbuf;
+      decopts.src_clip_rectangle = qoir_make_rectangle(
+          clips[i][0], clips[i][1], clips[i][2], clips[i][3]);
+      decopts.use_src_clip_rectangle = true;
+      memset(dst_data0, 0, dst_len);
+      memset(dst_data1, 0, dst_len);
+      decopts.pixbuf.data = dst_data0;
+      qoir_decode_result dec0 =
+          qoir_decode(enc0.dst_ptr, enc0.dst_len, &decopts);
+      decopts.pixbuf.data = dst_data1;
+      qoir_decode_result dec1 =
+          qoir_decode(enc1.dst_ptr, enc1.dst_len, &decopts);
+      if (dec0.status_message || dec1.status_message) {
+        printf("%s: clip #%d: qoir_decode failed\n", __func__, i);
+        ok = false;
+      } else if (memcmp(dst_data0, dst_data1, dst_len)) {
+        printf("%s: clip #%d: different pixels\n", __func__, i);
+        ok = false;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+
+    // Corrupt the last tile's offset. Decoding that tile should fail.
+    size_t last_offset_pos = enc1.dst_len - 12 - 8;
+    enc1.dst_ptr[last_offset_pos] ^= 0x01;
+    qoir_decode_result dec = qoir_decode(enc1.dst_ptr, enc1.dst_len, NULL);
+    free(dec.owned_memory);
+    if (dec.status_message != qoir_status_message__error_invalid_data) {
+      printf("%s: corrupt tile index: have \"%s\", want \"%s\"\n", __func__,
+             dec.status_message, qoir_status_message__error_invalid_data);
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(dst_data0);
+  free(dst_data1);
+  free(enc0.owned_memory);
+  free(enc1.owned_memory);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+int                    //
+test_decode_metadata(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  static const uint8_t iccp[5] = {'I', 'C', 'C', 'P', '!'};
+  static const uint8_t exif[6] = {'E', 'x', 'i', 'f', '!', 0};
+  static const uint8_t xmp[3] = {'X', 'M', 'P'};
+  int ret = 1;
+  qoir_encode_result enc0 = {0};
+  qoir_encode_result enc1 = {0};
+  qoir_decode_result dec = {0};
+
+  do {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = 2;
+    enc0 = qoir_encode(&src_pixbuf, &encopts);
+    encopts.metadata_iccp_ptr = iccp;
+    encopts.metadata_iccp_len = sizeof(iccp);
+    encopts.metadata_exif_ptr = exif;
+    encopts.metadata_exif_len = sizeof(exif);
+    encopts.metadata_xmp_ptr = xmp;
+    encopts.metadata_xmp_len = sizeof(xmp);
+    encopts.write_tile_index = true;
+    encopts.num_mipmap_levels = 2;
+    enc1 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc0.status_message || enc1.status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      break;
+    }
+
+    qoir_decode_metadata_result meta0 =
+        qoir_decode_metadata(enc0.dst_ptr, enc0.dst_len);
+    if (meta0.status_message || meta0.tile_index_ptr ||
+        meta0.number_of_tiles || meta0.mipmap_len ||
+        meta0.metadata_iccp_ptr || meta0.metadata_exif_ptr ||
+        meta0.metadata_xmp_ptr || meta0.metadata_cicp_ptr) {
+      printf("%s: meta0 has unexpected metadata\n", __func__);
+      break;
+    }
+
+    qoir_decode_metadata_result meta1 =
+        qoir_decode_metadata(enc1.dst_ptr, enc1.dst_len);
+    dec = qoir_decode(enc1.dst_ptr, enc1.dst_len, NULL);
+    if (meta1.status_message || dec.status_message) {
+      printf("%s: decode failed\n", __func__);
+      break;
+    } else if ((meta1.src_pixcfg.pixfmt != QOIR_PIXEL_FORMAT__BGRA_NONPREMUL) ||
+               (meta1.src_pixcfg.width_in_pixels !=
+                src_pixbuf.pixcfg.width_in_pixels) ||
+               (meta1.src_pixcfg.height_in_pixels !=
+                src_pixbuf.pixcfg.height_in_pixels) ||
+               (meta1.lossiness != 2)) {
+      printf("%s: wrong pixel configuration or lossiness\n", __func__);
+      break;
+    } else if (!meta1.tile_index_ptr ||
+               (meta1.number_of_tiles !=
+                qoir_calculate_number_of_tiles_2d(
+                    src_pixbuf.pixcfg.width_in_pixels,
+                    src_pixbuf.pixcfg.height_in_pixels)) ||
+               (meta1.mipmap_len == 0)) {
+      printf("%s: wrong tile index or mipmaps\n", __func__);
+      break;
+    } else if ((meta1.metadata_iccp_ptr != dec.metadata_iccp_ptr) ||
+               (meta1.metadata_iccp_len != sizeof(iccp)) ||
+               memcmp(meta1.metadata_iccp_ptr, iccp, sizeof(iccp)) ||
+               (meta1.metadata_exif_ptr != dec.metadata_exif_ptr) ||
+               (meta1.metadata_exif_len != sizeof(exif)) ||
+               (meta1.metadata_xmp_ptr != dec.metadata_xmp_ptr) ||
+               (meta1.metadata_xmp_len != sizeof(xmp)) ||
+               meta1.metadata_cicp_ptr) {
+      printf("%s: wrong metadata chunks\n", __func__);
+      break;
+    }
+
+    // Corrupting a tile's pixel data (the first tile's first byte, after
+    // its 4 byte prefix) isn't noticed, as the tiles are skipped. Truncating
+    // or otherwise corrupting the chunk structure is.
+    enc1.dst_ptr[32 + 4] ^= 0xFF;
+    if (qoir_decode_metadata(enc1.dst_ptr, enc1.dst_len).status_message) {
+      printf("%s: corrupt tile: metadata was rejected\n", __func__);
+      break;
+    } else if (qoir_decode_metadata(enc1.dst_ptr, enc1.dst_len - 1)
+                   .status_message !=
+               qoir_status_message__error_invalid_data) {
+      printf("%s: truncated image was not rejected\n", __func__);
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(dec.owned_memory);
+  free(enc0.owned_memory);
+  free(enc1.owned_memory);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// do_test_decode_direct decodes enc (whose source image, like src_pixbuf, has
+// 4 bytes per pixel) to a BGRA_NONPREMUL pixbuf with the given stride, which
+// can use the direct-to-destination code paths, and checks that the result
+// matches decoding to RGBA_NONPREMUL, which can't.
+int                                       //
+do_test_decode_direct(                    //
+    const char* testname,                 //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_result* enc,        //
+    size_t stride_in_bytes) {
+  uint32_t width = src_pixbuf->pixcfg.width_in_pixels;
+  uint32_t height = src_pixbuf->pixcfg.height_in_pixels;
+  uint8_t* have_data = malloc(stride_in_bytes * height);
+  if (!have_data) {
+    printf("%s: out of memory\n", testname);
+    return 1;
+  }
+  int ret = 1;
+  qoir_decode_result want = {0};
+  do {
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    want = qoir_decode(enc->dst_ptr, enc->dst_len, &decopts);
+    if (want.status_message) {
+      printf("%s: qoir_decode (want): %s\n", testname, want.status_message);
+      break;
+    }
+    memset(have_data, 0x77, stride_in_bytes * height);
+    memset(&decopts, 0, sizeof(decopts));
+    decopts.pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+    decopts.pixbuf.pixcfg.width_in_pixels = width;
+    decopts.pixbuf.pixcfg.height_in_pixels = height;
+    decopts.pixbuf.data = have_data;
+    decopts.pixbuf.stride_in_bytes = stride_in_bytes;
+    qoir_decode_result have = qoir_decode(enc->dst_ptr, enc->dst_len, &decopts);
+    if (have.status_message) {
+      printf("%s: qoir_decode (have): %s\n", testname, have.status_message);
+      break;
+    }
+    bool ok = true;
+    for (uint32_t y = 0; ok && (y < height); y++) {
+      const uint8_t* h = have_data + (y * stride_in_bytes);
+      const uint8_t* w =
+          want.dst_pixbuf.data + (y * want.dst_pixbuf.stride_in_bytes);
+      for (uint32_t x = 0; x < width; x++) {
+        if ((h[(4 * x) + 0] != w[(4 * x) + 2]) ||
+            (h[(4 * x) + 1] != w[(4 * x) + 1]) ||
+            (h[(4 * x) + 2] != w[(4 * x) + 0]) ||
+            (h[(4 * x) + 3] != w[(4 * x) + 3])) {
+          printf("%s: stride %zu: different pixels at (%u, %u)\n", testname,
+                 stride_in_bytes, x, y);
+          ok = false;
+          break;
+        }
+      }
+      for (size_t i = 4 * (size_t)width; ok && (i < stride_in_bytes); i++) {
+        if (h[i] != 0x77) {
+          printf("%s: stride %zu: row %u's padding was overwritten\n",
+                 testname, stride_in_bytes, y);
+          ok = false;
+        }
+      }
+    }
+    if (ok) {
+      ret = 0;
+    }
+  } while (false);
+  free(want.owned_memory);
+  free(have_data);
+  return ret;
+}
+
+// test_decode_direct checks the direct-to-destination decode paths, which
+// are only taken when decoding a lossless image to its own pixel format, and
+// the single pass unlossify-and-swizzle paths for lossy images.
+int                  //
+test_decode_direct(  //
+    void) {
+  static const char* filenames[2] = {
+      "test/data/bricks-color.png",
+      "test/data/hibiscus.primitive.png",
+  };
+  for (int i = 0; i < 2; i++) {
+    qoir_pixel_buffer src_pixbuf;
+    uint8_t* src_data =
+        load_png_pixbuf(&src_pixbuf, __func__, filenames[i], 4);
+    if (!src_data) {
+      return 1;
+    }
+    // Check the whole image (whose rows span multiple tiles), with and without
+    // row padding, and a 64 pixel wide crop (whose rows fit in one tile).
+    qoir_pixel_buffer crop_pixbuf = src_pixbuf;
+    crop_pixbuf.pixcfg.width_in_pixels = 64;
+    qoir_encode_options lossy_encopts = {0};
+    lossy_encopts.lossiness = 2;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, NULL);
+    qoir_encode_result crop_enc = qoir_encode(&crop_pixbuf, NULL);
+    qoir_encode_result lossy_enc = qoir_encode(&src_pixbuf, &lossy_encopts);
+    int ret = 0;
+    if (enc.status_message || crop_enc.status_message ||
+        lossy_enc.status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      ret = 1;
+    } else {
+      size_t stride = 4 * (size_t)src_pixbuf.pixcfg.width_in_pixels;
+      ret = do_test_decode_direct(__func__, &src_pixbuf, &enc, stride) ||
+            do_test_decode_direct(__func__, &src_pixbuf, &enc, stride + 12) ||
+            do_test_decode_direct(__func__, &crop_pixbuf, &crop_enc, 4 * 64) ||
+            do_test_decode_direct(__func__, &src_pixbuf, &lossy_enc,
+                                  stride + 12);
+    }
+    free(enc.owned_memory);
+    free(crop_enc.owned_memory);
+    free(lossy_enc.owned_memory);
+    stbi_image_free(src_data);
+    if (ret) {
+      return ret;
+    }
+  }
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
+// test_encode_src_pixfmts checks that encoding a BGRA source (whose pixels the
+// encoder reads directly) and the equivalent RGBA source (whose pixels it
+// swizzles first) give identical output, with and without lossiness and
+// dithering.
+int                       //
+test_encode_src_pixfmts(  //
+    void) {
+  qoir_pixel_buffer rgba_pixbuf;
+  uint8_t* rgba_data = load_png_pixbuf(&rgba_pixbuf, __func__,
+                                       "test/data/hibiscus.primitive.png", 4);
+  if (!rgba_data) {
+    return 1;
+  }
+  size_t num_bytes = rgba_pixbuf.stride_in_bytes *
+                     (size_t)rgba_pixbuf.pixcfg.height_in_pixels;
+  uint8_t* bgra_data = malloc(num_bytes);
+  if (!bgra_data) {
+    printf("%s: out of memory\n", __func__);
+    stbi_image_free(rgba_data);
+    return 1;
+  }
+  for (size_t i = 0; i < num_bytes; i += 4) {
+    bgra_data[i + 0] = rgba_data[i + 2];
+    bgra_data[i + 1] = rgba_data[i + 1];
+    bgra_data[i + 2] = rgba_data[i + 0];
+    bgra_data[i + 3] = rgba_data[i + 3];
+  }
+  qoir_pixel_buffer bgra_pixbuf = rgba_pixbuf;
+  bgra_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  bgra_pixbuf.data = bgra_data;
+
+  int ret = 0;
+  for (int i = 0; (ret == 0) && (i < 4); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = (i & 1) ? 3 : 0;
+    encopts.dither = i & 2;
+    encopts.num_mipmap_levels = (i == 3) ? 2 : 0;
+    qoir_encode_result have = qoir_encode(&bgra_pixbuf, &encopts);
+    qoir_encode_result want = qoir_encode(&rgba_pixbuf, &encopts);
+    if (have.status_message || want.status_message) {
+      printf("%s: lossiness %u, dither %d: qoir_encode failed\n", __func__,
+             encopts.lossiness, encopts.dither);
+      ret = 1;
+    } else if ((have.dst_len != want.dst_len) ||
+               memcmp(have.dst_ptr, want.dst_ptr, have.dst_len)) {
+      printf("%s: lossiness %u, dither %d: different encodings\n", __func__,
+             encopts.lossiness, encopts.dither);
+      ret = 1;
+    }
+    free(have.owned_memory);
+    free(want.owned_memory);
+  }
+
+  free(bgra_data);
+  stbi_image_free(rgba_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+// linear_light_sum returns the sum, over every pixel, of the color channels'
+// linear light values (which ignores the alpha channel).
+uint64_t           //
+linear_light_sum(  //
+    const qoir_pixel_buffer* pixbuf) {
+  uint64_t sum = 0;
+  for (uint32_t y = 0; y < pixbuf->pixcfg.height_in_pixels; y++) {
+    const uint8_t* row = pixbuf->data + (y * pixbuf->stride_in_bytes);
+    for (uint32_t x = 0; x < pixbuf->pixcfg.width_in_pixels; x++) {
+      sum += qoir_private_table_linearize[row[(4 * x) + 0]];
+      sum += qoir_private_table_linearize[row[(4 * x) + 1]];
+      sum += qoir_private_table_linearize[row[(4 * x) + 2]];
+    }
+  }
+  return sum;
+}
+
+// test_gamma_aware_dither checks that, at a high lossiness, gamma-aware
+// dithering keeps the image's overall (linear light) brightness closer to the
+// original than naive dithering does.
+int                       //
+test_gamma_aware_dither(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/at-mouquins.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  uint64_t want = linear_light_sum(&src_pixbuf);
+
+  int ret = 0;
+  uint64_t have[2] = {0};
+  for (int i = 0; (ret == 0) && (i < 2); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = 6;
+    encopts.dither = true;
+    encopts.gamma_aware_dither = i;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: i=%d: qoir_encode: %s\n", __func__, i, enc.status_message);
+      ret = 1;
+      break;
+    }
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    if (dec.status_message) {
+      printf("%s: i=%d: qoir_decode: %s\n", __func__, i, dec.status_message);
+      ret = 1;
+    } else {
+      have[i] = linear_light_sum(&dec.dst_pixbuf);
+    }
+    free(dec.owned_memory);
+    free(enc.owned_memory);
+  }
+
+  if (ret == 0) {
+    uint64_t naive_error =
+        (have[0] > want) ? (have[0] - want) : (want - have[0]);
+    uint64_t gamma_error =
+        (have[1] > want) ? (have[1] - want) : (want - have[1]);
+    if (gamma_error >= naive_error) {
+      printf("%s: gamma-aware error %llu >= naive error %llu\n", __func__,
+             (unsigned long long)gamma_error,
+             (unsigned long long)naive_error);
+      ret = 1;
+    }
+  }
+
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+// test_decode_downscale checks decoding at 1/2, 1/4 and 1/8 scale against
+// box filtering (with alpha-weighted colors) a full size decode, for lossless
+// and lossy images, with and without a tile index and a source clip.
+int                     //
+test_decode_downscale(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  uint32_t width = src_pixbuf.pixcfg.width_in_pixels;
+  uint32_t height = src_pixbuf.pixcfg.height_in_pixels;
+  // Vary the alpha (including fully transparent pixels), so that the test
+  // exercises the alpha-weighted averaging.
+  for (size_t j = 0; j < ((size_t)width * height); j++) {
+    src_data[(4 * j) + 3] = (uint8_t)(((j % width) + (j / width)) * 5);
+  }
+  int ret = 0;
+  for (int i = 0; (ret == 0) && (i < 4); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = (i & 1) ? 2 : 0;
+    encopts.write_tile_index = i & 2;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    qoir_decode_result full = {0};
+    if (enc.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+    } else {
+      full = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+      if (full.status_message) {
+        printf("%s: #%d: qoir_decode (full): %s\n", __func__, i,
+               full.status_message);
+        ret = 1;
+      }
+    }
+
+    // A downscale_shift of 4 should be equivalent to 3.
+    for (uint32_t shift = 1; (ret == 0) && (shift <= 4); shift++) {
+      uint32_t s = (shift < 3) ? shift : 3;
+      uint32_t block = 1u << s;
+      uint32_t dw = (width + block - 1) >> s;
+      uint32_t dh = (height + block - 1) >> s;
+      decopts.downscale_shift = shift;
+      decopts.use_src_clip_rectangle = (shift == 2);
+      decopts.src_clip_rectangle = qoir_make_rectangle(5, 7, 60, 50);
+      qoir_decode_result have = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+      if (have.status_message) {
+        printf("%s: #%d: shift %u: qoir_decode: %s\n", __func__, i, shift,
+               have.status_message);
+        ret = 1;
+        break;
+      } else if ((have.dst_pixbuf.pixcfg.width_in_pixels != dw) ||
+                 (have.dst_pixbuf.pixcfg.height_in_pixels != dh)) {
+        printf("%s: #%d: shift %u: wrong dimensions\n", __func__, i, shift);
+        free(have.owned_memory);
+        ret = 1;
+        break;
+      }
+      for (uint32_t y = 0; (ret == 0) && (y < dh); y++) {
+        for (uint32_t x = 0; x < dw; x++) {
+          uint8_t want[4] = {0};
+          const qoir_rectangle* r = &decopts.src_clip_rectangle;
+          if (!decopts.use_src_clip_rectangle ||
+              ((r->x0 <= (int32_t)x) && ((int32_t)x < r->x1) &&
+               (r->y0 <= (int32_t)y) && ((int32_t)y < r->y1))) {
+            uint32_t sums[4] = {0};
+            uint32_t n = 0;
+            for (uint32_t fy = y << s; (fy < (y + 1) << s) && (fy < height);
+                 fy++) {
+              for (uint32_t fx = x << s; (fx < (x + 1) << s) && (fx < width);
+                   fx++) {
+                const uint8_t* p = full.dst_pixbuf.data +
+                                   (fy * full.dst_pixbuf.stride_in_bytes) +
+                                   (4 * fx);
+                sums[0] += p[0] * p[3];
+                sums[1] += p[1] * p[3];
+                sums[2] += p[2] * p[3];
+                sums[3] += p[3];
+                n++;
+              }
+            }
+            for (int c = 0; (c < 3) && sums[3]; c++) {
+              want[c] = (uint8_t)((sums[c] + (sums[3] / 2)) / sums[3]);
+            }
+            want[3] = (uint8_t)((sums[3] + (n / 2)) / n);
+          }
+          const uint8_t* h = have.dst_pixbuf.data +
+                             (y * have.dst_pixbuf.stride_in_bytes) + (4 * x);
+          if (memcmp(h, want, 4)) {
+            printf("%s: #%d: shift %u: different pixels at (%u, %u)\n",
+                   __func__, i, shift, x, y);
+            ret = 1;
+            break;
+          }
+        }
+      }
+      free(have.owned_memory);
+    }
+    free(full.owned_memory);
+    free(enc.owned_memory);
+  }
+
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+// test_mipmaps checks that the MIPS chunk's levels are 2x2 box filtered
+// (with alpha-weighted colors) versions of the previous level, that decoding
+// selects the smallest level that is large enough and that decoders that
+// don't ask for a mipmap level are unaffected.
+int            //
+test_mipmaps(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  uint32_t width = src_pixbuf.pixcfg.width_in_pixels;
+  uint32_t height = src_pixbuf.pixcfg.height_in_pixels;
+  for (size_t j = 0; j < ((size_t)width * height); j++) {
+    src_data[(4 * j) + 3] = (uint8_t)(((j % width) + (j / width)) * 5);
+  }
+  // want holds the reference levels, one at a time, in RGBA_NONPREMUL.
+  uint8_t* want = malloc(4 * (size_t)width * height);
+  if (!want) {
+    printf("%s: out of memory\n", __func__);
+    stbi_image_free(src_data);
+    return 1;
+  }
+  memcpy(want, src_data, 4 * (size_t)width * height);
+
+  qoir_encode_options encopts = {0};
+  qoir_encode_result enc0 = qoir_encode(&src_pixbuf, &encopts);
+  encopts.num_mipmap_levels = 3;
+  qoir_encode_result enc1 = qoir_encode(&src_pixbuf, &encopts);
+  int ret = 0;
+  if (enc0.status_message || enc1.status_message) {
+    printf("%s: qoir_encode failed\n", __func__);
+    ret = 1;
+  }
+
+  // Without the mipmap_min_etc options, the decoded pixels are the same.
+  qoir_decode_options decopts = {0};
+  decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  if (ret == 0) {
+    qoir_decode_result dec0 =
+        qoir_decode(enc0.dst_ptr, enc0.dst_len, &decopts);
+    qoir_decode_result dec1 =
+        qoir_decode(enc1.dst_ptr, enc1.dst_len, &decopts);
+    if (dec0.status_message || dec1.status_message) {
+      printf("%s: qoir_decode failed\n", __func__);
+      ret = 1;
+    } else if (memcmp(dec0.dst_pixbuf.data, dec1.dst_pixbuf.data,
+                      4 * (size_t)width * height)) {
+      printf("%s: level 0: different pixels\n", __func__);
+      ret = 1;
+    }
+    free(dec0.owned_memory);
+    free(dec1.owned_memory);
+  }
+
+  // Asking for (at least) level k's dimensions should give level k. Asking
+  // for 1x1 should give the smallest level, level 3.
+  uint32_t w = width;
+  uint32_t h = height;
+  for (uint32_t k = 1; (ret == 0) && (k <= 4); k++) {
+    if (k <= 3) {
+      uint32_t w1 = (w + 1) >> 1;
+      uint32_t h1 = (h + 1) >> 1;
+      for (uint32_t y = 0; y < h1; y++) {
+        for (uint32_t x = 0; x < w1; x++) {
+          uint32_t sums[4] = {0};
+          uint32_t n = 0;
+          for (uint32_t sy = 2 * y; (sy < (2 * y) + 2) && (sy < h); sy++) {
+            for (uint32_t sx = 2 * x; (sx < (2 * x) + 2) && (sx < w); sx++) {
+              const uint8_t* p = want + (4 * ((sy * w) + sx));
+              sums[0] += p[0] * p[3];
+              sums[1] += p[1] * p[3];
+              sums[2] += p[2] * p[3];
+              sums[3] += p[3];
+              n++;
+            }
+          }
+          // Writing in place is OK, since (x, y) comes before (2x, 2y).
+          uint8_t* q = want + (4 * ((y * w1) + x));
+          for (int c = 0; c < 3; c++) {
+            q[c] = sums[3] ? (uint8_t)((sums[c] + (sums[3] / 2)) / sums[3])
+                           : 0;
+          }
+          q[3] = (uint8_t)((sums[3] + (n / 2)) / n);
+        }
+      }
+      w = w1;
+      h = h1;
+    }
+    decopts.mipmap_min_width_in_pixels = (k <= 3) ? w : 1;
+    decopts.mipmap_min_height_in_pixels = (k <= 3) ? h : 1;
+    qoir_decode_result dec = qoir_decode(enc1.dst_ptr, enc1.dst_len, &decopts);
+    if (dec.status_message) {
+      printf("%s: level %u: qoir_decode failed: %s\n", __func__, k,
+             dec.status_message);
+      ret = 1;
+    } else if ((dec.dst_pixbuf.pixcfg.width_in_pixels != w) ||
+               (dec.dst_pixbuf.pixcfg.height_in_pixels != h)) {
+      printf("%s: level %u: wrong dimensions\n", __func__, k);
+      ret = 1;
+    } else if (memcmp(dec.dst_pixbuf.data, want, 4 * (size_t)w * h)) {
+      printf("%s: level %u: different pixels\n", __func__, k);
+      ret = 1;
+    }
+    free(dec.owned_memory);
+  }
+
+  free(enc0.owned_memory);
+  free(enc1.owned_memory);
+  free(want);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+// test_constant_tiles checks that uniform tiles use the 8 byte Constant tile
+// format and that they decode (to various pixel formats, with and without
+// lossiness, clipping and downscaling) to the same pixels as when a tile is
+// not quite uniform and so uses another tile format.
+int                   //
+test_constant_tiles(  //
+    void) {
+  // The image is 100 x 70 pixels: 2 x 2 tiles. Every pixel is the same
+  // (non-opaque) color, except that, in the copy, the top-left tile's
+  // bottom-right pixel differs.
+  const uint32_t width = 100;
+  const uint32_t height = 70;
+  uint8_t* data = malloc(2 * 4 * width * height);
+  if (!data) {
+    printf("%s: out of memory\n", __func__);
+    return 1;
+  }
+  static const uint8_t color[4] = {0x12, 0x9A, 0xE5, 0xC0};
+  for (uint32_t i = 0; i < (2 * width * height); i++) {
+    memcpy(data + (4 * i), color, 4);
+  }
+  data[(4 * width * height) + (4 * ((63 * width) + 63))] ^= 0x80;
+  qoir_pixel_buffer pixbufs[2];
+  for (int i = 0; i < 2; i++) {
+    pixbufs[i].pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    pixbufs[i].pixcfg.width_in_pixels = width;
+    pixbufs[i].pixcfg.height_in_pixels = height;
+    pixbufs[i].data = data + (i * 4 * width * height);
+    pixbufs[i].stride_in_bytes = 4 * width;
+  }
+
+  static const qoir_pixel_format dst_pixfmts[3] = {
+      QOIR_PIXEL_FORMAT__BGRA_NONPREMUL,
+      QOIR_PIXEL_FORMAT__RGBA_PREMUL,
+      QOIR_PIXEL_FORMAT__RGB,
+  };
+  int ret = 0;
+  for (int i = 0; (ret == 0) && (i < 6); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = (i & 1) ? 3 : 0;
+    encopts.use_constant_tile_format = true;
+    qoir_encode_result encs[2];
+    encs[0] = qoir_encode(&pixbufs[0], &encopts);
+    encs[1] = qoir_encode(&pixbufs[1], &encopts);
+    if (encs[0].status_message || encs[1].status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+    } else if ((encs[0].dst_len != 76) ||
+               (qoir_private_peek_u32le(encs[0].dst_ptr + 32) != 0x04000004)) {
+      // 76 is 20 (QOIR chunk) + 12 (QPIX chunk header) + (4 * 8) (tiles) +
+      // 12 (QEND chunk).
+      printf("%s: #%d: not using the Constant tile format\n", __func__, i);
+      ret = 1;
+    }
+
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = dst_pixfmts[i >> 1];
+    decopts.use_src_clip_rectangle = i >= 4;
+    decopts.src_clip_rectangle = qoir_make_rectangle(5, 10, 90, 68);
+    decopts.downscale_shift = (i == 5) ? 1 : 0;
+    qoir_decode_result decs[2] = {0};
+    for (int j = 0; (ret == 0) && (j < 2); j++) {
+      decs[j] = qoir_decode(encs[j].dst_ptr, encs[j].dst_len, &decopts);
+      if (decs[j].status_message) {
+        printf("%s: #%d: qoir_decode failed: %s\n", __func__, i,
+               decs[j].status_message);
+        ret = 1;
+      }
+    }
+    if (ret == 0) {
+      // Compare the pixels of the top-left tile, other than its last row.
+      size_t n = 64 >> decopts.downscale_shift;
+      size_t stride = decs[0].dst_pixbuf.stride_in_bytes;
+      size_t bpp = qoir_pixel_format__bytes_per_pixel(decopts.pixfmt);
+      for (size_t y = 0; (y + 1) < n; y++) {
+        if (memcmp(decs[0].dst_pixbuf.data + (y * stride),
+                   decs[1].dst_pixbuf.data + (y * stride), n * bpp)) {
+          printf("%s: #%d: different pixels in row %zu\n", __func__, i, y);
+          ret = 1;
+          break;
+        }
+      }
+    }
+    for (int j = 0; j < 2; j++) {
+      free(decs[j].owned_memory);
+      free(encs[j].owned_memory);
+    }
+  }
+
+  free(data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                    //
+test_duplicate_tiles(  //
+    void) {
+  // The image is 192 x 100 pixels: 3 x 2 tiles. The tiles in each row have
+  // the same (noisy) pixels, other than the top-middle tile, so that 3 of the
+  // tiles are Back-References.
+  const uint32_t width = 192;
+  const uint32_t height = 100;
+  uint8_t* data = malloc(4 * width * height);
+  if (!data) {
+    printf("%s: out of memory\n", __func__);
+    return 1;
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t h = (((x & 63) * 0x9E3779B1u) ^ ((y & 63) * 0x85EBCA77u)) >> 8;
+      if (((x >> 6) == 1) && (y < 64)) {
+        h ^= 0x40;
+      }
+      uint8_t* p = data + (4 * ((y * width) + x));
+      p[0] = (uint8_t)(h >> 0) & 0xF0;
+      p[1] = (uint8_t)(h >> 8) & 0xF0;
+      p[2] = (uint8_t)(h >> 16) & 0xF0;
+      p[3] = 0xFF;
+    }
+  }
+  qoir_pixel_buffer src_pixbuf;
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  src_pixbuf.pixcfg.width_in_pixels = width;
+  src_pixbuf.pixcfg.height_in_pixels = height;
+  src_pixbuf.data = data;
+  src_pixbuf.stride_in_bytes = 4 * width;
+
+  int ret = 0;
+  for (int i = 0; (ret == 0) && (i < 4); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = (i & 1) ? 2 : 0;
+    encopts.write_tile_index = i >= 2;
+    qoir_encode_result encs[2];
+    encs[0] = qoir_encode(&src_pixbuf, &encopts);
+    encopts.reference_duplicate_tiles = true;
+    encs[1] = qoir_encode(&src_pixbuf, &encopts);
+    if (encs[0].status_message || encs[1].status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+    }
+
+    // Count the Back-Reference tiles, walking the QPIX chunk's payload that
+    // starts after the 20 byte QOIR chunk and 12 byte QPIX chunk header.
+    int num_back_references = 0;
+    for (size_t j = 0, pos = 32; (ret == 0) && (j < 6); j++) {
+      uint32_t prefix = qoir_private_peek_u32le(encs[1].dst_ptr + pos);
+      num_back_references += (prefix >> 24) == 5;
+      pos += 4 + (prefix & 0xFFFFFF);
+    }
+    if ((ret == 0) && ((num_back_references != 3) ||
+                       (encs[1].dst_len >= encs[0].dst_len))) {
+      printf("%s: #%d: not using the Back-Reference tile format\n", __func__,
+             i);
+      ret = 1;
+    }
+
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    decopts.use_src_clip_rectangle = i == 3;
+    decopts.src_clip_rectangle = qoir_make_rectangle(70, 20, 190, 90);
+    qoir_decode_result decs[2] = {0};
+    for (int j = 0; (ret == 0) && (j < 2); j++) {
+      decs[j] = qoir_decode(encs[j].dst_ptr, encs[j].dst_len, &decopts);
+      if (decs[j].status_message) {
+        printf("%s: #%d: qoir_decode failed: %s\n", __func__, i,
+               decs[j].status_message);
+        ret = 1;
+      }
+    }
+    if ((ret == 0) &&
+        memcmp(decs[0].dst_pixbuf.data, decs[1].dst_pixbuf.data,
+               decs[0].dst_pixbuf.stride_in_bytes *
+                   decs[0].dst_pixbuf.pixcfg.height_in_pixels)) {
+      printf("%s: #%d: different pixels\n", __func__, i);
+      ret = 1;
+    }
+
+    // The incremental decoder can't look back at earlier tiles.
+    if (ret == 0) {
+      qoir_decoder decoder;
+      const char* status_message = qoir_decoder__initialize(&decoder, &decopts);
+      size_t consumed = 0;
+      while (!status_message && !qoir_decoder__is_done(&decoder)) {
+        qoir_size_result r = qoir_decoder__decode(
+            &decoder, encs[1].dst_ptr + consumed, encs[1].dst_len - consumed);
+        status_message = r.status_message;
+        consumed += r.value;
+        if (!status_message && (r.value == 0)) {
+          break;
+        }
+      }
+      qoir_decoder__destroy(&decoder);
+      if (status_message !=
+          qoir_status_message__error_unsupported_tile_format) {
+        printf("%s: #%d: incremental decode did not reject the tiles\n",
+               __func__, i);
+        ret = 1;
+      }
+    }
+
+    for (int j = 0; j < 2; j++) {
+      free(decs[j].owned_memory);
+      free(encs[j].owned_memory);
+    }
+  }
+
+  free(data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                    //
+test_lz4_high_effort(  //
+    void) {
+  // The src bytes are either all zero, noise or a repeating (but sometimes
+  // perturbed) pattern.
+  const size_t max_len = 4 * QOIR_TILE_SIZE * QOIR_TILE_SIZE;
+  static const size_t lens[] = {1, 12, 13, 20, 100, 1000, 16384};
+  uint8_t* src = malloc(max_len);
+  uint8_t* enc = malloc(QOIR_TILE_LZ4_COMPRESSION_WORST_CASE);
+  uint8_t* dec = malloc(max_len);
+  qoir_encode_buffer* encbuf = malloc(sizeof(qoir_encode_buffer));
+  if (!src || !enc || !dec || !encbuf) {
+    printf("%s: out of memory\n", __func__);
+    free(src);
+    free(enc);
+    free(dec);
+    free(encbuf);
+    return 1;
+  }
+
+  int ret = 0;
+  for (int kind = 0; (ret == 0) && (kind < 3); kind++) {
+    uint32_t x = 1;
+    for (size_t i = 0; i < max_len; i++) {
+      x = (x * 1103515245u) + 12345u;
+      src[i] = (kind == 0)   ? 0
+               : (kind == 1) ? (uint8_t)(x >> 24)
+               : ((x >> 24) < 8) ? (uint8_t)(x >> 16)
+                                 : (uint8_t)((i % 37) * 11);
+    }
+    for (size_t l = 0; (ret == 0) && (l < sizeof(lens) / sizeof(lens[0]));
+         l++) {
+      for (uint32_t max_attempts = 4; max_attempts <= 2048;
+           max_attempts *= 512) {
+        qoir_size_result r0 = qoir_lz4_private_block_encode_hc(
+            enc, QOIR_TILE_LZ4_COMPRESSION_WORST_CASE, src, lens[l],
+            encbuf->private_impl.lz4_chain, encbuf->private_impl.lz4_heads,
+            max_attempts);
+        qoir_size_result r1 = {0};
+        if (!r0.status_message) {
+          r1 = qoir_lz4_block_decode(dec, max_len, enc, r0.value);
+        }
+        if (r0.status_message || r1.status_message || (r1.value != lens[l]) ||
+            memcmp(dec, src, lens[l])) {
+          printf("%s: kind %d, len %zu, max_attempts %u: round trip failed\n",
+                 __func__, kind, lens[l], max_attempts);
+          ret = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  // A repeating 12 x 7 pixel pattern compresses better with a high effort.
+  const uint32_t width = 256;
+  const uint32_t height = 128;
+  uint8_t* data = (ret == 0) ? malloc(4 * width * height) : NULL;
+  if ((ret == 0) && !data) {
+    printf("%s: out of memory\n", __func__);
+    ret = 1;
+  } else if (ret == 0) {
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t k = 0; k < (4 * width); k++) {
+        data[(4 * width * y) + k] =
+            src[(k % 48) + (48 * (y % 7)) + 1000] | ((k & 3) == 3 ? 0xFF : 0);
+      }
+    }
+    qoir_pixel_buffer src_pixbuf;
+    src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    src_pixbuf.pixcfg.width_in_pixels = width;
+    src_pixbuf.pixcfg.height_in_pixels = height;
+    src_pixbuf.data = data;
+    src_pixbuf.stride_in_bytes = 4 * width;
+    qoir_encode_options encopts = {0};
+    qoir_encode_result encs[2];
+    encs[0] = qoir_encode(&src_pixbuf, &encopts);
+    encopts.effort = 9;
+    encs[1] = qoir_encode(&src_pixbuf, &encopts);
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    qoir_decode_result dec1 = {0};
+    if (encs[0].status_message || encs[1].status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      ret = 1;
+    } else if (encs[1].dst_len >= encs[0].dst_len) {
+      printf("%s: effort: have %zu bytes, want fewer than %zu\n", __func__,
+             encs[1].dst_len, encs[0].dst_len);
+      ret = 1;
+    } else {
+      dec1 = qoir_decode(encs[1].dst_ptr, encs[1].dst_len, &decopts);
+      if (dec1.status_message ||
+          memcmp(dec1.dst_pixbuf.data, data, 4 * width * height)) {
+        printf("%s: different pixels\n", __func__);
+        ret = 1;
+      }
+    }
+    free(dec1.owned_memory);
+    free(encs[0].owned_memory);
+    free(encs[1].owned_memory);
+  }
+
+  free(data);
+  free(src);
+  free(enc);
+  free(dec);
+  free(encbuf);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                            //
+test_lz4_min_savings_percent(  //
+    void) {
+  // The image is 128 x 128 pixels: 2 x 2 tiles. The left tiles' noise is
+  // incompressible but the right tiles' repeating 8 x 8 pattern is highly
+  // compressible, by LZ4 if not by the ops.
+  const uint32_t width = 128;
+  const uint32_t height = 128;
+  uint8_t* data = malloc(4 * width * height);
+  if (!data) {
+    printf("%s: out of memory\n", __func__);
+    return 1;
+  }
+  uint32_t x = 1;
+  for (uint32_t i = 0; i < (4 * width * height); i++) {
+    x = (x * 1103515245u) + 12345u;
+    data[i] = (uint8_t)(x >> 24);
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    memcpy(data + (4 * ((y * width) + 64)), data + (4 * (y & 7) * width), 256);
+  }
+  qoir_pixel_buffer src_pixbuf;
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  src_pixbuf.pixcfg.width_in_pixels = width;
+  src_pixbuf.pixcfg.height_in_pixels = height;
+  src_pixbuf.data = data;
+  src_pixbuf.stride_in_bytes = 4 * width;
+
+  // want_num_lz4_tiles is, for each percentage, the number of tiles that use
+  // the LZ4-Literals or LZ4-Ops tile format.
+  static const uint32_t percents[4] = {0, 50, 99, 100};
+  static const int want_num_lz4_tiles[4] = {2, 2, 0, 0};
+  int ret = 0;
+  size_t prev_dst_len = 0;
+  for (int i = 0; (ret == 0) && (i < 4); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lz4_min_savings_percent = percents[i];
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+      break;
+    }
+
+    // Walk the QPIX chunk's payload that starts after the 20 byte QOIR chunk
+    // and 12 byte QPIX chunk header.
+    int num_lz4_tiles = 0;
+    for (size_t j = 0, pos = 32; j < 4; j++) {
+      uint32_t prefix = qoir_private_peek_u32le(enc.dst_ptr + pos);
+      num_lz4_tiles += ((prefix >> 24) == 2) || ((prefix >> 24) == 3);
+      pos += 4 + (prefix & 0xFFFFFF);
+    }
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    if (num_lz4_tiles != want_num_lz4_tiles[i]) {
+      printf("%s: #%d: LZ4 tiles: have %d, want %d\n", __func__, i,
+             num_lz4_tiles, want_num_lz4_tiles[i]);
+      ret = 1;
+    } else if (enc.dst_len < prev_dst_len) {
+      printf("%s: #%d: dst_len went backwards\n", __func__, i);
+      ret = 1;
+    } else if (dec.status_message ||
+               memcmp(dec.dst_pixbuf.data, data, 4 * width * height)) {
+      printf("%s: #%d: different pixels\n", __func__, i);
+      ret = 1;
+    }
+    prev_dst_len = enc.dst_len;
+    free(dec.owned_memory);
+    free(enc.owned_memory);
+  }
+
+  free(data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                  //
+test_huffman_tiles(  //
+    void) {
+  // The image is 128 x 128 pixels: 2 x 2 tiles of a gradient with low
+  // amplitude noise. Its ops are not very LZ4 compressible but their byte
+  // values are far from uniformly distributed.
+  const uint32_t width = 128;
+  const uint32_t height = 128;
+  uint8_t* data = malloc(4 * width * height);
+  if (!data) {
+    printf("%s: out of memory\n", __func__);
+    return 1;
+  }
+  uint32_t x = 1;
+  for (uint32_t i = 0; i < (4 * width * height); i++) {
+    x = (x * 1103515245u) + 12345u;
+    data[i] = (uint8_t)(((i / 4) % width) + ((i & 3) * 32) + (x >> 30));
+  }
+  qoir_pixel_buffer src_pixbuf;
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  src_pixbuf.pixcfg.width_in_pixels = width;
+  src_pixbuf.pixcfg.height_in_pixels = height;
+  src_pixbuf.data = data;
+  src_pixbuf.stride_in_bytes = 4 * width;
+
+  int ret = 0;
+  size_t dst_lens[2] = {0};
+  for (int i = 0; (ret == 0) && (i < 2); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.use_huffman_tile_format = i;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+      break;
+    }
+    dst_lens[i] = enc.dst_len;
+
+    // Walk the QPIX chunk's payload that starts after the 20 byte QOIR chunk
+    // and 12 byte QPIX chunk header.
+    int num_huffman_tiles = 0;
+    size_t first_huffman_pos = 0;
+    for (size_t j = 0, pos = 32; j < 4; j++) {
+      uint32_t prefix = qoir_private_peek_u32le(enc.dst_ptr + pos);
+      if ((prefix >> 24) == 6) {
+        num_huffman_tiles++;
+        first_huffman_pos = first_huffman_pos ? first_huffman_pos : pos;
+      }
+      pos += 4 + (prefix & 0xFFFFFF);
+    }
+    if (num_huffman_tiles != (i ? 4 : 0)) {
+      printf("%s: #%d: Huffman tiles: have %d, want %d\n", __func__, i,
+             num_huffman_tiles, i ? 4 : 0);
+      ret = 1;
+    }
+
+    // Decode the whole image and, via the more general code path, a clipped
+    // part of it.
+    for (int k = 0; (ret == 0) && (k < 2); k++) {
+      qoir_decode_options decopts = {0};
+      decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+      decopts.use_src_clip_rectangle = k;
+      decopts.src_clip_rectangle = qoir_make_rectangle(3, 5, 123, 120);
+      qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+      uint32_t x0 = k ? 3 : 0;
+      uint32_t y0 = k ? 5 : 0;
+      uint32_t w = k ? 120 : width;
+      uint32_t h = k ? 115 : height;
+      if (dec.status_message) {
+        printf("%s: #%d.%d: qoir_decode failed\n", __func__, i, k);
+        ret = 1;
+      }
+      for (uint32_t y = y0; (ret == 0) && (y < (y0 + h)); y++) {
+        if (memcmp(dec.dst_pixbuf.data + (y * dec.dst_pixbuf.stride_in_bytes) +
+                       (4 * x0),
+                   data + (4 * ((y * width) + x0)), 4 * w)) {
+          printf("%s: #%d.%d: different pixels\n", __func__, i, k);
+          ret = 1;
+        }
+      }
+      free(dec.owned_memory);
+    }
+
+    // Code lengths that over-subscribe the code space are invalid.
+    if ((ret == 0) && first_huffman_pos) {
+      memset(enc.dst_ptr + first_huffman_pos + 4, 0x11, 128);
+      qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, NULL);
+      if (dec.status_message != qoir_status_message__error_invalid_data) {
+        printf("%s: #%d: corrupt code lengths were not rejected\n", __func__,
+               i);
+        ret = 1;
+      }
+      free(dec.owned_memory);
+    }
+    free(enc.owned_memory);
+  }
+
+  free(data);
+  if ((ret == 0) && (dst_lens[1] >= dst_lens[0])) {
+    printf("%s: dst_len: have %zu, want < %zu\n", __func__, dst_lens[1],
+           dst_lens[0]);
+    ret = 1;
+  }
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+// run_jobs_in_reverse is a qoir_run_jobs_func that runs every job on the
+// calling thread, last job first. Any valid order should give the same result.
+void                         //
+run_jobs_in_reverse(         //
+    void* context,           //
+    qoir_job_func job_func,  //
+    void* job_context,       //
+    uint32_t num_jobs) {
+  uint32_t* num_calls = (uint32_t*)context;
+  for (uint32_t i = num_jobs; i > 0; i--) {
+    (*job_func)(job_context, i - 1);
+    (*num_calls)++;
+  }
+}
+
+int                         //
+test_multithreaded_decode(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  int ret = 1;
+  qoir_encode_result encs[2] = {{0}};
+  uint8_t* dst_data0 = NULL;
+  uint8_t* dst_data1 = NULL;
+
+  do {
+    // Encode without and with a TIDX chunk.
+    qoir_encode_options encopts = {0};
+    encs[0] = qoir_encode(&src_pixbuf, &encopts);
+    encopts.write_tile_index = true;
+    encs[1] = qoir_encode(&src_pixbuf, &encopts);
+    if (encs[0].status_message || encs[1].status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      break;
+    }
+
+    size_t dst_len = src_pixbuf.stride_in_bytes *
+                     (size_t)src_pixbuf.pixcfg.height_in_pixels;
+    dst_data0 = malloc(dst_len);
+    dst_data1 = malloc(dst_len);
+    if (!dst_data0 || !dst_data1) {
+      printf("%s: out of memory\n", __func__);
+      break;
+    }
+    static const int32_t clips[3][4] = {
+        {0, 0, 312, 442},
+        {70, 5, 271, 306},
+        {-10, 400, 999, 999},
+    };
+    static const uint32_t max_num_jobs[3] = {3, 7, 1000};
+    bool ok = true;
+    for (int e = 0; ok && (e < 2); e++) {
+      for (int i = 0; ok && (i < 3); i++) {
+        for (int j = 0; ok && (j < 3); j++) {
+          qoir_decode_options decopts = {0};
+          decopts.pixbuf = src_pixbuf;
+          decopts.src_clip_rectangle = qoir_make_rectangle(
+              clips[i][0], clips[i][1], clips[i][2], clips[i][3]);
+          decopts.use_src_clip_rectangle = true;
+          memset(dst_data0, 0, dst_len);
+          memset(dst_data1, 0, dst_len);
+          decopts.pixbuf.data = dst_data0;
+          qoir_decode_result dec0 =
+              qoir_decode(encs[e].dst_ptr, encs[e].dst_len, &decopts);
+
+          uint32_t num_calls = 0;
+          decopts.pixbuf.data = dst_data1;
+          decopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+          decopts.run_jobs_func_context = &num_calls;
+          decopts.max_num_jobs = max_num_jobs[j];
+          qoir_decode_result dec1 =
+              qoir_decode(encs[e].dst_ptr, encs[e].dst_len, &decopts);
+
+          if (dec0.status_message || dec1.status_message) {
+            printf("%s: #%d.%d.%d: qoir_decode failed\n", __func__, e, i, j);
+            ok = false;
+          } else if ((num_calls < 2) || (num_calls > max_num_jobs[j])) {
+            printf("%s: #%d.%d.%d: num_calls: have %u\n", __func__, e, i, j,
+                   (unsigned int)num_calls);
+            ok = false;
+          } else if (memcmp(dst_data0, dst_data1, dst_len)) {
+            printf("%s: #%d.%d.%d: different pixels\n", __func__, e, i, j);
+            ok = false;
+          }
+        }
+      }
+    }
+    if (!ok) {
+      break;
+    }
+
+    // Lengthening the first tile (whose 4 byte prefix immediately follows the
+    // 12 byte QPIX chunk header) should still be rejected when multi-threaded,
+    // even without a TIDX chunk.
+    uint8_t* qpix = encs[0].dst_ptr + 20;
+    if ((encs[0].dst_len < 36) || memcmp(qpix, "QPIX", 4)) {
+      printf("%s: no QPIX chunk\n", __func__);
+      break;
+    }
+    qpix[12 + 1] ^= 0x40;
+    uint32_t num_calls = 0;
+    qoir_decode_options decopts = {0};
+    decopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+    decopts.run_jobs_func_context = &num_calls;
+    decopts.max_num_jobs = 4;
+    qoir_decode_result dec =
+        qoir_decode(encs[0].dst_ptr, encs[0].dst_len, &decopts);
+    free(dec.owned_memory);
+    if (dec.status_message != qoir_status_message__error_invalid_data) {
+      printf("%s: corrupt tile: have \"%s\", want \"%s\"\n", __func__,
+             dec.status_message, qoir_status_message__error_invalid_data);
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(dst_data0);
+  free(dst_data1);
+  free(encs[0].owned_memory);
+  free(encs[1].owned_memory);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                 //
+test_decode_batch(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  // Each sprite is a crop (x, y, width, height) of the source image. They
+  // are placed side by side in the atlas, 3 pixels apart. Sprite #4's
+  // dst_rectangle is shorter than it is, so that its bottom rows are clipped.
+  static const uint32_t sprites[6][4] = {
+      {0, 0, 20, 30},
+      {100, 50, 70, 90},
+      {64, 64, 64, 64},
+      {5, 7, 1, 1},
+      {150, 300, 130, 40},
+      {30, 200, 33, 17},
+  };
+  static const int32_t clipped_height = 25;
+  const uint32_t atlas_width = 20 + 70 + 64 + 1 + 130 + 33 + (3 * 6);
+  const uint32_t atlas_height = 90;
+  const size_t atlas_len = 4 * (size_t)atlas_width * atlas_height;
+
+  int ret = 1;
+  qoir_encode_result encs[6] = {{0}};
+  qoir_decode_batch_item items[6] = {{0}};
+  uint8_t* want = calloc(1, atlas_len);
+  uint8_t* have = malloc(atlas_len);
+
+  do {
+    if (!want || !have) {
+      printf("%s: out of memory\n", __func__);
+      break;
+    }
+    bool ok = true;
+    int32_t x = 0;
+    for (int i = 0; ok && (i < 6); i++) {
+      qoir_pixel_buffer sprite = src_pixbuf;
+      sprite.pixcfg.width_in_pixels = sprites[i][2];
+      sprite.pixcfg.height_in_pixels = sprites[i][3];
+      sprite.data += (sprites[i][1] * src_pixbuf.stride_in_bytes) +
+                     (4 * sprites[i][0]);
+      qoir_encode_options encopts = {0};
+      encopts.lossiness = i & 1;
+      encs[i] = qoir_encode(&sprite, &encopts);
+      if (encs[i].status_message) {
+        printf("%s: #%d: qoir_encode failed\n", __func__, i);
+        ok = false;
+        break;
+      }
+      int32_t h = (i == 4) ? clipped_height : (int32_t)sprites[i][3];
+      items[i].src_ptr = encs[i].dst_ptr;
+      items[i].src_len = encs[i].dst_len;
+      items[i].dst_rectangle =
+          qoir_make_rectangle(x, 0, x + (int32_t)sprites[i][2], h);
+
+      // Sprite #2 is corrupt, so its part of the want atlas stays zero.
+      if (i == 2) {
+        items[i].src_len = 40;
+      } else {
+        qoir_decode_options decopts = {0};
+        decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+        qoir_decode_result dec =
+            qoir_decode(encs[i].dst_ptr, encs[i].dst_len, &decopts);
+        if (dec.status_message) {
+          printf("%s: #%d: qoir_decode failed\n", __func__, i);
+          ok = false;
+          break;
+        }
+        for (int32_t y = 0; y < h; y++) {
+          memcpy(want + (4 * (((size_t)y * atlas_width) + (size_t)x)),
+                 dec.dst_pixbuf.data + (y * dec.dst_pixbuf.stride_in_bytes),
+                 4 * sprites[i][2]);
+        }
+        free(dec.owned_memory);
+      }
+      x += (int32_t)sprites[i][2] + 3;
+    }
+    if (!ok) {
+      break;
+    }
+
+    qoir_decode_options decopts = {0};
+    if (qoir_decode_batch(items, 6, &decopts) !=
+        qoir_status_message__error_invalid_argument) {
+      printf("%s: zero pixbuf was not rejected\n", __func__);
+      break;
+    }
+    decopts.pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    decopts.pixbuf.pixcfg.width_in_pixels = atlas_width;
+    decopts.pixbuf.pixcfg.height_in_pixels = atlas_height;
+    decopts.pixbuf.data = have;
+    decopts.pixbuf.stride_in_bytes = 4 * (size_t)atlas_width;
+
+    // The stats should be the same however many jobs there are.
+    qoir_stats want_stats = {0};
+    static const uint32_t max_num_jobs[3] = {1, 4, 1000};
+    for (int j = 0; ok && (j < 3); j++) {
+      uint32_t num_calls = 0;
+      qoir_stats have_stats = {0};
+      decopts.stats = &have_stats;
+      decopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      decopts.run_jobs_func_context = &num_calls;
+      decopts.max_num_jobs = max_num_jobs[j];
+      memset(have, 0, atlas_len);
+      const char* status_message = qoir_decode_batch(items, 6, &decopts);
+      if (status_message != qoir_status_message__error_invalid_data) {
+        printf("%s: #%d: status_message: have \"%s\", want \"%s\"\n",
+               __func__, j, status_message,
+               qoir_status_message__error_invalid_data);
+        ok = false;
+      } else if (items[2].status_message != status_message) {
+        printf("%s: #%d: corrupt item was not reported\n", __func__, j);
+        ok = false;
+      } else if (items[0].status_message || items[5].status_message) {
+        printf("%s: #%d: valid item was reported\n", __func__, j);
+        ok = false;
+      } else if ((j > 0) && ((num_calls < 2) || (num_calls > 6))) {
+        printf("%s: #%d: num_calls: have %u\n", __func__, j,
+               (unsigned int)num_calls);
+        ok = false;
+      } else if (memcmp(want, have, atlas_len)) {
+        printf("%s: #%d: different pixels\n", __func__, j);
+        ok = false;
+      } else if (j == 0) {
+        want_stats = have_stats;
+        if (want_stats.num_tiles_by_format[1] == 0) {
+          printf("%s: #%d: no Ops tiles counted\n", __func__, j);
+          ok = false;
+        }
+      } else if (memcmp(&want_stats, &have_stats, sizeof(qoir_stats))) {
+        printf("%s: #%d: different stats\n", __func__, j);
+        ok = false;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(want);
+  free(have);
+  for (int i = 0; i < 6; i++) {
+    free(encs[i].owned_memory);
+  }
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                         //
+test_multithreaded_encode(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+
+  // Multi-threaded encoding should produce exactly the same bytes as
+  // single-threaded encoding.
+  static const uint32_t max_num_jobs[4] = {2, 3, 7, 1000};
+  int ret = 0;
+  for (int i = 0; (ret == 0) && (i < 3); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = (i == 0) ? 0 : 2;
+    encopts.dither = i == 2;
+    encopts.write_tile_index = i == 1;
+    qoir_encode_result enc0 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc0.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+    }
+
+    for (int j = 0; (ret == 0) && (j < 4); j++) {
+      uint32_t num_calls = 0;
+      encopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      encopts.run_jobs_func_context = &num_calls;
+      encopts.max_num_jobs = max_num_jobs[j];
+      qoir_encode_result enc1 = qoir_encode(&src_pixbuf, &encopts);
+      if (enc1.status_message) {
+        printf("%s: #%d.%d: qoir_encode failed\n", __func__, i, j);
+        ret = 1;
+      } else if ((num_calls < 2) || (num_calls > max_num_jobs[j])) {
+        printf("%s: #%d.%d: num_calls: have %u\n", __func__, i, j,
+               (unsigned int)num_calls);
+        ret = 1;
+      } else if ((enc0.dst_len != enc1.dst_len) ||
+                 memcmp(enc0.dst_ptr, enc1.dst_ptr, enc0.dst_len)) {
+        printf("%s: #%d.%d: different bytes\n", __func__, i, j);
+        ret = 1;
+      }
+      free(enc1.owned_memory);
+    }
+    free(enc0.owned_memory);
+  }
+
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                            //
+test_encode_dirty_rectangles(  //
+    void) {
+  // The image is 300 x 200 pixels: 5 x 4 tiles, whose (noisy) pixels repeat
+  // every 64 pixels, so that many tiles are Back-References when using the
+  // reference_duplicate_tiles option.
+  const uint32_t width = 300;
+  const uint32_t height = 200;
+  uint8_t* data0 = malloc(4 * width * height);
+  uint8_t* data1 = malloc(4 * width * height);
+  if (!data0 || !data1) {
+    printf("%s: out of memory\n", __func__);
+    free(data0);
+    free(data1);
+    return 1;
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t h = (((x & 63) * 0x9E3779B1u) ^ ((y & 63) * 0x85EBCA77u)) >> 8;
+      uint8_t* p = data0 + (4 * ((y * width) + x));
+      p[0] = (uint8_t)(h >> 0) & 0xF0;
+      p[1] = (uint8_t)(h >> 8) & 0xF0;
+      p[2] = (uint8_t)(h >> 16) & 0xF0;
+      p[3] = 0xFF;
+    }
+  }
+
+  // The second frame differs from the first only within the dirty
+  // rectangles, which span 4 tiles. The third dirty rectangle is unchanged
+  // (which is valid) and the fourth is out of bounds (which is ignored).
+  static const int32_t dirty[4][4] = {
+      {100, 70, 140, 90},
+      {250, 150, 251, 151},
+      {0, 0, 3, 3},
+      {-9, 500, 999, 999},
+  };
+  qoir_rectangle dirty_rectangles[4];
+  memcpy(data1, data0, 4 * width * height);
+  for (int i = 0; i < 4; i++) {
+    dirty_rectangles[i] = qoir_make_rectangle(dirty[i][0], dirty[i][1],
+                                              dirty[i][2], dirty[i][3]);
+    for (int32_t y = dirty[i][1]; (i < 2) && (y < dirty[i][3]); y++) {
+      for (int32_t x = dirty[i][0]; x < dirty[i][2]; x++) {
+        data1[(4 * ((y * width) + x)) + 1] ^= 0x80;
+      }
+    }
+  }
+  qoir_pixel_buffer src_pixbufs[2];
+  for (int i = 0; i < 2; i++) {
+    src_pixbufs[i].pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    src_pixbufs[i].pixcfg.width_in_pixels = width;
+    src_pixbufs[i].pixcfg.height_in_pixels = height;
+    src_pixbufs[i].data = i ? data1 : data0;
+    src_pixbufs[i].stride_in_bytes = 4 * width;
+  }
+
+  // Re-encoding should give the same bytes as encoding from scratch,
+  // including when resolving (and then re-creating) Back-References.
+  int ret = 0;
+  for (int i = 0; (ret == 0) && (i < 4); i++) {
+    uint32_t num_calls = 0;
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = (i & 1) ? 2 : 0;
+    encopts.reference_duplicate_tiles = i >= 2;
+    encopts.write_tile_index = i >= 2;
+    if (i == 3) {
+      encopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      encopts.run_jobs_func_context = &num_calls;
+      encopts.max_num_jobs = 3;
+    }
+    qoir_encode_result prev = qoir_encode(&src_pixbufs[0], &encopts);
+    qoir_encode_result want = qoir_encode(&src_pixbufs[1], &encopts);
+    qoir_encode_result have = {0};
+    qoir_encode_result none = {0};
+    if (prev.status_message || want.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+    } else {
+      have = qoir_encode_dirty_rectangles(&src_pixbufs[1], prev.dst_ptr,
+                                          prev.dst_len, dirty_rectangles, 4,
+                                          &encopts);
+      none = qoir_encode_dirty_rectangles(&src_pixbufs[0], prev.dst_ptr,
+                                          prev.dst_len, NULL, 0, &encopts);
+      if (have.status_message || none.status_message) {
+        printf("%s: #%d: qoir_encode_dirty_rectangles failed\n", __func__, i);
+        ret = 1;
+      } else if ((have.dst_len != want.dst_len) ||
+                 memcmp(have.dst_ptr, want.dst_ptr, want.dst_len)) {
+        printf("%s: #%d: re-encoding differs\n", __func__, i);
+        ret = 1;
+      } else if ((none.dst_len != prev.dst_len) ||
+                 memcmp(none.dst_ptr, prev.dst_ptr, prev.dst_len)) {
+        printf("%s: #%d: copying every tile differs\n", __func__, i);
+        ret = 1;
+      }
+    }
+
+    // The previous encoding's lossiness must match.
+    if (ret == 0) {
+      encopts.lossiness ^= 1;
+      qoir_encode_result bad = qoir_encode_dirty_rectangles(
+          &src_pixbufs[1], prev.dst_ptr, prev.dst_len, dirty_rectangles, 4,
+          &encopts);
+      free(bad.owned_memory);
+      if (bad.status_message != qoir_status_message__error_invalid_argument) {
+        printf("%s: #%d: different lossiness: have \"%s\", want \"%s\"\n",
+               __func__, i, bad.status_message,
+               qoir_status_message__error_invalid_argument);
+        ret = 1;
+      }
+    }
+    free(none.owned_memory);
+    free(have.owned_memory);
+    free(want.owned_memory);
+    free(prev.owned_memory);
+  }
+
+  free(data0);
+  free(data1);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                    //
+test_encode_into_dst(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  int ret = 1;
+  qoir_encode_result enc0 = {0};
+  uint8_t* dst_data = NULL;
+
+  do {
+    qoir_encode_options encopts = {0};
+    encopts.write_tile_index = true;
+    enc0 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc0.status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      break;
+    }
+
+    qoir_size_result worst_case =
+        qoir_encode_worst_case_dst_len(&src_pixbuf, &encopts);
+    if (worst_case.status_message) {
+      printf("%s: qoir_encode_worst_case_dst_len failed\n", __func__);
+      break;
+    } else if (worst_case.value < enc0.dst_len) {
+      printf("%s: worst case: have %zu, want >= %zu\n", __func__,
+             worst_case.value, enc0.dst_len);
+      break;
+    }
+    dst_data = malloc(worst_case.value);
+    if (!dst_data) {
+      printf("%s: out of memory\n", __func__);
+      break;
+    }
+
+    // A too-short buffer should be rejected, even if the encoded output would
+    // fit, and a long enough buffer should give the same bytes as before.
+    encopts.dst_ptr = dst_data;
+    encopts.dst_len = worst_case.value - 1;
+    qoir_encode_result enc1 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc1.status_message != qoir_status_message__error_dst_is_too_short) {
+      printf("%s: too short: have \"%s\", want \"%s\"\n", __func__,
+             enc1.status_message, qoir_status_message__error_dst_is_too_short);
+      free(enc1.owned_memory);
+      break;
+    }
+    encopts.dst_len = worst_case.value;
+    enc1 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc1.status_message) {
+      printf("%s: qoir_encode (into dst) failed\n", __func__);
+      break;
+    } else if (enc1.owned_memory || (enc1.dst_ptr != dst_data)) {
+      printf("%s: qoir_encode (into dst) did not use dst\n", __func__);
+      free(enc1.owned_memory);
+      break;
+    } else if ((enc0.dst_len != enc1.dst_len) ||
+               memcmp(enc0.dst_ptr, enc1.dst_ptr, enc0.dst_len)) {
+      printf("%s: different bytes\n", __func__);
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(dst_data);
+  free(enc0.owned_memory);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+typedef struct test_sink_struct {
+  uint8_t* ptr;
+  size_t len;
+  size_t cap;
+  uint32_t num_calls;
+  uint32_t fail_after_num_calls;
+} test_sink;
+
+const char test_sink_error[] = "#unit_tests: test sink error";
+
+const char*                  //
+write_to_test_sink(          //
+    void* context,           //
+    uint64_t position,       //
+    const uint8_t* src_ptr,  //
+    size_t src_len) {
+  test_sink* sink = (test_sink*)context;
+  if (sink->num_calls++ >= sink->fail_after_num_calls) {
+    return test_sink_error;
+  } else if ((position > sink->cap) || (src_len > (sink->cap - position))) {
+    return "#unit_tests: test sink is too short";
+  }
+  memcpy(sink->ptr + position, src_ptr, src_len);
+  if (sink->len < (position + src_len)) {
+    sink->len = position + src_len;
+  }
+  return NULL;
+}
+
+int                   //
+test_encode_to_sink(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  static const uint8_t exif[5] = {0x45, 0x78, 0x69, 0x66, 0x21};
+  int ret = 0;
+
+  // Writing to a sink should produce exactly the same bytes as writing to
+  // memory, with or without a TIDX chunk and multi-threading.
+  for (int i = 0; (ret == 0) && (i < 3); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.metadata_exif_ptr = exif;
+    encopts.metadata_exif_len = sizeof(exif);
+    encopts.write_tile_index = i > 0;
+    encopts.num_mipmap_levels = (i == 2) ? 4 : 0;
+    uint32_t num_calls = 0;
+    if (i == 2) {
+      encopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      encopts.run_jobs_func_context = &num_calls;
+      encopts.max_num_jobs = 3;
+    }
+    qoir_encode_result enc0 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc0.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+      break;
+    }
+
+    test_sink sink = {0};
+    sink.cap = enc0.dst_len;
+    sink.ptr = malloc(sink.cap);
+    if (!sink.ptr) {
+      printf("%s: #%d: out of memory\n", __func__, i);
+      free(enc0.owned_memory);
+      ret = 1;
+      break;
+    }
+    sink.fail_after_num_calls = 0xFFFFFFFF;
+    encopts.contextual_write_func = &write_to_test_sink;
+    encopts.write_func_context = &sink;
+    qoir_encode_result enc1 = qoir_encode(&src_pixbuf, &encopts);
+    if (enc1.status_message) {
+      printf("%s: #%d: qoir_encode (to sink) failed: %s\n", __func__, i,
+             enc1.status_message);
+      ret = 1;
+    } else if (enc1.owned_memory || enc1.dst_ptr ||
+               (enc1.dst_len != enc0.dst_len) ||
+               (sink.len != enc0.dst_len) ||
+               memcmp(enc0.dst_ptr, sink.ptr, enc0.dst_len)) {
+      printf("%s: #%d: different bytes\n", __func__, i);
+      ret = 1;
+    }
+
+    // A sink error should be returned, after no further calls.
+    if (ret == 0) {
+      uint32_t want_num_calls = sink.num_calls / 2;
+      sink.len = 0;
+      sink.num_calls = 0;
+      sink.fail_after_num_calls = want_num_calls;
+      enc1 = qoir_encode(&src_pixbuf, &encopts);
+      if (enc1.status_message != test_sink_error) {
+        printf("%s: #%d: sink error: have \"%s\", want \"%s\"\n", __func__,
+               i, enc1.status_message, test_sink_error);
+        ret = 1;
+      } else if (sink.num_calls != (want_num_calls + 1)) {
+        printf("%s: #%d: sink error: num_calls: have %u, want %u\n",
+               __func__, i, (unsigned int)sink.num_calls,
+               (unsigned int)(want_num_calls + 1));
+        ret = 1;
+      }
+    }
+    free(sink.ptr);
+    free(enc0.owned_memory);
+  }
+
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                       //
+test_incremental_encode(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  static const uint8_t exif[5] = {0x45, 0x78, 0x69, 0x66, 0x21};
+  static const uint32_t band_heights[5] = {64, 7, 130, 1000, 1};
+  int ret = 0;
+
+  // Pushing the rows a band at a time should produce exactly the same bytes
+  // as qoir_encode, whatever the band heights.
+  for (int i = 0; (ret == 0) && (i < 5); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.metadata_exif_ptr = exif;
+    encopts.metadata_exif_len = sizeof(exif);
+    encopts.write_tile_index = (i & 1) == 0;
+    encopts.lossiness = (i == 3) ? 1 : 0;
+    encopts.num_mipmap_levels = (i >= 3) ? 5 : 0;
+    uint32_t num_calls = 0;
+    if (i >= 2) {
+      encopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      encopts.run_jobs_func_context = &num_calls;
+      encopts.max_num_jobs = 3;
+    }
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+      break;
+    }
+
+    test_sink sink = {0};
+    sink.cap = enc.dst_len;
+    sink.ptr = malloc(sink.cap);
+    if (!sink.ptr) {
+      printf("%s: #%d: out of memory\n", __func__, i);
+      free(enc.owned_memory);
+      ret = 1;
+      break;
+    }
+    sink.fail_after_num_calls = 0xFFFFFFFF;
+    encopts.contextual_write_func = &write_to_test_sink;
+    encopts.write_func_context = &sink;
+
+    qoir_encoder encoder;
+    const char* status_message =
+        qoir_encoder__initialize(&encoder, &src_pixbuf.pixcfg, &encopts);
+    uint32_t height = src_pixbuf.pixcfg.height_in_pixels;
+    bool restarted = false;
+    for (uint32_t y = 0; !status_message && (y < height);) {
+      qoir_pixel_buffer band = src_pixbuf;
+      band.pixcfg.height_in_pixels =
+          ((height - y) < band_heights[i]) ? (height - y) : band_heights[i];
+      band.data = src_pixbuf.data + (src_pixbuf.stride_in_bytes * y);
+      status_message = qoir_encoder__push_rows(&encoder, &band);
+      y += band.pixcfg.height_in_pixels;
+
+      // Finishing early should fail. Start again.
+      if (!status_message && !restarted && (y >= 64) && (y < height)) {
+        restarted = true;
+        qoir_size_result r = qoir_encoder__finish(&encoder);
+        if (r.status_message != qoir_status_message__error_invalid_argument) {
+          printf("%s: #%d: finishing early did not fail\n", __func__, i);
+          ret = 1;
+          break;
+        }
+        qoir_encoder__destroy(&encoder);
+        status_message =
+            qoir_encoder__initialize(&encoder, &src_pixbuf.pixcfg, &encopts);
+        y = 0;
+        sink.len = 0;
+      }
+    }
+    qoir_size_result r = {0};
+    if (!status_message) {
+      r = qoir_encoder__finish(&encoder);
+      status_message = r.status_message;
+    }
+    qoir_encoder__destroy(&encoder);
+
+    if (ret) {
+      // No-op.
+    } else if (status_message) {
+      printf("%s: #%d: incremental encode failed: %s\n", __func__, i,
+             status_message);
+      ret = 1;
+    } else if ((r.value != enc.dst_len) || (sink.len != enc.dst_len) ||
+               memcmp(enc.dst_ptr, sink.ptr, enc.dst_len)) {
+      printf("%s: #%d: different bytes\n", __func__, i);
+      ret = 1;
+    }
+    free(sink.ptr);
+    free(enc.owned_memory);
+  }
+
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int                       //
+test_incremental_decode(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  static const uint8_t exif[5] = {0x45, 0x78, 0x69, 0x66, 0x21};
+  static const size_t steps[4] = {1000, 97, 4096, 1};
+  int ret = 0;
+
+  // Feeding the bytes a piece at a time (and re-passing the unconsumed bytes)
+  // should produce the same pixels as qoir_decode.
+  for (int i = 0; (ret == 0) && (i < 4); i++) {
+    qoir_encode_options encopts = {0};
+    encopts.metadata_exif_ptr = exif;
+    encopts.metadata_exif_len = sizeof(exif);
+    encopts.write_tile_index = (i & 1) == 0;
+    encopts.lossiness = (i == 1) ? 2 : 0;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+      break;
+    }
+
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    if (i == 2) {
+      decopts.use_src_clip_rectangle = true;
+      decopts.src_clip_rectangle = qoir_make_rectangle(70, 100, 200, 300);
+      decopts.offset_x = -30;
+      decopts.offset_y = 5;
+    }
+    qoir_decode_result want = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    if (want.status_message) {
+      printf("%s: #%d: qoir_decode failed\n", __func__, i);
+      free(enc.owned_memory);
+      ret = 1;
+      break;
+    }
+    size_t want_len = want.dst_pixbuf.stride_in_bytes *
+                      want.dst_pixbuf.pixcfg.height_in_pixels;
+
+    qoir_decoder decoder;
+    const char* status_message = qoir_decoder__initialize(&decoder, &decopts);
+    size_t received = 0;
+    size_t consumed = 0;
+    uint32_t num_decoded_rows = 0;
+    bool checked_partial_rows = false;
+    while (!status_message && !qoir_decoder__is_done(&decoder)) {
+      if (received == enc.dst_len) {
+        status_message = "truncated";
+        break;
+      }
+      received += ((enc.dst_len - received) < steps[i])
+                      ? (enc.dst_len - received)
+                      : steps[i];
+      qoir_size_result r = qoir_decoder__decode(
+          &decoder, enc.dst_ptr + consumed, received - consumed);
+      status_message = r.status_message;
+      consumed += r.value;
+
+      uint32_t n = qoir_decoder__num_decoded_rows(&decoder);
+      if (n < num_decoded_rows) {
+        status_message = "num_decoded_rows went backwards";
+      } else if ((i == 0) && (n > 0) && !checked_partial_rows &&
+                 !qoir_decoder__is_done(&decoder)) {
+        checked_partial_rows = true;
+        if (memcmp(qoir_decoder__dst_pixbuf(&decoder)->data,
+                   want.dst_pixbuf.data,
+                   n * want.dst_pixbuf.stride_in_bytes)) {
+          status_message = "different partial pixels";
+        }
+      }
+      num_decoded_rows = n;
+    }
+    qoir_decode_result have = {0};
+    if (!status_message) {
+      have = qoir_decoder__finish(&decoder);
+      status_message = have.status_message;
+    }
+    qoir_decoder__destroy(&decoder);
+
+    if (status_message) {
+      printf("%s: #%d: incremental decode failed: %s\n", __func__, i,
+             status_message);
+      ret = 1;
+    } else if ((i == 0) && !checked_partial_rows) {
+      printf("%s: #%d: no partial rows\n", __func__, i);
+      ret = 1;
+    } else if ((consumed != enc.dst_len) ||
+               (num_decoded_rows != src_pixbuf.pixcfg.height_in_pixels) ||
+               (have.dst_pixbuf.stride_in_bytes !=
+                want.dst_pixbuf.stride_in_bytes) ||
+               memcmp(have.dst_pixbuf.data, want.dst_pixbuf.data, want_len)) {
+      printf("%s: #%d: different pixels\n", __func__, i);
+      ret = 1;
+    }
+    free(have.owned_memory);
+    free(want.owned_memory);
+
+    // Truncated or corrupted input should be rejected.
+    if ((ret == 0) && (i == 0)) {
+      qoir_decode_result r0 = {0};
+      if (!qoir_decoder__initialize(&decoder, NULL) &&
+          !qoir_decoder__decode(&decoder, enc.dst_ptr, enc.dst_len - 1)
+               .status_message) {
+        r0 = qoir_decoder__finish(&decoder);
+      }
+      qoir_decoder__destroy(&decoder);
+
+      // Give the first tile an unsupported format. Its prefix starts after
+      // the QOIR chunk (20 bytes) and the QPIX chunk header (12 bytes).
+      enc.dst_ptr[20 + 12 + 3] = 0x7F;
+      const char* s1 =
+          qoir_decode(enc.dst_ptr, enc.dst_len, NULL).status_message;
+      qoir_size_result r1 = {0};
+      if (!qoir_decoder__initialize(&decoder, NULL)) {
+        r1 = qoir_decoder__decode(&decoder, enc.dst_ptr, enc.dst_len);
+      }
+      qoir_decoder__destroy(&decoder);
+
+      if (r0.status_message != qoir_status_message__error_invalid_data) {
+        printf("%s: truncated input was not rejected\n", __func__);
+        free(r0.owned_memory);
+        ret = 1;
+      } else if (!s1 || (r1.status_message != s1)) {
+        printf("%s: corrupted input was not rejected\n", __func__);
+        ret = 1;
+      }
+    }
+    free(enc.owned_memory);
+  }
+
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// counting_allocator counts the calls to its malloc and free functions.
+typedef struct counting_allocator_struct {
+  uint32_t num_mallocs;
+  uint32_t num_frees;
+} counting_allocator;
+
+void*               //
+counting_malloc(    //
+    void* context,  //
+    size_t len) {
+  ((counting_allocator*)context)->num_mallocs++;
+  return malloc(len);
+}
+
+void                //
+counting_free(      //
+    void* context,  //
+    void* ptr) {
+  if (ptr) {
+    ((counting_allocator*)context)->num_frees++;
+  }
+  free(ptr);
+}
+
+int            //
+test_context(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  qoir_encode_result want_enc = qoir_encode(&src_pixbuf, NULL);
+  qoir_decode_result want_dec = {0};
+  if (!want_enc.status_message) {
+    want_dec = qoir_decode(want_enc.dst_ptr, want_enc.dst_len, NULL);
+  }
+  int ret = 0;
+  if (want_enc.status_message || want_dec.status_message) {
+    printf("%s: could not encode or decode without a context\n", __func__);
+    ret = 1;
+  }
+
+  counting_allocator allocator = {0};
+  qoir_context context;
+  qoir_context__initialize(&context, &counting_malloc, &counting_free,
+                           &allocator);
+  uint32_t num_calls = 0;
+  uint32_t num_mallocs_after_warm_up = 0;
+
+  // After the first two (warm up) iterations, there should be no allocations.
+  // The second iteration is multi-threaded, and the later ones alternate.
+  for (int i = 0; (ret == 0) && (i < 6); i++) {
+    if (i == 2) {
+      num_mallocs_after_warm_up = allocator.num_mallocs;
+    }
+    qoir_encode_options encopts = {0};
+    qoir_decode_options decopts = {0};
+    encopts.context = &context;
+    decopts.context = &context;
+    if (i & 1) {
+      encopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      encopts.run_jobs_func_context = &num_calls;
+      encopts.max_num_jobs = 3;
+      decopts.contextual_run_jobs_func = &run_jobs_in_reverse;
+      decopts.run_jobs_func_context = &num_calls;
+      decopts.max_num_jobs = 3;
+    }
+
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: #%d: qoir_encode failed\n", __func__, i);
+      ret = 1;
+      break;
+    }
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    if (dec.status_message) {
+      printf("%s: #%d: qoir_decode failed\n", __func__, i);
+      ret = 1;
+    } else if ((enc.dst_len != want_enc.dst_len) ||
+               memcmp(enc.dst_ptr, want_enc.dst_ptr, enc.dst_len)) {
+      printf("%s: #%d: different encoded bytes\n", __func__, i);
+      ret = 1;
+    } else if (memcmp(dec.dst_pixbuf.data, want_dec.dst_pixbuf.data,
+                      want_dec.dst_pixbuf.stride_in_bytes *
+                          want_dec.dst_pixbuf.pixcfg.height_in_pixels)) {
+      printf("%s: #%d: different decoded pixels\n", __func__, i);
+      ret = 1;
+    }
+    qoir_context__recycle(&context, dec.owned_memory);
+    qoir_context__recycle(&context, enc.owned_memory);
+  }
+
+  if ((ret == 0) && (allocator.num_mallocs != num_mallocs_after_warm_up)) {
+    printf("%s: allocated after warming up\n", __func__);
+    ret = 1;
+  }
+  qoir_context__destroy(&context);
+  qoir_context__destroy(&context);
+  if ((ret == 0) && (allocator.num_mallocs != allocator.num_frees)) {
+    printf("%s: leaked memory\n", __func__);
+    ret = 1;
+  }
+
+  free(want_dec.owned_memory);
+  free(want_enc.owned_memory);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+int              //
+test_container(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  int ret = 1;
+  qoir_encode_result encs[3] = {{0}};
+  const uint8_t* frame_ptrs[3] = {NULL};
+  size_t frame_lens[3] = {0};
+  uint8_t* dst_ptr = NULL;
+
+  do {
+    bool ok = true;
+    for (int i = 0; i < 3; i++) {
+      qoir_pixel_buffer frame = src_pixbuf;
+      frame.pixcfg.width_in_pixels = 40 + (50 * i);
+      frame.pixcfg.height_in_pixels = 30 + (20 * i);
+      frame.data += 4 * (20 * i);
+      qoir_encode_options encopts = {0};
+      encopts.lossiness = i;
+      encs[i] = qoir_encode(&frame, &encopts);
+      if (encs[i].status_message) {
+        printf("%s: #%d: qoir_encode failed\n", __func__, i);
+        ok = false;
+        break;
+      }
+      frame_ptrs[i] = encs[i].dst_ptr;
+      frame_lens[i] = encs[i].dst_len;
+    }
+    if (!ok) {
+      break;
+    }
+
+    qoir_size_result dst_len = qoir_container_encode_dst_len(frame_lens, 3);
+    if (dst_len.status_message ||
+        (dst_len.value !=
+         (32 + (28 * 3) + frame_lens[0] + frame_lens[1] + frame_lens[2]))) {
+      printf("%s: qoir_container_encode_dst_len failed\n", __func__);
+      break;
+    }
+    dst_ptr = malloc(dst_len.value);
+    if (!dst_ptr) {
+      printf("%s: out of memory\n", __func__);
+      break;
+    }
+    qoir_size_result enc = qoir_container_encode(
+        dst_ptr, dst_len.value - 1, frame_ptrs, frame_lens, 3);
+    if (enc.status_message != qoir_status_message__error_dst_is_too_short) {
+      printf("%s: short dst: have \"%s\", want \"%s\"\n", __func__,
+             enc.status_message, qoir_status_message__error_dst_is_too_short);
+      break;
+    }
+    enc = qoir_container_encode(dst_ptr, dst_len.value, frame_ptrs,
+                                frame_lens, 3);
+    if (enc.status_message || (enc.value != dst_len.value)) {
+      printf("%s: qoir_container_encode failed\n", __func__);
+      break;
+    }
+
+    qoir_size_result number_of_frames =
+        qoir_container_decode_number_of_frames(dst_ptr, enc.value);
+    if (number_of_frames.status_message || (number_of_frames.value != 3)) {
+      printf("%s: qoir_container_decode_number_of_frames failed\n",
+             __func__);
+      break;
+    }
+    // Visit the frames out of order.
+    static const size_t order[3] = {2, 0, 1};
+    for (int j = 0; ok && (j < 3); j++) {
+      size_t i = order[j];
+      qoir_container_frame_result frame =
+          qoir_container_decode_frame(dst_ptr, enc.value, i);
+      if (frame.status_message || (frame.dst_len != frame_lens[i]) ||
+          memcmp(frame.dst_ptr, frame_ptrs[i], frame_lens[i])) {
+        printf("%s: #%d: qoir_container_decode_frame failed\n", __func__,
+               (int)i);
+        ok = false;
+        break;
+      }
+      qoir_decode_result dec =
+          qoir_decode(frame.dst_ptr, frame.dst_len, NULL);
+      if (dec.status_message ||
+          (dec.dst_pixbuf.pixcfg.width_in_pixels != (40 + (50 * i)))) {
+        printf("%s: #%d: qoir_decode failed\n", __func__, (int)i);
+        ok = false;
+      }
+      free(dec.owned_memory);
+    }
+    if (!ok) {
+      break;
+    }
+    qoir_container_frame_result frame =
+        qoir_container_decode_frame(dst_ptr, enc.value, 3);
+    if (frame.status_message != qoir_status_message__error_invalid_argument) {
+      printf("%s: out of range: have \"%s\", want \"%s\"\n", __func__,
+             frame.status_message,
+             qoir_status_message__error_invalid_argument);
+      break;
+    }
+
+    // Corrupting frame #1's directory entry (its length) should reject that
+    // frame but not the others.
+    dst_ptr[20 + 16 + 8] ^= 0x01;
+    if (!qoir_container_decode_frame(dst_ptr, enc.value, 1).status_message ||
+        qoir_container_decode_frame(dst_ptr, enc.value, 0).status_message ||
+        qoir_container_decode_frame(dst_ptr, enc.value, 2).status_message) {
+      printf("%s: corrupt directory entry: wrong frames rejected\n",
+             __func__);
+      break;
+    }
+    // A container truncated within its directory should be rejected.
+    if (!qoir_container_decode_number_of_frames(dst_ptr, 70).status_message) {
+      printf("%s: truncated container was not rejected\n", __func__);
+      break;
+    }
+
+    // An empty container is valid.
+    uint8_t empty[32];
+    enc = qoir_container_encode(empty, sizeof(empty), NULL, NULL, 0);
+    number_of_frames = qoir_container_decode_number_of_frames(empty, enc.value);
+    if (enc.status_message || (enc.value != 32) ||
+        number_of_frames.status_message || (number_of_frames.value != 0)) {
+      printf("%s: empty container failed\n", __func__);
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(dst_ptr);
+  for (int i = 0; i < 3; i++) {
+    free(encs[i].owned_memory);
+  }
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
+// test_tile_totals is the tile_func_context for sum_tile_stats.
+typedef struct test_tile_totals_struct {
+  uint64_t num_tiles;
+  uint64_t compressed_len;
+} test_tile_totals;
+
+void                //
+sum_tile_stats(     //
+    void* context,  //
+    const qoir_tile_stats* tile_stats) {
+  test_tile_totals* totals = (test_tile_totals*)context;
+  totals->num_tiles++;
+  totals->compressed_len += tile_stats->compressed_len;
+}
+
+int          //
+test_stats(  //
+    void) {
+  qoir_pixel_buffer src_pixbuf;
+  uint8_t* src_data = load_png_pixbuf(&src_pixbuf, __func__,
+                                      "test/data/hibiscus.primitive.png", 4);
+  if (!src_data) {
+    return 1;
+  }
+  uint64_t number_of_tiles =
+      qoir_calculate_number_of_tiles_2d(src_pixbuf.pixcfg.width_in_pixels,
+                                        src_pixbuf.pixcfg.height_in_pixels);
+  int ret = 1;
+  qoir_encode_result encs[2] = {{0}};
+
+  do {
+    // Encode without and with a TIDX chunk, gathering stats.
+    qoir_stats enc_stats = {0};
+    test_tile_totals totals = {0};
+    qoir_encode_options encopts = {0};
+    encopts.use_huffman_tile_format = true;
+    encopts.stats = &enc_stats;
+    encopts.contextual_tile_func = &sum_tile_stats;
+    encopts.tile_func_context = &totals;
+    encs[0] = qoir_encode(&src_pixbuf, &encopts);
+    encopts.stats = NULL;
+    encopts.contextual_tile_func = NULL;
+    encopts.write_tile_index = true;
+    encs[1] = qoir_encode(&src_pixbuf, &encopts);
+    if (encs[0].status_message || encs[1].status_message) {
+      printf("%s: qoir_encode failed\n", __func__);
+      break;
+    }
+
+    uint64_t num_tiles = 0;
+    uint64_t compressed_len = 0;
+    for (int i = 0; i < QOIR_NUM_TILE_FORMATS; i++) {
+      num_tiles += enc_stats.num_tiles_by_format[i];
+      compressed_len += enc_stats.compressed_len_by_format[i];
+    }
+    uint64_t num_ops = 0;
+    for (int i = 0; i < QOIR_NUM_OP_TYPES; i++) {
+      num_ops += enc_stats.num_ops_by_type[i];
+    }
+    // The QPIX chunk's payload is every tile's 4 byte prefix and encoded
+    // bytes. It starts after the 20 byte QOIR chunk and 12 byte QPIX chunk
+    // header and is followed by the 12 byte QEND chunk.
+    if ((num_tiles != number_of_tiles) ||
+        (totals.num_tiles != number_of_tiles)) {
+      printf("%s: num_tiles: have %d and %d, want %d\n", __func__,
+             (int)num_tiles, (int)totals.num_tiles, (int)number_of_tiles);
+      break;
+    } else if ((compressed_len != totals.compressed_len) ||
+               ((32 + (4 * num_tiles) + compressed_len + 12) !=
+                encs[0].dst_len)) {
+      printf("%s: compressed_len: have %d and %d\n", __func__,
+             (int)compressed_len, (int)totals.compressed_len);
+      break;
+    } else if (num_ops == 0) {
+      printf("%s: num_ops: have 0\n", __func__);
+      break;
+    }
+
+    // Decoding the whole image should see the same tiles as encoding it.
+    qoir_stats dec_stats = {0};
+    qoir_decode_options decopts = {0};
+    decopts.stats = &dec_stats;
+    qoir_decode_result dec =
+        qoir_decode(encs[0].dst_ptr, encs[0].dst_len, &decopts);
+    free(dec.owned_memory);
+    if (dec.status_message) {
+      printf("%s: qoir_decode failed\n", __func__);
+      break;
+    } else if (memcmp(&enc_stats, &dec_stats, sizeof(qoir_stats))) {
+      printf("%s: decode stats differ from encode stats\n", __func__);
+      break;
+    }
+
+    // Clipped decodes (with or without a TIDX chunk, single- or
+    // multi-threaded) should agree on which tiles they skipped.
+    bool ok = true;
+    qoir_stats want = {0};
+    for (int i = 0; ok && (i < 4); i++) {
+      uint32_t num_calls = 0;
+      qoir_stats have = {0};
+      decopts.stats = &have;
+      decopts.src_clip_rectangle = qoir_make_rectangle(70, 5, 271, 306);
+      decopts.use_src_clip_rectangle = true;
+      decopts.contextual_run_jobs_func = (i & 1) ? &run_jobs_in_reverse : NULL;
+      decopts.run_jobs_func_context = &num_calls;
+      decopts.max_num_jobs = 3;
+      dec = qoir_decode(encs[i >> 1].dst_ptr, encs[i >> 1].dst_len, &decopts);
+      free(dec.owned_memory);
+      num_tiles = 0;
+      for (int j = 0; j < QOIR_NUM_TILE_FORMATS; j++) {
+        num_tiles += have.num_tiles_by_format[j];
+      }
+      if (dec.status_message) {
+        printf("%s: #%d: qoir_decode failed\n", __func__, i);
+        ok = false;
+      } else if ((have.num_clipped_tiles == 0) ||
+                 ((have.num_clipped_tiles + num_tiles) != number_of_tiles)) {
+        printf("%s: #%d: num_clipped_tiles: have %d\n", __func__, i,
+               (int)have.num_clipped_tiles);
+        ok = false;
+      } else if (i == 0) {
+        want = have;
+      } else if (memcmp(&want, &have, sizeof(qoir_stats))) {
+        printf("%s: #%d: different stats\n", __func__, i);
+        ok = false;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  free(encs[0].owned_memory);
+  free(encs[1].owned_memory);
+  stbi_image_free(src_data);
+  if (ret == 0) {
+    printf("%s: OK\n", __func__);
+  }
+  return ret;
+}
+
+// ----
+
 int            //
 main(          //
     int argc,  //
     char** argv) {
-  return test_swizzle() ||  //
-         test_round_trip();
+  return test_swizzle() ||                  //
+         test_swizzle_all_pixels() ||       //
+         test_lossify() ||                  //
+         test_round_trip() ||               //
+         test_tile_index() ||               //
+         test_decode_metadata() ||          //
+         test_decode_direct() ||            //
+         test_encode_src_pixfmts() ||       //
+         test_gamma_aware_dither() ||       //
+         test_decode_downscale() ||         //
+         test_mipmaps() ||                  //
+         test_constant_tiles() ||           //
+         test_duplicate_tiles() ||          //
+         test_lz4_high_effort() ||          //
+         test_lz4_min_savings_percent() ||  //
+         test_huffman_tiles() ||            //
+         test_multithreaded_decode() ||     //
+         test_decode_batch() ||             //
+         test_multithreaded_encode() ||     //
+         test_encode_dirty_rectangles() ||  //
+         test_encode_into_dst() ||          //
+         test_encode_to_sink() ||           //
+         test_incremental_encode() ||       //
+         test_incremental_decode() ||       //
+         test_context() ||                  //
+         test_container() ||                //
+         test_stats();
 }
@@ -92,13 +92,13 @@ check_round_trip_1(          //
 const char*        //
 check_round_trip(  //
     FILE* f) {
-  load_file_result r = load_file(f, UINT64_MAX);
+  load_file_result r = map_file(f, UINT64_MAX);
   if (r.status_message) {
-    free(r.owned_memory);
+    unload_file(&r);
     return r.status_message;
   }
   const char* result = check_round_trip_1(r.dst_ptr, r.dst_len);
-  free(r.owned_memory);
+  unload_file(&r);
   return result;
 }
 
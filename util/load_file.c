@@ -22,14 +22,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// The mmap path also needs fileno, ftello and madvise, which strict ISO C
+// modes (e.g. -std=c99) hide, along with MADV_SEQUENTIAL. It falls back to
+// fread when they're unavailable.
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_SEQUENTIAL)
+#define LOAD_FILE_USE_MMAP
+#endif
+#endif
+
+// load_file_result's dst_ptr and dst_len are the file's contents. Callers
+// should pass the result to unload_file when done, which frees owned_memory
+// (a malloc'ed buffer) or unmaps mapped_memory, whichever is non-NULL.
+// Callers should not write to mapped_memory, as it is only mapped for reading.
 typedef struct load_file_result_struct {
   const char* status_message;
   void* owned_memory;
   uint8_t* dst_ptr;
   size_t dst_len;
   bool truncated;
+  void* mapped_memory;
+  size_t mapped_len;
 } load_file_result;
 
+static inline void  //
+unload_file(        //
+    load_file_result* r) {
+#if defined(LOAD_FILE_USE_MMAP)
+  if (r->mapped_memory) {
+    munmap(r->mapped_memory, r->mapped_len);
+  }
+#endif
+  free(r->owned_memory);
+}
+
 static load_file_result  //
 load_file(               //
     FILE* f,             //
@@ -102,4 +132,43 @@ load_file(               //
   return result;
 }
 
+// map_file is like load_file but, where possible, memory-maps the file (a
+// regular file, read from its start) instead of copying it into a heap
+// buffer, so that dst_ptr points straight into the OS' page cache. Otherwise,
+// such as for pipes or empty files, it falls back to load_file.
+static load_file_result  //
+map_file(                //
+    FILE* f,             //
+    uint64_t max_incl_len) {
+#if defined(LOAD_FILE_USE_MMAP)
+  struct stat st;
+  if (f && !ferror(f) && (ftello(f) == 0) && !fstat(fileno(f), &st) &&
+      S_ISREG(st.st_mode) && (st.st_size > 0) &&
+      ((uint64_t)st.st_size <= SIZE_MAX)) {
+    uint64_t len = (uint64_t)st.st_size;
+    bool truncated = false;
+    if (len > max_incl_len) {
+      len = max_incl_len;
+      truncated = true;
+    }
+    void* ptr = (len > 0) ? mmap(NULL, (size_t)len, PROT_READ, MAP_PRIVATE,
+                                 fileno(f), 0)
+                          : MAP_FAILED;
+    if (ptr != MAP_FAILED) {
+      // These are only hints, so ignore any errors.
+      madvise(ptr, (size_t)len, MADV_SEQUENTIAL);
+      madvise(ptr, (size_t)len, MADV_WILLNEED);
+      load_file_result result = {0};
+      result.dst_ptr = (uint8_t*)ptr;
+      result.dst_len = (size_t)len;
+      result.truncated = truncated;
+      result.mapped_memory = ptr;
+      result.mapped_len = (size_t)len;
+      return result;
+    }
+  }
+#endif
+  return load_file(f, max_incl_len);
+}
+
 #endif  // INCLUDE_GUARD_ETC